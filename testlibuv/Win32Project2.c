@@ -9,6 +9,47 @@
 #define DEFAULT_BIND_HOST     "127.0.0.1"
 #define DEFAULT_BIND_PORT     1080
 #define DEFAULT_IDLE_TIMEOUT  (60 * 1000)
+#define DEFAULT_FD_CACHE_SIZE 1024
+#define DEFAULT_CONTENT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_CONTENT_MAX_FILE   (256 * 1024)
+#define DEFAULT_USE_SENDFILE       0  /* Not available on Windows. */
+#define DEFAULT_STREAM_BUFS        4
+#define DEFAULT_STREAM_CHUNK       (64 * 1024)
+#define DEFAULT_UPSTREAM_MAX_IDLE      32
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT  (30 * 1000)
+#define DEFAULT_DNS_TTL                (30 * 1000)
+#define DEFAULT_DNS_NEGATIVE_TTL       (5 * 1000)
+#define DEFAULT_DNS_STALE_TTL          (5 * 60 * 1000)
+#define DEFAULT_RELAY_BUFS             4
+#define DEFAULT_RELAY_CHUNK            (16 * 1024)
+#define DEFAULT_RELAY_MAX_INFLIGHT     (64 * 1024)
+#define DEFAULT_USE_SPLICE             1  /* Only has an effect on Linux. */
+#define DEFAULT_SPLICE_MIN             (64 * 1024)
+#define DEFAULT_ALLOW_CONNECT          0
+#define DEFAULT_CONNECT_PORT           443
+#define DEFAULT_CONNECT_INTERNAL       0
+#define DEFAULT_HEALTH_FAILURES        5
+#define DEFAULT_OUTLIER_FACTOR         3
+#define DEFAULT_EJECT_MS               (10 * 1000)
+#define DEFAULT_EJECT_MAX_MS           (5 * 60 * 1000)
+#define DEFAULT_PROBE_EVERY            20
+#define DEFAULT_HEDGE_PERCENTILE       95
+#define DEFAULT_HEDGE_BUDGET           5
+#define DEFAULT_HEDGE_MIN_MS           2
+#define DEFAULT_PROXY_CACHE_SIZE       (32 * 1024 * 1024)
+#define DEFAULT_PROXY_CACHE_MAX_ENTRY  (1024 * 1024)
+#define DEFAULT_THREADPOOL_SIZE        4
+#define DEFAULT_INBOX_SIZE             16384
+#define DEFAULT_EXECUTOR_THREADS       4
+#define DEFAULT_DNS_THREADS            2
+#define DEFAULT_REQUEST_TIMEOUT        (30 * 1000)
+#define DEFAULT_DRAIN_TIMEOUT          (30 * 1000)
+
+static const route_config default_routes[] = {
+	{ "/static/", route_static, "www" },
+	{ "/_stats", route_stats, NULL },
+	{ "/api/", route_proxy, NULL, "127.0.0.1", 8080 },
+};
 
 static char *modulename = 0;
 static const char *progname = 0;//__FILE__;  /* Reset in main(). */
@@ -22,6 +63,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
                      _In_ LPWSTR    lpCmdLine,
                      _In_ int       nCmdShow)
 {
+	static char *upgrade_argv[2];
 	server_config config;
 
 	modulename = malloc(MAX_PATH);
@@ -35,6 +77,48 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	config.bind_host = DEFAULT_BIND_HOST;
 	config.bind_port = DEFAULT_BIND_PORT;
 	config.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	config.routes = default_routes;
+	config.nroutes = sizeof(default_routes) / sizeof(default_routes[0]);
+	config.fd_cache_size = DEFAULT_FD_CACHE_SIZE;
+	config.content_cache_size = DEFAULT_CONTENT_CACHE_SIZE;
+	config.content_max_file = DEFAULT_CONTENT_MAX_FILE;
+	config.use_sendfile = DEFAULT_USE_SENDFILE;
+	config.stream_bufs = DEFAULT_STREAM_BUFS;
+	config.stream_chunk = DEFAULT_STREAM_CHUNK;
+	config.upstream_max_idle = DEFAULT_UPSTREAM_MAX_IDLE;
+	config.upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT;
+	config.dns_ttl = DEFAULT_DNS_TTL;
+	config.dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+	config.dns_stale_ttl = DEFAULT_DNS_STALE_TTL;
+	config.relay_bufs = DEFAULT_RELAY_BUFS;
+	config.relay_chunk = DEFAULT_RELAY_CHUNK;
+	config.relay_max_inflight = DEFAULT_RELAY_MAX_INFLIGHT;
+	config.use_splice = DEFAULT_USE_SPLICE;
+	config.splice_min = DEFAULT_SPLICE_MIN;
+	config.allow_connect = DEFAULT_ALLOW_CONNECT;
+	config.connect_ports[0] = DEFAULT_CONNECT_PORT;
+	config.connect_internal = DEFAULT_CONNECT_INTERNAL;
+	config.health_failures = DEFAULT_HEALTH_FAILURES;
+	config.outlier_factor = DEFAULT_OUTLIER_FACTOR;
+	config.eject_ms = DEFAULT_EJECT_MS;
+	config.eject_max_ms = DEFAULT_EJECT_MAX_MS;
+	config.probe_every = DEFAULT_PROBE_EVERY;
+	config.hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+	config.hedge_budget = DEFAULT_HEDGE_BUDGET;
+	config.hedge_min_ms = DEFAULT_HEDGE_MIN_MS;
+	config.proxy_cache_size = DEFAULT_PROXY_CACHE_SIZE;
+	config.proxy_cache_max_entry = DEFAULT_PROXY_CACHE_MAX_ENTRY;
+	config.threadpool_size = DEFAULT_THREADPOOL_SIZE;
+	config.inbox_size = DEFAULT_INBOX_SIZE;
+	config.executor_threads = DEFAULT_EXECUTOR_THREADS;
+	config.dns_threads = DEFAULT_DNS_THREADS;
+	config.request_timeout = DEFAULT_REQUEST_TIMEOUT;
+	config.drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+
+	/* Upgrades run the module again; it takes no arguments. */
+	upgrade_argv[0] = modulename;
+	upgrade_argv[1] = NULL;
+	config.argv = upgrade_argv;
 
 	int err = server_run(&config, uv_default_loop());
 	if (err) {
@@ -0,0 +1,66 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Runs one of the benchmarks, by name:
+ *
+ *   bench mpsc [producers] [messages each] [cells]
+ *   bench relay [body MB] [downloads] [window KB] [server port]
+ *               [upstream port]
+ *   bench proxy [requests] [body bytes] [server port] [upstream port]
+ *
+ * Each one prints the parameters it ran with next to what it measured, so
+ * that a result can be reproduced from the output alone.  Numbers from a
+ * Debug build mean little, build the Release configuration.
+ */
+
+typedef struct {
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *usage;
+} bench_entry;
+
+static const bench_entry benches[] = {
+  { "mpsc", bench_mpsc, "[producers] [messages each] [cells]" },
+  { "relay",
+    bench_relay,
+    "[body MB] [downloads] [window KB] [server port] [upstream port]" },
+  { "proxy",
+    bench_proxy,
+    "[requests] [body bytes] [server port] [upstream port]" },
+};
+
+const char *_getprogname(void) {
+  return "bench";
+}
+
+int main(int argc, char **argv) {
+  unsigned int i;
+  int err;
+
+  for (i = 0; argc > 1 && i < sizeof(benches) / sizeof(benches[0]); i += 1) {
+    if (0 == strcmp(argv[1], benches[i].name)) {
+      log_start();
+      err = benches[i].run(argc - 2, argv + 2);
+      log_stop();
+      return err;
+    }
+  }
+
+  fprintf(stderr, "usage:\n");
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i += 1) {
+    fprintf(stderr, "  bench %s %s\n", benches[i].name, benches[i].usage);
+  }
+  return 2;
+}
+
+/* The |i|th argument as a number, or |def| if there aren't that many. */
+unsigned long bench_arg(int argc, char **argv, int i, unsigned long def) {
+  return i < argc ? strtoul(argv[i], NULL, 10) : def;
+}
+
+/* Seconds since |start|, a uv_hrtime() reading. */
+double bench_seconds(uint64_t start) {
+  return (double) (uv_hrtime() - start) / 1e9;
+}
@@ -0,0 +1,36 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "defs.h"
+
+/* A forwarder standing in for a long link, see bench_forward_start(). */
+typedef struct {
+  unsigned short port;    /* Listens here, */
+  unsigned short target;  /* and connects to here. */
+  unsigned int delay_ms;  /* Added each way. */
+  size_t window;  /* Bytes on the link per direction, at most. */
+} bench_link;
+
+/* bench.c */
+unsigned long bench_arg(int argc, char **argv, int i, unsigned long def);
+double bench_seconds(uint64_t start);
+
+/* bench_mpsc.c */
+int bench_mpsc(int argc, char **argv);
+
+/* bench_net.c */
+int bench_backend_start(uv_loop_t *loop, unsigned short port, uint64_t bodylen);
+int bench_forward_start(uv_loop_t *loop, const bench_link *link);
+int bench_fetch(uv_loop_t *loop,
+                unsigned short port,
+                const char *path,
+                unsigned int n,
+                uint64_t *bytes);
+
+/* bench_proxy.c */
+int bench_proxy(int argc, char **argv);
+
+/* bench_relay.c */
+int bench_relay(int argc, char **argv);
+
+#endif  /* BENCH_H_ */
@@ -0,0 +1,174 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Throughput and wakeup coalescing of mpsc_queue.c.
+ *
+ * First, |producers| threads each post |messages| empty messages as fast
+ * as they can, retrying whenever the queue is full, while the loop drains
+ * it.  Then a single thread posts BURSTS bursts of BURST_LEN messages and
+ * waits for each one to be delivered before the next, which shows what a
+ * burst costs in wakeups and how long its messages wait.
+ */
+
+#define BURSTS    10
+#define BURST_LEN 10000
+
+typedef struct {
+  uv_thread_t thread;
+  mpsc_queue *q;
+  unsigned long messages;  /* Per burst. */
+  unsigned long bursts;
+  uint64_t retries;  /* Posts that found the queue full. */
+} producer;
+
+static uv_timer_t keepalive;
+static uv_sem_t burst_done;
+static uint64_t received;
+static uint64_t expected;
+static unsigned long burst_len;
+
+static void mpsc_phase(uv_loop_t *loop,
+                       unsigned int size,
+                       producer *p,
+                       unsigned int n,
+                       mpsc_queue *q);
+static void producer_main(void *arg);
+static void on_message(void *data);
+static void on_keepalive(uv_timer_t *handle);
+
+int bench_mpsc(int argc, char **argv) {
+  unsigned int producers;
+  unsigned long messages;
+  unsigned int size;
+  uv_loop_t *loop;
+  mpsc_queue q;
+  producer *p;
+  uint64_t retries;
+  uint64_t start;
+  unsigned int i;
+  double secs;
+
+  producers = (unsigned int) bench_arg(argc, argv, 0, 4);
+  messages = bench_arg(argc, argv, 1, 1000000);
+  size = (unsigned int) bench_arg(argc, argv, 2, 16384);
+  if (producers == 0 || messages == 0) {
+    fprintf(stderr, "need at least one producer and one message\n");
+    return 2;
+  }
+
+  loop = uv_default_loop();
+  p = xmalloc(producers * sizeof(p[0]));
+  CHECK(0 == uv_sem_init(&burst_done, 0));
+
+  memset(p, 0, producers * sizeof(p[0]));
+  for (i = 0; i < producers; i += 1) {
+    p[i].messages = messages;
+    p[i].bursts = 1;
+  }
+  burst_len = 0;
+  start = uv_hrtime();
+  mpsc_phase(loop, size, p, producers, &q);
+  secs = bench_seconds(start);
+  for (retries = 0, i = 0; i < producers; i += 1) {
+    retries += p[i].retries;
+  }
+  printf("mpsc: %u producers x %lu messages, %lu cells\n",
+         producers,
+         messages,
+         q.mask + 1);
+  printf("  %.2f M messages/s, %llu delivered, %llu wakeups, "
+         "%llu posts retried\n",
+         (double) expected / secs / 1e6,
+         (unsigned long long) q.delivered,
+         (unsigned long long) q.wakeups,
+         (unsigned long long) retries);
+
+  memset(p, 0, sizeof(p[0]));
+  p[0].messages = BURST_LEN;
+  p[0].bursts = BURSTS;
+  burst_len = BURST_LEN;
+  mpsc_phase(loop, size, p, 1, &q);
+  printf("bursts: %u x %u messages\n", BURSTS, BURST_LEN);
+  printf("  %llu wakeups, largest drain %u, latency avg %llu us, "
+         "max %llu us\n",
+         (unsigned long long) q.wakeups,
+         q.drained_max,
+         (unsigned long long) (q.latency_us / q.delivered),
+         (unsigned long long) q.latency_max_us);
+
+  uv_sem_destroy(&burst_done);
+  free(p);
+  return q.delivered == expected ? 0 : 1;
+}
+
+/* Runs |n| producers against a fresh queue of |size| cells until all their
+ * messages are in.  |q| keeps its counters after it's closed.
+ */
+static void mpsc_phase(uv_loop_t *loop,
+                       unsigned int size,
+                       producer *p,
+                       unsigned int n,
+                       mpsc_queue *q) {
+  unsigned int i;
+
+  mpsc_queue_init(q, loop, size);
+  received = 0;
+  expected = 0;
+  for (i = 0; i < n; i += 1) {
+    p[i].q = q;
+    expected += (uint64_t) p[i].messages * p[i].bursts;
+  }
+
+  /* The queue's handle doesn't keep the loop alive, this does. */
+  CHECK(0 == uv_timer_init(loop, &keepalive));
+  CHECK(0 == uv_timer_start(&keepalive, on_keepalive, 1000, 1000));
+  for (i = 0; i < n; i += 1) {
+    CHECK(0 == uv_thread_create(&p[i].thread, producer_main, p + i));
+  }
+
+  uv_run(loop, UV_RUN_DEFAULT);
+  for (i = 0; i < n; i += 1) {
+    uv_thread_join(&p[i].thread);
+  }
+
+  uv_close((uv_handle_t *) &keepalive, NULL);
+  mpsc_queue_close(q);
+  uv_run(loop, UV_RUN_DEFAULT);
+}
+
+static void producer_main(void *arg) {
+  unsigned long b;
+  unsigned long i;
+  producer *p;
+
+  p = arg;
+  for (b = 0; b < p->bursts; b += 1) {
+    for (i = 0; i < p->messages; i += 1) {
+      while (0 != mpsc_queue_post(p->q, on_message, NULL)) {
+        p->retries += 1;
+        thread_yield();
+      }
+    }
+    if (burst_len != 0) {
+      uv_sem_wait(&burst_done);
+    }
+  }
+}
+
+/* Loop thread. */
+static void on_message(void *data) {
+  (void) data;
+  received += 1;
+  if (burst_len != 0 && received % burst_len == 0) {
+    uv_sem_post(&burst_done);
+  }
+  if (received == expected) {
+    uv_timer_stop(&keepalive);
+  }
+}
+
+static void on_keepalive(uv_timer_t *handle) {
+  (void) handle;
+}
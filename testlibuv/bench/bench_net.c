@@ -0,0 +1,722 @@
+#include "bench.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The network end of the benchmarks: a backend that answers every request
+ * with a body of zeros, a TCP forwarder that holds each chunk back for a
+ * while to stand in for a long link, and a client that runs sequential
+ * GETs.  They all run on the benchmark's loop; the server under test is a
+ * separate process.
+ */
+
+#define NET_CHUNK   (64 * 1024)
+#define NET_WRITES  4  /* Body writes the backend keeps in flight. */
+
+/* One backend connection.  Requests are counted by the blank lines that
+ * end their heads; bodies aren't expected.
+ */
+typedef struct {
+  uv_tcp_t handle;
+  uint64_t bodylen;
+  uint64_t left;  /* Of the current answer's body. */
+  unsigned int pending;  /* Requests not answered yet. */
+  unsigned int writes;  /* In flight. */
+  unsigned int match;  /* Bytes of "\r\n\r\n" seen. */
+  int closing;
+  char head[128];
+} backend_conn;
+
+typedef struct fwd_conn fwd_conn;
+
+/* A chunk held back until |due|.  One without data stands for the EOF. */
+typedef struct fwd_chunk {
+  struct fwd_chunk *next;
+  struct fwd_dir *d;
+  uv_write_t req;
+  uint64_t due;
+  size_t len;
+  char data[NET_CHUNK];
+} fwd_chunk;
+
+typedef struct fwd_dir {
+  fwd_conn *fc;
+  uv_stream_t *src;
+  uv_stream_t *dst;
+  uv_timer_t timer;
+  uv_shutdown_t shutdown;
+  fwd_chunk *head;
+  fwd_chunk *tail;
+  size_t queued;  /* Read and not written yet. */
+  int reading;
+  int eof;
+} fwd_dir;
+
+struct fwd_conn {
+  uv_tcp_t in;
+  uv_tcp_t out;
+  uv_connect_t connect;
+  fwd_dir up;    /* in -> out */
+  fwd_dir down;  /* out -> in */
+  const bench_link *link;
+  unsigned int refs;  /* Open handles and pending requests. */
+  unsigned int done;  /* Directions that passed their EOF on. */
+  int closing;
+};
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect;
+  uv_write_t write;
+  char req[256];
+  char head[4096];
+  size_t headlen;
+  int64_t length;  /* Content-Length, -1 until the head is in. */
+  uint64_t body;
+  int status;
+  int finished;
+} fetch_conn;
+
+static char zeros[NET_CHUNK];
+
+static int net_listen(uv_loop_t *loop,
+                      uv_tcp_t *handle,
+                      unsigned short port,
+                      uv_connection_cb cb);
+static void net_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void backend_accept(uv_stream_t *server, int status);
+static void backend_read_done(uv_stream_t *stream,
+                              ssize_t nread,
+                              const uv_buf_t *buf);
+static void backend_pump(backend_conn *bc);
+static void backend_write_done(uv_write_t *req, int status);
+static void backend_close(backend_conn *bc);
+static void backend_close_done(uv_handle_t *handle);
+static void fwd_accept(uv_stream_t *server, int status);
+static void fwd_connect_done(uv_connect_t *req, int status);
+static void fwd_read_start(fwd_dir *d);
+static void fwd_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void fwd_read_done(uv_stream_t *stream,
+                          ssize_t nread,
+                          const uv_buf_t *buf);
+static void fwd_send(fwd_dir *d);
+static void fwd_timer_expire(uv_timer_t *handle);
+static void fwd_write_done(uv_write_t *req, int status);
+static void fwd_shutdown_done(uv_shutdown_t *req, int status);
+static void fwd_abort(fwd_conn *fc);
+static void fwd_unref(fwd_conn *fc);
+static void fwd_close_done(uv_handle_t *handle);
+static void fetch_connect_done(uv_connect_t *req, int status);
+static void fetch_write_done(uv_write_t *req, int status);
+static void fetch_read_done(uv_stream_t *stream,
+                            ssize_t nread,
+                            const uv_buf_t *buf);
+static int fetch_head(fetch_conn *c);
+static void fetch_finish(fetch_conn *c, int status);
+static void fetch_close_done(uv_handle_t *handle);
+
+/* Answers every request to 127.0.0.1:|port| with |bodylen| zero bytes. */
+int bench_backend_start(uv_loop_t *loop, unsigned short port, uint64_t bodylen) {
+  uv_tcp_t *listener;
+  uint64_t *len;
+  int err;
+
+  listener = xmalloc(sizeof(*listener));
+  len = xmalloc(sizeof(*len));
+  *len = bodylen;
+  listener->data = len;
+  err = net_listen(loop, listener, port, backend_accept);
+  if (err != 0) {
+    free(len);
+  }
+  return err;
+}
+
+/* Passes connections to 127.0.0.1:|link->port| on to link->target.  Each
+ * chunk, either way, waits link->delay_ms before it's sent on, and reading
+ * stops while link->window bytes are waiting.  A new delay applies to
+ * what's read from then on.
+ */
+int bench_forward_start(uv_loop_t *loop, const bench_link *link) {
+  uv_tcp_t *listener;
+
+  listener = xmalloc(sizeof(*listener));
+  listener->data = (void *) link;
+  return net_listen(loop, listener, link->port, fwd_accept);
+}
+
+/* GETs |path| from 127.0.0.1:|port| |n| times, one after the other, and
+ * adds up the body bytes in |bytes|.  Returns 0 or the first error.
+ */
+int bench_fetch(uv_loop_t *loop,
+                unsigned short port,
+                const char *path,
+                unsigned int n,
+                uint64_t *bytes) {
+  struct sockaddr_in addr;
+  fetch_conn *c;
+  unsigned int i;
+  int err;
+
+  *bytes = 0;
+  CHECK(0 == uv_ip4_addr("127.0.0.1", port, &addr));
+  for (i = 0; i < n; i += 1) {
+    c = xmalloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->length = -1;
+    snprintf(c->req,
+             sizeof(c->req),
+             "GET %s HTTP/1.1\r\n"
+             "Host: bench\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             path);
+    CHECK(0 == uv_tcp_init(loop, &c->handle));
+    c->handle.data = c;
+    err = uv_tcp_connect(&c->connect,
+                         &c->handle,
+                         (const struct sockaddr *) &addr,
+                         fetch_connect_done);
+    if (err != 0) {
+      fetch_finish(c, err);
+    }
+
+    while (!c->finished) {
+      uv_run(loop, UV_RUN_ONCE);
+    }
+
+    err = c->status;
+    *bytes += c->body;
+    uv_close((uv_handle_t *) &c->handle, fetch_close_done);
+    if (err != 0) {
+      return err;
+    }
+  }
+
+  return 0;
+}
+
+static int net_listen(uv_loop_t *loop,
+                      uv_tcp_t *handle,
+                      unsigned short port,
+                      uv_connection_cb cb) {
+  struct sockaddr_in addr;
+  void *data;
+  int err;
+
+  data = handle->data;
+  CHECK(0 == uv_ip4_addr("127.0.0.1", port, &addr));
+  CHECK(0 == uv_tcp_init(loop, handle));
+  handle->data = data;
+  err = uv_tcp_bind(handle, (const struct sockaddr *) &addr, 0);
+  if (err == 0) {
+    err = uv_listen((uv_stream_t *) handle, 128, cb);
+  }
+
+  if (err != 0) {
+    fprintf(stderr, "listen on port %u: %s\n", port, uv_strerror(err));
+    uv_close((uv_handle_t *) handle, (uv_close_cb) free);
+  }
+  return err;
+}
+
+static void net_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  (void) handle;
+  (void) size;
+  buf->base = xmalloc(NET_CHUNK);
+  buf->len = NET_CHUNK;
+}
+
+static void backend_accept(uv_stream_t *server, int status) {
+  backend_conn *bc;
+
+  if (status != 0) {
+    return;
+  }
+
+  bc = xmalloc(sizeof(*bc));
+  memset(bc, 0, sizeof(*bc));
+  bc->bodylen = *(uint64_t *) server->data;
+  CHECK(0 == uv_tcp_init(server->loop, &bc->handle));
+  bc->handle.data = bc;
+  if (0 != uv_accept(server, (uv_stream_t *) &bc->handle)) {
+    uv_close((uv_handle_t *) &bc->handle, backend_close_done);
+    return;
+  }
+
+  uv_tcp_nodelay(&bc->handle, 1);
+  CHECK(0 == uv_read_start((uv_stream_t *) &bc->handle,
+                           net_alloc,
+                           backend_read_done));
+}
+
+static void backend_read_done(uv_stream_t *stream,
+                              ssize_t nread,
+                              const uv_buf_t *buf) {
+  static const char end[] = "\r\n\r\n";
+  backend_conn *bc;
+  ssize_t i;
+
+  bc = stream->data;
+  for (i = 0; i < nread; i += 1) {
+    if (buf->base[i] == end[bc->match]) {
+      bc->match += 1;
+    } else {
+      bc->match = buf->base[i] == '\r';
+    }
+    if (bc->match == 4) {
+      bc->match = 0;
+      bc->pending += 1;
+    }
+  }
+
+  free(buf->base);
+  if (nread < 0) {
+    backend_close(bc);
+  } else {
+    backend_pump(bc);
+  }
+}
+
+/* Starts the next answer and keeps its body flowing. */
+static void backend_pump(backend_conn *bc) {
+  uv_write_t *req;
+  uv_buf_t buf;
+
+  while (!bc->closing && bc->writes < NET_WRITES) {
+    if (bc->left != 0) {
+      buf.base = zeros;
+      buf.len = bc->left < NET_CHUNK ? (size_t) bc->left : NET_CHUNK;
+      bc->left -= buf.len;
+    } else if (bc->pending != 0) {
+      bc->pending -= 1;
+      bc->left = bc->bodylen;
+      buf.base = bc->head;
+      buf.len = snprintf(bc->head,
+                         sizeof(bc->head),
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: application/octet-stream\r\n"
+                         "Content-Length: %llu\r\n"
+                         "\r\n",
+                         (unsigned long long) bc->bodylen);
+    } else {
+      return;
+    }
+
+    req = xmalloc(sizeof(*req));
+    req->data = bc;
+    bc->writes += 1;
+    if (0 != uv_write(req,
+                      (uv_stream_t *) &bc->handle,
+                      &buf,
+                      1,
+                      backend_write_done)) {
+      bc->writes -= 1;
+      free(req);
+      backend_close(bc);
+    }
+  }
+}
+
+static void backend_write_done(uv_write_t *req, int status) {
+  backend_conn *bc;
+
+  bc = req->data;
+  free(req);
+  bc->writes -= 1;
+  if (status != 0) {
+    backend_close(bc);
+  } else if (bc->closing) {
+    if (bc->writes == 0) {
+      uv_close((uv_handle_t *) &bc->handle, backend_close_done);
+    }
+  } else {
+    backend_pump(bc);
+  }
+}
+
+static void backend_close(backend_conn *bc) {
+  if (bc->closing) {
+    return;
+  }
+
+  /* Closing with writes in flight would free |bc| under them. */
+  bc->closing = 1;
+  uv_read_stop((uv_stream_t *) &bc->handle);
+  if (bc->writes == 0) {
+    uv_close((uv_handle_t *) &bc->handle, backend_close_done);
+  }
+}
+
+static void backend_close_done(uv_handle_t *handle) {
+  free(handle->data);
+}
+
+static void fwd_accept(uv_stream_t *server, int status) {
+  struct sockaddr_in addr;
+  fwd_conn *fc;
+  int err;
+
+  if (status != 0) {
+    return;
+  }
+
+  fc = xmalloc(sizeof(*fc));
+  memset(fc, 0, sizeof(*fc));
+  fc->link = server->data;
+  fc->refs = 1;
+  CHECK(0 == uv_tcp_init(server->loop, &fc->in));
+  fc->in.data = fc;
+  if (0 != uv_accept(server, (uv_stream_t *) &fc->in)) {
+    uv_close((uv_handle_t *) &fc->in, fwd_close_done);
+    return;
+  }
+
+  fc->refs = 5;  /* Both sockets, both timers and the connect. */
+  CHECK(0 == uv_tcp_init(server->loop, &fc->out));
+  CHECK(0 == uv_timer_init(server->loop, &fc->up.timer));
+  CHECK(0 == uv_timer_init(server->loop, &fc->down.timer));
+  fc->out.data = fc;
+  fc->up.timer.data = fc;
+  fc->down.timer.data = fc;
+  fc->up.fc = fc;
+  fc->up.src = (uv_stream_t *) &fc->in;
+  fc->up.dst = (uv_stream_t *) &fc->out;
+  fc->down.fc = fc;
+  fc->down.src = (uv_stream_t *) &fc->out;
+  fc->down.dst = (uv_stream_t *) &fc->in;
+  uv_tcp_nodelay(&fc->in, 1);
+  uv_tcp_nodelay(&fc->out, 1);
+
+  CHECK(0 == uv_ip4_addr("127.0.0.1", fc->link->target, &addr));
+  err = uv_tcp_connect(&fc->connect,
+                       &fc->out,
+                       (const struct sockaddr *) &addr,
+                       fwd_connect_done);
+  if (err != 0) {
+    fwd_abort(fc);
+    fwd_unref(fc);
+  }
+}
+
+static void fwd_connect_done(uv_connect_t *req, int status) {
+  fwd_conn *fc;
+
+  fc = CONTAINER_OF(req, fwd_conn, connect);
+  if (status != 0) {
+    fwd_abort(fc);
+  } else if (!fc->closing) {
+    fwd_read_start(&fc->up);
+    fwd_read_start(&fc->down);
+  }
+  fwd_unref(fc);
+}
+
+static void fwd_read_start(fwd_dir *d) {
+  d->reading = 1;
+  if (0 != uv_read_start(d->src, fwd_alloc, fwd_read_done)) {
+    fwd_abort(d->fc);
+  }
+}
+
+/* Reads go straight into a chunk, which is what gets queued. */
+static void fwd_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  fwd_chunk *c;
+
+  (void) handle;
+  (void) size;
+  c = xmalloc(sizeof(*c));
+  buf->base = c->data;
+  buf->len = sizeof(c->data);
+}
+
+static void fwd_read_done(uv_stream_t *stream,
+                          ssize_t nread,
+                          const uv_buf_t *buf) {
+  fwd_conn *fc;
+  fwd_chunk *c;
+  fwd_dir *d;
+
+  fc = stream->data;
+  d = stream == (uv_stream_t *) &fc->in ? &fc->up : &fc->down;
+  c = NULL;
+  if (buf->base != NULL) {
+    c = CONTAINER_OF(buf->base, fwd_chunk, data);
+  }
+  if (nread == 0) {
+    free(c);
+    return;
+  }
+
+  if (nread < 0) {
+    /* EOF or a reset, pass it on as an EOF either way. */
+    uv_read_stop(stream);
+    d->reading = 0;
+    d->eof = 1;
+    if (c == NULL) {
+      c = xmalloc(sizeof(*c));
+    }
+    nread = 0;
+  }
+
+  c->next = NULL;
+  c->d = d;
+  c->len = nread;
+  c->due = uv_now(stream->loop) + fc->link->delay_ms;
+  if (d->tail != NULL) {
+    d->tail->next = c;
+  } else {
+    d->head = c;
+  }
+  d->tail = c;
+  d->queued += c->len;
+  if (d->reading && d->queued >= fc->link->window) {
+    uv_read_stop(stream);
+    d->reading = 0;
+  }
+
+  fwd_send(d);
+}
+
+/* Sends on whatever is due and sets the timer for the rest. */
+static void fwd_send(fwd_dir *d) {
+  fwd_chunk *c;
+  uv_buf_t buf;
+  uint64_t now;
+
+  now = uv_now(d->timer.loop);
+  while (!d->fc->closing && d->head != NULL && d->head->due <= now) {
+    c = d->head;
+    d->head = c->next;
+    if (d->head == NULL) {
+      d->tail = NULL;
+    }
+
+    d->fc->refs += 1;
+    if (c->len == 0) {
+      free(c);
+      if (0 != uv_shutdown(&d->shutdown, d->dst, fwd_shutdown_done)) {
+        d->fc->refs -= 1;
+        fwd_abort(d->fc);
+      }
+    } else {
+      buf = uv_buf_init(c->data, (unsigned int) c->len);
+      if (0 != uv_write(&c->req, d->dst, &buf, 1, fwd_write_done)) {
+        d->fc->refs -= 1;
+        d->queued -= c->len;
+        free(c);
+        fwd_abort(d->fc);
+      }
+    }
+  }
+
+  if (!d->fc->closing && d->head != NULL) {
+    CHECK(0 == uv_timer_start(&d->timer,
+                              fwd_timer_expire,
+                              d->head->due - now,
+                              0));
+  }
+}
+
+static void fwd_timer_expire(uv_timer_t *handle) {
+  fwd_send(CONTAINER_OF(handle, fwd_dir, timer));
+}
+
+static void fwd_write_done(uv_write_t *req, int status) {
+  fwd_chunk *c;
+  fwd_conn *fc;
+  fwd_dir *d;
+
+  c = CONTAINER_OF(req, fwd_chunk, req);
+  d = c->d;
+  fc = d->fc;
+  d->queued -= c->len;
+  free(c);
+  if (status != 0) {
+    fwd_abort(fc);
+  } else if (!fc->closing &&
+             !d->reading &&
+             !d->eof &&
+             d->queued < fc->link->window) {
+    fwd_read_start(d);
+  }
+  fwd_unref(fc);
+}
+
+static void fwd_shutdown_done(uv_shutdown_t *req, int status) {
+  fwd_conn *fc;
+  fwd_dir *d;
+
+  d = CONTAINER_OF(req, fwd_dir, shutdown);
+  fc = d->fc;
+  fc->done += 1;
+  if (status != 0 || fc->done == 2) {
+    fwd_abort(fc);
+  }
+  fwd_unref(fc);
+}
+
+/* Closes everything.  Writes still in flight come back cancelled. */
+static void fwd_abort(fwd_conn *fc) {
+  fwd_chunk *c;
+  fwd_dir *d;
+  int i;
+
+  if (fc->closing) {
+    return;
+  }
+
+  fc->closing = 1;
+  for (i = 0; i < 2; i += 1) {
+    d = i == 0 ? &fc->up : &fc->down;
+    while (d->head != NULL) {
+      c = d->head;
+      d->head = c->next;
+      free(c);
+    }
+    d->tail = NULL;
+    uv_close((uv_handle_t *) &d->timer, fwd_close_done);
+  }
+  uv_close((uv_handle_t *) &fc->in, fwd_close_done);
+  uv_close((uv_handle_t *) &fc->out, fwd_close_done);
+}
+
+static void fwd_unref(fwd_conn *fc) {
+  fc->refs -= 1;
+  if (fc->refs == 0) {
+    free(fc);
+  }
+}
+
+static void fwd_close_done(uv_handle_t *handle) {
+  fwd_unref(handle->data);
+}
+
+static void fetch_connect_done(uv_connect_t *req, int status) {
+  fetch_conn *c;
+  uv_buf_t buf;
+
+  c = CONTAINER_OF(req, fetch_conn, connect);
+  if (status != 0) {
+    fetch_finish(c, status);
+    return;
+  }
+
+  uv_tcp_nodelay(&c->handle, 1);
+  buf = uv_buf_init(c->req, (unsigned int) strlen(c->req));
+  status = uv_write(&c->write,
+                    (uv_stream_t *) &c->handle,
+                    &buf,
+                    1,
+                    fetch_write_done);
+  if (status == 0) {
+    status = uv_read_start((uv_stream_t *) &c->handle,
+                           net_alloc,
+                           fetch_read_done);
+  }
+  if (status != 0) {
+    fetch_finish(c, status);
+  }
+}
+
+static void fetch_write_done(uv_write_t *req, int status) {
+  if (status != 0) {
+    fetch_finish(CONTAINER_OF(req, fetch_conn, write), status);
+  }
+}
+
+static void fetch_read_done(uv_stream_t *stream,
+                            ssize_t nread,
+                            const uv_buf_t *buf) {
+  fetch_conn *c;
+  size_t n;
+  char *end;
+
+  c = stream->data;
+  if (nread < 0) {
+    free(buf->base);
+    fetch_finish(c, nread == UV_EOF ? UV_EPROTO : (int) nread);
+    return;
+  }
+
+  if (c->length < 0 && nread > 0) {
+    n = sizeof(c->head) - 1 - c->headlen;
+    n = (size_t) nread < n ? (size_t) nread : n;
+    memcpy(c->head + c->headlen, buf->base, n);
+    c->headlen += n;
+    c->head[c->headlen] = '\0';
+    end = strstr(c->head, "\r\n\r\n");
+    if (end == NULL) {
+      if (c->headlen == sizeof(c->head) - 1) {
+        fetch_finish(c, UV_E2BIG);
+      }
+      free(buf->base);
+      return;
+    }
+
+    /* What followed the head in this read is body. */
+    end += 4;
+    c->body = nread - (n - (c->head + c->headlen - end));
+    if (0 != fetch_head(c)) {
+      free(buf->base);
+      return;
+    }
+  } else {
+    c->body += nread;
+  }
+
+  free(buf->base);
+  if (c->length >= 0 && c->body >= (uint64_t) c->length) {
+    fetch_finish(c, 0);
+  }
+}
+
+/* Wants a 200 with a Content-Length. */
+static int fetch_head(fetch_conn *c) {
+  static const char name[] = "content-length:";
+  const char *line;
+  size_t i;
+
+  if (0 != strncmp(c->head, "HTTP/1.1 200 ", 13)) {
+    line = strchr(c->head, '\r');
+    fprintf(stderr,
+            "unexpected response: %.*s\n",
+            (int) (line - c->head),
+            c->head);
+    fetch_finish(c, UV_EPROTO);
+    return -1;
+  }
+
+  for (line = strstr(c->head, "\r\n"); line != NULL;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+    for (i = 0; name[i] != '\0'; i += 1) {
+      if ((line[i] | 0x20) != name[i]) {
+        break;
+      }
+    }
+    if (name[i] == '\0') {
+      c->length = strtoll(line + i, NULL, 10);
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "response without a Content-Length\n");
+  fetch_finish(c, UV_EPROTO);
+  return -1;
+}
+
+static void fetch_finish(fetch_conn *c, int status) {
+  if (c->finished) {
+    return;
+  }
+
+  c->finished = 1;
+  c->status = status;
+  uv_read_stop((uv_stream_t *) &c->handle);
+}
+
+static void fetch_close_done(uv_handle_t *handle) {
+  free(handle->data);
+}
@@ -0,0 +1,98 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What a running server adds to a small proxied request.
+ *
+ * The benchmark's backend listens on |upstream port|, where the server's
+ * /api/ route points (8080 in Win32Project2.c).  The same |requests| GETs
+ * are made straight to the backend and then through the server, one after
+ * the other on a new connection each; the difference in the average is
+ * the proxy's overhead.  The server may keep its upstream connections,
+ * so that part isn't counted.
+ */
+
+#define WARMUP  10
+
+static int proxy_time(uv_loop_t *loop,
+                      unsigned short port,
+                      const char *path,
+                      unsigned long requests,
+                      uint64_t bodylen,
+                      double *us);
+
+int bench_proxy(int argc, char **argv) {
+  unsigned short upstream;
+  unsigned short server;
+  unsigned long requests;
+  uv_loop_t *loop;
+  uint64_t bodylen;
+  double direct;
+  double proxied;
+
+  requests = bench_arg(argc, argv, 0, 2000);
+  bodylen = bench_arg(argc, argv, 1, 100);
+  server = (unsigned short) bench_arg(argc, argv, 2, 1080);
+  upstream = (unsigned short) bench_arg(argc, argv, 3, 8080);
+  if (requests == 0) {
+    fprintf(stderr, "need at least one request\n");
+    return 2;
+  }
+
+  loop = uv_default_loop();
+  if (0 != bench_backend_start(loop, upstream, bodylen)) {
+    return 1;
+  }
+
+  if (0 != proxy_time(loop, upstream, "/", requests, bodylen, &direct) ||
+      0 != proxy_time(loop, server, "/api/proxy", requests, bodylen, &proxied)) {
+    return 1;
+  }
+
+  printf("proxy: server on port %u, upstream port %u, %lu requests, "
+         "%llu byte bodies\n",
+         server,
+         upstream,
+         requests,
+         (unsigned long long) bodylen);
+  printf("  direct %.0f us, proxied %.0f us, overhead %.0f us\n",
+         direct,
+         proxied,
+         proxied - direct);
+  return 0;
+}
+
+/* Average microseconds per GET, after a few that warm things up. */
+static int proxy_time(uv_loop_t *loop,
+                      unsigned short port,
+                      const char *path,
+                      unsigned long requests,
+                      uint64_t bodylen,
+                      double *us) {
+  uint64_t bytes;
+  uint64_t start;
+  int err;
+
+  err = bench_fetch(loop, port, path, WARMUP, &bytes);
+  if (err == 0) {
+    start = uv_hrtime();
+    err = bench_fetch(loop, port, path, requests, &bytes);
+    *us = bench_seconds(start) * 1e6 / requests;
+  }
+
+  if (err != 0) {
+    fprintf(stderr, "GET %s on port %u: %s\n", path, port, uv_strerror(err));
+    return err;
+  }
+
+  if (bytes != bodylen * requests) {
+    /* Some other route answered. */
+    fprintf(stderr,
+            "got %llu bytes, is /api/ routed to the upstream port?\n",
+            (unsigned long long) bytes);
+    return UV_EPROTO;
+  }
+
+  return 0;
+}
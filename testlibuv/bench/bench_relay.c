@@ -0,0 +1,90 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Relay throughput of a running server as the round trip grows.
+ *
+ * The server's /api/ route must point at 127.0.0.1:|upstream port|, which
+ * is where Win32Project2.c sends it by default.  The benchmark listens
+ * there itself and forwards to its own backend, and also sits between the
+ * client and the server, adding the same delay to both legs:
+ *
+ *   client -> link -> server -> link -> backend
+ *
+ * Each delay in DELAYS is run |downloads| times with a |body MB| body.
+ * What the server relays with is its own configuration (relay_bufs,
+ * relay_chunk, use_splice and so on), so to compare settings run the
+ * server once per setting.  splice() is only used on Linux.
+ */
+
+#define BACKEND_PORT  18201
+#define CLIENT_PORT   18202
+
+static const unsigned int delays[] = { 0, 1, 5, 25 };
+
+int bench_relay(int argc, char **argv) {
+  bench_link client;
+  bench_link upstream;
+  unsigned long downloads;
+  uv_loop_t *loop;
+  uint64_t bodylen;
+  uint64_t bytes;
+  uint64_t start;
+  unsigned int i;
+  double secs;
+  int err;
+
+  bodylen = (uint64_t) bench_arg(argc, argv, 0, 20) << 20;
+  downloads = bench_arg(argc, argv, 1, 3);
+  memset(&client, 0, sizeof(client));
+  memset(&upstream, 0, sizeof(upstream));
+  client.window = upstream.window = bench_arg(argc, argv, 2, 4096) << 10;
+  client.port = CLIENT_PORT;
+  client.target = (unsigned short) bench_arg(argc, argv, 3, 1080);
+  upstream.port = (unsigned short) bench_arg(argc, argv, 4, 8080);
+  upstream.target = BACKEND_PORT;
+  if (downloads == 0 || client.window == 0) {
+    fprintf(stderr, "need at least one download and a window\n");
+    return 2;
+  }
+
+  loop = uv_default_loop();
+  if (0 != bench_backend_start(loop, BACKEND_PORT, bodylen) ||
+      0 != bench_forward_start(loop, &upstream) ||
+      0 != bench_forward_start(loop, &client)) {
+    return 1;
+  }
+
+  printf("relay: server on port %u, upstream port %u, %lu x %llu MB, "
+         "%lu KB window\n",
+         client.target,
+         upstream.port,
+         downloads,
+         (unsigned long long) (bodylen >> 20),
+         (unsigned long) (client.window >> 10));
+
+  for (i = 0; i < sizeof(delays) / sizeof(delays[0]); i += 1) {
+    client.delay_ms = upstream.delay_ms = delays[i];
+    start = uv_hrtime();
+    err = bench_fetch(loop, CLIENT_PORT, "/api/relay", downloads, &bytes);
+    secs = bench_seconds(start);
+    if (err != 0) {
+      fprintf(stderr, "download: %s\n", uv_strerror(err));
+      return 1;
+    }
+    if (bytes != bodylen * downloads) {
+      /* Some other route answered. */
+      fprintf(stderr,
+              "got %llu bytes, is /api/ routed to port %u?\n",
+              (unsigned long long) bytes,
+              upstream.port);
+      return 1;
+    }
+    printf("  %2u ms each way: %8.1f MB/s\n",
+           delays[i],
+           (double) bytes / secs / 1e6);
+  }
+
+  return 0;
+}
@@ -0,0 +1,322 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The content cache holds complete responses for small, hot files: the
+ * prebuilt header block followed by the file contents, in one contiguous
+ * buffer that goes out with a single uv_write().  Memory use is bounded by
+ * a byte budget; the least recently used entries are dropped first.
+ *
+ * Entries are keyed by path and content coding, so the gzip and brotli
+ * variants of a file live next to the identity one and share the budget.
+ *
+ * Entries are reference counted like the ones in the file cache.  An entry
+ * that is invalidated while a response is still writing from it is unlinked
+ * right away and freed when the last user releases it.
+ *
+ * A response is read into an unlinked entry and inserted when complete.  A
+ * file that changes while that read is under way leaves the entry holding
+ * old contents, so every invalidation bumps the cache's generation and an
+ * entry whose file was looked up under an earlier one is served once but
+ * never cached.
+ */
+
+static content_entry *content_find(content_cache *cc,
+                                   const char *path,
+                                   content_encoding encoding,
+                                   unsigned int h);
+static void content_lru_unlink(content_entry *ce);
+static void content_lru_push(content_cache *cc, content_entry *ce);
+static void content_remove(content_cache *cc, content_entry *ce);
+static void content_drop(content_cache *cc, content_entry *ce);
+static void content_evict(content_cache *cc, size_t need);
+static void content_free(content_entry *ce);
+
+void content_cache_init(content_cache *cc, size_t max_bytes, size_t max_file) {
+  memset(cc, 0, sizeof(*cc));
+  cc->max_bytes = max_bytes;
+  cc->max_file = max_file;
+
+  /* Size the table for an average entry of 4 kB. */
+  cc->nbuckets = 256;
+  while (cc->nbuckets < max_bytes / 4096) {
+    cc->nbuckets *= 2;
+  }
+  cc->buckets = xmalloc(cc->nbuckets * sizeof(cc->buckets[0]));
+  memset(cc->buckets, 0, cc->nbuckets * sizeof(cc->buckets[0]));
+  cc->lru.lru_next = &cc->lru;
+  cc->lru.lru_prev = &cc->lru;
+}
+
+/* Returns the pinned |encoding| variant of |path| or NULL on a miss. */
+content_entry *content_cache_get(content_cache *cc,
+                                 const char *path,
+                                 content_encoding encoding) {
+  content_entry *ce;
+
+  ce = content_find(cc, path, encoding, path_hash(path));
+  if (ce == NULL) {
+    cc->misses += 1;
+    return NULL;
+  }
+
+  cc->hits += 1;
+  if (encoding != enc_identity) {
+    cc->variant_hits += 1;
+  }
+  content_lru_unlink(ce);
+  content_lru_push(cc, ce);
+  ce->refs += 1;
+  return ce;
+}
+
+/* Allocates an unlinked, pinned entry with room for a |bodylen| byte body
+ * at ce->body and up to CONTENT_HEAD_MAX bytes of header in front of it.
+ * |generation| is the cache's as of when the file was looked up, before
+ * anything that goes into the body was read.
+ */
+content_entry *content_cache_alloc(const char *path,
+                                   content_encoding encoding,
+                                   size_t bodylen,
+                                   uint64_t generation) {
+  content_entry *ce;
+  size_t len;
+
+  len = strlen(path);
+  ce = xmalloc(sizeof(*ce) + len);
+  memset(ce, 0, sizeof(*ce));
+  memcpy(ce->path, path, len + 1);
+  ce->hash = path_hash(path);
+  ce->encoding = encoding;
+  ce->generation = generation;
+  ce->refs = 1;
+  ce->stale = 1;  /* Not in the cache (yet). */
+  ce->buf = xmalloc(CONTENT_HEAD_MAX + bodylen);
+  ce->body = ce->buf + CONTENT_HEAD_MAX;
+  ce->bodylen = bodylen;
+  ce->lru_next = ce;
+  ce->lru_prev = ce;
+  return ce;
+}
+
+/* Shrinks the body of an unlinked entry to |bodylen| bytes and gives the
+ * memory past it back, so that the budget accounts for what's really used.
+ */
+void content_cache_trim(content_entry *ce, size_t bodylen) {
+  ASSERT(ce->stale && bodylen <= ce->bodylen);
+  ce->buf = realloc(ce->buf, CONTENT_HEAD_MAX + bodylen);
+  CHECK(ce->buf != NULL);
+  ce->body = ce->buf + CONTENT_HEAD_MAX;
+  ce->bodylen = bodylen;
+}
+
+/* Places the header block right in front of the body so that header and
+ * body form one contiguous buffer.
+ */
+void content_cache_set_head(content_entry *ce, const char *head, size_t len) {
+  CHECK(len <= CONTENT_HEAD_MAX);
+  ce->data = ce->body - len;
+  ce->size = len + ce->bodylen;
+  memcpy(ce->data, head, len);
+}
+
+/* Adds |ce| to the cache.  If another request has cached the same path in
+ * the meantime, |ce| is released and the existing entry returned instead.
+ * Entries that were invalidated while being filled or don't fit in the
+ * budget stay unlinked and are freed when the caller releases them.
+ */
+content_entry *content_cache_insert(content_cache *cc, content_entry *ce) {
+  content_entry **bucket;
+  content_entry *old;
+  size_t cost;
+
+  ASSERT(ce->stale && ce->refs == 1);
+  old = content_find(cc, ce->path, ce->encoding, ce->hash);
+  if (old != NULL) {
+    old->refs += 1;
+    content_cache_release(cc, ce);
+    return old;
+  }
+
+  if (ce->generation != cc->generation) {
+    return ce;  /* The file changed while we read it. */
+  }
+
+  cost = CONTENT_HEAD_MAX + ce->bodylen;
+  if (cost > cc->max_bytes) {
+    return ce;
+  }
+
+  content_evict(cc, cost);
+  if (cc->nbytes + cost > cc->max_bytes) {
+    return ce;  /* Everything left is in use. */
+  }
+
+  bucket = cc->buckets + (ce->hash & (cc->nbuckets - 1));
+  ce->hash_next = *bucket;
+  *bucket = ce;
+  ce->stale = 0;
+  content_lru_push(cc, ce);
+  cc->nentries += 1;
+  cc->nbytes += cost;
+  return ce;
+}
+
+void content_cache_release(content_cache *cc, content_entry *ce) {
+  ASSERT(ce->refs > 0);
+  ce->refs -= 1;
+  if (ce->refs == 0 && ce->stale) {
+    content_free(ce);
+  }
+}
+
+/* Drops all variants of |path| and, with |tree| set, everything below it.
+ * Called from the file system watchers, which only ask for the full scan
+ * when |path| may be a directory.
+ */
+void content_cache_invalidate(content_cache *cc, const char *path, int tree) {
+  content_entry *ce;
+  content_entry *next;
+  unsigned int h;
+  size_t len;
+  int e;
+
+  cc->generation += 1;
+
+  if (!tree) {
+    h = path_hash(path);
+    for (e = enc_identity; e <= enc_br; e += 1) {
+      ce = content_find(cc, path, (content_encoding) e, h);
+      if (ce != NULL) {
+        content_drop(cc, ce);
+      }
+    }
+    return;
+  }
+
+  len = strlen(path);
+  for (ce = cc->lru.lru_next; ce != &cc->lru; ce = next) {
+    next = ce->lru_next;
+    if (path_within(ce->path, path, len)) {
+      content_drop(cc, ce);
+    }
+  }
+}
+
+int content_cache_stats(const content_cache *cc, char *buf, size_t len) {
+  uint64_t lookups;
+  double ratio;
+
+  lookups = cc->hits + cc->misses;
+  ratio = lookups == 0 ? 0.0 : (double) cc->hits / (double) lookups;
+  return snprintf(buf,
+                  len,
+                  "content_cache_hits %llu\n"
+                  "content_cache_misses %llu\n"
+                  "content_cache_hit_ratio %.4f\n"
+                  "content_cache_entries %u\n"
+                  "content_cache_bytes_resident %llu\n"
+                  "content_cache_bytes_max %llu\n"
+                  "content_cache_evictions %llu\n"
+                  "content_cache_invalidations %llu\n"
+                  "content_cache_variant_hits %llu\n"
+                  "gzip_compressions %llu\n"
+                  "gzip_bytes_in %llu\n"
+                  "gzip_bytes_out %llu\n"
+                  "gzip_incompressible %llu\n",
+                  (unsigned long long) cc->hits,
+                  (unsigned long long) cc->misses,
+                  ratio,
+                  cc->nentries,
+                  (unsigned long long) cc->nbytes,
+                  (unsigned long long) cc->max_bytes,
+                  (unsigned long long) cc->evictions,
+                  (unsigned long long) cc->invalidations,
+                  (unsigned long long) cc->variant_hits,
+                  (unsigned long long) cc->compressions,
+                  (unsigned long long) cc->compress_in,
+                  (unsigned long long) cc->compress_out,
+                  (unsigned long long) cc->incompressible);
+}
+
+/* Make room for |need| bytes by dropping unused entries from the cold end
+ * of the LRU list.
+ */
+static void content_evict(content_cache *cc, size_t need) {
+  content_entry *ce;
+  content_entry *prev;
+
+  for (ce = cc->lru.lru_prev;
+       ce != &cc->lru && cc->nbytes + need > cc->max_bytes;
+       ce = prev) {
+    prev = ce->lru_prev;
+    if (ce->refs == 0) {
+      content_remove(cc, ce);
+      content_free(ce);
+      cc->evictions += 1;
+    }
+  }
+}
+
+static void content_remove(content_cache *cc, content_entry *ce) {
+  content_entry **pp;
+
+  ASSERT(!ce->stale);
+  for (pp = cc->buckets + (ce->hash & (cc->nbuckets - 1));
+       *pp != ce;
+       pp = &(*pp)->hash_next) {
+    ASSERT(*pp != NULL);
+  }
+  *pp = ce->hash_next;
+  content_lru_unlink(ce);
+  ce->stale = 1;
+  cc->nentries -= 1;
+  cc->nbytes -= CONTENT_HEAD_MAX + ce->bodylen;
+}
+
+static content_entry *content_find(content_cache *cc,
+                                   const char *path,
+                                   content_encoding encoding,
+                                   unsigned int h) {
+  content_entry *ce;
+
+  for (ce = cc->buckets[h & (cc->nbuckets - 1)];
+       ce != NULL;
+       ce = ce->hash_next) {
+    if (ce->hash == h &&
+        ce->encoding == encoding &&
+        path_equal(ce->path, path)) {
+      return ce;
+    }
+  }
+
+  return NULL;
+}
+
+static void content_drop(content_cache *cc, content_entry *ce) {
+  content_remove(cc, ce);
+  cc->invalidations += 1;
+  if (ce->refs == 0) {
+    content_free(ce);
+  }
+}
+
+static void content_lru_unlink(content_entry *ce) {
+  ce->lru_prev->lru_next = ce->lru_next;
+  ce->lru_next->lru_prev = ce->lru_prev;
+  ce->lru_next = ce;
+  ce->lru_prev = ce;
+}
+
+static void content_lru_push(content_cache *cc, content_entry *ce) {
+  ce->lru_next = cc->lru.lru_next;
+  ce->lru_prev = &cc->lru;
+  cc->lru.lru_next->lru_prev = ce;
+  cc->lru.lru_next = ce;
+}
+
+static void content_free(content_entry *ce) {
+  free(ce->buf);
+  free(ce);
+}
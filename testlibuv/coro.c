@@ -0,0 +1,586 @@
+#include "defs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(O_BINARY)
+# define O_BINARY 0
+#endif
+
+/* Coroutine handlers.  A route_coro handler is written top to bottom, as
+ * if its file reads, lookups, fetches and sleeps blocked, but it runs on
+ * the loop thread and never does: each operation is started from the
+ * handler, and if it can't complete right away the handler returns
+ * CORO_SUSPENDED and gets re-entered where it left off once it has, see
+ * CORO_AWAIT().  It's the same state machine as everything else here, one
+ * state per await, only the switch is written by the macros.
+ *
+ * The frame holds the operation's results, its libuv requests and the
+ * handler's own variables.  Frames come from a free list on the loop, so
+ * a handler costs no allocation once the server is warm, and the timer a
+ * frame sleeps on is initialized once and stays with it.
+ *
+ * A frame whose session goes away is cancelled in the middle of whatever
+ * it waits for.  The handler isn't resumed again.  Timers, lookups and
+ * connections are stopped on the spot; a file system request that a
+ * thread already works on is waited for, and its file closed, before the
+ * frame goes back to the pool.  Either way the owner is done with it.
+ */
+
+#define CORO_POOL_MAX 256  /* Frames kept for reuse. */
+
+enum coro_op {
+  coro_idle,
+  coro_timer,
+  coro_file,
+  coro_lookup,
+  coro_fetching
+};
+
+enum coro_step {
+  coro_open,
+  coro_stat,
+  coro_read,
+  coro_close,
+  coro_dial,
+  coro_send,
+  coro_recv
+};
+
+static void coro_start(coro *co, unsigned char op);
+static int coro_started(coro *co);
+static void coro_settle(coro *co);
+static void coro_release(coro *co);
+static void coro_close_done(uv_handle_t *handle);
+static void coro_timer_done(uv_timer_t *handle);
+static void coro_fs_done(uv_fs_t *req);
+static void coro_fs_close(coro *co);
+static void coro_dns_done(dns_query *q, int status);
+static void coro_dial_done(upstream_dial *d, int status);
+static void coro_fetch_sent(uv_write_t *req, int status);
+static void coro_fetch_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void coro_fetch_read(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf);
+static void coro_fetch_end(coro *co, ssize_t result);
+static ssize_t coro_fetch_parse(coro *co);
+
+void coro_pool_init(coro_pool *pool, uv_loop_t *loop, dns_cache *dc) {
+  memset(pool, 0, sizeof(*pool));
+  pool->loop = loop;
+  pool->dns = dc;
+}
+
+/* After the loop has closed the frames' timers. */
+void coro_pool_free(coro_pool *pool) {
+  coro *co;
+
+  ASSERT(pool->active == 0);
+  while (pool->free != NULL) {
+    co = pool->free;
+    pool->free = co->next;
+    free(co);
+  }
+  pool->nfree = 0;
+}
+
+/* A frame for |fn| that starts at the top.  |wake| is called on the loop
+ * thread each time an operation the handler waits for completes; the
+ * owner then calls coro_resume().
+ */
+coro *coro_new(coro_pool *pool,
+               coro_fn fn,
+               const http_ctx *req,
+               handler_resp *resp,
+               coro_wake_cb wake,
+               void *arg) {
+  coro *co;
+
+  co = pool->free;
+  if (co != NULL) {
+    pool->free = co->next;
+    pool->nfree -= 1;
+    pool->reused += 1;
+  } else {
+    co = xmalloc(sizeof(*co));
+    CHECK(0 == uv_timer_init(pool->loop, &co->timer));
+    pool->frames += 1;
+  }
+
+  pool->active += 1;
+  co->line = 0;
+  co->result = 0;
+  co->data = NULL;
+  co->len = 0;
+  co->cap = 0;
+  co->status = 0;
+  co->fn = fn;
+  co->req = req;
+  co->resp = resp;
+  co->wake = wake;
+  co->arg = arg;
+  co->pool = pool;
+  co->next = NULL;
+  co->op = coro_idle;
+  co->starting = 0;
+  co->fd = -1;
+  co->uc = NULL;
+  memset(&co->vars, 0, sizeof(co->vars));
+  return co;
+}
+
+/* Runs the handler up to its next await or its end.  Returns CORO_DONE
+ * or CORO_SUSPENDED.
+ */
+int coro_resume(coro *co) {
+  int r;
+
+  ASSERT(co->op == coro_idle && co->wake != NULL);
+  r = co->fn(co, co->req, co->resp);
+  if (r == CORO_SUSPENDED) {
+    CHECK(co->op != coro_idle);  /* Nothing would wake it. */
+    co->pool->suspends += 1;
+  }
+  return r;
+}
+
+/* Returns a frame whose handler is done. */
+void coro_free(coro *co) {
+  ASSERT(co->op == coro_idle);
+  coro_release(co);
+}
+
+/* Gives up on a suspended handler.  Not a finalizer: the frame goes back
+ * to the pool by itself once its operation has settled.
+ */
+void coro_cancel(coro *co) {
+  co->wake = NULL;
+  co->pool->cancelled += 1;
+  switch (co->op) {
+    case coro_idle:
+      break;
+    case coro_timer:
+      uv_timer_stop(&co->timer);
+      break;
+    case coro_lookup:
+      dns_cache_cancel(&co->dns);
+      break;
+    case coro_file:
+      uv_cancel((uv_req_t *) &co->fs_req);
+      return;  /* coro_fs_done() closes the file and releases it. */
+    case coro_fetching:
+      if (co->step == coro_dial) {
+        upstream_dial_cancel(&co->dial);
+      } else {
+        upstream_conn_close(co->uc);
+        co->uc = NULL;
+      }
+      break;
+    default:
+      UNREACHABLE();
+  }
+
+  co->op = coro_idle;
+  coro_release(co);
+}
+
+/* The handler's variables, zeroed when the frame was handed out. */
+void *coro_vars(coro *co, size_t size) {
+  CHECK(size <= sizeof(co->vars));
+  return co->vars.bytes;
+}
+
+/* The operations return nonzero if they completed without waiting, as
+ * CORO_AWAIT() expects, and leave their outcome in co->result either way.
+ */
+
+int coro_sleep(coro *co, unsigned int ms) {
+  coro_start(co, coro_timer);
+  CHECK(0 == uv_timer_start(&co->timer, coro_timer_done, ms, 0));
+  return coro_started(co);
+}
+
+/* Reads all of |path| into co->data if it's no larger than |max| bytes.
+ * co->result is its length, UV_EFBIG if it's larger, or another error.
+ */
+int coro_read_file(coro *co, const char *path, size_t max) {
+  int err;
+
+  coro_start(co, coro_file);
+  free(co->data);
+  co->data = NULL;
+  co->len = 0;
+  co->cap = max;
+  co->step = coro_open;
+  err = uv_fs_open(co->pool->loop,
+                   &co->fs_req,
+                   path,
+                   O_RDONLY | O_BINARY,
+                   0,
+                   coro_fs_done);
+  if (err != 0) {
+    co->result = err;
+    coro_settle(co);
+  }
+  return coro_started(co);
+}
+
+/* Looks |host| up through the server's DNS cache; co->addr gets the
+ * answer, without a port.
+ */
+int coro_resolve(coro *co, const char *host) {
+  int err;
+
+  coro_start(co, coro_lookup);
+  err = dns_cache_resolve(co->pool->dns, host, &co->dns, coro_dns_done);
+  if (err != DNS_PENDING) {
+    coro_dns_done(&co->dns, err);
+  }
+  return coro_started(co);
+}
+
+/* GETs |path| from |host|:|port| over a connection of its own and reads
+ * the response to the end.  co->status is its status code and co->data
+ * its body, whose length co->result is.  Responses over CORO_FETCH_MAX
+ * fail with UV_E2BIG.
+ */
+int coro_fetch(coro *co,
+               const char *host,
+               unsigned short port,
+               const char *path) {
+  int n;
+
+  coro_start(co, coro_fetching);
+  free(co->data);
+  co->len = 0;
+  co->status = 0;
+
+  /* Kept here until it's copied to the connection's buffer. */
+  co->cap = sizeof(co->uc->c.t.buf);
+  co->data = xmalloc(co->cap);
+  n = snprintf(co->data,
+               co->cap,
+               "GET %s HTTP/1.0\r\n"
+               "Host: %s:%u\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               path,
+               host,
+               port);
+  if (n < 0 || (size_t) n >= co->cap) {
+    coro_fetch_end(co, UV_E2BIG);
+    return coro_started(co);
+  }
+
+  co->len = n;
+  co->step = coro_dial;
+  upstream_pool_init(&co->upstream, co->pool->loop, host, port, 0, 0);
+  upstream_dial_start(&co->dial, &co->upstream, co->pool->dns, coro_dial_done);
+  co->upstream.host = NULL;  /* The lookup has its own copy. */
+  return coro_started(co);
+}
+
+int coro_pool_stats(const coro_pool *pool, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "coro_frames %llu\n"
+                  "coro_reused %llu\n"
+                  "coro_active %u\n"
+                  "coro_pooled %u\n"
+                  "coro_suspends %llu\n"
+                  "coro_cancelled %llu\n",
+                  (unsigned long long) pool->frames,
+                  (unsigned long long) pool->reused,
+                  pool->active,
+                  pool->nfree,
+                  (unsigned long long) pool->suspends,
+                  (unsigned long long) pool->cancelled);
+}
+
+static void coro_start(coro *co, unsigned char op) {
+  ASSERT(co->op == coro_idle);
+  co->op = op;
+  co->starting = 1;
+  co->result = 0;
+}
+
+static int coro_started(coro *co) {
+  co->starting = 0;
+  return co->op == coro_idle;
+}
+
+/* The operation is over: resume the handler, unless it's still in the
+ * call that started it, or let the frame go if it was cancelled.
+ */
+static void coro_settle(coro *co) {
+  co->op = coro_idle;
+  if (co->wake == NULL) {
+    coro_release(co);
+  } else if (!co->starting) {
+    co->wake(co);
+  }
+}
+
+static void coro_release(coro *co) {
+  coro_pool *pool;
+
+  pool = co->pool;
+  free(co->data);
+  co->data = NULL;
+  pool->active -= 1;
+  if (pool->nfree == CORO_POOL_MAX
+      && !uv_is_closing((uv_handle_t *) &co->timer)) {
+    uv_close((uv_handle_t *) &co->timer, coro_close_done);
+    return;
+  }
+
+  co->next = pool->free;
+  pool->free = co;
+  pool->nfree += 1;
+}
+
+static void coro_close_done(uv_handle_t *handle) {
+  free(CONTAINER_OF(handle, coro, timer));
+}
+
+static void coro_timer_done(uv_timer_t *handle) {
+  coro_settle(CONTAINER_OF(handle, coro, timer));
+}
+
+/* Open, stat, read until the end and close, one request at a time. */
+static void coro_fs_done(uv_fs_t *req) {
+  uint64_t size;
+  ssize_t result;
+  uv_buf_t buf;
+  coro *co;
+
+  co = CONTAINER_OF(req, coro, fs_req);
+  result = req->result;
+  size = req->statbuf.st_size;
+  uv_fs_req_cleanup(req);
+
+  if (co->step == coro_close) {
+    coro_settle(co);  /* With the result of the read. */
+    return;
+  }
+
+  if (co->step == coro_open && result >= 0) {
+    co->fd = (uv_file) result;
+  }
+  if (co->wake == NULL && result >= 0) {
+    result = UV_ECANCELED;
+  }
+  if (result < 0) {
+    free(co->data);
+    co->data = NULL;
+    co->len = 0;
+    co->result = result;
+    coro_fs_close(co);
+    return;
+  }
+
+  switch (co->step) {
+    case coro_open:
+      co->step = coro_stat;
+      CHECK(0 == uv_fs_fstat(co->pool->loop, req, co->fd, coro_fs_done));
+      return;
+    case coro_stat:
+      if (size > co->cap) {
+        co->result = UV_EFBIG;
+        coro_fs_close(co);
+        return;
+      }
+      co->cap = (size_t) size;
+      co->data = xmalloc(co->cap + 1);
+      break;
+    case coro_read:
+      co->len += (size_t) result;
+      if (result == 0 || co->len == co->cap) {
+        co->data[co->len] = '\0';  /* Shorter if it shrank meanwhile. */
+        co->result = co->len;
+        coro_fs_close(co);
+        return;
+      }
+      break;
+    default:
+      UNREACHABLE();
+  }
+
+  co->step = coro_read;
+  buf = uv_buf_init(co->data + co->len, (unsigned int) (co->cap - co->len));
+  CHECK(0 == uv_fs_read(co->pool->loop,
+                        req,
+                        co->fd,
+                        &buf,
+                        1,
+                        co->len,
+                        coro_fs_done));
+}
+
+static void coro_fs_close(coro *co) {
+  uv_file fd;
+
+  fd = co->fd;
+  if (fd < 0) {
+    coro_settle(co);
+    return;
+  }
+
+  co->fd = -1;
+  co->step = coro_close;
+  CHECK(0 == uv_fs_close(co->pool->loop, &co->fs_req, fd, coro_fs_done));
+}
+
+static void coro_dns_done(dns_query *q, int status) {
+  coro *co;
+
+  co = CONTAINER_OF(q, coro, dns);
+  co->result = status;
+  if (status == 0) {
+    memcpy(&co->addr, &q->addr, sizeof(co->addr));
+  }
+  coro_settle(co);
+}
+
+/* On failure the dial has closed the connection already. */
+static void coro_dial_done(upstream_dial *d, int status) {
+  upstream_conn *uc;
+  uv_buf_t buf;
+  coro *co;
+
+  co = CONTAINER_OF(d, coro, dial);
+  if (status < 0) {
+    coro_fetch_end(co, status);
+    return;
+  }
+
+  uc = d->uc;
+  d->uc = NULL;
+  co->uc = uc;
+  co->step = coro_send;
+  memcpy(uc->c.t.buf, co->data, co->len);
+  buf = uv_buf_init(uc->c.t.buf, (unsigned int) co->len);
+  free(co->data);
+  co->data = NULL;
+  co->len = 0;
+  co->cap = 0;
+
+  uc->c.write_req.data = co;
+  CHECK(0 == uv_write(&uc->c.write_req,
+                      &uc->c.handle.stream,
+                      &buf,
+                      1,
+                      coro_fetch_sent));
+}
+
+static void coro_fetch_sent(uv_write_t *req, int status) {
+  upstream_conn *uc;
+  coro *co;
+
+  uc = CONTAINER_OF(req, upstream_conn, c.write_req);
+  if (uc->closing != 0) {
+    return;  /* Cancelled since, the frame may be another handler's. */
+  }
+
+  co = req->data;
+  if (status < 0) {
+    coro_fetch_end(co, status);
+    return;
+  }
+
+  co->step = coro_recv;
+  uc->c.handle.stream.data = co;
+  CHECK(0 == uv_read_start(&uc->c.handle.stream,
+                           coro_fetch_alloc,
+                           coro_fetch_read));
+}
+
+static void coro_fetch_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  upstream_conn *uc;
+
+  uc = CONTAINER_OF(handle, upstream_conn, c.handle);
+  buf->base = uc->c.t.buf;
+  buf->len = sizeof(uc->c.t.buf);
+}
+
+static void coro_fetch_read(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf) {
+  size_t cap;
+  coro *co;
+
+  if (nread == 0) {
+    return;  /* EAGAIN. */
+  }
+
+  co = handle->data;
+  if (nread == UV_EOF) {
+    coro_fetch_end(co, coro_fetch_parse(co));
+    return;
+  }
+  if (nread < 0) {
+    coro_fetch_end(co, nread);
+    return;
+  }
+  if (co->len + nread > CORO_FETCH_MAX) {
+    coro_fetch_end(co, UV_E2BIG);
+    return;
+  }
+
+  if (co->len + nread + 1 > co->cap) {
+    cap = co->cap * 2;
+    if (cap < co->len + nread + 1) {
+      cap = co->len + nread + 1;
+    }
+    co->data = realloc(co->data, cap);
+    CHECK(co->data != NULL);
+    co->cap = cap;
+  }
+
+  memcpy(co->data + co->len, buf->base, nread);
+  co->len += nread;
+}
+
+static void coro_fetch_end(coro *co, ssize_t result) {
+  if (co->uc != NULL) {
+    upstream_conn_close(co->uc);
+    co->uc = NULL;
+  }
+  if (result < 0) {
+    free(co->data);
+    co->data = NULL;
+    co->len = 0;
+  }
+  co->result = result;
+  coro_settle(co);
+}
+
+/* Takes the status code and cuts the head off, leaving the body. */
+static ssize_t coro_fetch_parse(coro *co) {
+  size_t i;
+
+  if (co->len < 12
+      || 0 != memcmp(co->data, "HTTP/1.", 7)
+      || co->data[8] != ' ') {
+    return UV_EPROTO;
+  }
+
+  for (i = 9; i < 12; i += 1) {
+    if (co->data[i] < '0' || co->data[i] > '9') {
+      return UV_EPROTO;
+    }
+    co->status = co->status * 10 + (co->data[i] - '0');
+  }
+
+  for (i = 12; i + 4 <= co->len; i += 1) {
+    if (0 == memcmp(co->data + i, "\r\n\r\n", 4)) {
+      co->len -= i + 4;
+      memmove(co->data, co->data + i + 4, co->len);
+      co->data[co->len] = '\0';
+      return (ssize_t) co->len;
+    }
+  }
+
+  return UV_EPROTO;
+}
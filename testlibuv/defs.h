@@ -26,28 +26,608 @@
 #include "uv.h"
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stddef.h>      /* size_t, ssize_t */
 #include <stdint.h>
 #include <winsock2.h>  /* sockaddr */
 
 struct client_ctx;
+struct server_state;
+struct upstream_group;
+
+typedef enum {
+  route_static,  /* Serve files below |root|. */
+  route_stats,   /* Plain text dump of the server's counters. */
+  route_proxy,   /* Forward to the backend at |host|:|port|. */
+  route_handler,  /* Answer with whatever |handler| makes of the request. */
+  route_coro  /* Likewise with |coro|, which can wait for I/O on the loop. */
+} route_kind;
+
+/* How a proxy route picks one of its backends. */
+typedef enum {
+  lb_least_outstanding,  /* Fewest requests in flight, then lowest EWMA. */
+  lb_p2c,   /* Better of two random picks by EWMA times load. */
+  lb_hash   /* Consistent hash of the key, with bounded load. */
+} lb_policy;
+
+typedef struct {
+  const char *host;
+  unsigned short port;
+} backend_config;
+
+/* The response of a route_handler, see do_handler_start(). */
+typedef struct {
+  const char *status;  /* Status line, "200 OK" if NULL. */
+  const char *type;    /* Content-Type, "text/plain" if NULL. */
+  char *body;  /* From xmalloc(), freed with the session. */
+  size_t bodylen;
+  volatile long *cancel;  /* See handler_cancelled(). */
+} handler_resp;
+
+/* Builds the response to |req|.  A blocking route runs it on a threadpool
+ * thread, so it must not touch anything but its arguments and data of its
+ * own.  A slow one should poll handler_cancelled() and give up once the
+ * request is gone.
+ */
+typedef void (*route_handler_fn)(const http_ctx *req, handler_resp *resp);
+
+struct coro;
+
+/* Builds the response to |req| on the loop thread, as a coroutine that
+ * returns CORO_SUSPENDED while one of its operations is under way and
+ * CORO_DONE once |resp| is filled in.  See coro.c.
+ */
+typedef int (*coro_fn)(struct coro *co,
+                       const http_ctx *req,
+                       handler_resp *resp);
 
 typedef struct {
+  const char *prefix;  /* URI prefix, e.g. "/static/".  Matched literally. */
+  route_kind kind;
+  const char *root;    /* route_static: directory the prefix maps to. */
+  const char *host;    /* route_proxy: backend host name or address. */
+  unsigned short port;
+  const backend_config *backends;  /* Used instead of |host| if set. */
+  unsigned int nbackends;
+  lb_policy lb;
+  const char *lb_key;  /* lb_hash: header to hash, NULL for the URI. */
+  int hedge;  /* Resend slow GETs to a second backend. */
+  int cache;  /* Keep cacheable responses, see proxy_cache.c. */
+  route_handler_fn handler;  /* route_handler: makes the response. */
+  int blocking;  /* route_handler: slow or CPU-bound, keep off the loop. */
+  coro_fn coro;  /* route_coro: makes the response. */
+} route_config;
+
+struct server_config;
+
+/* Fills |cf| in with the configuration to switch to and returns 0, or
+ * returns nonzero to keep the current one.  It runs on a threadpool thread
+ * and gets the configuration the server was started with, without its
+ * routes; what it makes |cf| point to must last until the next call.
+ */
+typedef int (*config_reload_fn)(struct server_config *cf);
+
+#define CONNECT_MAX_PORTS 8
+
+typedef struct server_config {
   const char *bind_host;
   unsigned short bind_port;
   unsigned int idle_timeout;
+  const route_config *routes;
+  unsigned int nroutes;
+  unsigned int fd_cache_size;  /* Max number of cached open files. */
+  size_t content_cache_size;  /* Memory budget for cached file contents. */
+  size_t content_max_file;  /* Largest file kept in memory, in bytes. */
+  int use_sendfile;  /* Send large files with uv_fs_sendfile(), not on Windows. */
+  unsigned int stream_bufs;  /* Read buffers per download when streaming. */
+  unsigned int stream_chunk;  /* Size of each of those buffers. */
+  unsigned int upstream_max_idle;  /* Idle connections kept per upstream. */
+  unsigned int upstream_idle_timeout;  /* Close idle connections after ms. */
+  unsigned int dns_ttl;  /* Cache host name lookups for ms. */
+  unsigned int dns_negative_ttl;  /* Cache failed lookups for ms. */
+  unsigned int dns_stale_ttl;  /* Serve expired answers while refreshing. */
+  unsigned int relay_bufs;  /* Proxy read buffers per direction. */
+  unsigned int relay_chunk;  /* Size of each of those buffers. */
+  unsigned int relay_max_inflight;  /* Bytes read but not yet written. */
+  int use_splice;  /* Linux: relay large proxied bodies with splice(). */
+  unsigned int splice_min;  /* Smallest body that's worth it, in bytes. */
+  int allow_connect;  /* Tunnel CONNECT requests, see below. */
+  unsigned short connect_ports[CONNECT_MAX_PORTS];  /* Tunnels may go to
+                                                      these, 0 ends. */
+  int connect_internal;  /* Even to loopback, link-local or private ones. */
+  unsigned int health_failures;  /* Consecutive failures that eject, 0: off. */
+  unsigned int outlier_factor;  /* Latency that counts as a failure, 0: off. */
+  unsigned int eject_ms;  /* First ejection; doubles on each repeat. */
+  unsigned int eject_max_ms;  /* Longest ejection. */
+  unsigned int probe_every;  /* An ejected backend gets 1 in this many picks. */
+  unsigned int hedge_percentile;  /* Hedge requests slower than this TTFB. */
+  unsigned int hedge_budget;  /* Extra requests hedging may add, percent. */
+  unsigned int hedge_min_ms;  /* Never hedge sooner than this. */
+  size_t proxy_cache_size;  /* Memory budget for proxied responses, 0: off. */
+  size_t proxy_cache_max_entry;  /* Largest response kept, in bytes. */
+  unsigned int threadpool_size;  /* File system threads, 0: libuv's default. */
+  unsigned int inbox_size;  /* Messages other threads can queue for the loop. */
+  unsigned int executor_threads;  /* CPU-bound work threads, at least 1. */
+  unsigned int dns_threads;  /* Host name lookup threads, at least 1. */
+  unsigned int request_timeout;  /* Ms until the response begins, 0: none. */
+  char **argv;  /* Run again to upgrade, see upgrade.c; NULL: no upgrades. */
+  unsigned int drain_timeout;  /* Ms requests get to finish when draining. */
+  config_reload_fn reload;  /* Run on SIGHUP, see snapshot.c; NULL: none. */
 } server_config;
 
 typedef struct {
-  unsigned int idle_timeout;  /* Connection idle timeout in ms. */
   uv_tcp_t tcp_handle;
   uv_loop_t *loop;
+  struct server_state *state;  /* Backlink to per-loop server state. */
 } server_ctx;
 
+/* Cache validators of a served file and the 304 response that goes with
+ * them, so that revalidation never has to touch the file.
+ */
+typedef struct {
+  int64_t mtime;    /* Last-Modified, in seconds since the epoch. */
+  char etag[48];    /* Quoted strong ETag, empty until computed. */
+  char notmod[256];  /* Prebuilt 304 response. */
+  unsigned int notmodlen;  /* Zero when |notmod| needs (re)building. */
+} file_validator;
+
+/* An open file plus its stat() result, shared by every response that
+ * serves the same path.  Entries are reference counted; an entry that
+ * is in use is never evicted.
+ */
+typedef struct file_entry {
+  struct file_entry *lru_prev;
+  struct file_entry *lru_next;
+  struct file_entry *hash_next;
+  unsigned int hash;
+  unsigned int refs;  /* Responses currently sending from |fd|. */
+  unsigned char stale;  /* Invalidated, close |fd| on last release. */
+  unsigned char etag_busy;  /* ETag is being computed on the threadpool. */
+  uv_file fd;
+  uv_stat_t st;
+  file_validator v;
+  char path[1];  /* NUL terminated, allocated together with the entry. */
+} file_entry;
+
+struct file_open_req;
+typedef void (*file_open_cb)(struct file_open_req *req,
+                             file_entry *fe,
+                             int status);
+
+typedef struct file_cache {
+  uv_loop_t *loop;
+  struct work_pool *pool;  /* Where ETags are computed. */
+  file_entry **buckets;
+  unsigned int nbuckets;  /* Always a power of two. */
+  unsigned int nentries;
+  unsigned int max_entries;
+  file_entry lru;  /* List head; lru.lru_next is the most recently used. */
+  uint64_t generation;  /* Bumped by every invalidation. */
+  uint64_t hits;
+  uint64_t misses;
+} file_cache;
+
+typedef struct file_open_req {
+  file_cache *fc;
+  file_open_cb cb;
+  uv_fs_t fs_req;
+  uv_file fd;
+  uint64_t generation;  /* The cache's when the open started. */
+  char *path;
+} file_open_req;
+
+/* Content codings we can send.  Doubles as a bit index in Accept-Encoding
+ * masks.
+ */
+typedef enum {
+  enc_identity,
+  enc_gzip,
+  enc_br
+} content_encoding;
+
+/* Room reserved in front of a cached body for the response header. */
+#define CONTENT_HEAD_MAX 512
+
+/* A complete in-memory response: |data| points at the header block, which
+ * is immediately followed by the file contents at |body|.
+ */
+typedef struct content_entry {
+  struct content_entry *lru_prev;
+  struct content_entry *lru_next;
+  struct content_entry *hash_next;
+  unsigned int hash;
+  unsigned int refs;  /* Responses currently writing from |data|. */
+  unsigned char stale;  /* Not in the cache, free on last release. */
+  unsigned char encoding;  /* Key is |path| plus the content coding. */
+  unsigned char incompressible;  /* Gzip didn't pay off, don't retry. */
+  char *buf;       /* Allocation backing |data| and |body|. */
+  char *data;      /* Header followed by body. */
+  size_t size;     /* Header plus body length. */
+  char *body;
+  size_t bodylen;
+  file_validator v;
+  uint64_t generation;  /* The cache's when its contents were read. */
+  char path[1];
+} content_entry;
+
+typedef struct {
+  content_entry **buckets;
+  unsigned int nbuckets;  /* Always a power of two. */
+  unsigned int nentries;
+  size_t nbytes;     /* Bytes resident, including header room. */
+  size_t max_bytes;  /* Budget for |nbytes|. */
+  size_t max_file;   /* Larger files are served with sendfile instead. */
+  content_entry lru;
+  uint64_t generation;  /* Bumped by every invalidation. */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t variant_hits;  /* Hits on compressed entries. */
+  uint64_t compressions;
+  uint64_t compress_in;  /* Bytes given to and returned by gzip. */
+  uint64_t compress_out;
+  uint64_t incompressible;
+} content_cache;
+
+/* Watches a static route's directory and invalidates cached files. */
+typedef struct static_watch {
+  uv_fs_event_t handle;
+  struct server_state *state;
+  const route_config *route;  /* Of the current snapshot. */
+  struct static_watch *next;
+} static_watch;
+
+/* Proxy counters.  Times are in microseconds, summed over requests, so
+ * that averages over any interval fall out of two samples.
+ */
+typedef struct {
+  uint64_t requests;
+  uint64_t errors;      /* Upstream unreachable, answered with 502. */
+  uint64_t resolve_us;  /* Request parsed to upstream address known. */
+  uint64_t connect_us;  /* Address known to connection established. */
+  uint64_t ttfb_us;     /* Request parsed to first response byte. */
+  uint64_t bytes_up;    /* Relayed request body bytes. */
+  uint64_t bytes_down;  /* Relayed response bytes. */
+  uint64_t splices;     /* Response bodies relayed with splice(). */
+  uint64_t bytes_spliced;  /* Part of |bytes_down| that never left the kernel. */
+  uint64_t tunnels;     /* CONNECT requests to an allowed port. */
+  uint64_t tunnels_active;  /* Of those, still open. */
+  uint64_t tunnels_refused;  /* Port or address not allowed. */
+} proxy_metrics;
+
+/* Requests given up on before they were answered, and what was stopped
+ * on their behalf.  Pool jobs are counted by their work_pool.
+ */
+typedef struct {
+  uint64_t expired;  /* The deadline passed before the response began. */
+  uint64_t gone;     /* The client left while work was under way. */
+  uint64_t cancelled_fs;       /* File system requests that didn't run. */
+  uint64_t cancelled_lookups;  /* Waits for a host name dropped. */
+  uint64_t cancelled_fetches;  /* Upstream exchanges cut short. */
+} request_metrics;
+
+struct work_job;
+struct executor;
+struct mpsc_queue;
+typedef void (*work_fn)(struct work_job *job);
+typedef void (*work_done_cb)(struct work_job *job, int status);
+typedef void (*mpsc_cb)(void *data);
+
+/* Blocking or CPU-bound work for the threadpool, see work_pool.c. */
+typedef struct work_job {
+  uv_work_t req;
+  struct work_pool *pool;
+  work_fn work;  /* Runs on a worker thread. */
+  work_done_cb cb;  /* Then this on the loop thread. */
+  uint64_t queued;   /* uv_hrtime() when submitted. */
+  uint64_t started;  /* Set by the worker. */
+  uint64_t finished;
+  struct mpsc_queue *inbox;  /* Executor: the loop to report back to. */
+  mpsc_cb posted;  /* Executor: runs there with the job. */
+  volatile long claim;  /* Executor: 0 queued, 1 running, 2 cancelled. */
+  volatile long cancel;  /* Set by work_pool_cancel(), for work that polls. */
+  int status;  /* Executor: 0, or UV_ECANCELED if it didn't run. */
+} work_job;
+
+typedef struct work_pool {
+  const char *name;
+  uv_loop_t *loop;
+  struct executor *exec;  /* Runs the jobs instead of libuv, or NULL. */
+  struct mpsc_queue *inbox;  /* Where |exec| reports back. */
+  unsigned int size;  /* Threads that run the jobs. */
+  unsigned int pending;  /* Submitted, callback not run yet. */
+  unsigned int pending_max;
+  uint64_t jobs;
+  uint64_t cancelled;  /* Never ran. */
+  uint64_t abandoned;  /* Ran, but was cancelled before it was done. */
+  uint64_t wait_us;  /* Time from submit until a worker started it. */
+  uint64_t wait_max_us;
+  uint64_t run_us;
+  uv_timer_t probe_timer;  /* Measures the wait of requests made elsewhere. */
+  work_job probe_job;
+  unsigned char probing;
+} work_pool;
+
+#define DNS_BUCKETS 64  /* Not resized; CONNECT names are pruned instead. */
+#define DNS_MAX_ENTRIES 1024  /* Idle entries are evicted past this. */
+#define DNS_PENDING 1   /* dns_cache_resolve() will call back. */
+
+struct dns_query;
+typedef void (*dns_cb)(struct dns_query *q, int status);
+
+/* A lookup waiting for an answer.  Lives in the caller's memory. */
+typedef struct dns_query {
+  struct dns_query *next;  /* Waiting on the same entry. */
+  struct dns_entry *entry;
+  dns_cb cb;
+  struct sockaddr_storage addr;  /* The answer, when status is 0. */
+} dns_query;
+
+/* The last answer for a host name, good or bad.  Entries aren't freed
+ * while they're being looked up, waiters hold on to them.
+ */
+typedef struct dns_entry {
+  struct dns_entry *hash_next;
+  unsigned int hash;
+  struct dns_cache *dc;
+  work_job job;  /* Runs getaddrinfo() on the DNS pool. */
+  unsigned char resolving;  /* |job| is in flight. */
+  unsigned char valid;  /* |addr| holds an answer, maybe an expired one. */
+  int status;       /* Error of the last lookup if it failed. */
+  uint64_t started;  /* uv_hrtime() when |job| was submitted. */
+  uint64_t expires;  /* uv_now() after which the answer is refreshed. */
+  uint64_t stale_until;  /* And after which it's no longer served. */
+  struct sockaddr_storage addr;
+  struct sockaddr_storage found;  /* Written by the lookup, see |job|. */
+  int found_status;
+  dns_query *waiters;
+  char host[1];
+} dns_entry;
+
+typedef struct dns_cache {
+  uv_loop_t *loop;
+  work_pool *pool;
+  dns_entry *buckets[DNS_BUCKETS];
+  unsigned int nentries;
+  unsigned int evict_next;  /* Bucket dns_evict() goes on with. */
+  unsigned int ttl;
+  unsigned int negative_ttl;
+  unsigned int stale_ttl;
+  uint64_t hits;
+  uint64_t stale_hits;     /* Served an expired answer, refresh pending. */
+  uint64_t negative_hits;  /* Failed without asking the resolver. */
+  uint64_t misses;
+  uint64_t coalesced;  /* Waited on another request's lookup. */
+  uint64_t lookups;    /* getaddrinfo() calls. */
+  uint64_t failures;
+  uint64_t lookup_us;  /* Summed over |lookups|. */
+  uint64_t evicted;  /* Entries freed to stay under DNS_MAX_ENTRIES. */
+} dns_cache;
+
+struct cache_waiter;
+typedef void (*cache_wait_cb)(struct cache_waiter *w);
+
+/* A request waiting for another one to fetch the response it wants. */
+typedef struct cache_waiter {
+  struct cache_waiter *next;
+  struct cache_entry *entry;  /* Waited on, NULL once woken. */
+  cache_wait_cb cb;
+  int stored;  /* The response is in the cache now, look again. */
+} cache_waiter;
+
+/* A cached proxy response: the backend's head minus hop-by-hop headers and
+ * Age, then the body as it came, in |data|.  The key is the URI plus the
+ * request values of the headers that Vary names.  An entry being filled
+ * has no response yet, only requests waiting for it.
+ */
+typedef struct cache_entry {
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+  struct cache_entry *hash_next;
+  uint64_t hash;  /* Of the URI, also keys the frequency sketch. */
+  unsigned int refs;  /* Responses writing from |data|, refreshes, fillers. */
+  unsigned char stale;  /* Not in the cache, free on last release. */
+  unsigned char filling;  /* No response yet, see |waiters|. */
+  unsigned char refreshing;  /* A background fetch will replace it. */
+  cache_waiter *waiters;
+  char *data;
+  size_t size;
+  size_t headlen;  /* Including the blank line. */
+  unsigned int age;  /* Seconds, as the backend said when it came in. */
+  uint64_t stored;  /* uv_now() when it came in. */
+  uint64_t fresh_until;
+  uint64_t stale_until;  /* Served while refreshing until then. */
+  const char *vary;  /* Lowercase names, comma separated, or "". */
+  const char *varyval;  /* Their request values, one per line. */
+  char key[1];  /* URI, space, Host; followed by |vary| and |varyval|. */
+} cache_entry;
+
+typedef enum {
+  cache_miss,
+  cache_hit,
+  cache_stale,   /* Served, but should be refreshed. */
+  cache_pending  /* Another request is fetching it, wait. */
+} cache_result;
+
+/* What the request lets a shared cache do. */
+typedef enum {
+  cache_use,
+  cache_refetch,  /* Fetch anew, but the response may be kept. */
+  cache_bypass    /* Leave the cache alone. */
+} cache_mode;
+
+typedef struct proxy_cache {
+  uv_loop_t *loop;
+  cache_entry **buckets;
+  unsigned int nbuckets;  /* Always a power of two. */
+  unsigned int nentries;
+  size_t nbytes;
+  size_t max_bytes;
+  size_t max_entry;
+  unsigned int timeout;  /* For background refreshes, ms. */
+  cache_entry lru;
+  uint8_t *sketch;  /* Four rows of request counters, see admission. */
+  unsigned int sketch_width;  /* Counters per row, a power of two. */
+  unsigned int sketch_adds;  /* Since the counters were last halved. */
+  uint64_t hits;
+  uint64_t stale_hits;
+  uint64_t misses;
+  uint64_t collapsed;  /* Waited for another request's fetch. */
+  uint64_t stores;
+  uint64_t uncacheable;
+  uint64_t rejected;  /* Not admitted, colder than what it would evict. */
+  uint64_t evictions;
+  uint64_t refreshes;
+  uint64_t refresh_failures;
+} proxy_cache;
+
+typedef struct {
+  volatile long seq;  /* Whose turn it is, see mpsc_queue.c. */
+  mpsc_cb cb;
+  void *data;
+  uint64_t posted;  /* uv_hrtime() when it was queued. */
+} mpsc_cell;
+
+#define MPSC_BATCH 256  /* Messages run between clock readings. */
+
+/* Hands messages from any thread to the loop thread, see mpsc_queue.c.
+ * The first group of fields is written by producers, the second one by
+ * the loop only; the padding keeps them on separate cache lines.
+ */
+typedef struct mpsc_queue {
+  uv_async_t async;
+  mpsc_cell *cells;
+  unsigned long mask;  /* Number of cells minus one. */
+  volatile long tail;  /* Next cell to claim. */
+  volatile long signalled;  /* A wakeup is on its way. */
+  volatile long full;  /* Posts turned away. */
+  char pad[64];
+  unsigned long head;  /* Next cell to run. */
+  uint64_t delivered;
+  uint64_t wakeups;
+  unsigned int drained_max;  /* Most messages run by one wakeup. */
+  uint64_t latency_us;  /* From post to callback, summed. */
+  uint64_t latency_max_us;
+} mpsc_queue;
+
+/* A thread of an executor with its deque of jobs, see executor.c. */
+typedef struct {
+  uv_thread_t thread;
+  uv_mutex_t lock;  /* Guards the deque. */
+  work_job **jobs;  /* Ring of |cap| slots, |count| of them from |head|. */
+  unsigned int cap;
+  unsigned int head;
+  volatile long count;  /* Thieves peek at it without the lock. */
+  struct executor *exec;
+  unsigned int index;
+  unsigned int victim;  /* Where the next steal attempt starts. */
+  uint64_t ran;  /* Counters, written by this thread only. */
+  uint64_t stolen;
+  uint64_t parked;
+  char pad[64];
+} exec_worker;
+
+typedef struct executor {
+  exec_worker *workers;
+  unsigned int nworkers;
+  volatile long next;  /* Round robin for jobs from other threads. */
+  volatile long queued;  /* Jobs in all deques. */
+  volatile long sleeping;  /* Workers waiting on |park|. */
+  volatile long stop;
+  uv_mutex_t park_lock;
+  uv_cond_t park;
+  uv_key_t self;  /* The calling thread's exec_worker, if it's one. */
+} executor;
+
+/* A hot upgrade, see upgrade.c.  Both processes use one. */
+typedef struct {
+  uv_signal_t signal;
+  uv_pipe_t pipe;  /* IPC channel, fd 3 in the new process. */
+  uv_process_t process;  /* Old process: the new one. */
+  uv_write_t *reqs;  /* One per listener, and one more. */
+  unsigned char running;
+  char buf[16];
+} upgrade_ctx;
+
+/* How a drain went, see server_drain(). */
+typedef struct {
+  uint64_t started;  /* uv_now() when it began. */
+  unsigned int sessions;  /* Open then. */
+  unsigned int idle;  /* Of those, closed before they sent a request. */
+  unsigned int cut_off;  /* Killed unfinished at drain_timeout. */
+} drain_metrics;
+
+/* A configuration that sessions run under, see snapshot.c.  Nothing in
+ * it changes once it's published, but for the groups' counters.
+ */
+typedef struct config_snapshot {
+  server_config config;  /* Its routes and strings live in this block. */
+  struct upstream_group *groups;  /* Indexed like config.routes. */
+  uint64_t epoch;  /* One more with every reload. */
+  unsigned int readers;  /* Sessions that started under it and live on,
+                            and work they left behind. */
+} config_snapshot;
+
+/* Frames of coroutine handlers, see coro.c.  Loop thread only. */
+typedef struct coro_pool {
+  uv_loop_t *loop;
+  dns_cache *dns;
+  struct coro *free;  /* Finished frames, ready for the next handler. */
+  unsigned int nfree;
+  unsigned int active;  /* Handed out, or cancelled and still settling. */
+  uint64_t frames;  /* Allocated. */
+  uint64_t reused;
+  uint64_t suspends;
+  uint64_t cancelled;
+} coro_pool;
+
+typedef struct server_state {
+  uv_getaddrinfo_t getaddrinfo_req;
+  server_config config;  /* As started, without routes, see snapshot.c. */
+  server_ctx *servers;
+  unsigned int nservers;
+  uv_loop_t *loop;
+  file_cache files;
+  content_cache contents;
+  static_watch *watches;
+  proxy_metrics proxy;
+  request_metrics requests;
+  dns_cache dns;
+  proxy_cache cache;
+  mpsc_queue inbox;
+  work_pool fs;  /* libuv's threadpool, file system requests only. */
+  work_pool cpu;  /* Handlers, hashing and compression. */
+  work_pool lookup;  /* Host name lookups for |dns|. */
+  executor *cpu_exec;  /* NULL to use libuv's pool. */
+  executor *lookup_exec;
+  coro_pool coros;
+  config_snapshot *snap;  /* What new sessions run under. */
+  void *volatile reload_pending;  /* Published, not taken yet. */
+  uv_async_t reload_async;
+  uv_signal_t reload_signal;
+  work_job reload_job;
+  server_config reload_config;  /* What config.reload fills in. */
+  int reload_status;
+  unsigned char reloading;
+  uint64_t reloads;
+  uint64_t reload_failures;
+  unsigned int retired;  /* Snapshots replaced but still in use. */
+  struct client_ctx *clients;  /* Live sessions, newest first. */
+  unsigned int nclients;
+  upgrade_ctx upgrade;
+  uv_signal_t stop_signals[2];  /* SIGINT and SIGTERM. */
+  uv_timer_t drain_timer;  /* Kills what's left when draining takes long. */
+  unsigned char draining;  /* Not accepting; uv_run() returns when idle. */
+  drain_metrics drain;
+} server_state;
+
 typedef struct {
   unsigned char rdstate;
   unsigned char wrstate;
   unsigned int idle_timeout;
+  unsigned int rdoff;  /* Offset in t.buf that the next read goes to. */
+  unsigned char watching;  /* Reads only to notice a close, see conn_watch(). */
   struct client_ctx *client;  /* Backlink to owning client context. */
   ssize_t result;
   union {
@@ -70,18 +650,678 @@ typedef struct {
   } t;
 } conn;
 
+typedef struct upstream_link {
+  struct upstream_link *prev;
+  struct upstream_link *next;
+} upstream_link;
+
+/* A connection to a backend.  It belongs to a client_ctx while a request
+ * is using it, and to its pool while it's idle; |c.client| is NULL then.
+ */
+typedef struct upstream_conn {
+  conn c;
+  upstream_link link;  /* In the pool's idle list. */
+  struct upstream_pool *pool;
+  unsigned int closing;  /* Handles left to close. */
+} upstream_conn;
+
+/* Idle keep-alive connections to one backend, most recently used first. */
+typedef struct upstream_pool {
+  uv_loop_t *loop;
+  const char *host;
+  unsigned short port;
+  upstream_link idle;
+  unsigned int nidle;
+  unsigned int max_idle;
+  unsigned int idle_timeout;
+  uint64_t reused;     /* Requests sent on a pooled connection. */
+  uint64_t connects;   /* Connections established. */
+  uint64_t connect_us;  /* Summed over |connects|. */
+  uint64_t expired;    /* Idle for too long. */
+  uint64_t dropped;    /* Closed by the backend or evicted while idle. */
+  uint64_t retries;    /* Requests resent after a pooled conn went stale. */
+} upstream_pool;
+
+struct upstream_dial;
+typedef void (*upstream_dial_cb)(struct upstream_dial *d, int status);
+
+/* Getting a connection to a backend for something other than a client
+ * session, see upstream_dial_start().
+ */
+typedef struct upstream_dial {
+  upstream_conn *uc;  /* The connection, or NULL. */
+  upstream_pool *pool;
+  dns_query dns;
+  uint64_t start;
+  unsigned char resolving;  /* |dns| is waiting. */
+  unsigned char reused;  /* |uc| came from the pool. */
+  upstream_dial_cb cb;
+} upstream_dial;
+
+#define CORO_DONE 0
+#define CORO_SUSPENDED 1
+#define CORO_VARS_SIZE 512  /* Room for a handler's locals, see CORO_VARS(). */
+#define CORO_FETCH_MAX (1024 * 1024)  /* Largest response coro_fetch() takes. */
+
+/* A coroutine handler is a function that its frame re-enters after each
+ * operation it waits for, at the line it left off:
+ *
+ *   static int motd(coro *co, const http_ctx *req, handler_resp *resp) {
+ *     CORO_BEGIN(co);
+ *     CORO_AWAIT(co, coro_read_file(co, "motd.txt", 4096));
+ *     if (co->result < 0) {
+ *       resp->status = "404 Not Found";
+ *     } else {
+ *       resp->body = co->data;
+ *       resp->bodylen = co->len;
+ *       co->data = NULL;
+ *     }
+ *     CORO_END(co);
+ *   }
+ *
+ * Its locals don't survive an await, so what must goes in CORO_VARS().
+ * One CORO_AWAIT() per line, and not from within a switch of its own.
+ */
+#define CORO_BEGIN(co)                                                        \
+  switch ((co)->line) {                                                       \
+    case 0:
+
+#define CORO_AWAIT(co, op)                                                    \
+  do {                                                                        \
+    (co)->line = __LINE__;                                                    \
+    if (!(op)) {                                                              \
+      return CORO_SUSPENDED;                                                  \
+    }                                                                         \
+    case __LINE__:;                                                           \
+  } while (0)
+
+#define CORO_END(co)                                                          \
+  }                                                                           \
+  return CORO_DONE
+
+#define CORO_VARS(co, type) ((type *) coro_vars((co), sizeof(type)))
+
+typedef void (*coro_wake_cb)(struct coro *co);
+
+/* The frame of a coroutine handler.  The handler reads the outcome of
+ * its last operation from the fields up to |fn|; the rest is coro.c's.
+ */
+typedef struct coro {
+  int line;  /* Where the handler resumes, 0 to start. */
+  ssize_t result;  /* Of the last operation; a libuv error if negative. */
+  char *data;  /* Bytes read or fetched, NUL-terminated, from xmalloc(). */
+  size_t len;  /* Freed with the frame unless the handler NULLs |data|. */
+  int status;  /* coro_fetch(): status code of the response. */
+  struct sockaddr_storage addr;  /* coro_resolve(): the answer. */
+  coro_fn fn;
+  const http_ctx *req;
+  handler_resp *resp;
+  coro_wake_cb wake;  /* Resumes the handler; NULL once cancelled. */
+  void *arg;  /* The owner's. */
+  coro_pool *pool;
+  struct coro *next;  /* In pool->free. */
+  unsigned char op;  /* Under way, see coro.c. */
+  unsigned char step;  /* Of a file read or a fetch. */
+  unsigned char starting;  /* Inside the call that started |op|. */
+  uv_file fd;
+  size_t cap;  /* Allocated for |data|. */
+  uv_timer_t timer;  /* Initialized once, kept while the frame is pooled. */
+  uv_fs_t fs_req;
+  dns_query dns;
+  upstream_pool upstream;  /* Never keeps the connection, just dials it. */
+  upstream_dial dial;
+  upstream_conn *uc;  /* coro_fetch(): the connection once it's dialed. */
+  union {
+    char bytes[CORO_VARS_SIZE];
+    void *align_ptr;
+    double align_double;
+    uint64_t align_u64;
+  } vars;
+} coro;
+
+/* One backend of a proxy route.  Load, latency and health are only
+ * touched on the loop thread, no locking.
+ */
+typedef struct {
+  upstream_pool pool;
+  unsigned int inflight;  /* Requests picked and not yet finished. */
+  uint64_t ewma_us;  /* Moving average of time to first byte. */
+  uint64_t requests;
+  unsigned int consecutive;  /* Failures since the last success. */
+  unsigned int backoff;  /* Ejections in a row, doubles the next one. */
+  uint64_t ejected_until;  /* Loop time; nonzero until a probe succeeds. */
+  uint64_t last_ejected;
+  uint64_t failures;
+  uint64_t ejections;
+  uint64_t probes;
+} upstream_backend;
+
+/* A point on the consistent hash ring. */
+typedef struct {
+  uint32_t hash;
+  unsigned int backend;
+} upstream_point;
+
+#define UPSTREAM_POINTS 64  /* Ring points per backend. */
+#define TTFB_BUCKETS 128  /* Latency histogram, four buckets per octave. */
+
+/* The backends of a proxy route and what's needed to choose among them. */
+typedef struct upstream_group {
+  const route_config *route;
+  const server_config *cf;
+  uv_loop_t *loop;
+  upstream_backend *backends;
+  unsigned int nbackends;
+  unsigned int nejected;  /* Backends out of rotation, never all of them. */
+  unsigned int inflight;  /* Sum over the backends. */
+  uint64_t picks;
+  upstream_point *ring;  /* lb_hash only, sorted by hash. */
+  unsigned int npoints;
+  uint32_t rand;  /* xorshift state for lb_p2c. */
+  uint64_t spills;  /* lb_hash picks that skipped a full backend. */
+  uint32_t ttfb[TTFB_BUCKETS];  /* Recent times to first byte, see hedge. */
+  uint32_t nttfb;
+  unsigned int hedge_delay;  /* ms, 0 until there are enough samples. */
+  unsigned int hedge_credit;  /* In hundredths of a hedge. */
+  uint64_t hedges;
+  uint64_t hedge_wins;
+} upstream_group;
+
+/* Tracks where a proxied response ends, so that the upstream connection
+ * can go back to the pool.
+ */
+typedef struct {
+  unsigned char state;
+  unsigned char head_request;  /* No body, whatever the headers say. */
+  unsigned char chunked;
+  unsigned char coded;  /* Has Transfer-Encoding, chunked or not. */
+  unsigned char conflict;  /* Also had Content-Length, which was ignored. */
+  unsigned char keepalive;  /* The backend will keep the connection. */
+  int status;
+  int64_t length;  /* Content-Length, or -1. */
+  uint64_t left;   /* Bytes left in the body or current chunk. */
+  uint64_t fed;    /* Bytes of the response seen so far. */
+  uint64_t head_start;  /* Offset of the final head, after any 1xx ones. */
+  uint64_t head_end;    /* Offset of the body, 0 until the head is in. */
+  unsigned int linelen;
+  char line[128];  /* Current head or chunk line, truncated. */
+} proxy_resp;
+
+#define STATIC_MAX_RANGES 8  /* More ranges than this and we send it all. */
+#define STATIC_MAX_RING   8  /* Upper bound for server_config.stream_bufs. */
+#define STATIC_GZIP_MIN   256  /* Smaller bodies aren't worth compressing. */
+
+typedef struct {
+  int64_t first;
+  int64_t last;  /* Inclusive, like in the Range header. */
+} byte_range;
+
+/* State of a static file response. */
+typedef struct {
+  file_open_req open_req;
+  file_entry *file;  /* Pinned cache entry, NULL until opened. */
+  content_entry *mem;  /* Pinned in-memory response, or being filled. */
+  int64_t offset;    /* Next file offset to send. */
+  int64_t remaining;
+  uv_file sockfd;    /* Descriptor that uv_fs_sendfile() writes to. */
+  ssize_t result;    /* Result of the last fs or work request. */
+  uv_fs_t fs_req;
+  uint64_t hash;
+  byte_range ranges[STATIC_MAX_RANGES];  /* What to send, in order. */
+  unsigned int nranges;
+  unsigned int range;  /* Index of the next range to send. */
+  unsigned char multipart;  /* Sending multipart/byteranges. */
+  unsigned char part_sent;  /* Part header of |range| is out. */
+  char boundary[24];
+  char *ring;        /* stream_bufs * stream_chunk bytes, or NULL. */
+  unsigned int ring_head;  /* Oldest filled buffer. */
+  unsigned int ring_count;  /* Filled buffers, waiting to be written. */
+  unsigned int ring_len[STATIC_MAX_RING];
+  unsigned char reading;  /* A read into the ring is in flight. */
+  int64_t rd_offset;  /* Next file offset to read into the ring. */
+  int64_t rd_remaining;
+  char path[1024];   /* File the URI maps to, without coding suffix. */
+  const char *type;  /* Content-Type of |path|. */
+  unsigned char encoding;  /* Coding of what we're sending. */
+  unsigned char accept;  /* Acceptable codings, 1 << content_encoding. */
+  content_entry *variant;  /* Being compressed from |mem|. */
+  uint64_t generation;  /* The content cache's when the lookup began. */
+} static_resp;
+
+struct splice_relay;
+typedef void (*splice_cb)(struct splice_relay *sr);
+
+/* A splice() relay between two sockets, see splice_relay.c. */
+typedef struct splice_relay {
+  uv_poll_t in_poll;
+  uv_poll_t out_poll;
+  int infd;   /* Duplicates of the sockets, owned by the relay. */
+  int outfd;
+  int pipefd[2];
+  size_t inpipe;  /* Bytes sitting in the pipe. */
+  uint64_t toread;  /* Bytes still to take from |infd|. */
+  uint64_t left;  /* Bytes still to deliver to |outfd|. */
+  uint64_t moved;  /* Bytes delivered so far. */
+  int result;  /* First error, the relay stops there. */
+  unsigned int closing;
+  splice_cb cb;
+  void *data;
+} splice_relay;
+
+struct upstream_hedge;
+typedef void (*hedge_cb)(struct upstream_hedge *h);
+
+/* A copy of a slow request on another backend, see upstream_hedge.c.
+ * Once |cb| has run, dial.uc holds the first |len| response bytes in its
+ * buffer; the owner takes dial.uc and |backend| by clearing them before it
+ * calls upstream_hedge_cancel().
+ */
+typedef struct upstream_hedge {
+  uv_timer_t timer;
+  upstream_group *group;
+  upstream_backend *primary;  /* Where the request went first. */
+  upstream_backend *backend;  /* Counted in its |inflight|, or NULL. */
+  upstream_dial dial;  /* dial.uc is the hedge's connection. */
+  dns_cache *dc;
+  char *head;  /* The owner's request until the hedge fires, then a copy. */
+  unsigned int headlen;
+  unsigned int len;
+  uint64_t start;  /* uv_hrtime() when the hedge fired. */
+  unsigned char written;
+  hedge_cb cb;
+  void *data;
+} upstream_hedge;
+
+#define RELAY_MAX_BUFS 16  /* Upper bound for server_config.relay_bufs. */
+
+typedef struct {
+  uv_write_t req;
+  unsigned int len;
+} relay_slot;
+
+/* One direction of a proxied exchange.  Reads land in the next free
+ * buffer and are written out right away, so the next read can proceed
+ * while earlier chunks are still being written.  The buffers are
+ * allocated on the first read.
+ */
+typedef struct {
+  struct client_ctx *cx;
+  conn *src;
+  conn *dst;
+  relay_slot *slots;  /* nbufs of them, or NULL.  Owns |bufs|. */
+  char *bufs;  /* nbufs buffers of relay_chunk bytes. */
+  unsigned int nbufs;
+  unsigned int head;   /* Oldest buffer still being written. */
+  unsigned int count;  /* Buffers being written. */
+  size_t inflight;     /* Their bytes. */
+  unsigned char reading;
+  unsigned char stopped;  /* Nothing more to read, e.g. response complete. */
+  unsigned char release;  /* Free the buffers whenever they drain. */
+  ssize_t rd_result;  /* UV_EOF or a read error; no reads after that. */
+  int wr_result;
+} relay_dir;
+
+/* State of a proxied request. */
+typedef struct {
+  char *head;       /* Request head for the upstream, then body bytes. */
+  unsigned int headlen;
+  uint64_t start;   /* uv_hrtime() when the request was parsed. */
+  uint64_t sent;    /* When |backend| got it; later if a hedge won. */
+  uint64_t resolved;
+  const char *host;  /* Where the upstream connection goes. */
+  unsigned short port;
+  upstream_backend *backend;  /* Counted in its |inflight| until do_kill(). */
+  upstream_pool *pool;  /* NULL for a tunnel. */
+  relay_dir down;  /* Backend to client. */
+  relay_dir up;    /* Client to backend. */
+  splice_relay *splice;  /* Relaying the response body, or NULL. */
+  upstream_hedge *hedge;  /* Armed until the first response bytes, or NULL. */
+  uint64_t spliced;  /* splice->moved already accounted for. */
+  dns_query dns;
+  proxy_resp resp;
+  int64_t up_remaining;  /* Request body bytes still to relay. */
+  unsigned char open;  /* The upstream conn has handles to close. */
+  unsigned char resolving;  /* |dns| is waiting, cancel it on kill. */
+  unsigned char responded;  /* Relayed the first response bytes. */
+  unsigned char reusable;  /* The upstream conn can go back to the pool. */
+  unsigned char reused;  /* It came from the pool. */
+  unsigned char replayable;  /* |head| holds the whole request. */
+  unsigned char tunnel;  /* CONNECT; |head| holds the host, then early data. */
+  unsigned char reported;  /* The backend's health has been updated. */
+  unsigned char cache_pass;  /* Go upstream, don't look in the cache again. */
+  unsigned char done;  /* The response has been relayed in full. */
+  cache_entry *cached;  /* Pinned response being served from the cache. */
+  cache_entry *fill;  /* Pending entry this request fetches, or NULL. */
+  cache_waiter wait;  /* Waiting for another request's fetch. */
+  char *capture;  /* Copy of the response for the cache, or NULL. */
+  size_t capturelen;
+  size_t capturecap;
+  char age[64];  /* Header lines added to a cached response. */
+} proxy_req;
+
 typedef struct client_ctx {
   unsigned int state;
   server_ctx *sx;  /* Backlink to owning server context. */
   conn clientconn;  /* Connection with upstream. */
+  upstream_conn *upstream;  /* Connection with the backend of a proxy route. */
   http_ctx parser;   /* http context parse result*/
+  const route_config *route;  /* Matched route, NULL for built-ins. */
+  uv_req_t *busy;  /* In-flight threadpool request, cancelled by do_kill(). */
+  static_resp file;
+  proxy_req proxy;
+  handler_resp handler;
+  work_job job;  /* Hashing, compression or a blocking handler. */
+  char *resp_buf;  /* Heap allocated response, freed with the session. */
+  uint64_t deadline;  /* uv_now() by which the response must begin, or 0. */
+  config_snapshot *snap;  /* The configuration, from accept to close. */
+  coro *coro;  /* Suspended route_coro handler, cancelled by do_kill(). */
+  struct client_ctx *prev;  /* In state->clients. */
+  struct client_ctx *next;
 } client_ctx;
 
 /* server.c */
 int server_run(const server_config *cf, uv_loop_t *loop);
+const route_config *route_match(const server_config *cf,
+                                const char *uri,
+                                size_t urilen);
+int server_stats(const struct server_state *state, char *buf, size_t len);
+int server_listen(server_ctx *sx);
+void server_drain(struct server_state *state, int close_idle);
+void server_drained(struct server_state *state);
 
 /* client.c */
 void http_client_finish_init(server_ctx *sx, client_ctx *cx);
+int http_client_kill(client_ctx *cx);
+int http_client_idle(const client_ctx *cx);
+int handler_cancelled(const handler_resp *resp);
+int request_stats(const request_metrics *m, char *buf, size_t len);
+
+/* dns_cache.c */
+void dns_cache_init(dns_cache *dc,
+                    uv_loop_t *loop,
+                    work_pool *pool,
+                    unsigned int ttl,
+                    unsigned int negative_ttl,
+                    unsigned int stale_ttl);
+int dns_cache_resolve(dns_cache *dc,
+                      const char *host,
+                      dns_query *q,
+                      dns_cb cb);
+void dns_cache_cancel(dns_query *q);
+int dns_cache_stats(const dns_cache *dc, char *buf, size_t len);
+
+/* file_cache.c */
+void file_cache_init(file_cache *fc,
+                     uv_loop_t *loop,
+                     work_pool *pool,
+                     unsigned int max_entries);
+file_entry *file_cache_get(file_cache *fc, const char *path);
+int file_cache_open(file_cache *fc,
+                    file_open_req *req,
+                    const char *path,
+                    file_open_cb cb);
+void file_cache_release(file_cache *fc, file_entry *fe);
+void file_cache_invalidate(file_cache *fc, const char *path, int tree);
+void file_cache_etag(file_cache *fc, file_entry *fe);
+uint64_t file_hash_contents(const char *data, size_t len, uint64_t h);
+int file_etag_format(char *buf, size_t len, uint64_t hash, uint64_t size);
+int file_cache_stats(const file_cache *fc, char *buf, size_t len);
+
+/* content_cache.c */
+void content_cache_init(content_cache *cc, size_t max_bytes, size_t max_file);
+content_entry *content_cache_get(content_cache *cc,
+                                 const char *path,
+                                 content_encoding encoding);
+content_entry *content_cache_alloc(const char *path,
+                                   content_encoding encoding,
+                                   size_t bodylen,
+                                   uint64_t generation);
+void content_cache_trim(content_entry *ce, size_t bodylen);
+void content_cache_set_head(content_entry *ce, const char *head, size_t len);
+content_entry *content_cache_insert(content_cache *cc, content_entry *ce);
+void content_cache_release(content_cache *cc, content_entry *ce);
+void content_cache_invalidate(content_cache *cc, const char *path, int tree);
+int content_cache_stats(const content_cache *cc, char *buf, size_t len);
+
+/* http_static.c */
+int static_path(const route_config *route,
+                const char *uri,
+                size_t urilen,
+                char *path,
+                size_t pathlen);
+const char *static_mime_type(const char *path);
+int static_compressible(const char *type);
+const char *static_encoding_suffix(content_encoding encoding);
+unsigned int static_accept_encoding(const http_ctx *parser);
+int static_head(char *buf,
+                size_t len,
+                const char *type,
+                content_encoding encoding,
+                uint64_t size,
+                const file_validator *v);
+int static_head_range(char *buf,
+                      size_t len,
+                      const char *type,
+                      content_encoding encoding,
+                      uint64_t size,
+                      const file_validator *v,
+                      const byte_range *r,
+                      uint64_t bodylen,
+                      const char *boundary);
+int static_part_head(char *buf,
+                     size_t len,
+                     const char *type,
+                     uint64_t size,
+                     const byte_range *r,
+                     const char *boundary);
+uint64_t static_multipart_length(const char *type,
+                                 uint64_t size,
+                                 const byte_range *ranges,
+                                 unsigned int nranges,
+                                 const char *boundary);
+int static_unsatisfiable(char *buf, size_t len, uint64_t size);
+int static_ranges(const char *value,
+                  size_t len,
+                  uint64_t size,
+                  byte_range *ranges,
+                  unsigned int max);
+int static_if_range(const http_ctx *parser, const file_validator *v);
+int static_not_modified(const http_ctx *parser, const file_validator *v);
+void static_notmod_build(file_validator *v, const char *type);
+void static_watch_start(struct server_state *state);
+void static_watch_stop(struct server_state *state);
+
+/* gzip.c */
+size_t gzip_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/* http_proxy.c */
+int proxy_request_head(const http_ctx *parser,
+                       const char *client,
+                       int keepalive,
+                       char *buf,
+                       size_t len);
+void proxy_resp_init(proxy_resp *r, int head_request);
+int proxy_resp_feed(proxy_resp *r, const char *data, size_t len);
+int proxy_resp_done(const proxy_resp *r);
+uint64_t proxy_resp_body_left(const proxy_resp *r);
+void proxy_resp_skip(proxy_resp *r, uint64_t n);
+int proxy_resp_strip(proxy_resp *r, char *data, size_t len);
+int proxy_stats(const proxy_metrics *m, char *buf, size_t len);
+
+/* proxy_cache.c */
+void proxy_cache_init(proxy_cache *pc,
+                      uv_loop_t *loop,
+                      size_t max_bytes,
+                      size_t max_entry,
+                      unsigned int timeout);
+cache_mode proxy_cache_mode(const http_ctx *parser);
+cache_result proxy_cache_lookup(proxy_cache *pc,
+                                const http_ctx *parser,
+                                cache_entry **out);
+cache_entry *proxy_cache_fill(proxy_cache *pc, const http_ctx *parser);
+void proxy_cache_wait(cache_entry *fill, cache_waiter *w, cache_wait_cb cb);
+void proxy_cache_unwait(cache_waiter *w);
+int proxy_cache_store(proxy_cache *pc,
+                      cache_entry *fill,
+                      const char *req,
+                      size_t reqlen,
+                      const proxy_resp *resp,
+                      char *data,
+                      size_t len);
+void proxy_cache_abort(proxy_cache *pc, cache_entry *fill);
+void proxy_cache_release(proxy_cache *pc, cache_entry *ce);
+unsigned int proxy_cache_age(const proxy_cache *pc, const cache_entry *ce);
+void proxy_cache_refresh(proxy_cache *pc,
+                         cache_entry *ce,
+                         server_state *state,
+                         config_snapshot *snap,
+                         upstream_group *g,
+                         const char *req,
+                         size_t reqlen,
+                         int keepalive);
+int proxy_cache_stats(const proxy_cache *pc, char *buf, size_t len);
+
+/* splice_relay.c */
+int splice_relay_start(uv_loop_t *loop,
+                       uv_tcp_t *from,
+                       uv_tcp_t *to,
+                       uint64_t len,
+                       splice_cb cb,
+                       void *data,
+                       splice_relay **out);
+void splice_relay_stop(splice_relay *sr);
+
+/* upstream_pool.c */
+void upstream_pool_init(upstream_pool *p,
+                        uv_loop_t *loop,
+                        const char *host,
+                        unsigned short port,
+                        unsigned int max_idle,
+                        unsigned int idle_timeout);
+upstream_conn *upstream_pool_get(upstream_pool *p);
+void upstream_pool_put(upstream_pool *p, upstream_conn *uc);
+upstream_conn *upstream_conn_new(uv_loop_t *loop, upstream_pool *p);
+void upstream_conn_close(upstream_conn *uc);
+void upstream_pool_flush(upstream_pool *p);
+void upstream_dial_start(upstream_dial *d,
+                         upstream_pool *p,
+                         dns_cache *dc,
+                         upstream_dial_cb cb);
+void upstream_dial_cancel(upstream_dial *d);
+int upstream_pool_stats(const upstream_pool *p, char *buf, size_t len);
+
+/* upstream_group.c */
+void upstream_group_init(upstream_group *g,
+                         uv_loop_t *loop,
+                         const server_config *cf,
+                         const route_config *route);
+void upstream_group_flush(upstream_group *g);
+void upstream_group_free(upstream_group *g);
+upstream_backend *upstream_group_pick(upstream_group *g,
+                                      const char *key,
+                                      size_t keylen);
+void upstream_group_done(upstream_group *g, upstream_backend *b);
+void upstream_backend_sample(upstream_group *g,
+                             upstream_backend *b,
+                             uint64_t us);
+void upstream_backend_failed(upstream_group *g, upstream_backend *b);
+unsigned int upstream_group_hedge_arm(upstream_group *g);
+upstream_backend *upstream_group_hedge_pick(upstream_group *g,
+                                            const upstream_backend *primary);
+int upstream_group_stats(const upstream_group *g, char *buf, size_t len);
+
+/* upstream_hedge.c */
+upstream_hedge *upstream_hedge_start(upstream_group *g,
+                                     upstream_backend *primary,
+                                     dns_cache *dc,
+                                     char *head,
+                                     unsigned int headlen,
+                                     unsigned int delay,
+                                     hedge_cb cb,
+                                     void *data);
+void upstream_hedge_cancel(upstream_hedge *h);
+
+/* executor.c */
+executor *executor_new(unsigned int nthreads);
+void executor_submit(executor *ex,
+                     work_job *job,
+                     mpsc_queue *inbox,
+                     mpsc_cb posted);
+int executor_cancel(work_job *job);
+void executor_free(executor *ex);
+int executor_stats(const executor *ex,
+                   const char *name,
+                   char *buf,
+                   size_t len);
+
+/* mpsc_queue.c */
+void mpsc_queue_init(mpsc_queue *q, uv_loop_t *loop, unsigned int size);
+int mpsc_queue_post(mpsc_queue *q, mpsc_cb cb, void *data);
+void mpsc_queue_close(mpsc_queue *q);
+int mpsc_queue_stats(const mpsc_queue *q, char *buf, size_t len);
+
+/* work_pool.c */
+unsigned int work_threadpool_size(unsigned int size);
+void work_pool_init(work_pool *wp,
+                    const char *name,
+                    uv_loop_t *loop,
+                    unsigned int size,
+                    executor *exec,
+                    mpsc_queue *inbox);
+void work_pool_probe(work_pool *wp, unsigned int interval);
+void work_pool_submit(work_pool *wp,
+                      work_job *job,
+                      work_fn work,
+                      work_done_cb cb);
+void work_pool_cancel(work_job *job);
+int work_job_cancelled(work_job *job);
+int work_pool_stats(const work_pool *wp, char *buf, size_t len);
+
+/* snapshot.c */
+config_snapshot *snapshot_new(const server_config *cf);
+void snapshot_free(config_snapshot *snap);
+void snapshot_init(server_state *state, config_snapshot *snap);
+void snapshot_publish(server_state *state, config_snapshot *snap);
+config_snapshot *snapshot_enter(server_state *state);
+void snapshot_hold(config_snapshot *snap);
+void snapshot_leave(server_state *state, config_snapshot *snap);
+void snapshot_close(server_state *state);
+int snapshot_stats(const server_state *state, char *buf, size_t len);
+
+/* coro.c */
+void coro_pool_init(coro_pool *pool, uv_loop_t *loop, dns_cache *dc);
+void coro_pool_free(coro_pool *pool);
+coro *coro_new(coro_pool *pool,
+               coro_fn fn,
+               const http_ctx *req,
+               handler_resp *resp,
+               coro_wake_cb wake,
+               void *arg);
+int coro_resume(coro *co);
+void coro_free(coro *co);
+void coro_cancel(coro *co);
+void *coro_vars(coro *co, size_t size);
+int coro_sleep(coro *co, unsigned int ms);
+int coro_read_file(coro *co, const char *path, size_t max);
+int coro_resolve(coro *co, const char *host);
+int coro_fetch(coro *co,
+               const char *host,
+               unsigned short port,
+               const char *path);
+int coro_pool_stats(const coro_pool *pool, char *buf, size_t len);
+
+/* upgrade.c */
+void upgrade_init(server_state *state);
+int upgrade_inherit(server_state *state);
+
+/* log.c */
+void log_start(void);
+void log_stop(void);
+void log_vprint(const char *label,
+                int to_stderr,
+                const char *fmt,
+                va_list ap);
+int log_stats(char *buf, size_t len);
 
 /* util.c */
 #if defined(__GNUC__)
@@ -93,6 +1333,17 @@ void pr_info(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_warn(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_err(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void *xmalloc(size_t size);
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+unsigned int path_hash(const char *path);
+int path_equal(const char *a, const char *b);
+int path_within(const char *path, const char *dir, size_t len);
+long atom_load(volatile long *p);
+void atom_store(volatile long *p, long v);
+int atom_cas(volatile long *p, long *expected, long desired);
+long atom_xchg(volatile long *p, long v);
+long atom_add(volatile long *p, long v);
+void *atom_xchg_ptr(void *volatile *p, void *v);
+void thread_yield(void);
 
 /* main.c */
 const char *_getprogname(void);
@@ -0,0 +1,317 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Host name lookups for proxy routes.  getaddrinfo() blocks, so it runs
+ * on a pool of its own where it doesn't queue behind file I/O, and answers
+ * are kept per loop so that a hit is served without leaving the loop
+ * thread.
+ *
+ * getaddrinfo() doesn't report TTLs; answers are kept for a configured
+ * time instead, failures for a shorter one.  An expired answer is still
+ * handed out for a while after that while a single lookup refreshes it
+ * in the background, and if the refresh fails the old answer stays in use
+ * until its stale window closes.  Concurrent misses for the same name
+ * wait on one lookup.
+ */
+
+static unsigned int dns_hash(const char *host);
+static dns_entry *dns_find(dns_cache *dc, const char *host, unsigned int h);
+static void dns_prune(dns_cache *dc, unsigned int h, uint64_t now);
+static void dns_evict(dns_cache *dc);
+static void dns_lookup(dns_entry *e);
+static void dns_lookup_run(work_job *job);
+static void dns_lookup_done(work_job *job, int status);
+
+/* Lookups run on |pool|. */
+void dns_cache_init(dns_cache *dc,
+                    uv_loop_t *loop,
+                    work_pool *pool,
+                    unsigned int ttl,
+                    unsigned int negative_ttl,
+                    unsigned int stale_ttl) {
+  memset(dc, 0, sizeof(*dc));
+  dc->loop = loop;
+  dc->pool = pool;
+  dc->ttl = ttl;
+  dc->negative_ttl = negative_ttl;
+  dc->stale_ttl = stale_ttl;
+}
+
+/* Returns 0 with q->addr set if the answer is known, the cached error if
+ * the name failed to resolve recently, or DNS_PENDING if |cb| will be
+ * called once the lookup completes.  Call dns_cache_cancel() to stop
+ * waiting.
+ */
+int dns_cache_resolve(dns_cache *dc,
+                      const char *host,
+                      dns_query *q,
+                      dns_cb cb) {
+  unsigned int h;
+  dns_entry *e;
+  uint64_t now;
+  size_t len;
+
+  now = uv_now(dc->loop);
+  h = dns_hash(host);
+  e = dns_find(dc, host, h);
+  if (e == NULL) {
+    dns_prune(dc, h, now);
+    if (dc->nentries >= DNS_MAX_ENTRIES) {
+      dns_evict(dc);
+    }
+    len = strlen(host);
+    e = xmalloc(sizeof(*e) + len);
+    memset(e, 0, sizeof(*e));
+    memcpy(e->host, host, len + 1);
+    e->hash = h;
+    e->dc = dc;
+    e->hash_next = dc->buckets[h & (DNS_BUCKETS - 1)];
+    dc->buckets[h & (DNS_BUCKETS - 1)] = e;
+    dc->nentries += 1;
+  }
+
+  if (e->valid && now < e->stale_until) {
+    if (now < e->expires) {
+      dc->hits += 1;
+    } else {
+      dc->stale_hits += 1;
+      if (!e->resolving) {
+        dns_lookup(e);
+      }
+    }
+    memcpy(&q->addr, &e->addr, sizeof(q->addr));
+    return 0;
+  }
+
+  if (!e->valid && e->status < 0 && now < e->expires) {
+    dc->negative_hits += 1;
+    return e->status;
+  }
+
+  if (e->resolving) {
+    dc->coalesced += 1;
+  } else {
+    dc->misses += 1;
+    dns_lookup(e);
+  }
+
+  q->entry = e;
+  q->cb = cb;
+  q->next = e->waiters;
+  e->waiters = q;
+  return DNS_PENDING;
+}
+
+/* Stops waiting for an answer.  The lookup itself carries on, the answer
+ * is still cached.
+ */
+void dns_cache_cancel(dns_query *q) {
+  dns_query **pq;
+
+  if (q->entry == NULL) {
+    return;  /* Already answered. */
+  }
+
+  for (pq = &q->entry->waiters; *pq != NULL; pq = &(*pq)->next) {
+    if (*pq == q) {
+      *pq = q->next;
+      break;
+    }
+  }
+  q->entry = NULL;
+}
+
+int dns_cache_stats(const dns_cache *dc, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "dns_cache_hits %llu\n"
+                  "dns_cache_stale_hits %llu\n"
+                  "dns_cache_negative_hits %llu\n"
+                  "dns_cache_misses %llu\n"
+                  "dns_cache_coalesced %llu\n"
+                  "dns_lookups %llu\n"
+                  "dns_lookup_failures %llu\n"
+                  "dns_lookup_us %llu\n"
+                  "dns_cache_entries %u\n"
+                  "dns_cache_evicted %llu\n",
+                  (unsigned long long) dc->hits,
+                  (unsigned long long) dc->stale_hits,
+                  (unsigned long long) dc->negative_hits,
+                  (unsigned long long) dc->misses,
+                  (unsigned long long) dc->coalesced,
+                  (unsigned long long) dc->lookups,
+                  (unsigned long long) dc->failures,
+                  (unsigned long long) dc->lookup_us,
+                  dc->nentries,
+                  (unsigned long long) dc->evicted);
+}
+
+static unsigned int dns_hash(const char *host) {
+  unsigned int h;
+
+  h = 2166136261u;
+  while (*host != '\0') {
+    h ^= (unsigned char) *host++;
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static dns_entry *dns_find(dns_cache *dc, const char *host, unsigned int h) {
+  dns_entry *e;
+
+  for (e = dc->buckets[h & (DNS_BUCKETS - 1)]; e != NULL; e = e->hash_next) {
+    if (e->hash == h && 0 == strcmp(e->host, host)) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+/* Frees the entries in |h|'s bucket that can't answer anymore.  Proxy
+ * routes name a few hosts, but CONNECT tunnels go wherever clients ask.
+ */
+static void dns_prune(dns_cache *dc, unsigned int h, uint64_t now) {
+  dns_entry **pe;
+  dns_entry *e;
+
+  pe = &dc->buckets[h & (DNS_BUCKETS - 1)];
+  while ((e = *pe) != NULL) {
+    if (e->resolving
+        || now < e->expires
+        || (e->valid && now < e->stale_until)) {
+      pe = &e->hash_next;
+      continue;
+    }
+    *pe = e->hash_next;
+    dc->nentries -= 1;
+    free(e);
+  }
+}
+
+/* Past DNS_MAX_ENTRIES, all of them clients' CONNECT names most likely.
+ * Frees answers that could still be served too, starting where the last
+ * eviction left off, until there's room for an eighth more.  Entries that
+ * are being looked up stay, their waiters point to them.
+ */
+static void dns_evict(dns_cache *dc) {
+  dns_entry **pe;
+  dns_entry *e;
+  unsigned int n;
+
+  for (n = 0; n < DNS_BUCKETS; n += 1) {
+    dc->evict_next = (dc->evict_next + 1) & (DNS_BUCKETS - 1);
+    pe = &dc->buckets[dc->evict_next];
+    while ((e = *pe) != NULL) {
+      if (e->resolving) {
+        pe = &e->hash_next;
+        continue;
+      }
+      *pe = e->hash_next;
+      dc->nentries -= 1;
+      dc->evicted += 1;
+      free(e);
+    }
+    if (dc->nentries < DNS_MAX_ENTRIES - DNS_MAX_ENTRIES / 8) {
+      break;
+    }
+  }
+}
+
+static void dns_lookup(dns_entry *e) {
+  e->resolving = 1;
+  e->started = uv_hrtime();
+  e->dc->lookups += 1;
+  work_pool_submit(e->dc->pool, &e->job, dns_lookup_run, dns_lookup_done);
+}
+
+/* Worker thread.  Only |found| and |found_status| are written here. */
+static void dns_lookup_run(work_job *job) {
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  dns_entry *e;
+  int err;
+
+  e = CONTAINER_OF(job, dns_entry, job);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  err = getaddrinfo(e->host, NULL, &hints, &ai);
+  switch (err) {
+    case 0:
+      memset(&e->found, 0, sizeof(e->found));
+      memcpy(&e->found, ai->ai_addr, ai->ai_addrlen);
+      freeaddrinfo(ai);
+      e->found_status = 0;
+      break;
+    case EAI_AGAIN:
+      e->found_status = UV_EAI_AGAIN;
+      break;
+    case EAI_NONAME:
+      e->found_status = UV_EAI_NONAME;
+      break;
+    case EAI_MEMORY:
+      e->found_status = UV_EAI_MEMORY;
+      break;
+    default:
+      e->found_status = UV_EAI_FAIL;
+      break;
+  }
+}
+
+static void dns_lookup_done(work_job *job, int status) {
+  struct sockaddr_storage addr;
+  dns_query *waiters;
+  dns_cache *dc;
+  dns_entry *e;
+  dns_query *q;
+  uint64_t now;
+
+  e = CONTAINER_OF(job, dns_entry, job);
+  dc = e->dc;
+  now = uv_now(dc->loop);
+  e->resolving = 0;
+  dc->lookup_us += (uv_hrtime() - e->started) / 1000;
+
+  if (status == 0) {
+    status = e->found_status;
+  }
+  if (status == 0) {
+    memcpy(&e->addr, &e->found, sizeof(e->addr));
+    e->valid = 1;
+    e->status = 0;
+    e->expires = now + dc->ttl;
+    e->stale_until = e->expires + dc->stale_ttl;
+  } else {
+    dc->failures += 1;
+    e->status = status;
+    e->expires = now + dc->negative_ttl;
+    if (e->valid && now >= e->stale_until) {
+      e->valid = 0;
+    }
+  }
+
+  /* Callbacks may look up names again, and that may evict |e|; take the
+   * list and the answer first.
+   */
+  waiters = e->waiters;
+  e->waiters = NULL;
+  if (e->valid) {
+    memcpy(&addr, &e->addr, sizeof(addr));
+    status = 0;
+  }
+  while (waiters != NULL) {
+    q = waiters;
+    waiters = q->next;
+    q->entry = NULL;
+    if (status == 0) {
+      memcpy(&q->addr, &addr, sizeof(q->addr));
+    }
+    q->cb(q, status);
+  }
+}
@@ -0,0 +1,307 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Runs CPU-bound jobs on threads of its own, away from libuv's pool,
+ * which has a single queue and a single lock that every submission and
+ * every worker goes through.
+ *
+ * Here each worker has a deque with a lock of its own.  Jobs from a loop
+ * are dealt to the workers in turn; a job submitted by a running job goes
+ * to its own worker.  A worker takes its newest job first, while its
+ * memory is still warm, and when it runs dry it steals the oldest job of
+ * another worker.  The locks are thus contended only when a thief meets
+ * the owner, not on every submission.
+ *
+ * Idle workers sleep on a condition variable.  Submitters count the job
+ * in |queued| and then look at |sleeping|; a worker about to sleep counts
+ * itself in |sleeping| and then looks at |queued|.  Both are atomic
+ * read-modify-writes, so one of the two always sees the other and no job
+ * waits for a worker that went to sleep.
+ *
+ * When a job is done, or was cancelled before it started, the worker
+ * posts it to the inbox of the loop that submitted it.
+ */
+
+#define EXEC_MAX_THREADS 1024
+#define EXEC_DEQUE_MIN 64
+
+enum {
+  job_queued,
+  job_running,
+  job_cancelled
+};
+
+static void exec_main(void *arg);
+static void exec_push(exec_worker *w, work_job *job);
+static work_job *exec_pop(exec_worker *w);
+static work_job *exec_steal(exec_worker *w);
+static int exec_park(exec_worker *w);
+static void exec_run(exec_worker *w, work_job *job);
+
+executor *executor_new(unsigned int nthreads) {
+  exec_worker *w;
+  executor *ex;
+  unsigned int i;
+
+  if (nthreads > EXEC_MAX_THREADS) {
+    nthreads = EXEC_MAX_THREADS;
+  }
+
+  ex = xmalloc(sizeof(*ex));
+  memset(ex, 0, sizeof(*ex));
+  ex->nworkers = nthreads;
+  ex->workers = xmalloc(nthreads * sizeof(ex->workers[0]));
+  memset(ex->workers, 0, nthreads * sizeof(ex->workers[0]));
+  CHECK(0 == uv_mutex_init(&ex->park_lock));
+  CHECK(0 == uv_cond_init(&ex->park));
+  CHECK(0 == uv_key_create(&ex->self));
+
+  for (i = 0; i < nthreads; i += 1) {
+    w = ex->workers + i;
+    w->exec = ex;
+    w->index = i;
+    w->victim = i + 1;
+    w->cap = EXEC_DEQUE_MIN;
+    w->jobs = xmalloc(w->cap * sizeof(w->jobs[0]));
+    CHECK(0 == uv_mutex_init(&w->lock));
+  }
+
+  /* Only now, a worker may steal from any other. */
+  for (i = 0; i < nthreads; i += 1) {
+    CHECK(0 == uv_thread_create(&ex->workers[i].thread,
+                                exec_main,
+                                ex->workers + i));
+  }
+
+  return ex;
+}
+
+/* Thread-safe.  Runs job->work on a worker, then |posted| with the job on
+ * the thread that drains |inbox|; job->status tells whether it ran.
+ */
+void executor_submit(executor *ex,
+                     work_job *job,
+                     mpsc_queue *inbox,
+                     mpsc_cb posted) {
+  exec_worker *w;
+
+  job->inbox = inbox;
+  job->posted = posted;
+  job->claim = job_queued;
+  job->status = 0;
+
+  w = uv_key_get(&ex->self);
+  if (w == NULL || w->exec != ex) {
+    w = ex->workers + (unsigned long) atom_add(&ex->next, 1) % ex->nworkers;
+  }
+  exec_push(w, job);
+
+  if (atom_add(&ex->sleeping, 0) > 0) {
+    uv_mutex_lock(&ex->park_lock);
+    uv_cond_signal(&ex->park);
+    uv_mutex_unlock(&ex->park_lock);
+  }
+}
+
+/* Returns nonzero if the job won't run.  It's still posted back, with a
+ * status of UV_ECANCELED.
+ */
+int executor_cancel(work_job *job) {
+  long state;
+
+  state = job_queued;
+  return atom_cas(&job->claim, &state, job_cancelled);
+}
+
+/* Stops and joins the workers.  Jobs that haven't run yet are dropped. */
+void executor_free(executor *ex) {
+  unsigned int i;
+
+  uv_mutex_lock(&ex->park_lock);
+  atom_store(&ex->stop, 1);
+  uv_cond_broadcast(&ex->park);
+  uv_mutex_unlock(&ex->park_lock);
+
+  for (i = 0; i < ex->nworkers; i += 1) {
+    CHECK(0 == uv_thread_join(&ex->workers[i].thread));
+  }
+  for (i = 0; i < ex->nworkers; i += 1) {
+    uv_mutex_destroy(&ex->workers[i].lock);
+    free(ex->workers[i].jobs);
+  }
+
+  uv_key_delete(&ex->self);
+  uv_cond_destroy(&ex->park);
+  uv_mutex_destroy(&ex->park_lock);
+  free(ex->workers);
+  free(ex);
+}
+
+/* The per-worker counters are read without a lock; they may lag a bit.
+ * |name| labels them like the pool's.
+ */
+int executor_stats(const executor *ex,
+                   const char *name,
+                   char *buf,
+                   size_t len) {
+  const exec_worker *w;
+  uint64_t ran;
+  uint64_t stolen;
+  uint64_t parked;
+  unsigned int i;
+
+  ran = 0;
+  stolen = 0;
+  parked = 0;
+  for (i = 0; i < ex->nworkers; i += 1) {
+    w = ex->workers + i;
+    ran += w->ran;
+    stolen += w->stolen;
+    parked += w->parked;
+  }
+
+  return snprintf(buf,
+                  len,
+                  "executor_threads{pool=\"%s\"} %u\n"
+                  "executor_queued{pool=\"%s\"} %ld\n"
+                  "executor_ran{pool=\"%s\"} %llu\n"
+                  "executor_stolen{pool=\"%s\"} %llu\n"
+                  "executor_parked{pool=\"%s\"} %llu\n",
+                  name, ex->nworkers,
+                  name, ex->queued,
+                  name, (unsigned long long) ran,
+                  name, (unsigned long long) stolen,
+                  name, (unsigned long long) parked);
+}
+
+static void exec_main(void *arg) {
+  exec_worker *w;
+  work_job *job;
+
+  w = arg;
+  uv_key_set(&w->exec->self, w);
+  for (;;) {
+    job = exec_pop(w);
+    if (job == NULL) {
+      job = exec_steal(w);
+    }
+    if (job != NULL) {
+      exec_run(w, job);
+    } else if (exec_park(w)) {
+      break;
+    }
+  }
+}
+
+/* Adds |job| at the back of w's deque, growing it when it's full. */
+static void exec_push(exec_worker *w, work_job *job) {
+  work_job **jobs;
+  unsigned int i;
+
+  uv_mutex_lock(&w->lock);
+  if ((unsigned long) w->count == w->cap) {
+    jobs = xmalloc(2 * w->cap * sizeof(jobs[0]));
+    for (i = 0; i < (unsigned int) w->count; i += 1) {
+      jobs[i] = w->jobs[(w->head + i) % w->cap];
+    }
+    free(w->jobs);
+    w->jobs = jobs;
+    w->head = 0;
+    w->cap *= 2;
+  }
+
+  w->jobs[(w->head + w->count) % w->cap] = job;
+  atom_store(&w->count, w->count + 1);
+  atom_add(&w->exec->queued, 1);
+  uv_mutex_unlock(&w->lock);
+}
+
+/* The owner's end: the newest job. */
+static work_job *exec_pop(exec_worker *w) {
+  work_job *job;
+
+  job = NULL;
+  uv_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    atom_store(&w->count, w->count - 1);
+    job = w->jobs[(w->head + w->count) % w->cap];
+    atom_add(&w->exec->queued, -1);
+  }
+  uv_mutex_unlock(&w->lock);
+  return job;
+}
+
+/* The thieves' end: the oldest job of the first other worker that has
+ * one.  Deques that look empty aren't locked at all.
+ */
+static work_job *exec_steal(exec_worker *w) {
+  exec_worker *victim;
+  executor *ex;
+  work_job *job;
+  unsigned int i;
+
+  ex = w->exec;
+  for (i = 0; i < ex->nworkers && atom_add(&ex->queued, 0) > 0; i += 1) {
+    victim = ex->workers + (w->victim + i) % ex->nworkers;
+    if (victim == w || atom_load(&victim->count) == 0) {
+      continue;
+    }
+
+    job = NULL;
+    uv_mutex_lock(&victim->lock);
+    if (victim->count > 0) {
+      job = victim->jobs[victim->head];
+      victim->head = (victim->head + 1) % victim->cap;
+      atom_store(&victim->count, victim->count - 1);
+      atom_add(&ex->queued, -1);
+    }
+    uv_mutex_unlock(&victim->lock);
+
+    if (job != NULL) {
+      w->victim = (w->victim + i) % ex->nworkers;  /* Try it first again. */
+      w->stolen += 1;
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+/* Sleeps until there may be work.  Returns nonzero when it's time to go. */
+static int exec_park(exec_worker *w) {
+  executor *ex;
+  int stop;
+
+  ex = w->exec;
+  uv_mutex_lock(&ex->park_lock);
+  atom_add(&ex->sleeping, 1);
+  if (atom_add(&ex->queued, 0) == 0 && !atom_load(&ex->stop)) {
+    w->parked += 1;
+    uv_cond_wait(&ex->park, &ex->park_lock);
+  }
+  atom_add(&ex->sleeping, -1);
+  stop = atom_load(&ex->stop);
+  uv_mutex_unlock(&ex->park_lock);
+  return stop;
+}
+
+static void exec_run(exec_worker *w, work_job *job) {
+  long state;
+
+  state = job_queued;
+  if (atom_cas(&job->claim, &state, job_running)) {
+    job->started = uv_hrtime();
+    job->work(job);
+    job->finished = uv_hrtime();
+  } else {
+    job->status = UV_ECANCELED;
+  }
+  w->ran += 1;
+
+  /* The loop drains its inbox every iteration; it's full only briefly. */
+  while (0 != mpsc_queue_post(job->inbox, job->posted, job)) {
+    thread_yield();
+  }
+}
@@ -0,0 +1,472 @@
+#include "defs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if !defined(O_BINARY)
+# define O_BINARY 0
+#endif
+
+/* ETags hash the contents in chunks of this size.  Anything that computes
+ * them must use the same chunking or the tags won't agree.
+ */
+#define ETAG_CHUNK (64 * 1024)
+
+typedef struct {
+  work_job job;
+  file_cache *fc;
+  file_entry *fe;
+  uint64_t hash;
+  int err;
+} etag_work;
+
+/* The file cache keeps files open between requests so that hot files skip
+ * the open() and stat() round trips through the threadpool.  Lookups go
+ * through a chained hash table keyed on the file system path; recency is
+ * tracked with an intrusive doubly linked list.  The cache is per loop and
+ * only ever touched from the loop thread, hence no locking.
+ *
+ * Invalidations bump the cache's generation.  A file whose open started
+ * under an earlier one may be the file as it was before the change; it is
+ * handed to the request that opened it and closed after, not cached.
+ */
+
+static file_entry *file_find(file_cache *fc, const char *path, unsigned int h);
+static void file_lru_unlink(file_entry *fe);
+static void file_lru_push(file_cache *fc, file_entry *fe);
+static void file_insert(file_cache *fc, file_entry *fe);
+static void file_remove(file_cache *fc, file_entry *fe);
+static void file_drop(file_cache *fc, file_entry *fe);
+static void file_evict(file_cache *fc);
+static void file_close(file_cache *fc, uv_file fd);
+static void file_close_done(uv_fs_t *req);
+static void file_open_done(uv_fs_t *req);
+static void file_stat_done(uv_fs_t *req);
+static void file_open_finish(file_open_req *req, int status);
+static void file_etag_work(work_job *job);
+static void file_etag_done(work_job *job, int status);
+
+/* ETags are computed on |pool|. */
+void file_cache_init(file_cache *fc,
+                     uv_loop_t *loop,
+                     work_pool *pool,
+                     unsigned int max_entries) {
+  unsigned int n;
+
+  memset(fc, 0, sizeof(*fc));
+  fc->loop = loop;
+  fc->pool = pool;
+  fc->max_entries = max_entries;
+
+  /* Aim for a load factor of at most one. */
+  n = 16;
+  while (n < max_entries) {
+    n *= 2;
+  }
+  fc->nbuckets = n;
+  fc->buckets = xmalloc(n * sizeof(fc->buckets[0]));
+  memset(fc->buckets, 0, n * sizeof(fc->buckets[0]));
+  fc->lru.lru_next = &fc->lru;
+  fc->lru.lru_prev = &fc->lru;
+}
+
+/* Returns the cached entry for |path| with its reference count bumped or
+ * NULL when the file is not open yet.  Never calls back into the caller.
+ */
+file_entry *file_cache_get(file_cache *fc, const char *path) {
+  file_entry *fe;
+
+  fe = file_find(fc, path, path_hash(path));
+  if (fe == NULL) {
+    fc->misses += 1;
+    return NULL;
+  }
+
+  fc->hits += 1;
+  file_lru_unlink(fe);
+  file_lru_push(fc, fe);
+  fe->refs += 1;
+  return fe;
+}
+
+/* Opens and stats |path| on the threadpool, then hands the (pinned) cache
+ * entry to |cb|.  Directories and other non-regular files are rejected.
+ */
+int file_cache_open(file_cache *fc,
+                    file_open_req *req,
+                    const char *path,
+                    file_open_cb cb) {
+  size_t len;
+  int err;
+
+  len = strlen(path);
+  req->fc = fc;
+  req->cb = cb;
+  req->fd = -1;
+  req->generation = fc->generation;
+  req->path = xmalloc(len + 1);
+  memcpy(req->path, path, len + 1);
+
+  err = uv_fs_open(fc->loop,
+                   &req->fs_req,
+                   req->path,
+                   O_RDONLY | O_BINARY,
+                   0,
+                   file_open_done);
+  if (err != 0) {
+    free(req->path);
+    req->path = NULL;
+  }
+
+  return err;
+}
+
+void file_cache_release(file_cache *fc, file_entry *fe) {
+  ASSERT(fe->refs > 0);
+  fe->refs -= 1;
+  if (fe->refs == 0 && fe->stale) {
+    file_close(fc, fe->fd);
+    free(fe);
+  } else if (fe->refs == 0 && fc->nentries > fc->max_entries) {
+    file_evict(fc);
+  }
+}
+
+/* Forgets |path| and, with |tree| set, every file below it.  Only a path
+ * that may name a directory needs the scan, a file is one hash lookup.
+ * The descriptors of entries that are still in use are closed on release.
+ */
+void file_cache_invalidate(file_cache *fc, const char *path, int tree) {
+  file_entry *fe;
+  file_entry *next;
+  size_t len;
+
+  fc->generation += 1;
+
+  if (!tree) {
+    fe = file_find(fc, path, path_hash(path));
+    if (fe != NULL) {
+      file_drop(fc, fe);
+    }
+    return;
+  }
+
+  len = strlen(path);
+  for (fe = fc->lru.lru_next; fe != &fc->lru; fe = next) {
+    next = fe->lru_next;
+    if (path_within(fe->path, path, len)) {
+      file_drop(fc, fe);
+    }
+  }
+}
+
+/* Computes the ETag of |fe| on the cache's work pool, once.  Until it's
+ * ready, responses go out with just Last-Modified.
+ */
+void file_cache_etag(file_cache *fc, file_entry *fe) {
+  etag_work *w;
+
+  if (fe->v.etag[0] != '\0' || fe->etag_busy) {
+    return;
+  }
+
+  w = xmalloc(sizeof(*w));
+  w->fc = fc;
+  w->fe = fe;
+  w->hash = 0;
+  w->err = 0;
+  fe->refs += 1;  /* Keep |fd| open while the work runs. */
+  fe->etag_busy = 1;
+  work_pool_submit(fc->pool, &w->job, file_etag_work, file_etag_done);
+}
+
+/* Hashes |len| bytes of file contents, continuing from |h|. */
+uint64_t file_hash_contents(const char *data, size_t len, uint64_t h) {
+  size_t n;
+
+  while (len > 0) {
+    n = len < ETAG_CHUNK ? len : ETAG_CHUNK;
+    h = hash64(data, n, h);
+    data += n;
+    len -= n;
+  }
+
+  return h;
+}
+
+int file_etag_format(char *buf, size_t len, uint64_t hash, uint64_t size) {
+  return snprintf(buf,
+                  len,
+                  "\"%llx-%016llx\"",
+                  (unsigned long long) size,
+                  (unsigned long long) hash);
+}
+
+int file_cache_stats(const file_cache *fc, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "file_cache_hits %llu\n"
+                  "file_cache_misses %llu\n"
+                  "file_cache_entries %u\n",
+                  (unsigned long long) fc->hits,
+                  (unsigned long long) fc->misses,
+                  fc->nentries);
+}
+
+static void file_open_done(uv_fs_t *req) {
+  file_open_req *r;
+  int err;
+
+  r = CONTAINER_OF(req, file_open_req, fs_req);
+  err = (int) req->result;
+  uv_fs_req_cleanup(req);
+
+  if (err < 0) {
+    file_open_finish(r, err);
+    return;
+  }
+
+  r->fd = err;
+  err = uv_fs_fstat(r->fc->loop, &r->fs_req, r->fd, file_stat_done);
+  if (err != 0) {
+    file_open_finish(r, err);
+  }
+}
+
+static void file_stat_done(uv_fs_t *req) {
+  file_open_req *r;
+  file_entry *fe;
+  unsigned int h;
+  size_t len;
+  int err;
+
+  r = CONTAINER_OF(req, file_open_req, fs_req);
+  err = (int) req->result;
+  if (err == 0 && (req->statbuf.st_mode & S_IFMT) != S_IFREG) {
+    err = UV_EISDIR;
+  }
+
+  if (err < 0) {
+    uv_fs_req_cleanup(req);
+    file_open_finish(r, err);
+    return;
+  }
+
+  /* Another request may have opened the same file in the meantime.  Keep
+   * the entry that's already in the cache, it may be in use.
+   */
+  h = path_hash(r->path);
+  fe = file_find(r->fc, r->path, h);
+  if (fe == NULL) {
+    len = strlen(r->path);
+    fe = xmalloc(sizeof(*fe) + len);
+    memcpy(fe->path, r->path, len + 1);
+    fe->hash = h;
+    fe->refs = 0;
+    fe->stale = 0;
+    fe->etag_busy = 0;
+    fe->fd = r->fd;
+    fe->st = req->statbuf;
+    fe->v.mtime = fe->st.st_mtim.tv_sec;
+    fe->v.etag[0] = '\0';
+    fe->v.notmodlen = 0;
+    r->fd = -1;
+    if (r->generation == r->fc->generation) {
+      file_insert(r->fc, fe);
+    } else {
+      fe->stale = 1;  /* Changed while we opened it, don't cache. */
+      fe->lru_next = fe;
+      fe->lru_prev = fe;
+    }
+  }
+
+  uv_fs_req_cleanup(req);
+  fe->refs += 1;
+  if (!fe->stale) {
+    file_lru_unlink(fe);
+    file_lru_push(r->fc, fe);
+    file_evict(r->fc);
+  }
+  file_open_finish(r, 0);
+  r->cb(r, fe, 0);
+}
+
+/* Releases the resources held by |req|.  On error, also runs the callback. */
+static void file_open_finish(file_open_req *req, int status) {
+  if (req->fd != -1) {
+    file_close(req->fc, req->fd);
+    req->fd = -1;
+  }
+
+  free(req->path);
+  req->path = NULL;
+
+  if (status != 0) {
+    req->cb(req, NULL, status);
+  }
+}
+
+/* Close least recently used entries until we're back under the limit.
+ * Entries that are still in use are skipped; they are reconsidered when
+ * their last user releases them.
+ */
+static void file_evict(file_cache *fc) {
+  file_entry *fe;
+  file_entry *prev;
+
+  for (fe = fc->lru.lru_prev;
+       fe != &fc->lru && fc->nentries > fc->max_entries;
+       fe = prev) {
+    prev = fe->lru_prev;
+    if (fe->refs == 0) {
+      file_remove(fc, fe);
+      file_close(fc, fe->fd);
+      free(fe);
+    }
+  }
+}
+
+static void file_insert(file_cache *fc, file_entry *fe) {
+  file_entry **bucket;
+
+  bucket = fc->buckets + (fe->hash & (fc->nbuckets - 1));
+  fe->hash_next = *bucket;
+  *bucket = fe;
+  fe->lru_next = fe;
+  fe->lru_prev = fe;
+  fc->nentries += 1;
+}
+
+static void file_remove(file_cache *fc, file_entry *fe) {
+  file_entry **pp;
+
+  for (pp = fc->buckets + (fe->hash & (fc->nbuckets - 1));
+       *pp != fe;
+       pp = &(*pp)->hash_next) {
+    ASSERT(*pp != NULL);
+  }
+  *pp = fe->hash_next;
+  file_lru_unlink(fe);
+  fc->nentries -= 1;
+}
+
+static void file_drop(file_cache *fc, file_entry *fe) {
+  file_remove(fc, fe);
+  if (fe->refs == 0) {
+    file_close(fc, fe->fd);
+    free(fe);
+  } else {
+    fe->stale = 1;
+  }
+}
+
+static file_entry *file_find(file_cache *fc, const char *path, unsigned int h) {
+  file_entry *fe;
+
+  for (fe = fc->buckets[h & (fc->nbuckets - 1)];
+       fe != NULL;
+       fe = fe->hash_next) {
+    if (fe->hash == h && path_equal(fe->path, path)) {
+      return fe;
+    }
+  }
+
+  return NULL;
+}
+
+static void file_lru_unlink(file_entry *fe) {
+  fe->lru_prev->lru_next = fe->lru_next;
+  fe->lru_next->lru_prev = fe->lru_prev;
+  fe->lru_next = fe;
+  fe->lru_prev = fe;
+}
+
+static void file_lru_push(file_cache *fc, file_entry *fe) {
+  fe->lru_next = fc->lru.lru_next;
+  fe->lru_prev = &fc->lru;
+  fc->lru.lru_next->lru_prev = fe;
+  fc->lru.lru_next = fe;
+}
+
+/* Runs on the threadpool.  Reads at explicit offsets so responses that are
+ * sending from the same descriptor aren't disturbed.  Every chunk but the
+ * last is filled completely, file_hash_contents() relies on that.
+ */
+static void file_etag_work(work_job *job) {
+  etag_work *w;
+  uv_buf_t buf;
+  uv_fs_t fs_req;
+  int64_t offset;
+  size_t fill;
+  char *chunk;
+  int n;
+
+  w = CONTAINER_OF(job, etag_work, job);
+  chunk = xmalloc(ETAG_CHUNK);
+  offset = 0;
+
+  for (;;) {
+    if (work_job_cancelled(job)) {
+      w->err = UV_ECANCELED;
+      break;
+    }
+
+    fill = 0;
+    do {
+      buf = uv_buf_init(chunk + fill, (unsigned int) (ETAG_CHUNK - fill));
+      n = uv_fs_read(NULL, &fs_req, w->fe->fd, &buf, 1, offset, NULL);
+      uv_fs_req_cleanup(&fs_req);
+      if (n < 0) {
+        w->err = n;
+        free(chunk);
+        return;
+      }
+      fill += n;
+      offset += n;
+    } while (n > 0 && fill < ETAG_CHUNK);
+
+    if (fill == 0) {
+      break;
+    }
+    w->hash = file_hash_contents(chunk, fill, w->hash);
+    if (n == 0) {
+      break;
+    }
+  }
+
+  free(chunk);
+}
+
+static void file_etag_done(work_job *job, int status) {
+  file_entry *fe;
+  etag_work *w;
+
+  w = CONTAINER_OF(job, etag_work, job);
+  fe = w->fe;
+  fe->etag_busy = 0;
+  if (status == 0 && w->err == 0) {
+    file_etag_format(fe->v.etag, sizeof(fe->v.etag), w->hash, fe->st.st_size);
+    fe->v.notmodlen = 0;  /* Rebuild the 304 with the ETag in it. */
+  } else if (w->err != 0 && w->err != UV_ECANCELED) {
+    pr_warn("etag of \"%s\": %s", fe->path, uv_strerror(w->err));
+  }
+
+  file_cache_release(w->fc, fe);
+  free(w);
+}
+
+static void file_close(file_cache *fc, uv_file fd) {
+  uv_fs_t *req;
+
+  req = xmalloc(sizeof(*req));
+  if (0 != uv_fs_close(fc->loop, req, fd, file_close_done)) {
+    free(req);
+  }
+}
+
+static void file_close_done(uv_fs_t *req) {
+  uv_fs_req_cleanup(req);
+  free(req);
+}
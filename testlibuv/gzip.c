@@ -0,0 +1,249 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A small gzip (RFC 1952) encoder for compressing cached responses on the
+ * threadpool.  It emits a single deflate block with the fixed Huffman codes
+ * and finds matches with hash chains over the last 32 kB.  That gives up
+ * some ratio compared to zlib's dynamic codes, but text still shrinks
+ * several times, it needs no extra library and it keeps no shared state,
+ * so any number of threads can use it at once.
+ */
+
+#define GZ_WINDOW     32768
+#define GZ_HASH_SIZE  32768
+#define GZ_MIN_MATCH  3
+#define GZ_MAX_MATCH  258
+#define GZ_MAX_CHAIN  32
+
+typedef struct {
+  unsigned char *out;
+  size_t cap;
+  size_t n;
+  uint32_t bits;
+  unsigned int nbits;
+  int overflow;
+} gz_stream;
+
+static const unsigned short len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+  16385, 24577
+};
+
+static const unsigned char dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void put_byte(gz_stream *s, unsigned int c);
+static void put_bits(gz_stream *s, uint32_t v, unsigned int n);
+static void put_code(gz_stream *s, unsigned int code, unsigned int len);
+static void put_literal(gz_stream *s, unsigned int sym);
+static void put_match(gz_stream *s, unsigned int len, unsigned int dist);
+static void put_le32(gz_stream *s, uint32_t v);
+static unsigned int gz_hash(const unsigned char *p);
+
+/* Compresses |len| bytes at |src| into |dst|.  Returns the size of the
+ * gzip member, or 0 if it doesn't fit in |cap| bytes.  Pass a |cap| below
+ * |len| to only accept output that actually saves something.
+ */
+size_t gzip_compress(const void *src, size_t len, void *dst, size_t cap) {
+  const unsigned char *p;
+  uint32_t crc_table[256];
+  unsigned int best_len;
+  unsigned int best_dist;
+  unsigned int maxlen;
+  unsigned int chain;
+  unsigned int h;
+  unsigned int k;
+  int32_t *head;
+  int32_t *prev;
+  int32_t cand;
+  gz_stream s;
+  uint32_t crc;
+  uint32_t c;
+  size_t i;
+
+  if (len > 0x7fffffff) {
+    return 0;
+  }
+
+  p = src;
+  s.out = dst;
+  s.cap = cap;
+  s.n = 0;
+  s.bits = 0;
+  s.nbits = 0;
+  s.overflow = 0;
+
+  /* Header: magic, deflate, no flags, no mtime, no extra flags, OS unknown. */
+  put_byte(&s, 0x1f);
+  put_byte(&s, 0x8b);
+  put_byte(&s, 8);
+  put_byte(&s, 0);
+  put_le32(&s, 0);
+  put_byte(&s, 0);
+  put_byte(&s, 255);
+
+  /* A single final block with the fixed codes. */
+  put_bits(&s, 1, 1);
+  put_bits(&s, 1, 2);
+
+  head = xmalloc(GZ_HASH_SIZE * sizeof(head[0]));
+  prev = xmalloc(GZ_WINDOW * sizeof(prev[0]));
+  memset(head, -1, GZ_HASH_SIZE * sizeof(head[0]));
+
+  i = 0;
+  while (i < len && !s.overflow) {
+    best_len = 0;
+    best_dist = 0;
+    if (i + GZ_MIN_MATCH <= len) {
+      maxlen = GZ_MAX_MATCH;
+      if (len - i < maxlen) {
+        maxlen = (unsigned int) (len - i);
+      }
+
+      h = gz_hash(p + i);
+      cand = head[h];
+      for (chain = GZ_MAX_CHAIN;
+           cand >= 0 && i - cand <= GZ_WINDOW && chain > 0;
+           chain -= 1) {
+        if (p[cand + best_len] == p[i + best_len]) {
+          for (k = 0; k < maxlen && p[cand + k] == p[i + k]; k += 1);
+          if (k > best_len) {
+            best_len = k;
+            best_dist = (unsigned int) (i - cand);
+            if (k == maxlen) {
+              break;
+            }
+          }
+        }
+        cand = prev[cand & (GZ_WINDOW - 1)];
+      }
+
+      prev[i & (GZ_WINDOW - 1)] = head[h];
+      head[h] = (int32_t) i;
+    }
+
+    if (best_len < GZ_MIN_MATCH) {
+      put_literal(&s, p[i]);
+      i += 1;
+      continue;
+    }
+
+    put_match(&s, best_len, best_dist);
+    for (k = 1; k < best_len; k += 1) {
+      if (i + k + GZ_MIN_MATCH <= len) {
+        h = gz_hash(p + i + k);
+        prev[(i + k) & (GZ_WINDOW - 1)] = head[h];
+        head[h] = (int32_t) (i + k);
+      }
+    }
+    i += best_len;
+  }
+
+  free(head);
+  free(prev);
+
+  put_literal(&s, 256);  /* End of block. */
+  if (s.nbits > 0) {
+    put_bits(&s, 0, 8 - s.nbits);
+  }
+
+  for (h = 0; h < 256; h += 1) {
+    c = h;
+    for (k = 0; k < 8; k += 1) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[h] = c;
+  }
+
+  crc = 0xffffffff;
+  for (i = 0; i < len; i += 1) {
+    crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  put_le32(&s, crc ^ 0xffffffff);
+  put_le32(&s, (uint32_t) len);
+  return s.overflow ? 0 : s.n;
+}
+
+static void put_byte(gz_stream *s, unsigned int c) {
+  if (s->n == s->cap) {
+    s->overflow = 1;
+    return;
+  }
+  s->out[s->n++] = (unsigned char) c;
+}
+
+/* Deflate packs bits starting at the least significant one. */
+static void put_bits(gz_stream *s, uint32_t v, unsigned int n) {
+  s->bits |= v << s->nbits;
+  s->nbits += n;
+  while (s->nbits >= 8) {
+    put_byte(s, s->bits & 0xff);
+    s->bits >>= 8;
+    s->nbits -= 8;
+  }
+}
+
+/* Huffman codes are the exception, they go out most significant bit
+ * first.
+ */
+static void put_code(gz_stream *s, unsigned int code, unsigned int len) {
+  unsigned int rev;
+  unsigned int i;
+
+  rev = 0;
+  for (i = 0; i < len; i += 1) {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  put_bits(s, rev, len);
+}
+
+static void put_literal(gz_stream *s, unsigned int sym) {
+  if (sym < 144) {
+    put_code(s, 0x30 + sym, 8);
+  } else if (sym < 256) {
+    put_code(s, 0x190 + sym - 144, 9);
+  } else if (sym < 280) {
+    put_code(s, sym - 256, 7);
+  } else {
+    put_code(s, 0xc0 + sym - 280, 8);
+  }
+}
+
+static void put_match(gz_stream *s, unsigned int len, unsigned int dist) {
+  unsigned int i;
+
+  for (i = 28; len_base[i] > len; i -= 1);
+  put_literal(s, 257 + i);
+  put_bits(s, len - len_base[i], len_extra[i]);
+
+  for (i = 29; dist_base[i] > dist; i -= 1);
+  put_code(s, i, 5);
+  put_bits(s, dist - dist_base[i], dist_extra[i]);
+}
+
+static void put_le32(gz_stream *s, uint32_t v) {
+  put_byte(s, v & 0xff);
+  put_byte(s, (v >> 8) & 0xff);
+  put_byte(s, (v >> 16) & 0xff);
+  put_byte(s, (v >> 24) & 0xff);
+}
+
+static unsigned int gz_hash(const unsigned char *p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (GZ_HASH_SIZE - 1);
+}
@@ -21,6 +21,7 @@
 
 #include "defs.h"
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -41,8 +42,8 @@
  * When the connection with upstream has been established, the client_ctx
  * moves into a state where incoming data from the client is sent upstream
  * and vice versa, incoming data from upstream is sent to the client.  In
- * other words, we're just piping data back and forth.  See conn_cycle()
- * for details.
+ * other words, we're just piping data back and forth.  That relay is the
+ * exception to the rules here and below; see relay_pump() for details.
  *
  * An interesting deviation from libuv's I/O model is that reads are discrete
  * rather than continuous events.  In layman's terms, when a read operation
@@ -66,6 +67,23 @@ enum conn_state {
 enum sess_state {
   s_req_start,        /* Start waiting for request data. */
   s_req_parse,        /* Wait for request data. */
+  s_resp_write,       /* Wait for the response to be written. */
+  s_handler_run,      /* Wait for a blocking handler on the threadpool. */
+  s_coro_run,         /* Wait for what a coroutine handler awaits. */
+  s_static_open,      /* Wait for the file to be opened. */
+  s_static_read,      /* Wait for file contents to be read into memory. */
+  s_static_hash,      /* Wait for the ETag of the contents. */
+  s_static_compress,  /* Wait for the gzip variant to be built. */
+  s_static_write,     /* Wait for a header or in-memory body to be written. */
+  s_static_body,      /* Wait for uv_fs_sendfile() to complete. */
+  s_static_stream,    /* Wait for a ring buffer read or write to complete. */
+  s_proxy_wait,       /* Wait for another request to fetch the response. */
+  s_proxy_resolve,    /* Wait for the upstream address to be resolved. */
+  s_proxy_connect,    /* Wait for the upstream connection. */
+  s_proxy_send,       /* Wait for the request head to go upstream. */
+  s_proxy,            /* Relay the body and the response. */
+  s_proxy_splice,     /* Relay the response body with splice(). */
+  s_tunnel_reply,     /* Wait for the CONNECT reply to be written. */
   s_kill,             /* Tear down session. */
   s_almost_dead_0,    /* Waiting for finalizers to complete. */
   s_almost_dead_1,    /* Waiting for finalizers to complete. */
@@ -78,36 +96,185 @@ enum sess_state {
 static void do_next(client_ctx *cx);
 static int do_req_start(client_ctx *cx);
 static int do_req_parse(client_ctx *cx);
+static int do_resp_simple(client_ctx *cx, const char *status, const char *body);
+static int do_resp_write(client_ctx *cx);
+static int do_resp_stats(client_ctx *cx);
+static int do_handler_start(client_ctx *cx);
+static int do_handler_run(client_ctx *cx);
+static int do_handler_respond(client_ctx *cx);
+static int do_coro_start(client_ctx *cx);
+static int do_coro_run(client_ctx *cx);
+static int do_static_start(client_ctx *cx);
+static int do_static_lookup(client_ctx *cx);
+static int do_static_error(client_ctx *cx, int err);
+static int do_static_serve(client_ctx *cx);
+static int do_static_send_mem(client_ctx *cx);
+static int do_static_respond(client_ctx *cx);
+static int do_static_next(client_ctx *cx);
+static int do_static_open(client_ctx *cx);
+static int do_static_read(client_ctx *cx);
+static int do_static_hash(client_ctx *cx);
+static int do_static_compress_start(client_ctx *cx);
+static int do_static_compress(client_ctx *cx);
+static int do_static_write(client_ctx *cx);
+static int do_static_body(client_ctx *cx);
+static int do_static_stream(client_ctx *cx);
+static int do_proxy_start(client_ctx *cx);
+static int proxy_body_length(const http_ctx *parser, int64_t *length);
+static int do_proxy_lookup(client_ctx *cx);
+static int do_proxy_wait(client_ctx *cx);
+static int do_proxy_cached(client_ctx *cx);
+static int do_proxy_checkout(client_ctx *cx);
+static int do_proxy_dial(client_ctx *cx);
+static int do_proxy_retry(client_ctx *cx);
+static int do_proxy_resolve(client_ctx *cx);
+static int do_proxy_connect(client_ctx *cx);
+static int do_proxy_send(client_ctx *cx);
+static int do_proxy(client_ctx *cx);
+static int do_proxy_close(client_ctx *cx);
+static int do_proxy_hedge(client_ctx *cx);
+static int do_proxy_splice_start(client_ctx *cx);
+static int do_proxy_splice(client_ctx *cx);
+static int do_proxy_finish(client_ctx *cx);
+static int do_proxy_error(client_ctx *cx, const char *what, int err);
+static int do_tunnel_start(client_ctx *cx);
+static int do_tunnel_open(client_ctx *cx);
+static int do_tunnel_reply(client_ctx *cx);
 static int do_kill(client_ctx *cx);
 static int do_almost_dead(client_ctx *cx);
+static void static_open_done(file_open_req *req, file_entry *fe, int status);
+static void static_read(client_ctx *cx);
+static void static_read_done(uv_fs_t *req);
+static void static_hash_work(work_job *job);
+static void static_gzip_work(work_job *job);
+static void static_work_done(work_job *job, int status);
+static void static_sendfile(client_ctx *cx);
+static void static_sendfile_done(uv_fs_t *req);
+static void static_stream_pump(client_ctx *cx);
+static void static_stream_read_done(uv_fs_t *req);
+static void static_cleanup(client_ctx *cx);
+static void handler_work(work_job *job);
+static void handler_done(work_job *job, int status);
+static void coro_woken(coro *co);
+static void proxy_resolve_done(dns_query *q, int status);
+static void proxy_set_addr(conn *c, const struct sockaddr_storage *addr);
+static int tunnel_internal(const struct sockaddr *addr);
+static void proxy_splice_done(splice_relay *sr);
+static upstream_group *proxy_group(client_ctx *cx);
+static void proxy_connect_done(uv_connect_t *req, int status);
+static void proxy_hedge_arm(client_ctx *cx);
+static void proxy_hedge_done(upstream_hedge *h);
+static void proxy_hedge_cancel(client_ctx *cx);
+static void proxy_cache_woken(cache_waiter *w);
+static void proxy_capture(client_ctx *cx, const char *data, size_t len);
+static void proxy_capture_end(client_ctx *cx, int complete);
+static void relay_init(client_ctx *cx,
+                       relay_dir *d,
+                       conn *src,
+                       conn *dst,
+                       unsigned int nbufs);
+static void relay_pump(relay_dir *d);
+static void relay_stop(relay_dir *d);
+static relay_dir *relay_of(conn *c);
+static void relay_feed(relay_dir *d, const char *data, size_t len);
+static void relay_buf(relay_dir *d, uv_buf_t *buf);
+static void relay_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void relay_read_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf);
+static void relay_write(relay_dir *d, char *data, size_t len);
+static void relay_write_done(uv_write_t *req, int status);
+static size_t proxy_filter(client_ctx *cx, relay_dir *d, char *data, size_t len);
+static void proxy_report(client_ctx *cx, int failed);
 static void conn_timer_reset(conn *c);
 static void conn_timer_expire(uv_timer_t *handle, int status);
+static void conn_watch(conn *c);
+static void conn_watch_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void conn_watch_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf);
 static void conn_read(conn *c);
 static void conn_read_done(uv_stream_t *handle,
                            ssize_t nread,
                            const uv_buf_t *buf);
 static void conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
 static void conn_write(conn *c, const void *data, unsigned int len);
+static void conn_writev(conn *c, const uv_buf_t *bufs, unsigned int nbufs);
 static void conn_write_done(uv_write_t *req, int status);
 static void conn_close(conn *c);
 static void conn_close_done(uv_handle_t *handle);
+static int conn_sendfd(conn *c, uv_file *fd);
 
 /* |incoming| has been initialized by server.c when this is called. */
 void http_client_finish_init(server_ctx *sx, client_ctx *cx) {
+  server_state *state;
   conn *incoming;
   http_ctx *parser;
 
   cx->sx = sx;
   cx->state = s_req_start;
 
+  /* Live until it's freed, see server_drain(). */
+  state = sx->state;
+  cx->prev = NULL;
+  cx->next = state->clients;
+  if (cx->next != NULL) {
+    cx->next->prev = cx;
+  }
+  state->clients = cx;
+  state->nclients += 1;
+  cx->snap = snapshot_enter(state);
+
   incoming = &cx->clientconn;
   incoming->client = cx;
   incoming->result = 0;
   incoming->rdstate = c_stop;
   incoming->wrstate = c_stop;
-  incoming->idle_timeout = sx->idle_timeout;
+  incoming->rdoff = 0;
+  incoming->watching = 0;
+  incoming->idle_timeout = cx->snap->config.idle_timeout;
   CHECK(0 == uv_timer_init(sx->loop, &incoming->timer_handle));
-  
+
+  cx->route = NULL;
+  cx->resp_buf = NULL;
+  cx->upstream = NULL;
+  cx->proxy.backend = NULL;
+  cx->proxy.splice = NULL;
+  cx->proxy.hedge = NULL;
+  cx->proxy.down.slots = NULL;
+  cx->proxy.up.slots = NULL;
+  cx->proxy.tunnel = 0;
+  cx->proxy.head = NULL;
+  cx->proxy.open = 0;
+  cx->proxy.resolving = 0;
+  cx->proxy.responded = 0;
+  cx->proxy.cache_pass = 0;
+  cx->proxy.done = 0;
+  cx->proxy.cached = NULL;
+  cx->proxy.fill = NULL;
+  cx->proxy.wait.entry = NULL;
+  cx->proxy.capture = NULL;
+  cx->handler.status = NULL;
+  cx->handler.type = NULL;
+  cx->handler.body = NULL;
+  cx->handler.bodylen = 0;
+  cx->handler.cancel = &cx->job.cancel;
+  cx->job.cancel = 0;
+  cx->coro = NULL;
+  cx->deadline = 0;
+  cx->file.file = NULL;
+  cx->file.mem = NULL;
+  cx->file.variant = NULL;
+  cx->busy = NULL;
+  cx->file.sockfd = -1;
+  cx->file.result = 0;
+  cx->file.nranges = 0;
+  cx->file.multipart = 0;
+  cx->file.ring = NULL;
+  cx->file.ring_head = 0;
+  cx->file.ring_count = 0;
+  cx->file.reading = 0;
+
   parser = &cx->parser;
   parser->status = ps_init;
   parser->curattr = cx->clientconn.t.buf;
@@ -122,12 +289,53 @@ void http_client_finish_init(server_ctx *sx, client_ctx *cx) {
   conn_read(incoming);
 }
 
+/* Tears the session down, whatever it's doing.  Not from within one of
+ * its own callbacks.  Returns zero if it was on its way out already.
+ */
+int http_client_kill(client_ctx *cx) {
+  if (cx->state >= s_almost_dead_0) {
+    return 0;
+  }
+  cx->state = do_kill(cx);
+  return 1;
+}
+
+/* Nonzero while the session waits for the first byte of its request, so
+ * that closing it loses nothing.
+ */
+int http_client_idle(const client_ctx *cx) {
+  return cx->state == s_req_start;
+}
+
+/* Worker thread.  Nonzero once the request a blocking handler works for
+ * has been given up on; what the handler makes from then on is dropped.
+ */
+int handler_cancelled(const handler_resp *resp) {
+  return resp->cancel != NULL && atom_load(resp->cancel) != 0;
+}
+
+int request_stats(const request_metrics *m, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "requests_expired %llu\n"
+                  "requests_gone %llu\n"
+                  "requests_cancelled_fs %llu\n"
+                  "requests_cancelled_lookups %llu\n"
+                  "requests_cancelled_fetches %llu\n",
+                  (unsigned long long) m->expired,
+                  (unsigned long long) m->gone,
+                  (unsigned long long) m->cancelled_fs,
+                  (unsigned long long) m->cancelled_lookups,
+                  (unsigned long long) m->cancelled_fetches);
+}
+
 /* This is the core state machine that drives the client <-> upstream proxy.
  * We move through the initial handshake and authentication steps first and
  * end up (if all goes well) in the proxy state where we're just proxying
  * data between the client and upstream.
  */
 static void do_next(client_ctx *cx) {
+  server_state *state;
   int new_state;
 
   ASSERT(cx->state != s_dead);
@@ -136,6 +344,57 @@ static void do_next(client_ctx *cx) {
     case s_req_parse:
       new_state = do_req_parse(cx);
       break;
+    case s_resp_write:
+      new_state = do_resp_write(cx);
+      break;
+    case s_handler_run:
+      new_state = do_handler_run(cx);
+      break;
+    case s_coro_run:
+      new_state = do_coro_run(cx);
+      break;
+    case s_static_open:
+      new_state = do_static_open(cx);
+      break;
+    case s_static_read:
+      new_state = do_static_read(cx);
+      break;
+    case s_static_hash:
+      new_state = do_static_hash(cx);
+      break;
+    case s_static_compress:
+      new_state = do_static_compress(cx);
+      break;
+    case s_static_write:
+      new_state = do_static_write(cx);
+      break;
+    case s_static_body:
+      new_state = do_static_body(cx);
+      break;
+    case s_static_stream:
+      new_state = do_static_stream(cx);
+      break;
+    case s_proxy_wait:
+      new_state = do_proxy_wait(cx);
+      break;
+    case s_proxy_resolve:
+      new_state = do_proxy_resolve(cx);
+      break;
+    case s_proxy_connect:
+      new_state = do_proxy_connect(cx);
+      break;
+    case s_proxy_send:
+      new_state = do_proxy_send(cx);
+      break;
+    case s_proxy:
+      new_state = do_proxy(cx);
+      break;
+    case s_proxy_splice:
+      new_state = do_proxy_splice(cx);
+      break;
+    case s_tunnel_reply:
+      new_state = do_tunnel_reply(cx);
+      break;
     case s_kill:
       new_state = do_kill(cx);
       break;
@@ -152,10 +411,25 @@ static void do_next(client_ctx *cx) {
   cx->state = new_state;
 
   if (cx->state == s_dead) {
+    state = cx->sx->state;
+    if (cx->prev != NULL) {
+      cx->prev->next = cx->next;
+    } else {
+      state->clients = cx->next;
+    }
+    if (cx->next != NULL) {
+      cx->next->prev = cx->prev;
+    }
+    state->nclients -= 1;
+    static_cleanup(cx);
+    snapshot_leave(state, cx->snap);
     if (DEBUG_CHECKS) {
       memset(cx, -1, sizeof(*cx));
     }
     free(cx);
+    if (state->draining && state->nclients == 0) {
+      server_drained(state);
+    }
   }
 }
 
@@ -178,13 +452,20 @@ static int do_req_parse(client_ctx *cx) {
 		return do_kill(cx);
 	}
 
-	data = (uint8_t *)incoming->t.buf;
+	data = (uint8_t *)incoming->t.buf + incoming->rdoff;
 	size = (size_t)incoming->result;
 	err = http_parse(parser, data, size);
 	if (err == http_ok) {
+		/* Need more data.  Keep what we have, the parser points into it. */
+		incoming->rdoff = (unsigned int)(parser->next - incoming->t.buf);
+		if (incoming->rdoff == sizeof(incoming->t.buf)) {
+			incoming->rdoff = 0;
+			return do_resp_simple(cx, "431 Request Header Fields Too Large", "Request Too Large");
+		}
 		conn_read(incoming);
-		return s_req_parse;  /* Need more data. */
+		return s_req_parse;
 	}
+	incoming->rdoff = 0;
 
 	if (err != http_exec_cmd) {
 
@@ -192,6 +473,44 @@ static int do_req_parse(client_ctx *cx) {
 		return do_kill(cx);
 	}
 
+	/* From here on, the response has to begin in time; the deadline
+	 * bounds every timer of this request, see conn_timer_reset().
+	 */
+	if (cx->snap->config.request_timeout > 0) {
+		cx->deadline = uv_now(cx->sx->loop) + cx->snap->config.request_timeout;
+		conn_timer_reset(incoming);
+	}
+
+	if (parser->methodlen == 7 && 0 == memcmp(parser->method, "CONNECT", 7)) {
+		return do_tunnel_start(cx);
+	}
+
+	cx->route = route_match(&cx->snap->config, parser->uri, parser->urilen);
+	if (cx->route != NULL && cx->route->kind == route_proxy) {
+		return do_proxy_start(cx);
+	}
+
+	if (cx->route != NULL && cx->route->kind == route_handler) {
+		return do_handler_start(cx);
+	}
+
+	if (cx->route != NULL && cx->route->kind == route_coro) {
+		return do_coro_start(cx);
+	}
+
+	if (cx->route != NULL
+		&& parser->methodlen == 3
+		&& 0 == memcmp(parser->method, "GET", 3)) {
+		switch (cx->route->kind) {
+		case route_static:
+			return do_static_start(cx);
+		case route_stats:
+			return do_resp_stats(cx);
+		default:
+			break;
+		}
+	}
+
 	const char *content = 0;
 	if (0 == memcmp(parser->method, "GET", 3)) {
 
@@ -203,162 +522,2556 @@ static int do_req_parse(client_ctx *cx) {
 	else {
 		content = "Unknown Method!";
 	}
-	wsprintfA(incoming->t.buf, "HTTP/1.1 200 OK\r\nContent-Length: %d \r\nConnection: close\r\n\r\n%s", strlen(content), content);
+	return do_resp_simple(cx, "200 OK", content);
+}
 
-	conn_write(incoming, incoming->t.buf, strlen(incoming->t.buf));
-	return s_almost_dead_0;
+/* Writes a complete, small response and closes the connection afterwards. */
+static int do_resp_simple(client_ctx *cx, const char *status, const char *body) {
+  conn *incoming;
+  int n;
 
-	return s_kill;
+  incoming = &cx->clientconn;
+  n = snprintf(incoming->t.buf,
+               sizeof(incoming->t.buf),
+               "HTTP/1.1 %s\r\n"
+               "Content-Length: %u\r\n"
+               "Connection: close\r\n"
+               "\r\n"
+               "%s",
+               status,
+               (unsigned) strlen(body),
+               body);
+  ASSERT(n > 0 && (size_t) n < sizeof(incoming->t.buf));
+  conn_write(incoming, incoming->t.buf, n);
+  return s_resp_write;
 }
 
-static int do_kill(client_ctx *cx) {
-  int new_state;
+static int do_resp_stats(client_ctx *cx) {
+  size_t len;
+  int body;
+  int n;
 
-  if (cx->state >= s_almost_dead_0) {
-    return cx->state;
+  /* Leave room for the header in front of the counters. */
+  len = 16384;
+  cx->resp_buf = xmalloc(len);
+  body = server_stats(cx->sx->state, cx->resp_buf + 128, len - 128);
+  n = snprintf(cx->resp_buf,
+               128,
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: text/plain\r\n"
+               "Content-Length: %d\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               body);
+  ASSERT(n > 0 && n < 128);
+  memmove(cx->resp_buf + n, cx->resp_buf + 128, body);
+  conn_write(&cx->clientconn, cx->resp_buf, n + body);
+  return s_resp_write;
+}
+
+static int do_resp_write(client_ctx *cx) {
+  conn *incoming;
+
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("write error: %s", uv_strerror(incoming->result));
   }
 
-  /* Try to cancel the request. The callback still runs but if the
-   * cancellation succeeded, it gets called with status=UV_ECANCELED.
-   */
-  new_state = s_almost_dead_1;
+  return do_kill(cx);
+}
 
-  conn_close(&cx->clientconn);
-  return new_state;
+/* A blocking handler runs on the threadpool, so that a slow one holds up
+ * its own request only.  The parser and the request it points into stay
+ * put meanwhile: nothing is read from the client until the response is
+ * out.
+ */
+static int do_handler_start(client_ctx *cx) {
+  if (!cx->route->blocking) {
+    cx->route->handler(&cx->parser, &cx->handler);
+    return do_handler_respond(cx);
+  }
+
+  work_pool_submit(&cx->sx->state->cpu, &cx->job, handler_work, handler_done);
+  cx->busy = (uv_req_t *) &cx->job.req;
+  conn_watch(&cx->clientconn);
+  return s_handler_run;
 }
 
-static int do_almost_dead(client_ctx *cx) {
-  ASSERT(cx->state >= s_almost_dead_0);
-  return cx->state + 1;  /* Another finalizer completed. */
+static int do_handler_run(client_ctx *cx) {
+  if (cx->clientconn.result < 0) {
+    pr_err("handler timed out");
+    return do_kill(cx);  /* Work still pending, do_kill() cancels it. */
+  }
+
+  return do_handler_respond(cx);
+}
+
+/* A route_coro handler runs on the loop thread, up to the first operation
+ * it has to wait for and then again each time one completes.  Same as a
+ * blocking handler, the client connection is watched meanwhile.
+ */
+static int do_coro_start(client_ctx *cx) {
+  cx->coro = coro_new(&cx->sx->state->coros,
+                      cx->route->coro,
+                      &cx->parser,
+                      &cx->handler,
+                      coro_woken,
+                      cx);
+  return do_coro_run(cx);
+}
+
+static int do_coro_run(client_ctx *cx) {
+  if (cx->clientconn.result < 0) {
+    pr_err("coroutine handler timed out");
+    return do_kill(cx);  /* Cancels what it waits for. */
+  }
+
+  if (coro_resume(cx->coro) == CORO_SUSPENDED) {
+    conn_watch(&cx->clientconn);
+    return s_coro_run;
+  }
+
+  coro_free(cx->coro);
+  cx->coro = NULL;
+  return do_handler_respond(cx);
+}
+
+static int do_handler_respond(client_ctx *cx) {
+  handler_resp *r;
+  conn *incoming;
+  uv_buf_t bufs[2];
+  int n;
+
+  r = &cx->handler;
+  incoming = &cx->clientconn;
+  n = snprintf(incoming->t.buf,
+               sizeof(incoming->t.buf),
+               "HTTP/1.1 %s\r\n"
+               "Content-Type: %s\r\n"
+               "Content-Length: %llu\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               r->status != NULL ? r->status : "200 OK",
+               r->type != NULL ? r->type : "text/plain",
+               (unsigned long long) r->bodylen);
+  ASSERT(n > 0 && (size_t) n < sizeof(incoming->t.buf));
+
+  bufs[0] = uv_buf_init(incoming->t.buf, n);
+  bufs[1] = uv_buf_init(r->body, (unsigned int) r->bodylen);
+  if (r->bodylen == 0
+      || (cx->parser.methodlen == 4
+          && 0 == memcmp(cx->parser.method, "HEAD", 4))) {
+    conn_write(incoming, bufs[0].base, bufs[0].len);
+  } else {
+    conn_writev(incoming, bufs, 2);
+  }
+  return s_resp_write;
 }
 
-static int conn_cycle(const char *who, conn *a, conn *b) {
-  if (a->result < 0) {
-    if (a->result != UV_EOF) {
-      pr_err("%s error: %s", who, uv_strerror(a->result));
+/* Map the URI to a file.  Compressible files go out in the best coding
+ * that the client accepts: a cached variant if there is one, else a
+ * precompressed .br or .gz sibling, else the file itself, which is then
+ * gzipped on the fly if it's small enough for the content cache.
+ */
+static int do_static_start(client_ctx *cx) {
+  content_cache *cc;
+  static_resp *r;
+  int e;
+  int err;
+
+  r = &cx->file;
+  r->generation = cx->sx->state->contents.generation;
+  err = static_path(cx->route,
+                    cx->parser.uri,
+                    cx->parser.urilen,
+                    r->path,
+                    sizeof(r->path));
+  if (err != 0) {
+    return do_static_error(cx, err);
+  }
+
+  r->type = static_mime_type(r->path);
+  r->accept = 0;
+  if (static_compressible(r->type)) {
+    r->accept = static_accept_encoding(&cx->parser);
+  }
+
+  /* Brotli beats gzip, either beats sending the file as is. */
+  cc = &cx->sx->state->contents;
+  for (e = enc_br; e > enc_identity; e -= 1) {
+    if (r->accept & (1u << e)) {
+      r->mem = content_cache_get(cc, r->path, (content_encoding) e);
+      if (r->mem != NULL) {
+        r->encoding = e;
+        return do_static_respond(cx);
+      }
     }
-    return -1;
   }
 
-  if (b->result < 0) {
-    return -1;
+  r->encoding = enc_br;
+  return do_static_lookup(cx);
+}
+
+/* Looks for the r->encoding variant of the file, or the next acceptable
+ * one.  Small hot files are answered straight from the content cache.
+ * Otherwise, look the file or its precompressed sibling up in the open
+ * file cache; on a miss, it is opened and stat'ed on the threadpool and we
+ * continue in do_static_open().
+ */
+static int do_static_lookup(client_ctx *cx) {
+  char path[sizeof(cx->file.path) + 4];
+  static_resp *r;
+  file_cache *fc;
+  int err;
+
+  r = &cx->file;
+  while (r->encoding != enc_identity && !(r->accept & (1u << r->encoding))) {
+    r->encoding -= 1;
   }
 
-  if (a->wrstate == c_done) {
-    a->wrstate = c_stop;
+  if (r->encoding == enc_identity) {
+    r->mem = content_cache_get(&cx->sx->state->contents,
+                               r->path,
+                               enc_identity);
+    if (r->mem != NULL) {
+      return do_static_respond(cx);
+    }
   }
 
-  /* The logic is as follows: read when we don't write and write when we don't
-   * read.  That gives us back-pressure handling for free because if the peer
-   * sends data faster than we consume it, TCP congestion control kicks in.
-   */
-  if (a->wrstate == c_stop) {
-    if (b->rdstate == c_stop) {
-      conn_read(b);
-    } else if (b->rdstate == c_done) {
-      conn_write(a, b->t.buf, b->result);
-      b->rdstate = c_stop;  /* Triggers the call to conn_read() above. */
+  snprintf(path,
+           sizeof(path),
+           "%s%s",
+           r->path,
+           static_encoding_suffix((content_encoding) r->encoding));
+  fc = &cx->sx->state->files;
+  r->file = file_cache_get(fc, path);
+  if (r->file != NULL) {
+    return do_static_serve(cx);
+  }
+
+  err = file_cache_open(fc, &r->open_req, path, static_open_done);
+  if (err != 0) {
+    if (r->encoding != enc_identity) {
+      r->encoding -= 1;
+      return do_static_lookup(cx);
     }
+    return do_static_error(cx, err);
   }
 
-  return 0;
+  cx->busy = (uv_req_t *) &r->open_req.fs_req;
+  conn_watch(&cx->clientconn);
+  return s_static_open;
 }
 
-static void conn_timer_reset(conn *c) {
-  CHECK(0 == uv_timer_start(&c->timer_handle,
-                            conn_timer_expire,
-                            c->idle_timeout,
-                            0));
+/* The file is open.  Read small files into memory so the next request for
+ * them is a content cache hit, send everything else from the file.
+ * Revalidations of large files are answered from the cached stat() data.
+ */
+static int do_static_serve(client_ctx *cx) {
+  content_cache *cc;
+  file_entry *fe;
+  uint64_t size;
+
+  fe = cx->file.file;
+  cc = &cx->sx->state->contents;
+  size = fe->st.st_size;
+  if (size > cc->max_file || size + CONTENT_HEAD_MAX > cc->max_bytes) {
+    file_cache_etag(&cx->sx->state->files, fe);
+    return do_static_respond(cx);
+  }
+
+  cx->file.mem = content_cache_alloc(cx->file.path,
+                                     (content_encoding) cx->file.encoding,
+                                     (size_t) size,
+                                     cx->file.generation);
+  cx->file.mem->v.mtime = fe->v.mtime;
+  cx->file.offset = 0;
+  cx->file.remaining = size;
+  if (size == 0) {
+    cx->file.hash = file_hash_contents(NULL, 0, 0);
+    return do_static_send_mem(cx);
+  }
+
+  static_read(cx);
+  return s_static_read;
 }
 
-static void conn_timer_expire(uv_timer_t *handle, int status) {
-  conn *c;
+static int do_static_error(client_ctx *cx, int err) {
+  switch (err) {
+    case UV_ENOENT:
+    case UV_ENOTDIR:
+    case UV_EISDIR:
+      return do_resp_simple(cx, "404 Not Found", "Not Found");
+    case UV_EACCES:
+    case UV_EPERM:
+      return do_resp_simple(cx, "403 Forbidden", "Forbidden");
+    case UV_EINVAL:
+    case UV_ENAMETOOLONG:
+      return do_resp_simple(cx, "400 Bad Request", "Bad Request");
+    default:
+      pr_err("open error: %s", uv_strerror(err));
+      return do_resp_simple(cx, "500 Internal Server Error", "Server Error");
+  }
+}
 
-  //CHECK(0 == status);
-  c = CONTAINER_OF(handle, conn, timer_handle);
-  c->result = UV_ETIMEDOUT;
-  do_next(c->client);
+/* The body is in memory and hashed.  Put the header in front of it and
+ * publish the entry.  The open file is no longer needed, let the file cache
+ * have it back.
+ */
+static int do_static_send_mem(client_ctx *cx) {
+  char head[CONTENT_HEAD_MAX];
+  content_entry *ce;
+  int n;
+
+  ce = cx->file.mem;
+  file_etag_format(ce->v.etag, sizeof(ce->v.etag), cx->file.hash, ce->bodylen);
+  n = static_head(head,
+                  sizeof(head),
+                  cx->file.type,
+                  (content_encoding) cx->file.encoding,
+                  ce->bodylen,
+                  &ce->v);
+  ASSERT(n > 0 && (size_t) n < sizeof(head));
+  content_cache_set_head(ce, head, n);
+  ce = content_cache_insert(&cx->sx->state->contents, ce);
+  cx->file.mem = ce;
+
+  file_cache_release(&cx->sx->state->files, cx->file.file);
+  cx->file.file = NULL;
+
+  return do_static_respond(cx);
 }
 
-static void conn_read(conn *c) {
-  ASSERT(c->rdstate == c_stop);
-  CHECK(0 == uv_read_start(&c->handle.tcp, conn_alloc, conn_read_done));
-  c->rdstate = c_busy;
-  conn_timer_reset(c);
+/* Answers the request from the file in cx->file.mem or, if that's NULL,
+ * from the open file in cx->file.file: with a 304 if the client's copy is
+ * current, with the byte ranges it asked for, or with the whole file.  A
+ * complete in-memory response goes out with a single write; everything
+ * else is sent piece by piece by do_static_next().
+ */
+static int do_static_respond(client_ctx *cx) {
+  file_validator *v;
+  static_resp *r;
+  const char *value;
+  conn *incoming;
+  uint64_t bodylen;
+  uint64_t size;
+  size_t len;
+  int n;
+
+  r = &cx->file;
+  incoming = &cx->clientconn;
+  if (r->mem != NULL &&
+      r->encoding == enc_identity &&
+      (r->accept & (1u << enc_gzip)) &&
+      !r->mem->incompressible &&
+      r->mem->bodylen >= STATIC_GZIP_MIN) {
+    return do_static_compress_start(cx);
+  }
+
+  if (r->mem != NULL) {
+    v = &r->mem->v;
+    size = r->mem->bodylen;
+  } else {
+    v = &r->file->v;
+    size = r->file->st.st_size;
+  }
+
+  if (static_not_modified(&cx->parser, v)) {
+    static_notmod_build(v, r->type);
+    conn_write(incoming, v->notmod, v->notmodlen);
+    return s_resp_write;
+  }
+
+  n = 0;
+  value = http_header_find(&cx->parser, "Range", &len);
+  if (value != NULL && static_if_range(&cx->parser, v)) {
+    n = static_ranges(value, len, size, r->ranges, STATIC_MAX_RANGES);
+  }
+
+  if (n < 0) {
+    n = static_unsatisfiable(incoming->t.buf, sizeof(incoming->t.buf), size);
+    ASSERT(n > 0 && (size_t) n < sizeof(incoming->t.buf));
+    conn_write(incoming, incoming->t.buf, n);
+    return s_resp_write;
+  }
+
+  if (n == 0 && r->mem != NULL) {
+    conn_write(incoming, r->mem->data, r->mem->size);
+    return s_resp_write;
+  }
+
+  if (n == 0) {
+    r->ranges[0].first = 0;
+    r->ranges[0].last = (int64_t) size - 1;
+    r->nranges = size == 0 ? 0 : 1;
+    n = static_head(incoming->t.buf,
+                    sizeof(incoming->t.buf),
+                    r->type,
+                    (content_encoding) r->encoding,
+                    size,
+                    v);
+  } else if (n == 1) {
+    r->nranges = 1;
+    n = static_head_range(incoming->t.buf,
+                          sizeof(incoming->t.buf),
+                          r->type,
+                          (content_encoding) r->encoding,
+                          size,
+                          v,
+                          r->ranges,
+                          0,
+                          NULL);
+  } else {
+    r->nranges = n;
+    r->multipart = 1;
+    snprintf(r->boundary,
+             sizeof(r->boundary),
+             "%016llx",
+             (unsigned long long) hash64(r->ranges,
+                                         n * sizeof(r->ranges[0]),
+                                         uv_hrtime()));
+    bodylen = static_multipart_length(r->type,
+                                      size,
+                                      r->ranges,
+                                      r->nranges,
+                                      r->boundary);
+    n = static_head_range(incoming->t.buf,
+                          sizeof(incoming->t.buf),
+                          r->type,
+                          (content_encoding) r->encoding,
+                          size,
+                          v,
+                          r->ranges,
+                          bodylen,
+                          r->boundary);
+  }
+
+  ASSERT(n > 0 && (size_t) n < sizeof(incoming->t.buf));
+  r->range = 0;
+  r->part_sent = 0;
+  conn_write(incoming, incoming->t.buf, n);
+  return s_static_write;
 }
 
-static void conn_read_done(uv_stream_t *handle,
-                           ssize_t nread,
-                           const uv_buf_t *buf) {
-  conn *c;
+/* Sends whatever comes after the previous piece: the part header if this
+ * is a multipart response, the bytes of the next range, and finally the
+ * closing delimiter.  In-memory bodies are written straight from the
+ * content cache; files go out with sendfile or, with sendfile disabled,
+ * through the stream ring.
+ */
+static int do_static_next(client_ctx *cx) {
+  const byte_range *br;
+  static_resp *r;
+  conn *incoming;
+  uint64_t size;
+  int err;
+  int n;
 
-  c = CONTAINER_OF(handle, conn, handle);
-  ASSERT(c->t.buf == buf->base);
-  ASSERT(c->rdstate == c_busy);
-  c->rdstate = c_done;
-  c->result = nread;
+  r = &cx->file;
+  incoming = &cx->clientconn;
+  if (r->range == r->nranges) {
+    if (!r->multipart) {
+      return do_kill(cx);
+    }
 
-  uv_read_stop(&c->handle.stream);
-  do_next(c->client);
+    r->multipart = 0;  /* Send the closing delimiter only once. */
+    n = snprintf(incoming->t.buf,
+                 sizeof(incoming->t.buf),
+                 "\r\n--%s--\r\n",
+                 r->boundary);
+    conn_write(incoming, incoming->t.buf, n);
+    return s_static_write;
+  }
+
+  br = r->ranges + r->range;
+  if (r->multipart && !r->part_sent) {
+    size = r->mem != NULL ? r->mem->bodylen : (uint64_t) r->file->st.st_size;
+    n = static_part_head(incoming->t.buf,
+                         sizeof(incoming->t.buf),
+                         r->type,
+                         size,
+                         br,
+                         r->boundary);
+    ASSERT(n > 0 && (size_t) n < sizeof(incoming->t.buf));
+    r->part_sent = 1;
+    conn_write(incoming, incoming->t.buf, n);
+    return s_static_write;
+  }
+
+  r->part_sent = 0;
+  r->range += 1;
+  r->offset = br->first;
+  r->remaining = br->last - br->first + 1;
+
+  if (r->mem != NULL) {
+    conn_write(incoming,
+               r->mem->body + r->offset,
+               (unsigned int) r->remaining);
+    return s_static_write;
+  }
+
+  if (cx->snap->config.use_sendfile) {
+    if (r->sockfd == -1) {
+      err = conn_sendfd(incoming, &r->sockfd);
+      if (err != 0) {
+        pr_err("sendfile setup error: %s", uv_strerror(err));
+        return do_kill(cx);
+      }
+    }
+
+    static_sendfile(cx);
+    return s_static_body;
+  }
+
+  r->rd_offset = r->offset;
+  r->rd_remaining = r->remaining;
+  static_stream_pump(cx);
+  return s_static_stream;
 }
 
-static void conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  conn *c;
+static int do_static_open(client_ctx *cx) {
+  conn *incoming;
 
-  c = CONTAINER_OF(handle, conn, handle);
-  ASSERT(c->rdstate == c_busy);
-  buf->base = c->t.buf;
-  buf->len = sizeof(c->t.buf);
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("open timed out");
+    return do_kill(cx);  /* Open still pending, do_kill() cancels it. */
+  }
+
+  if (cx->file.result < 0) {
+    if (cx->file.encoding != enc_identity) {
+      cx->file.encoding -= 1;  /* No such sibling, try the next coding. */
+      return do_static_lookup(cx);
+    }
+    return do_static_error(cx, (int) cx->file.result);
+  }
+
+  return do_static_serve(cx);
 }
 
-static void conn_write(conn *c, const void *data, unsigned int len) {
-  uv_buf_t buf;
+static int do_static_read(client_ctx *cx) {
+  conn *incoming;
 
-  ASSERT(c->wrstate == c_stop || c->wrstate == c_done);
-  c->wrstate = c_busy;
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("read timed out");
+    return do_kill(cx);  /* Read still pending, do_kill() cancels it. */
+  }
 
-  /* It's okay to cast away constness here, uv_write() won't modify the
-   * memory.
-   */
-  buf.base = (char *) data;
-  buf.len = len;
+  if (cx->file.result < 0) {
+    pr_err("read error: %s", uv_strerror((int) cx->file.result));
+    return do_resp_simple(cx, "500 Internal Server Error", "Server Error");
+  }
 
-  CHECK(0 == uv_write(&c->write_req,
-                      &c->handle.stream,
-                      &buf,
-                      1,
-                      conn_write_done));
-  conn_timer_reset(c);
+  cx->file.offset += cx->file.result;
+  cx->file.remaining -= cx->file.result;
+  if (cx->file.remaining > 0 && cx->file.result > 0) {
+    static_read(cx);
+    return s_static_read;
+  }
+
+  /* Compute the ETag off the loop thread, the body can be large. */
+  cx->file.mem->bodylen = (size_t) cx->file.offset;  /* Short if it shrank. */
+  work_pool_submit(&cx->sx->state->cpu,
+                   &cx->job,
+                   static_hash_work,
+                   static_work_done);
+  cx->busy = (uv_req_t *) &cx->job.req;
+  conn_watch(incoming);
+  return s_static_hash;
 }
 
-static void conn_write_done(uv_write_t *req, int status) {
-  conn *c;
+static int do_static_hash(client_ctx *cx) {
+  conn *incoming;
 
-  if (status == UV_ECANCELED) {
-    return;  /* Handle has been closed. */
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("hash timed out");
+    return do_kill(cx);  /* Work still pending, do_kill() cancels it. */
   }
 
-  c = CONTAINER_OF(req, conn, write_req);
-  ASSERT(c->wrstate == c_busy);
-  c->wrstate = c_done;
-  c->result = status;
-  do_next(c->client);
+  return do_static_send_mem(cx);
 }
 
-static void conn_close(conn *c) {
-  ASSERT(c->rdstate != c_dead);
-  ASSERT(c->wrstate != c_dead);
-  c->rdstate = c_dead;
-  c->wrstate = c_dead;
-  c->timer_handle.data = c;
-  c->handle.handle.data = c;
-  uv_close(&c->handle.handle, conn_close_done);
-  uv_close((uv_handle_t *) &c->timer_handle, conn_close_done);
+/* Compresses the identity body in cx->file.mem on the threadpool.  The
+ * result is cached as the gzip variant, so each file is compressed once
+ * until it changes or drops out of the cache.
+ */
+static int do_static_compress_start(client_ctx *cx) {
+  content_cache *cc;
+  static_resp *r;
+  uint64_t gen;
+
+  r = &cx->file;
+  cc = &cx->sx->state->contents;
+  /* A body that's in the cache is current, one that isn't may be older. */
+  gen = r->mem->stale ? r->mem->generation : cc->generation;
+  r->variant = content_cache_alloc(r->path, enc_gzip, r->mem->bodylen, gen);
+  r->variant->v.mtime = r->mem->v.mtime;
+  work_pool_submit(&cx->sx->state->cpu,
+                   &cx->job,
+                   static_gzip_work,
+                   static_work_done);
+  cx->busy = (uv_req_t *) &cx->job.req;
+  conn_watch(&cx->clientconn);
+  return s_static_compress;
 }
 
-static void conn_close_done(uv_handle_t *handle) {
-  conn *c;
+static int do_static_compress(client_ctx *cx) {
+  char head[CONTENT_HEAD_MAX];
+  content_entry *ce;
+  content_cache *cc;
+  static_resp *r;
+  int n;
 
-  c = handle->data;
-  do_next(c->client);
+  r = &cx->file;
+  if (cx->clientconn.result < 0) {
+    pr_err("compress timed out");
+    return do_kill(cx);  /* Work still pending, do_kill() cancels it. */
+  }
+
+  cc = &cx->sx->state->contents;
+  ce = r->variant;
+  r->variant = NULL;
+  if (ce->bodylen == 0) {
+    r->mem->incompressible = 1;
+    cc->incompressible += 1;
+    content_cache_release(cc, ce);
+    return do_static_respond(cx);
+  }
+
+  cc->compressions += 1;
+  cc->compress_in += r->mem->bodylen;
+  cc->compress_out += ce->bodylen;
+  file_etag_format(ce->v.etag, sizeof(ce->v.etag), r->hash, ce->bodylen);
+  n = static_head(head, sizeof(head), r->type, enc_gzip, ce->bodylen, &ce->v);
+  ASSERT(n > 0 && (size_t) n < sizeof(head));
+  content_cache_set_head(ce, head, n);
+
+  content_cache_release(cc, r->mem);
+  r->mem = content_cache_insert(cc, ce);
+  r->encoding = enc_gzip;
+  return do_static_respond(cx);
+}
+
+static int do_static_write(client_ctx *cx) {
+  conn *incoming;
+
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("write error: %s", uv_strerror(incoming->result));
+    return do_kill(cx);
+  }
+
+  ASSERT(incoming->wrstate == c_done);
+  incoming->wrstate = c_stop;
+  return do_static_next(cx);
+}
+
+static int do_static_body(client_ctx *cx) {
+  conn *incoming;
+
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("sendfile timed out");
+    return do_kill(cx);  /* Sendfile still pending, do_kill() cancels it. */
+  }
+
+  ASSERT(incoming->wrstate == c_done);
+  incoming->wrstate = c_stop;
+  if (cx->file.result < 0) {
+    pr_err("sendfile error: %s", uv_strerror((int) cx->file.result));
+    return do_kill(cx);
+  }
+
+  cx->file.offset += cx->file.result;
+  cx->file.remaining -= cx->file.result;
+  if (cx->file.remaining > 0 && cx->file.result > 0) {
+    static_sendfile(cx);
+    return s_static_body;
+  }
+
+  return do_static_next(cx);
+}
+
+/* Streams the current range through the ring when sendfile is off.  There
+ * is at most one read and one write in flight.  A read is only started
+ * when a buffer is free, and buffers only free up as writes complete, so a
+ * slow client stops the reads and a download never holds more than
+ * stream_bufs * stream_chunk bytes.
+ */
+static int do_static_stream(client_ctx *cx) {
+  static_resp *r;
+  conn *incoming;
+
+  r = &cx->file;
+  incoming = &cx->clientconn;
+  if (incoming->result < 0) {
+    pr_err("write error: %s", uv_strerror(incoming->result));
+    return do_kill(cx);  /* A pending read is cancelled by do_kill(). */
+  }
+
+  if (r->result < 0) {
+    pr_err("read error: %s", uv_strerror((int) r->result));
+    return do_kill(cx);
+  }
+
+  if (incoming->wrstate == c_done) {
+    incoming->wrstate = c_stop;
+    r->ring_head = (r->ring_head + 1) % cx->snap->config.stream_bufs;
+    r->ring_count -= 1;
+  }
+
+  static_stream_pump(cx);
+  if (r->reading || r->ring_count > 0) {
+    return s_static_stream;
+  }
+
+  ASSERT(r->rd_remaining == 0);
+  return do_static_next(cx);
+}
+
+/* Forward the request to the route's backend.  The head is rebuilt now,
+ * while the parser still points into the client's read buffer, together
+ * with any body bytes that arrived with it.  The upstream connection comes
+ * from the route's pool if there's an idle one; do_proxy_finish() hands it
+ * back when the response is complete.
+ */
+static int do_proxy_start(client_ctx *cx) {
+  struct sockaddr_storage peer;
+  char client[64];
+  conn *incoming;
+  proxy_req *pr;
+  size_t len;
+  int namelen;
+  int n;
+
+  incoming = &cx->clientconn;
+  pr = &cx->proxy;
+  pr->start = uv_hrtime();
+  cx->sx->state->proxy.requests += 1;
+
+  strcpy(client, "unknown");
+  namelen = sizeof(peer);
+  if (0 == uv_tcp_getpeername(&incoming->handle.tcp,
+                              (struct sockaddr *) &peer,
+                              &namelen)) {
+    if (peer.ss_family == AF_INET6) {
+      uv_ip6_name((struct sockaddr_in6 *) &peer, client, sizeof(client));
+    } else {
+      uv_ip4_name((struct sockaddr_in *) &peer, client, sizeof(client));
+    }
+  }
+
+  /* The upstream connection can only be reused if we know where the
+   * request body ends.  Chunked bodies aren't tracked, those requests
+   * still get a connection of their own.
+   */
+  pr->reusable = cx->snap->config.upstream_max_idle > 0;
+  if (0 != proxy_body_length(&cx->parser, &pr->up_remaining)) {
+    return do_resp_simple(cx, "400 Bad Request", "Bad Request");
+  }
+  if (pr->up_remaining == -1) {
+    pr->reusable = 0;
+  } else {
+    pr->up_remaining -= (int64_t) cx->parser.remain;
+    if (pr->up_remaining < 0) {
+      pr->reusable = 0;  /* Pipelined bytes, they'd go out as a request. */
+    }
+  }
+  pr->replayable = pr->up_remaining == 0;
+
+  len = sizeof(incoming->t.buf) + 512 + cx->parser.remain;
+  pr->head = xmalloc(len);
+  n = proxy_request_head(&cx->parser, client, pr->reusable, pr->head, len);
+  if (n < 0) {
+    return do_resp_simple(cx, "431 Request Header Fields Too Large", "Request Too Large");
+  }
+  memcpy(pr->head + n, cx->parser.next, cx->parser.remain);
+  pr->headlen = n + (unsigned int) cx->parser.remain;
+
+  proxy_resp_init(&pr->resp,
+                  cx->parser.methodlen == 4
+                  && 0 == memcmp(cx->parser.method, "HEAD", 4));
+  return do_proxy_lookup(cx);
+}
+
+/* Where the request body ends: |length| bytes, or -1 for a chunked (or
+ * otherwise transfer-coded) body.  The head goes to the backend as it is,
+ * so anything the backend could read differently is refused: more than
+ * one Content-Length, one that isn't plain digits, or Content-Length
+ * along with Transfer-Encoding.
+ */
+static int proxy_body_length(const http_ctx *parser, int64_t *length) {
+  const http_header *h;
+  int chunked;
+  int found;
+  size_t i;
+  int k;
+
+  *length = 0;
+  chunked = 0;
+  found = 0;
+  for (k = 0; k < parser->nheaders; k += 1) {
+    h = parser->headers + k;
+    if (http_token_eq(h->name, h->namelen, "Transfer-Encoding")) {
+      chunked = 1;
+      continue;
+    }
+    if (!http_token_eq(h->name, h->namelen, "Content-Length")) {
+      continue;
+    }
+
+    if (found || h->valuelen == 0 || h->valuelen > 18) {
+      return UV_EINVAL;
+    }
+    found = 1;
+    for (i = 0; i < h->valuelen; i += 1) {
+      if (h->value[i] < '0' || h->value[i] > '9') {
+        return UV_EINVAL;
+      }
+      *length = *length * 10 + (h->value[i] - '0');
+    }
+  }
+
+  if (chunked) {
+    if (found) {
+      return UV_EINVAL;
+    }
+    *length = -1;
+  }
+  return 0;
+}
+
+/* On routes that cache, GETs and HEADs are answered from the cache when
+ * the request allows it.  On a miss, the first request for the URI
+ * fetches it and keeps a copy; requests that come in meanwhile wait for
+ * that copy instead of going upstream too.  A stale entry that is still
+ * within its stale-while-revalidate window goes out while a background
+ * fetch refreshes it.
+ */
+static int do_proxy_lookup(client_ctx *cx) {
+  proxy_cache *pc;
+  cache_entry *ce;
+  proxy_req *pr;
+  cache_mode mode;
+  int get;
+
+  pc = &cx->sx->state->cache;
+  pr = &cx->proxy;
+  get = cx->parser.methodlen == 3 && 0 == memcmp(cx->parser.method, "GET", 3);
+  if (!cx->route->cache
+      || pc->max_bytes == 0
+      || pr->cache_pass
+      || !pr->replayable
+      || !(get || pr->resp.head_request)) {
+    return do_proxy_checkout(cx);
+  }
+
+  mode = proxy_cache_mode(&cx->parser);
+  if (mode == cache_bypass) {
+    return do_proxy_checkout(cx);
+  }
+
+  if (mode == cache_use) {
+    switch (proxy_cache_lookup(pc, &cx->parser, &ce)) {
+      case cache_stale:
+        proxy_cache_refresh(pc,
+                            ce,
+                            cx->sx->state,
+                            cx->snap,
+                            proxy_group(cx),
+                            pr->head,
+                            pr->headlen,
+                            pr->reusable);
+        /* Fall through. */
+      case cache_hit:
+        pr->cached = ce;
+        return do_proxy_cached(cx);
+      case cache_pending:
+        proxy_cache_wait(ce, &pr->wait, proxy_cache_woken);
+        conn_timer_reset(&cx->clientconn);
+        return s_proxy_wait;
+      case cache_miss:
+        if (get) {
+          pr->fill = proxy_cache_fill(pc, &cx->parser);
+        }
+        break;
+    }
+  }
+
+  if (get) {
+    pr->capturecap = 16 * 1024;
+    pr->capturelen = 0;
+    pr->capture = xmalloc(pr->capturecap);
+  }
+  return do_proxy_checkout(cx);
+}
+
+/* The fetch we waited for is over.  If it didn't leave anything in the
+ * cache for us, go upstream without another try.
+ */
+static int do_proxy_wait(client_ctx *cx) {
+  if (cx->clientconn.result < 0) {
+    return do_kill(cx);  /* Idle timeout, do_kill() stops the wait. */
+  }
+
+  ASSERT(cx->proxy.wait.entry == NULL);
+  if (!cx->proxy.wait.stored) {
+    cx->proxy.cache_pass = 1;
+  }
+  return do_proxy_lookup(cx);
+}
+
+/* A hit goes out in one write from the pinned entry: its head up to the
+ * blank line, our Age and Connection lines, then the body.  Nothing is
+ * copied.
+ */
+static int do_proxy_cached(client_ctx *cx) {
+  cache_entry *ce;
+  proxy_req *pr;
+  uv_buf_t bufs[3];
+  int n;
+
+  pr = &cx->proxy;
+  ce = pr->cached;
+  n = snprintf(pr->age,
+               sizeof(pr->age),
+               "Age: %u\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               proxy_cache_age(&cx->sx->state->cache, ce));
+  bufs[0].base = ce->data;
+  bufs[0].len = (unsigned long) ce->headlen - 2;
+  bufs[1].base = pr->age;
+  bufs[1].len = n;
+  bufs[2].base = ce->data + ce->headlen;
+  bufs[2].len = (unsigned long) (ce->size - ce->headlen);
+  conn_writev(&cx->clientconn, bufs, pr->resp.head_request ? 2 : 3);
+  return s_resp_write;
+}
+
+/* Pick a backend and send the request on an idle pooled connection if
+ * there is one, or connect a new one.
+ */
+static int do_proxy_checkout(client_ctx *cx) {
+  upstream_conn *uc;
+  const char *value;
+  conn *upstream;
+  proxy_req *pr;
+  size_t len;
+
+  pr = &cx->proxy;
+  value = NULL;
+  if (cx->route->lb_key != NULL) {
+    value = http_header_find(&cx->parser, cx->route->lb_key, &len);
+  }
+  if (value == NULL) {
+    value = cx->parser.uri;
+    len = cx->parser.urilen;
+  }
+  pr->reported = 0;
+  pr->sent = pr->start;
+  pr->backend = upstream_group_pick(proxy_group(cx), value, len);
+  pr->pool = &pr->backend->pool;
+  pr->host = pr->pool->host;
+  pr->port = pr->pool->port;
+
+  uc = NULL;
+  if (cx->proxy.reusable) {
+    uc = upstream_pool_get(cx->proxy.pool);
+  }
+  if (uc == NULL) {
+    return do_proxy_dial(cx);
+  }
+
+  upstream = &uc->c;
+  upstream->client = cx;
+  upstream->rdstate = c_stop;
+  upstream->wrstate = c_stop;
+  upstream->rdoff = 0;
+  upstream->idle_timeout = cx->clientconn.idle_timeout;
+  cx->upstream = uc;
+  cx->proxy.open = 1;
+  cx->proxy.reused = 1;
+  conn_write(upstream, cx->proxy.head, cx->proxy.headlen);
+  return s_proxy_send;
+}
+
+static int do_proxy_dial(client_ctx *cx) {
+  conn *upstream;
+  int err;
+
+  cx->upstream = upstream_conn_new(cx->sx->loop, cx->proxy.pool);
+  cx->proxy.open = 1;
+  cx->proxy.reused = 0;
+  upstream = &cx->upstream->c;
+  upstream->client = cx;
+  upstream->result = 0;
+  upstream->rdstate = c_stop;
+  upstream->wrstate = c_stop;
+  upstream->rdoff = 0;
+  upstream->idle_timeout = cx->clientconn.idle_timeout;
+
+  /* A pooled connection carries one small head after another; don't let
+   * Nagle hold them back waiting for the previous response's ACK.
+   */
+  uv_tcp_nodelay(&upstream->handle.tcp, 1);
+
+  err = dns_cache_resolve(&cx->sx->state->dns,
+                          cx->proxy.host,
+                          &cx->proxy.dns,
+                          proxy_resolve_done);
+  if (err == DNS_PENDING) {
+    /* No upstream timer until we're connected, the client's covers this. */
+    cx->proxy.resolving = 1;
+    return s_proxy_resolve;
+  }
+
+  if (err != 0) {
+    return do_proxy_error(cx, "lookup", err);
+  }
+
+  proxy_set_addr(upstream, &cx->proxy.dns.addr);
+  return do_proxy_resolve(cx);
+}
+
+/* A pooled connection failed before the backend answered, most likely
+ * because the backend closed it just as we sent the request.  Nothing
+ * reached the client yet, so if |head| holds the whole request, send it
+ * again on a fresh connection.  Returns the next state, or -1 if that's
+ * not possible.
+ */
+static int do_proxy_retry(client_ctx *cx) {
+  if (!cx->proxy.reused
+      || !cx->proxy.replayable
+      || cx->proxy.responded
+      || cx->proxy.up.count > 0) {
+    return -1;
+  }
+
+  /* The new connection's states don't expect a client read to complete. */
+  relay_stop(&cx->proxy.up);
+  proxy_hedge_cancel(cx);
+
+  upstream_conn_close(cx->upstream);
+  cx->upstream = NULL;
+  cx->proxy.open = 0;
+  cx->proxy.pool->retries += 1;
+  proxy_resp_init(&cx->proxy.resp, cx->proxy.resp.head_request);
+  return do_proxy_dial(cx);
+}
+
+static int do_proxy_resolve(client_ctx *cx) {
+  conn *incoming;
+  conn *upstream;
+  int err;
+
+  incoming = &cx->clientconn;
+  upstream = &cx->upstream->c;
+  if (incoming->result < 0) {
+    return do_kill(cx);  /* Lookup maybe pending, do_kill() cancels it. */
+  }
+
+  if (upstream->result < 0) {
+    return do_proxy_error(cx, "lookup", (int) upstream->result);
+  }
+
+  if (cx->proxy.tunnel
+      && !cx->snap->config.connect_internal
+      && tunnel_internal(&upstream->t.addr)) {
+    pr_warn("CONNECT to %s refused, internal address", cx->proxy.host);
+    cx->sx->state->proxy.tunnels_refused += 1;
+    return do_resp_simple(cx, "403 Forbidden", "Forbidden");
+  }
+
+  cx->proxy.resolved = uv_hrtime();
+  cx->sx->state->proxy.resolve_us += (cx->proxy.resolved - cx->proxy.start) / 1000;
+  if (upstream->t.addr.sa_family == AF_INET6) {
+    upstream->t.addr6.sin6_port = htons(cx->proxy.port);
+  } else {
+    upstream->t.addr4.sin_port = htons(cx->proxy.port);
+  }
+
+  err = uv_tcp_connect(&upstream->t.connect_req,
+                       &upstream->handle.tcp,
+                       &upstream->t.addr,
+                       proxy_connect_done);
+  if (err != 0) {
+    return do_proxy_error(cx, "connect", err);
+  }
+
+  return s_proxy_connect;
+}
+
+static int do_proxy_connect(client_ctx *cx) {
+  upstream_pool *pool;
+  conn *incoming;
+  conn *upstream;
+  uint64_t us;
+
+  incoming = &cx->clientconn;
+  upstream = &cx->upstream->c;
+  if (incoming->result < 0) {
+    return do_kill(cx);
+  }
+
+  if (upstream->result < 0) {
+    return do_proxy_error(cx, "connect", (int) upstream->result);
+  }
+
+  us = (uv_hrtime() - cx->proxy.resolved) / 1000;
+  cx->sx->state->proxy.connect_us += us;
+  if (cx->proxy.tunnel) {
+    return do_tunnel_open(cx);
+  }
+
+  pool = cx->proxy.pool;
+  pool->connects += 1;
+  pool->connect_us += us;
+  conn_write(upstream, cx->proxy.head, cx->proxy.headlen);
+  return s_proxy_send;
+}
+
+static int do_proxy_send(client_ctx *cx) {
+  conn *incoming;
+  conn *upstream;
+  int n;
+
+  incoming = &cx->clientconn;
+  upstream = &cx->upstream->c;
+  if (incoming->result < 0) {
+    return do_kill(cx);
+  }
+
+  if (upstream->result < 0) {
+    n = do_proxy_retry(cx);
+    if (n >= 0) {
+      return n;
+    }
+    return do_proxy_error(cx, "write", (int) upstream->result);
+  }
+
+  ASSERT(upstream->wrstate == c_done);
+  upstream->wrstate = c_stop;
+  cx->sx->state->proxy.bytes_up += cx->parser.remain;
+
+  /* Only a request body needs more than one buffer upstream. */
+  relay_init(cx,
+             &cx->proxy.down,
+             upstream,
+             incoming,
+             cx->snap->config.relay_bufs);
+  relay_init(cx,
+             &cx->proxy.up,
+             incoming,
+             upstream,
+             cx->proxy.up_remaining != 0 ? cx->snap->config.relay_bufs : 1);
+  proxy_hedge_arm(cx);
+  return do_proxy(cx);
+}
+
+/* Relay the rest of the request body upstream and the response back to
+ * the client, see relay_pump().  Once the last byte of the response has
+ * been written to the client, the upstream connection goes back to the
+ * pool.
+ */
+static int do_proxy(client_ctx *cx) {
+  relay_dir *down;
+  proxy_req *pr;
+  relay_dir *up;
+  int n;
+
+  pr = &cx->proxy;
+  down = &pr->down;
+  up = &pr->up;
+  if (pr->hedge != NULL && pr->hedge->written && pr->hedge->len > 0) {
+    return do_proxy_hedge(cx);
+  }
+
+  if (cx->clientconn.result < 0 || cx->upstream->c.result < 0) {
+    if (pr->up_remaining == 0) {
+      proxy_report(cx, 1);  /* The request was out, no answer in time. */
+    }
+    return do_kill(cx);  /* Idle timeout. */
+  }
+
+  if (down->wr_result < 0 || up->wr_result < 0) {
+    return do_kill(cx);
+  }
+
+  if (down->rd_result < 0) {
+    /* Closed before it answered.  A pooled connection may have raced
+     * with the backend's idle timeout.
+     */
+    if (!pr->responded) {
+      n = do_proxy_retry(cx);
+      if (n >= 0) {
+        return n;
+      }
+    }
+    proxy_report(cx, 1);
+    return do_proxy_close(cx);
+  }
+
+  if (proxy_resp_done(&pr->resp)) {
+    proxy_capture_end(cx, 1);
+    if (down->count > 0) {
+      return s_proxy;  /* The end of the response is on its way. */
+    }
+    return do_proxy_finish(cx);
+  }
+
+  if (up->rd_result < 0) {
+    return do_proxy_close(cx);
+  }
+
+  if (proxy_resp_body_left(&pr->resp) >= cx->snap->config.splice_min
+      && cx->snap->config.use_splice
+      && down->count == 0
+      && up->count == 0
+      && pr->up_remaining == 0
+      && pr->capture == NULL) {
+    n = do_proxy_splice_start(cx);
+    if (n >= 0) {
+      return n;
+    }
+  }
+
+  relay_pump(down);
+  relay_pump(up);
+  return s_proxy;
+}
+
+/* One side is gone.  Deliver what has been read already, then tear down.
+ * A write that completes after the close would still call back, and
+ * do_kill() doesn't count those.
+ */
+static int do_proxy_close(client_ctx *cx) {
+  relay_stop(&cx->proxy.down);
+  relay_stop(&cx->proxy.up);
+  if (cx->proxy.down.count > 0 || cx->proxy.up.count > 0) {
+    return s_proxy;
+  }
+
+  return do_kill(cx);
+}
+
+/* The hedge got the first response bytes while the first backend is still
+ * quiet.  Its connection replaces the upstream one and those bytes go out
+ * as if they had been read there.  Pipelined client bytes being written to
+ * the old connection would be lost; the first backend keeps the request
+ * then.
+ */
+static int do_proxy_hedge(client_ctx *cx) {
+  upstream_hedge *h;
+  upstream_conn *uc;
+  unsigned int len;
+  conn *upstream;
+  proxy_req *pr;
+
+  pr = &cx->proxy;
+  h = pr->hedge;
+  if (cx->clientconn.result < 0 || pr->up.count > 0) {
+    proxy_hedge_cancel(cx);
+    return do_proxy(cx);
+  }
+
+  /* What the first backend took so far is a lower bound of its latency. */
+  proxy_report(cx, 0);
+  relay_stop(&pr->down);
+  relay_stop(&pr->up);
+  upstream_conn_close(cx->upstream);
+  upstream_group_done(proxy_group(cx), pr->backend);
+
+  uc = h->dial.uc;
+  pr->backend = h->backend;
+  pr->pool = &pr->backend->pool;
+  pr->host = pr->pool->host;
+  pr->port = pr->pool->port;
+  pr->sent = h->start;
+  pr->reported = 0;
+  pr->reused = 0;  /* It has answered, there's nothing to retry. */
+  len = h->len;
+  h->dial.uc = NULL;
+  h->backend = NULL;
+  proxy_hedge_cancel(cx);
+  proxy_group(cx)->hedge_wins += 1;
+
+  upstream = &uc->c;
+  upstream->client = cx;
+  upstream->result = 0;
+  upstream->rdstate = c_stop;
+  upstream->wrstate = c_stop;
+  upstream->rdoff = 0;
+  upstream->idle_timeout = cx->clientconn.idle_timeout;
+  cx->upstream = uc;
+
+  relay_init(cx,
+             &pr->down,
+             upstream,
+             &cx->clientconn,
+             cx->snap->config.relay_bufs);
+  relay_init(cx, &pr->up, &cx->clientconn, upstream, 1);
+  relay_feed(&pr->down, upstream->t.buf, len);
+  return do_proxy(cx);
+}
+
+/* The rest of the response body goes from socket to socket in the kernel.
+ * Both connections are quiet: the request is out and no relay buffer is
+ * being written.  Reads stop; the client's could only bring a pipelined
+ * request.  Returns -1 if splice() isn't available; the relay then carries
+ * on in user space.
+ */
+static int do_proxy_splice_start(client_ctx *cx) {
+  conn *incoming;
+  conn *upstream;
+  int err;
+
+  incoming = &cx->clientconn;
+  upstream = &cx->upstream->c;
+  err = splice_relay_start(cx->sx->loop,
+                           &upstream->handle.tcp,
+                           &incoming->handle.tcp,
+                           proxy_resp_body_left(&cx->proxy.resp),
+                           proxy_splice_done,
+                           cx,
+                           &cx->proxy.splice);
+  if (err != 0) {
+    if (err != UV_ENOSYS) {
+      pr_warn("splice: %s", uv_strerror(err));
+    }
+    return -1;
+  }
+
+  relay_stop(&cx->proxy.down);
+  relay_stop(&cx->proxy.up);
+  cx->proxy.spliced = 0;
+  cx->sx->state->proxy.splices += 1;
+  conn_timer_reset(incoming);
+  conn_timer_reset(upstream);
+  return s_proxy_splice;
+}
+
+static int do_proxy_splice(client_ctx *cx) {
+  splice_relay *sr;
+  proxy_req *pr;
+  uint64_t n;
+
+  pr = &cx->proxy;
+  sr = pr->splice;
+  if (cx->clientconn.result < 0 || cx->upstream->c.result < 0) {
+    return do_kill(cx);  /* Idle timeout, do_kill() stops the relay. */
+  }
+
+  n = sr->moved - pr->spliced;
+  if (n > 0) {
+    pr->spliced = sr->moved;
+    proxy_resp_skip(&pr->resp, n);
+    cx->sx->state->proxy.bytes_down += n;
+    cx->sx->state->proxy.bytes_spliced += n;
+    conn_timer_reset(&cx->clientconn);
+    conn_timer_reset(&cx->upstream->c);
+  }
+
+  if (sr->result < 0) {
+    if (sr->result != UV_EOF) {
+      pr_err("splice error: %s", uv_strerror(sr->result));
+    }
+    return do_kill(cx);
+  }
+
+  if (sr->left > 0) {
+    return s_proxy_splice;
+  }
+
+  splice_relay_stop(sr);
+  pr->splice = NULL;
+  return do_proxy(cx);
+}
+
+/* The response has been relayed in full.  The client connection closes as
+ * usual; the upstream one goes back to the pool if the backend keeps it
+ * and the request went out in full.
+ */
+static int do_proxy_finish(client_ctx *cx) {
+  upstream_conn *uc;
+
+  cx->proxy.done = 1;
+  uc = cx->upstream;
+  if (cx->proxy.reusable
+      && cx->proxy.up_remaining == 0
+      && cx->proxy.up.count == 0
+      && uc->c.result >= 0) {
+    relay_stop(&cx->proxy.down);
+    uv_timer_stop(&uc->c.timer_handle);
+    cx->upstream = NULL;
+    cx->proxy.open = 0;
+    upstream_pool_put(cx->proxy.pool, uc);
+  }
+
+  return do_kill(cx);
+}
+
+/* The backend can't be reached.  Nothing has been sent to the client yet,
+ * so tell it so.
+ */
+static int do_proxy_error(client_ctx *cx, const char *what, int err) {
+  pr_warn("upstream %s:%u %s error: %s",
+          cx->proxy.host,
+          cx->proxy.port,
+          what,
+          uv_strerror(err));
+  cx->sx->state->proxy.errors += 1;
+  proxy_report(cx, 1);
+  proxy_hedge_cancel(cx);
+  if (err == UV_ETIMEDOUT) {
+    return do_resp_simple(cx, "504 Gateway Timeout", "Gateway Timeout");
+  }
+  return do_resp_simple(cx, "502 Bad Gateway", "Bad Gateway");
+}
+
+/* CONNECT host:port.  The upstream connection is made like a proxy
+ * route's, minus the pool, and once the client has been told the tunnel
+ * stands the relay passes bytes both ways without looking at them.  An
+ * idle tunnel holds no relay buffers, see relay_write_done().
+ *
+ * Tunnels are off unless allow_connect is set, and go only to the ports
+ * in connect_ports; the address the host resolves to is checked in
+ * do_proxy_resolve(), see tunnel_internal().
+ */
+static int do_tunnel_start(client_ctx *cx) {
+  const server_config *cf;
+  const char *colon;
+  const char *host;
+  unsigned long port;
+  proxy_req *pr;
+  size_t hostlen;
+  size_t i;
+
+  if (!cx->snap->config.allow_connect) {
+    return do_resp_simple(cx, "405 Method Not Allowed", "Method Not Allowed");
+  }
+
+  /* Authority form; an IPv6 address comes in brackets. */
+  host = cx->parser.uri;
+  colon = NULL;
+  for (i = cx->parser.urilen; i > 0; i -= 1) {
+    if (host[i - 1] == ':') {
+      colon = host + i - 1;
+      break;
+    }
+  }
+  if (colon == NULL || colon == host) {
+    return do_resp_simple(cx, "400 Bad Request", "Bad Request");
+  }
+
+  port = 0;
+  for (i = colon + 1 - host; i < cx->parser.urilen && port <= 65535; i += 1) {
+    if (host[i] < '0' || host[i] > '9') {
+      break;
+    }
+    port = port * 10 + (host[i] - '0');
+  }
+  if (i != cx->parser.urilen || port == 0 || port > 65535) {
+    return do_resp_simple(cx, "400 Bad Request", "Bad Request");
+  }
+
+  cf = &cx->snap->config;
+  for (i = 0; i < CONNECT_MAX_PORTS && cf->connect_ports[i] != port; i += 1) {
+    if (cf->connect_ports[i] == 0) {
+      i = CONNECT_MAX_PORTS;
+      break;
+    }
+  }
+  if (i == CONNECT_MAX_PORTS) {
+    cx->sx->state->proxy.tunnels_refused += 1;
+    return do_resp_simple(cx, "403 Forbidden", "Forbidden");
+  }
+
+  hostlen = colon - host;
+  if (hostlen > 2 && host[0] == '[' && host[hostlen - 1] == ']') {
+    host += 1;
+    hostlen -= 2;
+  }
+
+  pr = &cx->proxy;
+  pr->start = uv_hrtime();
+  pr->tunnel = 1;
+  pr->port = (unsigned short) port;
+  pr->head = xmalloc(hostlen + 1 + cx->parser.remain);
+  memcpy(pr->head, host, hostlen);
+  pr->head[hostlen] = '\0';
+  pr->host = pr->head;
+  memcpy(pr->head + hostlen + 1, cx->parser.next, cx->parser.remain);
+  pr->headlen = (unsigned int) cx->parser.remain;
+
+  /* Nothing to frame, pool or replay. */
+  pr->pool = NULL;
+  pr->backend = NULL;
+  pr->reusable = 0;
+  pr->replayable = 0;
+  pr->responded = 1;
+  pr->up_remaining = -1;
+  proxy_resp_init(&pr->resp, 0);
+
+  cx->sx->state->proxy.tunnels += 1;
+  cx->sx->state->proxy.tunnels_active += 1;
+  return do_proxy_dial(cx);
+}
+
+/* Connected.  Tell the client, and pass on whatever it sent after the
+ * CONNECT head without waiting, usually the start of a TLS handshake.
+ */
+static int do_tunnel_open(client_ctx *cx) {
+  static const char reply[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+  proxy_req *pr;
+
+  pr = &cx->proxy;
+  conn_write(&cx->clientconn, reply, sizeof(reply) - 1);
+  if (pr->headlen > 0) {
+    conn_write(&cx->upstream->c,
+               pr->head + strlen(pr->host) + 1,
+               pr->headlen);
+    cx->sx->state->proxy.bytes_up += pr->headlen;
+  }
+
+  return s_tunnel_reply;
+}
+
+static int do_tunnel_reply(client_ctx *cx) {
+  unsigned int nbufs;
+  conn *incoming;
+  conn *upstream;
+
+  incoming = &cx->clientconn;
+  upstream = &cx->upstream->c;
+  if (incoming->result < 0 || upstream->result < 0) {
+    return do_kill(cx);
+  }
+
+  if (incoming->wrstate == c_busy || upstream->wrstate == c_busy) {
+    return s_tunnel_reply;
+  }
+  incoming->wrstate = c_stop;
+  upstream->wrstate = c_stop;
+
+  nbufs = cx->snap->config.relay_bufs;
+  relay_init(cx, &cx->proxy.down, upstream, incoming, nbufs);
+  relay_init(cx, &cx->proxy.up, incoming, upstream, nbufs);
+  cx->proxy.down.release = 1;
+  cx->proxy.up.release = 1;
+  return do_proxy(cx);
+}
+
+static int do_kill(client_ctx *cx) {
+  request_metrics *m;
+  int new_state;
+
+  if (cx->state >= s_almost_dead_0) {
+    return cx->state;
+  }
+
+  m = &cx->sx->state->requests;
+
+  /* Every handle we close is a finalizer; so is the callback of the
+   * request we try to cancel here.  It still runs but if the cancellation
+   * succeeded, it gets called with status=UV_ECANCELED.
+   */
+  new_state = cx->proxy.open ? s_almost_dead_1 : s_almost_dead_3;
+  if (cx->busy == (uv_req_t *) &cx->job.req) {
+    new_state -= 1;
+    work_pool_cancel(&cx->job);  /* May not be libuv's, counts itself. */
+  } else if (cx->busy != NULL) {
+    new_state -= 1;
+    if (0 == uv_cancel(cx->busy)) {
+      m->cancelled_fs += 1;
+    }
+  }
+
+  if (cx->proxy.resolving) {
+    dns_cache_cancel(&cx->proxy.dns);  /* Not a finalizer, it won't call. */
+    cx->proxy.resolving = 0;
+    m->cancelled_lookups += 1;
+  }
+
+  if (cx->proxy.open
+      && !cx->proxy.tunnel
+      && !cx->proxy.done
+      && cx->upstream->c.result >= 0) {
+    m->cancelled_fetches += 1;  /* Closed below, the backend stops too. */
+  }
+
+  if (cx->proxy.splice != NULL) {
+    splice_relay_stop(cx->proxy.splice);  /* Not a finalizer, it frees itself. */
+    cx->proxy.splice = NULL;
+  }
+
+  if (cx->coro != NULL) {
+    coro_cancel(cx->coro);  /* Not a finalizer either, see coro.c. */
+    cx->coro = NULL;
+  }
+
+  proxy_hedge_cancel(cx);  /* Not a finalizer either. */
+  proxy_cache_unwait(&cx->proxy.wait);
+  proxy_capture_end(cx, 0);  /* Requests waiting for us go upstream. */
+
+  if (cx->proxy.backend != NULL) {
+    upstream_group_done(proxy_group(cx), cx->proxy.backend);
+    cx->proxy.backend = NULL;
+  }
+
+  if (cx->proxy.tunnel) {
+    cx->sx->state->proxy.tunnels_active -= 1;
+    cx->proxy.tunnel = 0;
+  }
+
+  conn_close(&cx->clientconn);
+  if (cx->proxy.open) {
+    conn_close(&cx->upstream->c);
+  }
+  return new_state;
+}
+
+static int do_almost_dead(client_ctx *cx) {
+  ASSERT(cx->state >= s_almost_dead_0);
+  return cx->state + 1;  /* Another finalizer completed. */
+}
+
+static void static_open_done(file_open_req *req, file_entry *fe, int status) {
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(req, client_ctx, file.open_req);
+  cx->busy = NULL;
+  cx->file.file = fe;
+  cx->file.result = status;
+  do_next(cx);
+}
+
+static void static_read(client_ctx *cx) {
+  content_entry *ce;
+  uv_buf_t buf;
+
+  ce = cx->file.mem;
+  buf.base = ce->body + cx->file.offset;
+  buf.len = (unsigned long) cx->file.remaining;
+  CHECK(0 == uv_fs_read(cx->sx->loop,
+                        &cx->file.fs_req,
+                        cx->file.file->fd,
+                        &buf,
+                        1,
+                        cx->file.offset,
+                        static_read_done));
+  cx->busy = (uv_req_t *) &cx->file.fs_req;
+  conn_watch(&cx->clientconn);
+}
+
+static void static_read_done(uv_fs_t *req) {
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(req, client_ctx, file.fs_req);
+  cx->busy = NULL;
+  cx->file.result = req->result;
+  uv_fs_req_cleanup(req);
+  do_next(cx);
+}
+
+static void static_hash_work(work_job *job) {
+  content_entry *ce;
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(job, client_ctx, job);
+  ce = cx->file.mem;
+  cx->file.hash = file_hash_contents(ce->body, ce->bodylen, 0);
+}
+
+/* Only keep output that saves at least an eighth; a zero length variant
+ * tells do_static_compress() that it didn't.
+ */
+static void static_gzip_work(work_job *job) {
+  content_entry *src;
+  content_entry *ce;
+  client_ctx *cx;
+  size_t n;
+
+  cx = CONTAINER_OF(job, client_ctx, job);
+  src = cx->file.mem;
+  ce = cx->file.variant;
+  n = gzip_compress(src->body,
+                    src->bodylen,
+                    ce->body,
+                    src->bodylen - src->bodylen / 8);
+  content_cache_trim(ce, n);
+  cx->file.hash = file_hash_contents(ce->body, n, 0);
+}
+
+static void static_work_done(work_job *job, int status) {
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(job, client_ctx, job);
+  cx->busy = NULL;
+  cx->file.result = status;
+  do_next(cx);
+}
+
+/* Send the next part of the file straight from the page cache to the
+ * socket.  This counts as a write on the client connection, so the usual
+ * wrstate and idle timer rules apply.  A part is no bigger than what the
+ * read ring would hold, so that the idle timer measures a stalled client
+ * and not a long download.
+ */
+static void static_sendfile(client_ctx *cx) {
+  const server_config *cf;
+  conn *incoming;
+  size_t len;
+
+  cf = &cx->snap->config;
+  incoming = &cx->clientconn;
+  ASSERT(incoming->wrstate == c_stop);
+  incoming->wrstate = c_busy;
+
+  len = (size_t) cf->stream_bufs * cf->stream_chunk;
+  if (cx->file.remaining < (int64_t) len) {
+    len = (size_t) cx->file.remaining;
+  }
+
+  CHECK(0 == uv_fs_sendfile(cx->sx->loop,
+                            &cx->file.fs_req,
+                            cx->file.sockfd,
+                            cx->file.file->fd,
+                            cx->file.offset,
+                            len,
+                            static_sendfile_done));
+  cx->busy = (uv_req_t *) &cx->file.fs_req;
+  conn_timer_reset(incoming);
+}
+
+static void static_sendfile_done(uv_fs_t *req) {
+  client_ctx *cx;
+  conn *c;
+
+  cx = CONTAINER_OF(req, client_ctx, file.fs_req);
+  c = &cx->clientconn;
+  cx->busy = NULL;
+  cx->file.result = req->result;
+  uv_fs_req_cleanup(req);
+
+  if (c->wrstate == c_busy) {
+    c->wrstate = c_done;
+  }
+  do_next(cx);
+}
+
+/* Starts a read into the next free ring buffer unless one is in flight,
+ * and writes out the oldest filled buffer if the connection is idle.
+ */
+static void static_stream_pump(client_ctx *cx) {
+  const server_config *cf;
+  static_resp *r;
+  conn *incoming;
+  unsigned int slot;
+  uv_buf_t buf;
+
+  cf = &cx->snap->config;
+  r = &cx->file;
+  incoming = &cx->clientconn;
+  if (r->ring == NULL) {
+    r->ring = xmalloc((size_t) cf->stream_bufs * cf->stream_chunk);
+  }
+
+  if (!r->reading && r->rd_remaining > 0 && r->ring_count < cf->stream_bufs) {
+    slot = (r->ring_head + r->ring_count) % cf->stream_bufs;
+    buf.base = r->ring + (size_t) slot * cf->stream_chunk;
+    buf.len = cf->stream_chunk;
+    if (r->rd_remaining < (int64_t) buf.len) {
+      buf.len = (unsigned long) r->rd_remaining;
+    }
+    CHECK(0 == uv_fs_read(cx->sx->loop,
+                          &r->fs_req,
+                          r->file->fd,
+                          &buf,
+                          1,
+                          r->rd_offset,
+                          static_stream_read_done));
+    cx->busy = (uv_req_t *) &r->fs_req;
+    r->reading = 1;
+  }
+
+  if (incoming->wrstate == c_stop && r->ring_count > 0) {
+    conn_write(incoming,
+               r->ring + (size_t) r->ring_head * cf->stream_chunk,
+               r->ring_len[r->ring_head]);
+  }
+}
+
+static void static_stream_read_done(uv_fs_t *req) {
+  static_resp *r;
+  client_ctx *cx;
+  unsigned int slot;
+
+  cx = CONTAINER_OF(req, client_ctx, file.fs_req);
+  r = &cx->file;
+  cx->busy = NULL;
+  r->reading = 0;
+  r->result = req->result;
+  if (r->result == 0) {
+    r->result = UV_EOF;  /* The file shrank, we can't keep our promise. */
+  }
+
+  if (r->result > 0) {
+    slot = (r->ring_head + r->ring_count) % cx->snap->config.stream_bufs;
+    r->ring_len[slot] = (unsigned int) r->result;
+    r->ring_count += 1;
+    r->rd_offset += r->result;
+    r->rd_remaining -= r->result;
+  }
+
+  uv_fs_req_cleanup(req);
+  do_next(cx);
+}
+
+/* Runs once all callbacks have completed and the session is about to be
+ * freed.  Nothing on the threadpool references the file any longer.
+ */
+static void static_cleanup(client_ctx *cx) {
+  if (cx->file.mem != NULL) {
+    content_cache_release(&cx->sx->state->contents, cx->file.mem);
+    cx->file.mem = NULL;
+  }
+
+  if (cx->proxy.cached != NULL) {
+    proxy_cache_release(&cx->sx->state->cache, cx->proxy.cached);
+    cx->proxy.cached = NULL;
+  }
+
+  free(cx->resp_buf);
+  cx->resp_buf = NULL;
+  free(cx->handler.body);
+  cx->handler.body = NULL;
+  free(cx->proxy.head);
+  cx->proxy.head = NULL;
+  free(cx->upstream);  /* Closed by do_kill() if it wasn't pooled. */
+  cx->upstream = NULL;
+  free(cx->file.ring);
+  cx->file.ring = NULL;
+  free(cx->proxy.down.slots);
+  cx->proxy.down.slots = NULL;
+  free(cx->proxy.up.slots);
+  cx->proxy.up.slots = NULL;
+
+  if (cx->file.variant != NULL) {
+    content_cache_release(&cx->sx->state->contents, cx->file.variant);
+    cx->file.variant = NULL;
+  }
+
+  if (cx->file.file != NULL) {
+    file_cache_release(&cx->sx->state->files, cx->file.file);
+    cx->file.file = NULL;
+  }
+
+  cx->file.sockfd = -1;  /* The socket's, uv_close() closes it. */
+}
+
+static void handler_work(work_job *job) {
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(job, client_ctx, job);
+  cx->route->handler(&cx->parser, &cx->handler);
+}
+
+static void handler_done(work_job *job, int status) {
+  client_ctx *cx;
+
+  cx = CONTAINER_OF(job, client_ctx, job);
+  cx->busy = NULL;
+  do_next(cx);
+}
+
+static void coro_woken(coro *co) {
+  do_next(co->arg);
+}
+
+static void proxy_resolve_done(dns_query *q, int status) {
+  client_ctx *cx;
+  conn *c;
+
+  cx = CONTAINER_OF(q, client_ctx, proxy.dns);
+  cx->proxy.resolving = 0;
+  c = &cx->upstream->c;
+  c->result = status;
+  if (status == 0) {
+    proxy_set_addr(c, &q->addr);
+  }
+
+  do_next(cx);
+}
+
+static upstream_group *proxy_group(client_ctx *cx) {
+  return cx->snap->groups + (cx->route - cx->snap->config.routes);
+}
+
+static void proxy_set_addr(conn *c, const struct sockaddr_storage *addr) {
+  if (addr->ss_family == AF_INET6) {
+    c->t.addr6 = *(const struct sockaddr_in6 *) addr;
+  } else {
+    c->t.addr4 = *(const struct sockaddr_in *) addr;
+  }
+}
+
+/* Loopback, link-local, private, unspecified and multicast addresses,
+ * where a tunnel would reach what only this host's network should.
+ */
+static int tunnel_internal(const struct sockaddr *addr) {
+  const unsigned char *b;
+  unsigned int i;
+
+  if (addr->sa_family == AF_INET6) {
+    b = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+    for (i = 0; i < 10 && b[i] == 0; i += 1) {
+    }
+    if (i == 10 && b[10] == 0xff && b[11] == 0xff) {
+      b += 12;  /* IPv4-mapped, checked below. */
+    } else {
+      for (i = 0; i < 15 && b[i] == 0; i += 1) {
+      }
+      return (i == 15 && b[15] <= 1)  /* :: and ::1 */
+          || (b[0] & 0xfe) == 0xfc  /* fc00::/7 */
+          || (b[0] == 0xfe && (b[1] & 0xc0) == 0x80)  /* fe80::/10 */
+          || b[0] == 0xff;  /* Multicast. */
+    }
+  } else {
+    b = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+  }
+
+  return b[0] == 0
+      || b[0] == 10
+      || b[0] == 127
+      || (b[0] == 100 && (b[1] & 0xc0) == 64)  /* 100.64/10 */
+      || (b[0] == 169 && b[1] == 254)
+      || (b[0] == 172 && (b[1] & 0xf0) == 16)
+      || (b[0] == 192 && b[1] == 168)
+      || b[0] >= 224;  /* Multicast, reserved and broadcast. */
+}
+
+static void proxy_splice_done(splice_relay *sr) {
+  do_next(sr->data);
+}
+
+static void proxy_connect_done(uv_connect_t *req, int status) {
+  conn *c;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  c = CONTAINER_OF(req, conn, t.connect_req);
+  c->result = status;
+  do_next(c->client);
+}
+
+/* Hedges idempotent requests without a body on routes that ask for it,
+ * once there's a delay to go by.
+ */
+static void proxy_hedge_arm(client_ctx *cx) {
+  upstream_group *g;
+  proxy_req *pr;
+  unsigned int delay;
+  size_t len;
+
+  pr = &cx->proxy;
+  g = proxy_group(cx);
+  len = cx->parser.methodlen;
+  if (!cx->route->hedge
+      || g->nbackends < 2
+      || pr->hedge != NULL
+      || !pr->replayable
+      || !((len == 3 && 0 == memcmp(cx->parser.method, "GET", 3))
+           || (len == 4 && 0 == memcmp(cx->parser.method, "HEAD", 4)))) {
+    return;
+  }
+
+  delay = upstream_group_hedge_arm(g);
+  if (delay == 0) {
+    return;
+  }
+
+  pr->hedge = upstream_hedge_start(g,
+                                   pr->backend,
+                                   &cx->sx->state->dns,
+                                   pr->head,
+                                   pr->headlen,
+                                   delay,
+                                   proxy_hedge_done,
+                                   cx);
+}
+
+static void proxy_hedge_done(upstream_hedge *h) {
+  do_next(h->data);
+}
+
+static void proxy_hedge_cancel(client_ctx *cx) {
+  if (cx->proxy.hedge != NULL) {
+    upstream_hedge_cancel(cx->proxy.hedge);
+    cx->proxy.hedge = NULL;
+  }
+}
+
+static void proxy_cache_woken(cache_waiter *w) {
+  do_next(CONTAINER_OF(w, client_ctx, proxy.wait));
+}
+
+/* Keeps a copy of relayed response bytes for the cache.  A response that
+ * outgrows proxy_cache_max_entry isn't kept, and whoever waits for it is
+ * let go right away.
+ */
+static void proxy_capture(client_ctx *cx, const char *data, size_t len) {
+  proxy_req *pr;
+  size_t max;
+  size_t cap;
+
+  pr = &cx->proxy;
+  max = cx->sx->state->cache.max_entry;
+  if (pr->capturelen + len > max) {
+    proxy_capture_end(cx, 0);
+    return;
+  }
+
+  if (pr->capturelen + len > pr->capturecap) {
+    cap = pr->capturecap * 2;
+    if (cap < pr->capturelen + len) {
+      cap = pr->capturelen + len;
+    }
+    if (cap > max) {
+      cap = max;
+    }
+    pr->capture = realloc(pr->capture, cap);
+    CHECK(pr->capture != NULL);
+    pr->capturecap = cap;
+  }
+
+  memcpy(pr->capture + pr->capturelen, data, len);
+  pr->capturelen += len;
+}
+
+/* Hands a complete response to the cache, or drops the copy. */
+static void proxy_capture_end(client_ctx *cx, int complete) {
+  proxy_cache *pc;
+  proxy_req *pr;
+
+  pc = &cx->sx->state->cache;
+  pr = &cx->proxy;
+  if (complete && pr->capture != NULL) {
+    proxy_cache_store(pc,
+                      pr->fill,
+                      pr->head,
+                      pr->headlen,
+                      &pr->resp,
+                      pr->capture,
+                      pr->capturelen);
+    pr->capture = NULL;
+    pr->fill = NULL;
+  }
+
+  free(pr->capture);
+  pr->capture = NULL;
+  if (pr->fill != NULL) {
+    proxy_cache_abort(pc, pr->fill);
+    pr->fill = NULL;
+  }
+}
+
+/* Sets up the relay from |src| to |dst|.  Called again when a retry swaps
+ * the upstream connection; the buffers are kept.
+ */
+static void relay_init(client_ctx *cx,
+                       relay_dir *d,
+                       conn *src,
+                       conn *dst,
+                       unsigned int nbufs) {
+  if (d->slots == NULL) {
+    d->nbufs = nbufs;
+  }
+  d->cx = cx;
+  d->src = src;
+  d->dst = dst;
+  d->head = 0;
+  d->count = 0;
+  d->inflight = 0;
+  d->reading = 0;
+  d->stopped = 0;
+  d->release = 0;
+  d->rd_result = 0;
+  d->wr_result = 0;
+}
+
+/* Keeps reading from d->src while there's a free buffer and less than
+ * relay_max_inflight bytes wait to be written.  Each chunk is written to
+ * d->dst as soon as it arrives; libuv queues the writes in order.  When
+ * the destination can't keep up, the buffers fill, reading stops and TCP
+ * flow control throttles the sender, just like it did with one buffer.
+ * With several, the next read overlaps the previous write, which keeps a
+ * long fat pipe busy.
+ */
+static void relay_pump(relay_dir *d) {
+  if (d->reading || d->stopped || d->rd_result < 0) {
+    return;
+  }
+
+  if (d->count == d->nbufs
+      || d->inflight >= d->cx->snap->config.relay_max_inflight) {
+    return;
+  }
+
+  CHECK(0 == uv_read_start(&d->src->handle.stream,
+                           relay_alloc,
+                           relay_read_done));
+  d->reading = 1;
+  conn_timer_reset(d->src);
+}
+
+static void relay_stop(relay_dir *d) {
+  if (d->reading) {
+    uv_read_stop(&d->src->handle.stream);
+    d->reading = 0;
+  }
+}
+
+/* The relay that reads from |c|. */
+static relay_dir *relay_of(conn *c) {
+  client_ctx *cx;
+
+  cx = c->client;
+  return c == &cx->clientconn ? &cx->proxy.up : &cx->proxy.down;
+}
+
+/* Bytes that were read elsewhere, by a hedge, go through the relay as if
+ * they had been read from d->src.
+ */
+static void relay_feed(relay_dir *d, const char *data, size_t len) {
+  uv_buf_t buf;
+  size_t n;
+
+  while (len > 0 && d->count < d->nbufs) {
+    relay_buf(d, &buf);
+    n = len < buf.len ? len : buf.len;
+    memcpy(buf.base, data, n);
+    relay_write(d, buf.base, n);
+    data += n;
+    len -= n;
+  }
+}
+
+static void relay_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  relay_buf(relay_of(CONTAINER_OF(handle, conn, handle)), buf);
+}
+
+/* The next free buffer. */
+static void relay_buf(relay_dir *d, uv_buf_t *buf) {
+  unsigned int chunk;
+  unsigned int slot;
+
+  chunk = d->cx->snap->config.relay_chunk;
+  if (d->slots == NULL) {
+    d->slots = xmalloc(d->nbufs * (sizeof(d->slots[0]) + chunk));
+    d->bufs = (char *) (d->slots + d->nbufs);
+  }
+
+  ASSERT(d->count < d->nbufs);
+  slot = (d->head + d->count) % d->nbufs;
+  buf->base = d->bufs + (size_t) slot * chunk;
+  buf->len = chunk;
+}
+
+static void relay_read_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf) {
+  relay_dir *d;
+
+  if (nread == 0) {
+    return;  /* EAGAIN, the buffer wasn't used. */
+  }
+
+  d = relay_of(CONTAINER_OF(handle, conn, handle));
+  if (nread < 0) {
+    if (nread != UV_EOF) {
+      pr_err("%s error: %s",
+             d == &d->cx->proxy.up ? "client" : "upstream",
+             uv_strerror((int) nread));
+    }
+    d->rd_result = nread;
+    relay_stop(d);
+    do_next(d->cx);
+    return;
+  }
+
+  relay_write(d, buf->base, (size_t) nread);
+  conn_timer_reset(d->src);
+  if (d->stopped
+      || d->count == d->nbufs
+      || d->inflight >= d->cx->snap->config.relay_max_inflight) {
+    relay_stop(d);
+  }
+  do_next(d->cx);
+}
+
+/* Passes |len| bytes just put in the next free buffer on to d->dst. */
+static void relay_write(relay_dir *d, char *data, size_t len) {
+  relay_slot *slot;
+  uv_buf_t out;
+
+  len = proxy_filter(d->cx, d, data, len);
+  if (len == 0) {
+    return;
+  }
+
+  slot = d->slots + (d->head + d->count) % d->nbufs;
+  slot->len = (unsigned int) len;
+  slot->req.data = d;
+  out.base = data;
+  out.len = (unsigned long) len;
+  CHECK(0 == uv_write(&slot->req,
+                      &d->dst->handle.stream,
+                      &out,
+                      1,
+                      relay_write_done));
+  d->count += 1;
+  d->inflight += len;
+  conn_timer_reset(d->dst);
+}
+
+static void relay_write_done(uv_write_t *req, int status) {
+  relay_slot *slot;
+  relay_dir *d;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  d = req->data;
+  if (d->dst->wrstate == c_dead) {
+    return;  /* Completed, but the handle has been closed since. */
+  }
+
+  slot = CONTAINER_OF(req, relay_slot, req);
+  ASSERT(slot == d->slots + d->head);
+  d->head = (d->head + 1) % d->nbufs;
+  d->count -= 1;
+  d->inflight -= slot->len;
+  if (status < 0) {
+    d->wr_result = status;
+  }
+
+  /* Most tunnels are idle most of the time; don't hold buffers for
+   * them.  The next relay_alloc() gets them back.
+   */
+  if (d->count == 0 && d->release) {
+    free(d->slots);
+    d->slots = NULL;
+    d->bufs = NULL;
+    d->head = 0;
+  }
+  do_next(d->cx);
+}
+
+/* Looks at relayed data on its way through.  Returns how much of it to
+ * pass on.
+ */
+static size_t proxy_filter(client_ctx *cx,
+                           relay_dir *d,
+                           char *data,
+                           size_t len) {
+  proxy_metrics *m;
+  proxy_req *pr;
+  int n;
+  int k;
+
+  pr = &cx->proxy;
+  m = &cx->sx->state->proxy;
+  if (pr->tunnel) {
+    if (d == &pr->up) {
+      m->bytes_up += len;
+    } else {
+      m->bytes_down += len;
+    }
+    return len;
+  }
+
+  if (d == &pr->up) {
+    m->bytes_up += len;
+    if (pr->up_remaining >= 0) {
+      pr->up_remaining -= len;
+    }
+    if (pr->up_remaining < 0) {
+      pr->reusable = 0;
+    }
+    return len;
+  }
+
+  if (!pr->responded) {
+    pr->responded = 1;
+    cx->deadline = 0;
+    m->ttfb_us += (uv_hrtime() - pr->start) / 1000;
+    proxy_hedge_cancel(cx);  /* Too late, or this is the hedge's answer. */
+  }
+  m->bytes_down += len;
+
+  n = proxy_resp_feed(&pr->resp, data, len);
+  if (n > 0 && pr->resp.conflict) {
+    k = proxy_resp_strip(&pr->resp, data, (size_t) n);
+    if (k < 0) {
+      d->rd_result = UV_EPROTO;  /* The length is out already, give up. */
+      d->stopped = 1;
+      return 0;
+    }
+    memmove(data + k, data + n, len - n);
+    len -= n - k;
+    n = k;
+  }
+  if (n < 0 || !pr->resp.keepalive) {
+    pr->reusable = 0;
+  } else if ((size_t) n < len) {
+    pr->reusable = 0;  /* Junk after the response, don't pass it on. */
+    len = n;
+  }
+
+  /* The status line tells how the backend did. */
+  if (n < 0 || pr->resp.status != 0) {
+    proxy_report(cx, n < 0 || pr->resp.status >= 500);
+  }
+
+  if (pr->capture != NULL) {
+    proxy_capture(cx, data, len);
+  }
+
+  if (proxy_resp_done(&pr->resp)) {
+    d->stopped = 1;
+  }
+  return len;
+}
+
+/* Tells the route's backend group how the backend did with this
+ * request, once.
+ */
+static void proxy_report(client_ctx *cx, int failed) {
+  proxy_req *pr;
+
+  pr = &cx->proxy;
+  if (pr->reported || pr->backend == NULL) {
+    return;
+  }
+
+  pr->reported = 1;
+  if (failed) {
+    upstream_backend_failed(proxy_group(cx), pr->backend);
+  } else {
+    upstream_backend_sample(proxy_group(cx),
+                            pr->backend,
+                            (uv_hrtime() - pr->sent) / 1000);
+  }
+}
+
+/* Until the response begins, no timer of a request runs past its
+ * deadline.
+ */
+static void conn_timer_reset(conn *c) {
+  client_ctx *cx;
+  uint64_t timeout;
+  uint64_t now;
+
+  timeout = c->idle_timeout;
+  cx = c->client;
+  if (cx != NULL && cx->deadline != 0) {
+    now = uv_now(cx->sx->loop);
+    if (cx->deadline <= now) {
+      timeout = 0;
+    } else if (cx->deadline - now < timeout) {
+      timeout = cx->deadline - now;
+    }
+  }
+
+  CHECK(0 == uv_timer_start(&c->timer_handle, conn_timer_expire, timeout, 0));
+}
+
+/* A deadline is the client's: whichever timer notices it, the request
+ * fails as if the client connection had timed out, so that no state
+ * mistakes it for a slow backend and tries another.
+ */
+static void conn_timer_expire(uv_timer_t *handle, int status) {
+  client_ctx *cx;
+  conn *c;
+
+  //CHECK(0 == status);
+  c = CONTAINER_OF(handle, conn, timer_handle);
+  cx = c->client;
+  if (cx->deadline != 0 && uv_now(cx->sx->loop) >= cx->deadline) {
+    pr_warn("request deadline passed");
+    cx->sx->state->requests.expired += 1;
+    cx->deadline = 0;
+    c = &cx->clientconn;
+  }
+  c->result = UV_ETIMEDOUT;
+  do_next(cx);
+}
+
+/* While a request waits for the threadpool, nothing reads from the
+ * client, so a client that gives up would go unnoticed until the work is
+ * done.  This reads, and drops, whatever arrives until the response
+ * begins, only to see the connection close; the request is then killed
+ * and its work cancelled.  A request is all a connection carries, so
+ * nothing of value is lost.
+ */
+static void conn_watch(conn *c) {
+  if (c->watching) {
+    return;
+  }
+
+  CHECK(0 == uv_read_start(&c->handle.stream,
+                           conn_watch_alloc,
+                           conn_watch_done));
+  c->watching = 1;
+  conn_timer_reset(c);
+}
+
+static void conn_watch_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  static char discard[256];  /* Loop thread only, never read. */
+
+  buf->base = discard;
+  buf->len = sizeof(discard);
+}
+
+static void conn_watch_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf) {
+  conn *c;
+
+  if (nread >= 0) {
+    return;  /* Pipelined bytes, or EAGAIN. */
+  }
+
+  c = CONTAINER_OF(handle, conn, handle);
+  uv_read_stop(&c->handle.stream);
+  c->watching = 0;
+  c->result = nread;
+  c->client->sx->state->requests.gone += 1;
+  do_next(c->client);
+}
+
+static void conn_read(conn *c) {
+  ASSERT(c->rdstate == c_stop);
+  CHECK(0 == uv_read_start(&c->handle.tcp, conn_alloc, conn_read_done));
+  c->rdstate = c_busy;
+  conn_timer_reset(c);
+}
+
+static void conn_read_done(uv_stream_t *handle,
+                           ssize_t nread,
+                           const uv_buf_t *buf) {
+  conn *c;
+
+  c = CONTAINER_OF(handle, conn, handle);
+  ASSERT(c->t.buf + c->rdoff == buf->base);
+  ASSERT(c->rdstate == c_busy);
+  c->rdstate = c_done;
+  c->result = nread;
+
+  uv_read_stop(&c->handle.stream);
+  do_next(c->client);
+}
+
+static void conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  conn *c;
+
+  c = CONTAINER_OF(handle, conn, handle);
+  ASSERT(c->rdstate == c_busy);
+  buf->base = c->t.buf + c->rdoff;
+  buf->len = sizeof(c->t.buf) - c->rdoff;
+}
+
+static void conn_write(conn *c, const void *data, unsigned int len) {
+  uv_buf_t buf;
+
+  /* It's okay to cast away constness here, uv_write() won't modify the
+   * memory.
+   */
+  buf.base = (char *) data;
+  buf.len = len;
+  conn_writev(c, &buf, 1);
+}
+
+/* uv_write() copies |bufs| but not what they point to. */
+static void conn_writev(conn *c, const uv_buf_t *bufs, unsigned int nbufs) {
+  ASSERT(c->wrstate == c_stop || c->wrstate == c_done);
+  if (c == &c->client->clientconn) {
+    c->client->deadline = 0;  /* The response begins, see do_req_parse(). */
+    if (c->watching) {
+      uv_read_stop(&c->handle.stream);
+      c->watching = 0;
+    }
+  }
+  c->wrstate = c_busy;
+  CHECK(0 == uv_write(&c->write_req,
+                      &c->handle.stream,
+                      bufs,
+                      nbufs,
+                      conn_write_done));
+  conn_timer_reset(c);
+}
+
+static void conn_write_done(uv_write_t *req, int status) {
+  conn *c;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  c = CONTAINER_OF(req, conn, write_req);
+  if (c->wrstate == c_dead) {
+    return;  /* Completed, but the handle has been closed since. */
+  }
+
+  ASSERT(c->wrstate == c_busy);
+  c->wrstate = c_done;
+  c->result = status;
+  do_next(c->client);
+}
+
+static void conn_close(conn *c) {
+  ASSERT(c->rdstate != c_dead);
+  ASSERT(c->wrstate != c_dead);
+  c->rdstate = c_dead;
+  c->wrstate = c_dead;
+  c->timer_handle.data = c;
+  c->handle.handle.data = c;
+  uv_close(&c->handle.handle, conn_close_done);
+  uv_close((uv_handle_t *) &c->timer_handle, conn_close_done);
+}
+
+static void conn_close_done(uv_handle_t *handle) {
+  conn *c;
+
+  c = handle->data;
+  do_next(c->client);
+}
+
+/* uv_fs_sendfile() writes to the socket's own descriptor.  There's none
+ * on Windows, where it is a CRT read and write loop anyway, so sendfile
+ * is off there, see snapshot_normalize().
+ */
+static int conn_sendfd(conn *c, uv_file *fd) {
+#if defined(_WIN32)
+  (void) c;
+  (void) fd;
+  return UV_ENOSYS;
+#else
+  uv_os_fd_t osfd;
+  int err;
+
+  err = uv_fileno(&c->handle.handle, &osfd);
+  if (err != 0) {
+    return err;
+  }
+
+  *fd = osfd;
+  return 0;
+#endif
 }
@@ -1,34 +1,45 @@
 #include "http_parser.h"
+#include <stdio.h>
+#include <string.h>
 
 
+/* Incremental parser for the request head.  |parser->next| points at the
+ * first byte that hasn't been looked at yet, |size| is the number of new
+ * bytes available from there on.  All pointers stored in |parser| point
+ * into the caller's buffer, which must stay put until the head is complete.
+ *
+ * Returns http_ok when more data is needed and http_exec_cmd once the
+ * blank line that ends the head has been seen.  |parser->next| then points
+ * at the first byte of the body, if any.
+ */
 int http_parse(http_ctx *parser, uint8_t *data, size_t size) {
 
-	char *cur_attr = parser->curattr;
-	size_t curr_attr_len = parser->curattrlen;
-	char *cur_val = parser->curval;
-	char *cur_val_len = parser->curvallen;
-
 	size_t remain = size;
 
 	int status = parser->status;
 
 	int err = http_ok;
 
+	http_header *h;
+	size_t len;
+
 	char *p = (char*)parser->next;
+	(void)data;
 	while (remain > 0
 		&& err == http_ok) {
 
 		switch (status)
 		{
-		case ps_init: // ʼmethod
-			parser->curattr = p;
-			parser->curattrlen = 0;
+		case ps_init: // start of the request line
+			if (p[0] == '\r' || p[0] == '\n') {
+				// tolerate empty lines in front of the request
+				break;
+			}
 
-			// http Э: УϢͷ
-			// аmethod uri version
 			status = ps_method;
 			parser->method = p;
 			parser->methodlen = 0;
+			parser->nheaders = 0;
 			// break;
 		case ps_method:
 			if (p[0] == ' ') {
@@ -39,7 +50,6 @@ int http_parse(http_ctx *parser, uint8_t *data, size_t size) {
 					break;
 				}
 
-				// ʼ:-uri
 				status = ps_uri;
 				parser->uri = p+1;
 				parser->urilen = 0;
@@ -57,60 +67,120 @@ int http_parse(http_ctx *parser, uint8_t *data, size_t size) {
 					break;
 				}
 
-				// ֱӸuriִ
-				// ʼ:-version
-				// status = ps_version;
-				err = http_exec_cmd;
-
+				status = ps_version;
 				parser->ver = p+1;
 				parser->verlen = 0;
 				break;
 			}
 
+			if (p[0] == '\r' || p[0] == '\n') {
+
+				err = http_bad_uri;
+				break;
+			}
+
 			parser->urilen++;
 			break;
-		case ps_attr: // attr
-			if (p[0] == '\r' || p[0] == '\n')
-			{
-				// ˵Ҫ¼attrval
-				status = ps_init;
+		case ps_version_cr: // a CR must be followed by LF
+			if (p[0] != '\n') {
+
+				err = http_bad_version;
+				break;
+			}
+			// break;
+		case ps_version:
+			if (p[0] == '\r') {
+				status = ps_version_cr;
+				break;
+			}
+			if (p[0] == '\n') {
+
+				if (parser->verlen == 0) {
+
+					err = http_bad_version;
+					break;
+				}
 
-				parser->curattr = p;
+				// the header fields follow
+				status = ps_attr;
+				parser->curattr = p + 1;
 				parser->curattrlen = 0;
 				break;
 			}
-			if (p[0] == ' ' || p[0] == '\t')
+
+			parser->verlen++;
+			break;
+		case ps_attr_cr: // a CR must be followed by LF
+			if (p[0] != '\n') {
+
+				err = http_bad_header;
+				break;
+			}
+			// break;
+		case ps_attr: // header name
+			if (p[0] == '\r') {
+				status = ps_attr_cr;
+				break;
+			}
+			if (p[0] == '\n')
 			{
+				// an empty line ends the request head
+				err = parser->curattrlen == 0 ? http_exec_cmd : http_bad_header;
 				break;
 			}
 			if (p[0] == ':')
 			{
-				// ˵ʼתval
-				status = ps_value;
+				if (parser->curattrlen == 0) {
 
+					err = http_bad_header;
+					break;
+				}
+
+				status = ps_value;
 				parser->curval = p + 1;
 				parser->curvallen = 0;
 				break;
 			}
+			if (p[0] == ' ' || p[0] == '\t')
+			{
+				// no whitespace in names, and no obsolete line folding
+				err = http_bad_header;
+				break;
+			}
 			parser->curattrlen++;
 			break;
-		case ps_value: // val;
+		case ps_value: // header value
+			if (parser->curvallen == 0 && (p[0] == ' ' || p[0] == '\t')) {
+				// skip leading whitespace
+				parser->curval = p + 1;
+				break;
+			}
 
-			if (p[0] == '\r' || p[0] == '\n')
+			if (p[0] == '\n')
 			{
-				// ˵valueϣ
-				// ֶ
-				if (memcpy(parser->curattr, "URI", parser->curattrlen)) {
+				if (parser->nheaders == HTTP_MAX_HEADERS) {
 
-					parser->uri = parser->curval;
-					parser->urilen = parser->curvallen;
+					err = http_too_many_headers;
+					break;
+				}
 
-					err = http_exec_cmd;
+				// drop the trailing CR and whitespace
+				len = parser->curvallen;
+				while (len > 0
+					&& (parser->curval[len - 1] == '\r'
+						|| parser->curval[len - 1] == ' '
+						|| parser->curval[len - 1] == '\t')) {
+					len--;
 				}
 
-				// ¼attrval
-				status = ps_init;
-				parser->curattr = p;
+				h = &parser->headers[parser->nheaders++];
+				h->name = parser->curattr;
+				h->namelen = parser->curattrlen;
+				h->value = parser->curval;
+				h->valuelen = len;
+
+				status = ps_attr;
+				parser->curattr = p + 1;
 				parser->curattrlen = 0;
 				break;
 			}
@@ -128,3 +198,149 @@ int http_parse(http_ctx *parser, uint8_t *data, size_t size) {
 	return err;
 }
 
+
+/* Case-insensitive comparison of |len| bytes at |s| with |token|. */
+int http_token_eq(const char *s, size_t len, const char *token) {
+
+	size_t i;
+	int a, b;
+
+	for (i = 0; i < len; i++) {
+
+		a = (unsigned char)s[i];
+		b = (unsigned char)token[i];
+		if (b == '\0') {
+			return 0;
+		}
+		if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+		if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+		if (a != b) {
+			return 0;
+		}
+	}
+
+	return token[len] == '\0';
+}
+
+
+/* Returns the value of the first header called |name| and stores its
+ * length in |len|, or returns NULL if the request doesn't have it.
+ */
+const char *http_header_find(const http_ctx *parser, const char *name, size_t *len) {
+
+	int i;
+
+	for (i = 0; i < parser->nheaders; i++) {
+
+		if (http_token_eq(parser->headers[i].name, parser->headers[i].namelen, name)) {
+
+			*len = parser->headers[i].valuelen;
+			return parser->headers[i].value;
+		}
+	}
+
+	return NULL;
+}
+
+
+static const char *const wdays[] = {
+	"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"  // 1970-01-01 was a Thursday
+};
+
+static const char *const months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+/* Formats |t| (seconds since the epoch) as an IMF-fixdate, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT".  Doesn't depend on the C library's
+ * notion of time zones and is safe to call from any thread.
+ */
+int http_date_format(int64_t t, char *buf, size_t len) {
+
+	int64_t days = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+	int64_t secs = t - days * 86400;
+	int64_t z, era, doe, yoe, doy, mp, y, m, d;
+
+	// civil_from_days(), after Howard Hinnant
+	z = days + 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y += m <= 2;
+
+	return snprintf(buf, len, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		wdays[((days % 7) + 7) % 7],
+		(int)d,
+		months[m - 1],
+		(int)y,
+		(int)(secs / 3600),
+		(int)(secs / 60 % 60),
+		(int)(secs % 60));
+}
+
+
+static int parse_num(const char *s, int n, int *v) {
+
+	int i;
+
+	*v = 0;
+	for (i = 0; i < n; i++) {
+
+		if (s[i] < '0' || s[i] > '9') {
+			return -1;
+		}
+		*v = *v * 10 + (s[i] - '0');
+	}
+
+	return 0;
+}
+
+
+/* Parses an IMF-fixdate.  The obsolete RFC 850 and asctime() formats
+ * aren't supported; a date we can't parse is treated as absent.
+ */
+int http_date_parse(const char *s, size_t len, int64_t *t) {
+
+	int d, m, y, hh, mm, ss;
+	int64_t era, yoe, doy, doe;
+
+	// "Sun, 06 Nov 1994 08:49:37 GMT"
+	if (len != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' '
+		|| s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':'
+		|| memcmp(s + 25, " GMT", 4) != 0) {
+		return -1;
+	}
+
+	for (m = 0; m < 12; m++) {
+		if (memcmp(s + 8, months[m], 3) == 0) {
+			break;
+		}
+	}
+
+	if (m == 12
+		|| parse_num(s + 5, 2, &d)
+		|| parse_num(s + 12, 4, &y)
+		|| parse_num(s + 17, 2, &hh)
+		|| parse_num(s + 20, 2, &mm)
+		|| parse_num(s + 23, 2, &ss)) {
+		return -1;
+	}
+
+	// days_from_civil()
+	m += 1;
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	*t = (era * 146097 + doe - 719468) * 86400 + hh * 3600 + mm * 60 + ss;
+	return 0;
+}
@@ -11,6 +11,8 @@
   V(-3, bad_atyp, "Bad address type.")                                        \
   V(-4, bad_method, "Bad http method.")                                        \
   V(-5, bad_uri, "Bad http uri.")                                        \
+  V(-6, bad_header, "Bad http header.")                                        \
+  V(-7, too_many_headers, "Too many http headers.")                                        \
   V(0, ok, "No error.")                                                       \
   V(1, exec_cmd, "Execute command.")											\
 
@@ -30,9 +32,22 @@ typedef enum {
 	ps_version, 
 	ps_attr,
 	ps_value,
+	ps_version_cr,  // seen the CR of the request line's CRLF
+	ps_attr_cr,  // seen a CR where a header name starts
 }parse_status;
 
 
+#define HTTP_MAX_HEADERS 32
+
+/* A header field, pointing into the request buffer.  Not NUL terminated.
+*/
+typedef struct {
+	char *name;
+	size_t namelen;
+	char *value;
+	size_t valuelen;
+} http_header;
+
 /* define for http header
 */
 typedef struct {
@@ -45,6 +60,9 @@ typedef struct {
 	char *ver;
 	int verlen;
 
+	http_header headers[HTTP_MAX_HEADERS];
+	int nheaders;
+
 
 	/* for parse*/
 	char *curattr;
@@ -58,5 +76,9 @@ typedef struct {
 }http_ctx;
 
 int http_parse(http_ctx *parser, uint8_t *data, size_t size);
+const char *http_header_find(const http_ctx *parser, const char *name, size_t *len);
+int http_token_eq(const char *s, size_t len, const char *token);
+int http_date_format(int64_t t, char *buf, size_t len);
+int http_date_parse(const char *s, size_t len, int64_t *t);
 
 #endif // HTTP_PARSER_H_
\ No newline at end of file
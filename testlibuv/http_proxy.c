@@ -0,0 +1,441 @@
+#include "defs.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int head_append(char *buf, size_t len, size_t *n, const char *fmt, ...);
+static int hop_by_hop(const http_header *h);
+static int resp_line(proxy_resp *r);
+static int resp_header(proxy_resp *r);
+static int line_has(const char *s, size_t len, const char *token);
+
+/* Where proxy_resp_feed() is in the response. */
+enum {
+  rs_status,      /* In the status line. */
+  rs_header,      /* In a header line. */
+  rs_body,        /* In a Content-Length body. */
+  rs_chunk_size,  /* In a chunk size line. */
+  rs_chunk_data,  /* In chunk data. */
+  rs_chunk_end,   /* In the CRLF after chunk data. */
+  rs_trailer,     /* In the trailer section. */
+  rs_eof,         /* Body runs until the backend closes. */
+  rs_done         /* Response complete. */
+};
+
+/* Headers that only apply to the connection they arrive on.  The upstream
+ * connection gets its own Connection header.
+ */
+static const char *const hop_headers[] = {
+  "Connection",
+  "Keep-Alive",
+  "Proxy-Connection",
+  "TE",
+  "Trailer",
+  "Upgrade",
+};
+
+/* Rebuilds the request head for the upstream.  Hop-by-hop headers are
+ * dropped, the upstream is asked to close the connection after one
+ * response unless |keepalive| is set, and |client| is appended to
+ * X-Forwarded-For.  Transfer-Encoding and Content-Length go through
+ * unchanged and the body is relayed as is; a request with both never gets
+ * here, see proxy_body_length().  Returns the length of the head, or -1
+ * if it doesn't fit in |buf|.
+ */
+int proxy_request_head(const http_ctx *parser,
+                       const char *client,
+                       int keepalive,
+                       char *buf,
+                       size_t len) {
+  const http_header *xff;
+  const http_header *h;
+  size_t n;
+  int err;
+  int i;
+
+  n = 0;
+  err = head_append(buf,
+                    len,
+                    &n,
+                    "%.*s %.*s HTTP/1.1\r\n",
+                    parser->methodlen,
+                    parser->method,
+                    parser->urilen,
+                    parser->uri);
+
+  xff = NULL;
+  for (i = 0; i < parser->nheaders && err == 0; i += 1) {
+    h = parser->headers + i;
+    if (hop_by_hop(h)) {
+      continue;
+    }
+
+    if (http_token_eq(h->name, h->namelen, "X-Forwarded-For")) {
+      xff = h;
+      continue;
+    }
+
+    err = head_append(buf,
+                      len,
+                      &n,
+                      "%.*s: %.*s\r\n",
+                      (int) h->namelen,
+                      h->name,
+                      (int) h->valuelen,
+                      h->value);
+  }
+
+  if (err == 0) {
+    err = head_append(buf,
+                      len,
+                      &n,
+                      "X-Forwarded-For: %.*s%s%s\r\n"
+                      "%s"
+                      "\r\n",
+                      xff != NULL ? (int) xff->valuelen : 0,
+                      xff != NULL ? xff->value : "",
+                      xff != NULL ? ", " : "",
+                      client,
+                      keepalive ? "" : "Connection: close\r\n");
+  }
+
+  return err == 0 ? (int) n : -1;
+}
+
+void proxy_resp_init(proxy_resp *r, int head_request) {
+  memset(r, 0, sizeof(*r));
+  r->state = rs_status;
+  r->head_request = head_request;
+  r->length = -1;
+}
+
+/* Feeds |len| bytes of response to the tracker.  Returns how many of them
+ * belong to the response; that's less than |len| only once the response
+ * is complete and the backend sent more than it should have.  Returns -1
+ * if the response can't be framed, which also clears r->keepalive.
+ */
+int proxy_resp_feed(proxy_resp *r, const char *data, size_t len) {
+  uint64_t n;
+  size_t i;
+  int prev;
+  int c;
+
+  i = 0;
+  while (i < len) {
+    switch (r->state) {
+      case rs_body:
+      case rs_chunk_data:
+        n = len - i;
+        if (n > r->left) {
+          n = r->left;
+        }
+        i += (size_t) n;
+        r->left -= n;
+        if (r->left == 0) {
+          r->state = r->state == rs_body ? rs_done : rs_chunk_end;
+        }
+        continue;
+      case rs_eof:
+        r->fed += len;
+        return (int) len;
+      case rs_done:
+        r->fed += i;
+        return (int) i;
+    }
+
+    /* Everything else is line based. */
+    c = data[i++];
+    if (c != '\n') {
+      if (r->linelen < sizeof(r->line) - 1) {
+        r->line[r->linelen++] = (char) c;
+      }
+      continue;
+    }
+
+    if (r->linelen > 0 && r->line[r->linelen - 1] == '\r') {
+      r->linelen -= 1;
+    }
+    r->line[r->linelen] = '\0';
+    prev = r->state;
+    if (resp_line(r)) {
+      r->keepalive = 0;
+      r->state = rs_eof;
+      return -1;
+    }
+    r->linelen = 0;
+
+    if (prev == rs_header && r->state == rs_status) {
+      r->head_start = r->fed + i;  /* Past an interim response. */
+    } else if (prev == rs_header && r->state != rs_header) {
+      r->head_end = r->fed + i;
+    }
+  }
+
+  r->fed += len;
+  return (int) len;
+}
+
+int proxy_resp_done(const proxy_resp *r) {
+  return r->state == rs_done;
+}
+
+/* Bytes left in a Content-Length body, 0 anywhere else.  Those can be
+ * relayed without looking at them.
+ */
+uint64_t proxy_resp_body_left(const proxy_resp *r) {
+  return r->state == rs_body ? r->left : 0;
+}
+
+/* Accounts for |n| body bytes that were relayed without being fed. */
+void proxy_resp_skip(proxy_resp *r, uint64_t n) {
+  ASSERT(r->state == rs_body && n <= r->left);
+  r->left -= n;
+  r->fed += n;
+  if (r->left == 0) {
+    r->state = rs_done;
+  }
+}
+
+/* Squeezes the Content-Length lines out of a head that came with
+ * Transfer-Encoding too, so that nobody downstream goes by the length.
+ * |data| holds the |len| bytes just fed.  Returns their new length, or -1
+ * if the head started in an earlier feed, which has been passed on as is.
+ */
+int proxy_resp_strip(proxy_resp *r, char *data, size_t len) {
+  const char *colon;
+  const char *eol;
+  uint64_t base;
+  size_t start;
+  size_t end;
+  size_t i;
+  size_t w;
+
+  base = r->fed - len;
+  if (!r->conflict || r->head_end <= base) {
+    return (int) len;  /* Not this part of the response. */
+  }
+  if (r->head_start < base) {
+    return -1;
+  }
+
+  start = (size_t) (r->head_start - base);
+  end = (size_t) (r->head_end - base);
+  for (i = start, w = start; i < end; i = eol + 1 - data) {
+    eol = memchr(data + i, '\n', end - i);
+    colon = memchr(data + i, ':', eol - (data + i));
+    if (i == start ||
+        colon == NULL ||
+        !http_token_eq(data + i, colon - (data + i), "Content-Length")) {
+      memmove(data + w, data + i, eol + 1 - (data + i));
+      w += eol + 1 - (data + i);
+    }
+  }
+
+  memmove(data + w, data + end, len - end);
+  r->head_end -= end - w;
+  r->fed -= end - w;
+  return (int) (len - (end - w));
+}
+
+int proxy_stats(const proxy_metrics *m, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "proxy_requests %llu\n"
+                  "proxy_errors %llu\n"
+                  "proxy_resolve_us %llu\n"
+                  "proxy_connect_us %llu\n"
+                  "proxy_ttfb_us %llu\n"
+                  "proxy_bytes_up %llu\n"
+                  "proxy_bytes_down %llu\n"
+                  "proxy_splices %llu\n"
+                  "proxy_bytes_spliced %llu\n"
+                  "proxy_tunnels %llu\n"
+                  "proxy_tunnels_active %llu\n"
+                  "proxy_tunnels_refused %llu\n",
+                  (unsigned long long) m->requests,
+                  (unsigned long long) m->errors,
+                  (unsigned long long) m->resolve_us,
+                  (unsigned long long) m->connect_us,
+                  (unsigned long long) m->ttfb_us,
+                  (unsigned long long) m->bytes_up,
+                  (unsigned long long) m->bytes_down,
+                  (unsigned long long) m->splices,
+                  (unsigned long long) m->bytes_spliced,
+                  (unsigned long long) m->tunnels,
+                  (unsigned long long) m->tunnels_active,
+                  (unsigned long long) m->tunnels_refused);
+}
+
+/* Handles a complete line of the response head or chunk framing. */
+static int resp_line(proxy_resp *r) {
+  char *end;
+
+  switch (r->state) {
+    case rs_status:
+      if (r->linelen < 12 || 0 != memcmp(r->line, "HTTP/1.", 7)) {
+        return -1;
+      }
+      r->keepalive = r->line[7] == '1';
+      r->status = (int) strtol(r->line + 9, &end, 10);
+      r->state = rs_header;
+      return 0;
+
+    case rs_header:
+      if (r->linelen > 0) {
+        return resp_header(r);
+      }
+
+      /* End of the head.  Interim responses are followed by another. */
+      if (r->status >= 100 && r->status < 200 && r->status != 101) {
+        r->state = rs_status;
+        r->chunked = 0;
+        r->coded = 0;
+        r->length = -1;
+        return 0;
+      }
+
+      /* Transfer-Encoding overrides Content-Length (RFC 9112, 6.3).  A
+       * backend that sends both is broken or being played, so the length
+       * is dropped on the way through, see proxy_resp_strip(), and the
+       * connection isn't trusted with another request.
+       */
+      if (r->coded && r->length != -1) {
+        r->conflict = 1;
+        r->length = -1;
+        r->keepalive = 0;
+      }
+
+      if (r->status == 101) {
+        r->keepalive = 0;
+        r->state = rs_eof;  /* Protocol switch, relay until closed. */
+      } else if (r->head_request || r->status == 204 || r->status == 304) {
+        r->state = rs_done;
+      } else if (r->chunked) {
+        r->state = rs_chunk_size;
+      } else if (r->length > 0) {
+        r->left = (uint64_t) r->length;
+        r->state = rs_body;
+      } else if (r->length == 0) {
+        r->state = rs_done;
+      } else {
+        r->keepalive = 0;
+        r->state = rs_eof;
+      }
+      return 0;
+
+    case rs_chunk_size:
+      r->left = strtoull(r->line, &end, 16);
+      if (end == r->line) {
+        return -1;
+      }
+      r->state = r->left == 0 ? rs_trailer : rs_chunk_data;
+      return 0;
+
+    case rs_chunk_end:
+      if (r->linelen != 0) {
+        return -1;
+      }
+      r->state = rs_chunk_size;
+      return 0;
+
+    case rs_trailer:
+      if (r->linelen == 0) {
+        r->state = rs_done;
+      }
+      return 0;
+  }
+
+  UNREACHABLE();
+  return -1;
+}
+
+/* Picks the framing out of a response header line. */
+static int resp_header(proxy_resp *r) {
+  char *value;
+  char *end;
+  size_t namelen;
+
+  value = strchr(r->line, ':');
+  if (value == NULL) {
+    return -1;
+  }
+  namelen = value - r->line;
+  value += 1;
+  while (*value == ' ' || *value == '\t') {
+    value += 1;
+  }
+
+  if (http_token_eq(r->line, namelen, "Content-Length")) {
+    if (r->length != -1) {
+      return -1;  /* Conflicting lengths are a smuggling vector. */
+    }
+    r->length = (int64_t) strtoull(value, &end, 10);
+    if (end == value) {
+      return -1;
+    }
+  } else if (http_token_eq(r->line, namelen, "Transfer-Encoding")) {
+    r->coded = 1;
+    r->chunked = line_has(value, strlen(value), "chunked");
+    if (!r->chunked) {
+      r->keepalive = 0;  /* Some other coding, only EOF ends the body. */
+    }
+  } else if (http_token_eq(r->line, namelen, "Connection")) {
+    if (line_has(value, strlen(value), "close")) {
+      r->keepalive = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* Looks for |token| in a comma separated list. */
+static int line_has(const char *s, size_t len, const char *token) {
+  size_t i;
+  size_t j;
+
+  i = 0;
+  while (i < len) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+      i += 1;
+    }
+    j = i;
+    while (j < len && s[j] != ',' && s[j] != ' ' && s[j] != '\t') {
+      j += 1;
+    }
+    if (j > i && http_token_eq(s + i, j - i, token)) {
+      return 1;
+    }
+    i = j;
+  }
+
+  return 0;
+}
+
+static int head_append(char *buf, size_t len, size_t *n, const char *fmt, ...) {
+  va_list ap;
+  int r;
+
+  va_start(ap, fmt);
+  r = vsnprintf(buf + *n, len - *n, fmt, ap);
+  va_end(ap);
+
+  if (r < 0 || (size_t) r >= len - *n) {
+    return -1;
+  }
+
+  *n += r;
+  return 0;
+}
+
+static int hop_by_hop(const http_header *h) {
+  unsigned int i;
+
+  for (i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i += 1) {
+    if (http_token_eq(h->name, h->namelen, hop_headers[i])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
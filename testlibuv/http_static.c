@@ -0,0 +1,817 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int hex_digit(int c);
+static int device_name(const char *seg, size_t len);
+static int etag_match(const char *list, size_t len, const char *etag);
+static int range_number(const char *s, size_t len, size_t *i, uint64_t *n);
+static void coding_fields(char *buf,
+                          size_t len,
+                          const char *type,
+                          content_encoding encoding);
+static const char *vary_field(const char *type);
+static void static_watch_event(uv_fs_event_t *handle,
+                               const char *filename,
+                               int events,
+                               int status);
+static void static_watch_close_done(uv_handle_t *handle);
+
+static const struct {
+  const char *ext;
+  const char *type;
+} mime_types[] = {
+  { "html", "text/html; charset=utf-8" },
+  { "htm",  "text/html; charset=utf-8" },
+  { "css",  "text/css; charset=utf-8" },
+  { "js",   "application/javascript; charset=utf-8" },
+  { "json", "application/json" },
+  { "txt",  "text/plain; charset=utf-8" },
+  { "xml",  "application/xml" },
+  { "svg",  "image/svg+xml" },
+  { "png",  "image/png" },
+  { "jpg",  "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif",  "image/gif" },
+  { "ico",  "image/x-icon" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "wasm", "application/wasm" },
+  { "mp4",  "video/mp4" },
+  { "pdf",  "application/pdf" },
+};
+
+/* Indexed by content_encoding. */
+static const struct {
+  const char *name;
+  const char *suffix;  /* Of precompressed siblings. */
+} encodings[] = {
+  { "identity", "" },
+  { "gzip", ".gz" },
+  { "br", ".br" },
+};
+
+/* Maps the request URI to a file below |route->root| and writes the result
+ * to |path|.  The URI is normalized first: the query string is dropped,
+ * percent escapes are decoded, empty and "." segments are skipped and ".."
+ * removes the previous segment.  A ".." that would climb out of the root is
+ * a traversal attempt and is rejected with UV_EACCES.
+ *
+ * Decoded slashes, backslashes, colons and NUL bytes are rejected outright,
+ * as are segments with trailing dots or spaces and the names of Windows
+ * devices (CON, NUL, COM1 and so on, with any extension); Windows would
+ * otherwise reinterpret them as separators, drive letters, alternate data
+ * streams, aliases of other names or devices.
+ */
+int static_path(const route_config *route,
+                const char *uri,
+                size_t urilen,
+                char *path,
+                size_t pathlen) {
+  size_t prefixlen;
+  size_t rootlen;
+  size_t seg;
+  size_t len;
+  size_t n;
+  size_t i;
+  int dir;
+  int hi;
+  int lo;
+  int c;
+
+  prefixlen = strlen(route->prefix);
+  rootlen = strlen(route->root);
+  ASSERT(urilen >= prefixlen);
+
+  if (rootlen >= pathlen) {
+    return UV_ENAMETOOLONG;
+  }
+  memcpy(path, route->root, rootlen);
+  n = rootlen;
+  dir = 1;
+
+  i = prefixlen;
+  while (i < urilen && uri[i] != '?' && uri[i] != '#') {
+    if (uri[i] == '/') {
+      dir = 1;
+      i += 1;
+      continue;
+    }
+
+    seg = n;
+    if (n + 1 >= pathlen) {
+      return UV_ENAMETOOLONG;
+    }
+    path[n++] = '/';
+
+    while (i < urilen && uri[i] != '/' && uri[i] != '?' && uri[i] != '#') {
+      c = (unsigned char) uri[i++];
+      if (c == '%') {
+        if (i + 2 > urilen ||
+            (hi = hex_digit(uri[i])) < 0 ||
+            (lo = hex_digit(uri[i + 1])) < 0) {
+          return UV_EINVAL;
+        }
+        c = hi * 16 + lo;
+        i += 2;
+      }
+
+      if (c == '\0' || c == '/' || c == '\\' || c == ':') {
+        return UV_EINVAL;
+      }
+
+      if (n + 1 >= pathlen) {
+        return UV_ENAMETOOLONG;
+      }
+      path[n++] = (char) c;
+    }
+
+    dir = 0;
+    len = n - seg - 1;
+    if (len == 1 && path[seg + 1] == '.') {
+      n = seg;
+      dir = 1;
+      continue;
+    }
+
+    if (len == 2 && path[seg + 1] == '.' && path[seg + 2] == '.') {
+      if (seg == rootlen) {
+        return UV_EACCES;  /* Would escape the document root. */
+      }
+      n = seg;
+      do {
+        n -= 1;
+      } while (path[n] != '/');
+      dir = 1;
+      continue;
+    }
+
+    if (path[n - 1] == '.' || path[n - 1] == ' ') {
+      return UV_EINVAL;
+    }
+
+    if (device_name(path + seg + 1, len)) {
+      return UV_EINVAL;
+    }
+  }
+
+  if (dir) {
+    if (n + sizeof("/index.html") > pathlen) {
+      return UV_ENAMETOOLONG;
+    }
+    memcpy(path + n, "/index.html", sizeof("/index.html") - 1);
+    n += sizeof("/index.html") - 1;
+  }
+
+  path[n] = '\0';
+  return 0;
+}
+
+const char *static_mime_type(const char *path) {
+  const char *ext;
+  unsigned int i;
+
+  ext = strrchr(path, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL) {
+    return "application/octet-stream";
+  }
+  ext += 1;
+
+  for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i += 1) {
+    if (0 == _stricmp(ext, mime_types[i].ext)) {
+      return mime_types[i].type;
+    }
+  }
+
+  return "application/octet-stream";
+}
+
+/* Worth compressing: text and the structured formats that are mostly
+ * text.  Images, video and fonts are compressed already.
+ */
+int static_compressible(const char *type) {
+  return 0 == strncmp(type, "text/", 5) ||
+         NULL != strstr(type, "json") ||
+         NULL != strstr(type, "javascript") ||
+         NULL != strstr(type, "xml") ||
+         0 == strcmp(type, "application/wasm");
+}
+
+const char *static_encoding_suffix(content_encoding encoding) {
+  return encodings[encoding].suffix;
+}
+
+/* Parses Accept-Encoding into a mask of 1 << content_encoding.  Codings
+ * with q=0 are refused; "*" stands for everything not listed otherwise.
+ */
+unsigned int static_accept_encoding(const http_ctx *parser) {
+  const char *value;
+  unsigned int listed;
+  unsigned int mask;
+  unsigned int bit;
+  size_t namelen;
+  size_t len;
+  size_t i;
+  size_t j;
+  int star;
+  int e;
+  int q;
+
+  value = http_header_find(parser, "Accept-Encoding", &len);
+  if (value == NULL) {
+    return 0;
+  }
+
+  mask = 0;
+  listed = 0;
+  star = 0;
+  i = 0;
+  while (i < len) {
+    while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+      i += 1;
+    }
+
+    j = i;
+    while (j < len && value[j] != ',' && value[j] != ';' &&
+           value[j] != ' ' && value[j] != '\t') {
+      j += 1;
+    }
+    namelen = j - i;
+
+    /* Only q=0 matters, anything else is as good as q=1 to us. */
+    q = 1;
+    while (j < len && value[j] != ',') {
+      if (value[j] == '=' && j + 1 < len) {
+        q = 0;
+        for (j += 1; j < len && value[j] != ','; j += 1) {
+          if (value[j] >= '1' && value[j] <= '9') {
+            q = 1;
+          }
+        }
+        break;
+      }
+      j += 1;
+    }
+
+    if (namelen == 1 && value[i] == '*') {
+      star = q ? 1 : -1;
+    }
+
+    for (e = enc_gzip; e <= enc_br; e += 1) {
+      if (http_token_eq(value + i, namelen, encodings[e].name)) {
+        bit = 1u << e;
+        listed |= bit;
+        if (q) {
+          mask |= bit;
+        }
+      }
+    }
+
+    i = j;
+  }
+
+  if (star > 0) {
+    mask |= ~listed & ((1u << enc_gzip) | (1u << enc_br));
+  }
+
+  return mask;
+}
+
+/* Formats the response header for a |size| byte file into |buf|. */
+int static_head(char *buf,
+                size_t len,
+                const char *type,
+                content_encoding encoding,
+                uint64_t size,
+                const file_validator *v) {
+  char coding[80];
+  char date[32];
+
+  coding_fields(coding, sizeof(coding), type, encoding);
+  http_date_format(v->mtime, date, sizeof(date));
+  return snprintf(buf,
+                  len,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %llu\r\n"
+                  "%s"
+                  "Accept-Ranges: bytes\r\n"
+                  "%s%s%s"
+                  "Last-Modified: %s\r\n"
+                  "Connection: close\r\n"
+                  "\r\n",
+                  type,
+                  (unsigned long long) size,
+                  coding,
+                  v->etag[0] != '\0' ? "ETag: " : "",
+                  v->etag,
+                  v->etag[0] != '\0' ? "\r\n" : "",
+                  date);
+}
+
+/* Formats the 206 header.  With a |boundary|, the body is a multipart/
+ * byteranges message of |bodylen| bytes, otherwise it's the single range
+ * |r|.
+ */
+int static_head_range(char *buf,
+                      size_t len,
+                      const char *type,
+                      content_encoding encoding,
+                      uint64_t size,
+                      const file_validator *v,
+                      const byte_range *r,
+                      uint64_t bodylen,
+                      const char *boundary) {
+  char ctype[80];
+  char coding[80];
+  char range[80];
+  char date[32];
+
+  coding_fields(coding, sizeof(coding), type, encoding);
+  if (boundary != NULL) {
+    snprintf(ctype,
+             sizeof(ctype),
+             "multipart/byteranges; boundary=%s",
+             boundary);
+    range[0] = '\0';
+  } else {
+    snprintf(ctype, sizeof(ctype), "%s", type);
+    snprintf(range,
+             sizeof(range),
+             "Content-Range: bytes %llu-%llu/%llu\r\n",
+             (unsigned long long) r->first,
+             (unsigned long long) r->last,
+             (unsigned long long) size);
+    bodylen = r->last - r->first + 1;
+  }
+
+  http_date_format(v->mtime, date, sizeof(date));
+  return snprintf(buf,
+                  len,
+                  "HTTP/1.1 206 Partial Content\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %llu\r\n"
+                  "%s"
+                  "%s"
+                  "%s%s%s"
+                  "Last-Modified: %s\r\n"
+                  "Connection: close\r\n"
+                  "\r\n",
+                  ctype,
+                  (unsigned long long) bodylen,
+                  coding,
+                  range,
+                  v->etag[0] != '\0' ? "ETag: " : "",
+                  v->etag,
+                  v->etag[0] != '\0' ? "\r\n" : "",
+                  date);
+}
+
+/* Formats the delimiter and header of one part of a multipart/byteranges
+ * body.  Pass a NULL |buf| to get the length only.
+ */
+int static_part_head(char *buf,
+                     size_t len,
+                     const char *type,
+                     uint64_t size,
+                     const byte_range *r,
+                     const char *boundary) {
+  return snprintf(buf,
+                  len,
+                  "\r\n--%s\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Range: bytes %llu-%llu/%llu\r\n"
+                  "\r\n",
+                  boundary,
+                  type,
+                  (unsigned long long) r->first,
+                  (unsigned long long) r->last,
+                  (unsigned long long) size);
+}
+
+/* Content-Length of the multipart body, closing delimiter included. */
+uint64_t static_multipart_length(const char *type,
+                                 uint64_t size,
+                                 const byte_range *ranges,
+                                 unsigned int nranges,
+                                 const char *boundary) {
+  uint64_t n;
+  unsigned int i;
+
+  n = 0;
+  for (i = 0; i < nranges; i += 1) {
+    n += static_part_head(NULL, 0, type, size, ranges + i, boundary);
+    n += ranges[i].last - ranges[i].first + 1;
+  }
+
+  return n + strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
+}
+
+int static_unsatisfiable(char *buf, size_t len, uint64_t size) {
+  return snprintf(buf,
+                  len,
+                  "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                  "Content-Range: bytes */%llu\r\n"
+                  "Content-Length: 0\r\n"
+                  "Connection: close\r\n"
+                  "\r\n",
+                  (unsigned long long) size);
+}
+
+/* Parses a Range header against a |size| byte file.  Returns the number of
+ * ranges stored in |ranges|, 0 if the header should be ignored and the
+ * whole file sent, or -1 if none of the ranges can be satisfied.
+ *
+ * Headers we don't understand are ignored, as RFC 7233 asks.  So are
+ * requests for more than |max| ranges; overlapping and excessive ranges
+ * are a known way to make servers do a lot of work for a small request.
+ */
+int static_ranges(const char *value,
+                  size_t len,
+                  uint64_t size,
+                  byte_range *ranges,
+                  unsigned int max) {
+  uint64_t first;
+  uint64_t last;
+  unsigned int n;
+  size_t i;
+  int suffix;
+
+  if (len < 6 || !http_token_eq(value, 5, "bytes") || value[5] != '=') {
+    return 0;
+  }
+
+  if (size == 0) {
+    return 0;
+  }
+
+  n = 0;
+  i = 6;
+  for (;;) {
+    while (i < len && (value[i] == ' ' || value[i] == '\t')) {
+      i += 1;
+    }
+
+    suffix = i < len && value[i] == '-';
+    if (suffix) {
+      i += 1;
+      if (range_number(value, len, &i, &last)) {
+        return 0;
+      }
+      first = last < size ? size - last : 0;
+      last = size - 1;
+      if (first > last) {
+        first = size;  /* "-0", unsatisfiable. */
+      }
+    } else {
+      if (range_number(value, len, &i, &first)) {
+        return 0;
+      }
+      if (i == len || value[i] != '-') {
+        return 0;
+      }
+      i += 1;
+      last = size - 1;
+      if (i < len && value[i] >= '0' && value[i] <= '9') {
+        if (range_number(value, len, &i, &last)) {
+          return 0;
+        }
+        if (last < first) {
+          return 0;
+        }
+        if (last >= size) {
+          last = size - 1;
+        }
+      }
+    }
+
+    if (first < size) {
+      if (n == max) {
+        return 0;
+      }
+      ranges[n].first = (int64_t) first;
+      ranges[n].last = (int64_t) last;
+      n += 1;
+    }
+
+    while (i < len && (value[i] == ' ' || value[i] == '\t')) {
+      i += 1;
+    }
+    if (i == len) {
+      break;
+    }
+    if (value[i] != ',') {
+      return 0;
+    }
+    i += 1;
+  }
+
+  return n == 0 ? -1 : (int) n;
+}
+
+/* A Range request with an If-Range that no longer matches gets the whole
+ * file.  Entity tags compare strongly, dates must match Last-Modified.
+ */
+int static_if_range(const http_ctx *parser, const file_validator *v) {
+  const char *value;
+  int64_t t;
+  size_t len;
+
+  value = http_header_find(parser, "If-Range", &len);
+  if (value == NULL) {
+    return 1;
+  }
+
+  if (len > 0 && (value[0] == '"' || value[0] == 'W')) {
+    return v->etag[0] != '\0' &&
+           len == strlen(v->etag) &&
+           0 == memcmp(value, v->etag, len);
+  }
+
+  return 0 == http_date_parse(value, len, &t) && t == v->mtime;
+}
+
+/* Builds the 304 response for |v|, a |type| file, unless it's already up
+ * to date.  It carries the Vary of the 200 so that a cache revalidating
+ * one variant doesn't start serving it for all of them.
+ */
+void static_notmod_build(file_validator *v, const char *type) {
+  char date[32];
+  int n;
+
+  if (v->notmodlen != 0) {
+    return;
+  }
+
+  http_date_format(v->mtime, date, sizeof(date));
+  n = snprintf(v->notmod,
+               sizeof(v->notmod),
+               "HTTP/1.1 304 Not Modified\r\n"
+               "%s"
+               "%s%s%s"
+               "Last-Modified: %s\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               vary_field(type),
+               v->etag[0] != '\0' ? "ETag: " : "",
+               v->etag,
+               v->etag[0] != '\0' ? "\r\n" : "",
+               date);
+  CHECK(n > 0 && (size_t) n < sizeof(v->notmod));
+  v->notmodlen = n;
+}
+
+/* Decides whether a conditional GET can be answered with 304 Not Modified.
+ * If-None-Match takes precedence; If-Modified-Since is only looked at when
+ * the request doesn't carry entity tags.
+ */
+int static_not_modified(const http_ctx *parser, const file_validator *v) {
+  const char *value;
+  int64_t since;
+  size_t len;
+
+  value = http_header_find(parser, "If-None-Match", &len);
+  if (value != NULL) {
+    return v->etag[0] != '\0' && etag_match(value, len, v->etag);
+  }
+
+  value = http_header_find(parser, "If-Modified-Since", &len);
+  if (value != NULL && 0 == http_date_parse(value, len, &since)) {
+    return v->mtime <= since;
+  }
+
+  return 0;
+}
+
+/* Looks for |etag| in a comma separated list of entity tags.  If-None-Match
+ * uses the weak comparison, so a W/ prefix is ignored.
+ */
+static int etag_match(const char *list, size_t len, const char *etag) {
+  size_t etaglen;
+  size_t i;
+  size_t j;
+
+  etaglen = strlen(etag);
+  i = 0;
+  while (i < len) {
+    while (i < len && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) {
+      i += 1;
+    }
+
+    if (i < len && list[i] == '*') {
+      return 1;
+    }
+
+    if (i + 2 <= len && list[i] == 'W' && list[i + 1] == '/') {
+      i += 2;
+    }
+
+    j = i;
+    while (j < len && list[j] != ',') {
+      j += 1;
+    }
+    while (j > i && (list[j - 1] == ' ' || list[j - 1] == '\t')) {
+      j -= 1;
+    }
+
+    if (j - i == etaglen && 0 == memcmp(list + i, etag, etaglen)) {
+      return 1;
+    }
+
+    while (i < len && list[i] != ',') {
+      i += 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Start watching the root directory of every static route of the current
+ * snapshot.  Changes to served files evict them from the file and content
+ * caches, so neither cache ever serves a stale copy for longer than it
+ * takes the event to arrive.
+ */
+void static_watch_start(server_state *state) {
+  const server_config *cf;
+  static_watch *w;
+  unsigned int i;
+  int err;
+
+  cf = &state->snap->config;
+  for (i = 0; i < cf->nroutes; i += 1) {
+    if (cf->routes[i].kind != route_static) {
+      continue;
+    }
+
+    w = xmalloc(sizeof(*w));
+    w->state = state;
+    w->route = cf->routes + i;
+    CHECK(0 == uv_fs_event_init(state->loop, &w->handle));
+    err = uv_fs_event_start(&w->handle,
+                            static_watch_event,
+                            w->route->root,
+                            UV_FS_EVENT_RECURSIVE);
+    if (err != 0) {
+      pr_warn("not watching \"%s\": %s, cached files may go stale",
+              w->route->root,
+              uv_strerror(err));
+      uv_close((uv_handle_t *) &w->handle, static_watch_close_done);
+      continue;
+    }
+
+    w->next = state->watches;
+    state->watches = w;
+  }
+}
+
+/* Before the snapshot the watches belong to goes away. */
+void static_watch_stop(server_state *state) {
+  static_watch *w;
+
+  while (state->watches != NULL) {
+    w = state->watches;
+    state->watches = w->next;
+    uv_close((uv_handle_t *) &w->handle, static_watch_close_done);
+  }
+}
+
+static void static_watch_event(uv_fs_event_t *handle,
+                               const char *filename,
+                               int events,
+                               int status) {
+  server_state *state;
+  static_watch *w;
+  char path[1024];
+  size_t suffixlen;
+  size_t rootlen;
+  size_t len;
+  size_t i;
+  int tree;
+
+  w = CONTAINER_OF(handle, static_watch, handle);
+  state = w->state;
+  rootlen = strlen(w->route->root);
+
+  /* Without a name we don't know what changed; forget the whole tree. */
+  len = filename == NULL ? 0 : strlen(filename);
+  if (status < 0 || len == 0 || rootlen + 1 + len >= sizeof(path)) {
+    content_cache_invalidate(&state->contents, w->route->root, 1);
+    file_cache_invalidate(&state->files, w->route->root, 1);
+    return;
+  }
+
+  /* Build the path the same way static_path() does. */
+  memcpy(path, w->route->root, rootlen);
+  path[rootlen] = '/';
+  for (i = 0; i < len; i += 1) {
+    path[rootlen + 1 + i] = filename[i] == '\\' ? '/' : filename[i];
+  }
+  path[rootlen + 1 + len] = '\0';
+
+  /* A change is to one file's contents.  A rename, which is also what
+   * creating and deleting look like, may be a directory's and take what's
+   * below it along, so only that is worth a walk of the caches.
+   */
+  tree = (events & UV_RENAME) != 0;
+  content_cache_invalidate(&state->contents, path, tree);
+  file_cache_invalidate(&state->files, path, tree);
+
+  /* Precompressed siblings are cached as variants of the file they belong
+   * to.
+   */
+  len = rootlen + 1 + len;
+  for (i = enc_gzip; i <= enc_br; i += 1) {
+    suffixlen = strlen(encodings[i].suffix);
+    if (len > suffixlen &&
+        path_equal(path + len - suffixlen, encodings[i].suffix)) {
+      path[len - suffixlen] = '\0';
+      content_cache_invalidate(&state->contents, path, 0);
+      break;
+    }
+  }
+}
+
+static void static_watch_close_done(uv_handle_t *handle) {
+  free(CONTAINER_OF(handle, static_watch, handle));
+}
+
+/* Content-Encoding of a variant, and Vary for anything we might compress,
+ * so that caches keep the variants apart.
+ */
+static void coding_fields(char *buf,
+                          size_t len,
+                          const char *type,
+                          content_encoding encoding) {
+  snprintf(buf,
+           len,
+           "%s%s%s%s",
+           encoding != enc_identity ? "Content-Encoding: " : "",
+           encoding != enc_identity ? encodings[encoding].name : "",
+           encoding != enc_identity ? "\r\n" : "",
+           vary_field(type));
+}
+
+static const char *vary_field(const char *type) {
+  return static_compressible(type) ? "Vary: Accept-Encoding\r\n" : "";
+}
+
+static int range_number(const char *s, size_t len, size_t *i, uint64_t *n) {
+  size_t start;
+
+  *n = 0;
+  for (start = *i; *i < len && s[*i] >= '0' && s[*i] <= '9'; *i += 1) {
+    if (*n > (UINT64_MAX - 9) / 10) {
+      return -1;
+    }
+    *n = *n * 10 + (s[*i] - '0');
+  }
+
+  return *i == start ? -1 : 0;
+}
+
+/* Windows opens a device for these names whatever the directory, and
+ * whatever follows the first dot.  Spaces before the dot don't count.
+ */
+static int device_name(const char *seg, size_t len) {
+  static const char *const names[] = {
+    "CON", "PRN", "AUX", "NUL", "CONIN$", "CONOUT$", "CLOCK$"
+  };
+  unsigned int i;
+  size_t n;
+
+  n = 0;
+  while (n < len && seg[n] != '.') {
+    n += 1;
+  }
+  while (n > 0 && seg[n - 1] == ' ') {
+    n -= 1;
+  }
+
+  if (n == 4 &&
+      (0 == _strnicmp(seg, "COM", 3) || 0 == _strnicmp(seg, "LPT", 3)) &&
+      seg[3] >= '0' && seg[3] <= '9') {
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i += 1) {
+    if (n == strlen(names[i]) && 0 == _strnicmp(seg, names[i], n)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int hex_digit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
@@ -0,0 +1,302 @@
+#include "defs.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Logging that never waits for the terminal or the disk.  While the
+ * writer runs, pr_info(), pr_warn() and pr_err() format their line into a
+ * ring of the calling thread and return; a thread of its own writes the
+ * lines out, many at a time.  A thread's lines come out in order, those
+ * of different threads interleaved as the writer finds them.
+ *
+ * Each ring has one producer, the thread it belongs to, and one consumer,
+ * the writer, so a line costs two atomic stores and no lock.  The writer
+ * sleeps on a semaphore; |signalled| makes sure that it's posted once per
+ * wakeup, not once per line, like the inbox of mpsc_queue.c.  A thread
+ * takes the lock only once, to add its ring to the list.
+ *
+ * A line that finds its ring full is dropped and counted.  The writer
+ * reports the drops in the log itself, as soon as there's room.  Before
+ * log_start() and after log_stop(), lines are written on the spot.
+ */
+
+#define LOG_SLOTS 128  /* Lines a thread can have queued; a power of two. */
+#define LOG_LINE_MAX 1024  /* Longer ones are cut. */
+#define LOG_BATCH (64 * 1024)  /* Most bytes the writer writes at once. */
+
+typedef struct {
+  unsigned int len;
+  int to_stderr;
+  char text[LOG_LINE_MAX];
+} log_slot;
+
+/* The lines of one thread.  Only that thread moves |tail| and |dropped|,
+ * only the writer moves |head|.
+ */
+typedef struct log_ring {
+  struct log_ring *next;  /* In logger.rings. */
+  volatile long tail;  /* Next slot to fill. */
+  volatile long dropped;
+  char pad[64];
+  volatile long head;  /* Next slot to write out. */
+  long reported;  /* Drops the writer has logged. */
+  log_slot slots[LOG_SLOTS];
+} log_ring;
+
+typedef struct {
+  char buf[LOG_BATCH];
+  size_t len;
+  FILE *stream;
+} log_batch;
+
+static struct {
+  volatile long running;
+  volatile long stop;
+  volatile long signalled;  /* |wake| has been posted. */
+  uv_thread_t thread;
+  uv_sem_t wake;
+  uv_key_t self;  /* The calling thread's ring. */
+  uv_mutex_t lock;  /* Guards |rings|. */
+  log_ring *rings;
+  unsigned int nrings;
+  uint64_t lines;  /* Counters, written by the writer only. */
+  uint64_t writes;
+  log_batch out;
+  log_batch err;
+} logger;
+
+static log_ring *log_ring_new(void);
+static void log_main(void *arg);
+static void log_drain(void);
+static void log_append(log_batch *b, const char *text, size_t len);
+static void log_flush(log_batch *b);
+
+/* Starts the writer.  Before anything else logs from another thread. */
+void log_start(void) {
+  if (logger.running) {
+    return;
+  }
+
+  CHECK(0 == uv_key_create(&logger.self));
+  CHECK(0 == uv_mutex_init(&logger.lock));
+  CHECK(0 == uv_sem_init(&logger.wake, 0));
+  logger.out.stream = stdout;
+  logger.err.stream = stderr;
+  logger.stop = 0;
+  logger.signalled = 0;
+  CHECK(0 == uv_thread_create(&logger.thread, log_main, NULL));
+  atom_store(&logger.running, 1);
+}
+
+/* Writes out what's queued and joins the writer, once no other thread
+ * logs any more; from then on, lines are written on the spot again.
+ */
+void log_stop(void) {
+  log_ring *r;
+
+  if (!atom_load(&logger.running)) {
+    return;
+  }
+
+  atom_store(&logger.running, 0);
+  atom_store(&logger.stop, 1);
+  uv_sem_post(&logger.wake);
+  CHECK(0 == uv_thread_join(&logger.thread));
+
+  while (logger.rings != NULL) {
+    r = logger.rings;
+    logger.rings = r->next;
+    free(r);
+  }
+  logger.nrings = 0;
+  uv_key_delete(&logger.self);
+  uv_sem_destroy(&logger.wake);
+  uv_mutex_destroy(&logger.lock);
+}
+
+/* Any thread.  Formats the line for pr_info() and friends. */
+void log_vprint(const char *label,
+                int to_stderr,
+                const char *fmt,
+                va_list ap) {
+  char fmtbuf[LOG_LINE_MAX];
+  log_slot *slot;
+  log_ring *r;
+  long tail;
+  int n;
+  int m;
+
+  r = NULL;
+  if (atom_load(&logger.running)) {
+    r = uv_key_get(&logger.self);
+    if (r == NULL) {
+      r = log_ring_new();
+    }
+  }
+
+  if (r == NULL) {
+    vsnprintf(fmtbuf, sizeof(fmtbuf), fmt, ap);
+    fprintf(to_stderr ? stderr : stdout,
+            "%s:%s: %s\n",
+            _getprogname(),
+            label,
+            fmtbuf);
+    return;
+  }
+
+  tail = r->tail;
+  if (tail - atom_load(&r->head) == LOG_SLOTS) {
+    atom_store(&r->dropped, r->dropped + 1);
+    return;
+  }
+
+  /* One byte is kept for the newline, vsnprintf() puts its NUL there. */
+  slot = r->slots + (tail & (LOG_SLOTS - 1));
+  n = snprintf(slot->text,
+               sizeof(slot->text),
+               "%s:%s: ",
+               _getprogname(),
+               label);
+  m = vsnprintf(slot->text + n, sizeof(slot->text) - n, fmt, ap);
+  if (m < 0) {
+    m = 0;
+  }
+  slot->len = n + m < LOG_LINE_MAX ? n + m : LOG_LINE_MAX - 1;
+  slot->text[slot->len] = '\n';
+  slot->len += 1;
+  slot->to_stderr = to_stderr;
+  atom_store(&r->tail, tail + 1);
+
+  if (atom_xchg(&logger.signalled, 1) == 0) {
+    uv_sem_post(&logger.wake);
+  }
+}
+
+/* Drops are counted as they happen, the rest is the writer's and may lag
+ * a bit, most of all while it's stuck writing.
+ */
+int log_stats(char *buf, size_t len) {
+  uint64_t dropped;
+  log_ring *r;
+
+  dropped = 0;
+  if (atom_load(&logger.running)) {
+    uv_mutex_lock(&logger.lock);
+    for (r = logger.rings; r != NULL; r = r->next) {
+      dropped += atom_load(&r->dropped);
+    }
+    uv_mutex_unlock(&logger.lock);
+  }
+
+  return snprintf(buf,
+                  len,
+                  "log_threads %u\n"
+                  "log_lines %llu\n"
+                  "log_dropped %llu\n"
+                  "log_writes %llu\n",
+                  logger.nrings,
+                  (unsigned long long) logger.lines,
+                  (unsigned long long) dropped,
+                  (unsigned long long) logger.writes);
+}
+
+/* Not xmalloc(), it logs.  NULL makes the caller write on the spot. */
+static log_ring *log_ring_new(void) {
+  log_ring *r;
+
+  r = malloc(sizeof(*r));
+  if (r == NULL) {
+    return NULL;
+  }
+
+  r->tail = 0;
+  r->dropped = 0;
+  r->head = 0;
+  r->reported = 0;
+  uv_key_set(&logger.self, r);
+  uv_mutex_lock(&logger.lock);
+  r->next = logger.rings;
+  logger.rings = r;
+  logger.nrings += 1;
+  uv_mutex_unlock(&logger.lock);
+  return r;
+}
+
+/* |signalled| is cleared before the rings are looked at, so a line that
+ * comes in meanwhile posts again and isn't left behind.
+ */
+static void log_main(void *arg) {
+  int stop;
+
+  for (;;) {
+    uv_sem_wait(&logger.wake);
+    atom_store(&logger.signalled, 0);
+    stop = atom_load(&logger.stop);
+    log_drain();
+    if (stop) {
+      break;
+    }
+  }
+}
+
+static void log_drain(void) {
+  char line[128];
+  log_slot *slot;
+  log_ring *r;
+  long dropped;
+  long head;
+  long tail;
+  int n;
+
+  uv_mutex_lock(&logger.lock);
+  r = logger.rings;
+  uv_mutex_unlock(&logger.lock);
+
+  /* Rings are only ever added in front, the rest of the list stays put. */
+  for (; r != NULL; r = r->next) {
+    head = r->head;
+    tail = atom_load(&r->tail);
+    for (; head != tail; head += 1) {
+      slot = r->slots + (head & (LOG_SLOTS - 1));
+      log_append(slot->to_stderr ? &logger.err : &logger.out,
+                 slot->text,
+                 slot->len);
+      atom_store(&r->head, head + 1);
+      logger.lines += 1;
+    }
+
+    dropped = atom_load(&r->dropped);
+    if (dropped != r->reported) {
+      n = snprintf(line,
+                   sizeof(line),
+                   "%s:warn: log full, dropped %ld lines\n",
+                   _getprogname(),
+                   dropped - r->reported);
+      log_append(&logger.err, line, n);
+      r->reported = dropped;
+    }
+  }
+
+  log_flush(&logger.out);
+  log_flush(&logger.err);
+}
+
+static void log_append(log_batch *b, const char *text, size_t len) {
+  if (b->len + len > sizeof(b->buf)) {
+    log_flush(b);
+  }
+  memcpy(b->buf + b->len, text, len);
+  b->len += len;
+}
+
+static void log_flush(log_batch *b) {
+  if (b->len == 0) {
+    return;
+  }
+
+  fwrite(b->buf, 1, b->len, b->stream);
+  fflush(b->stream);
+  b->len = 0;
+  logger.writes += 1;
+}
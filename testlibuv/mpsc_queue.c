@@ -0,0 +1,159 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A bounded queue through which any thread can have a function run on the
+ * loop thread.  Producers don't lock: each claims a cell by bumping |tail|
+ * and publishes it through the cell's sequence number, as in Dmitry
+ * Vyukov's bounded queue.  A cell whose sequence equals the position being
+ * claimed is free, one past it holds a message, and the consumer hands it
+ * back to producers one lap later by adding the queue size.
+ *
+ * Wakeups are coalesced: only the producer that finds |signalled| clear
+ * calls uv_async_send(), and the loop clears it before it starts draining.
+ * A burst of posts thus costs one wakeup, and a post that races with the
+ * drain either gets drained or sends a wakeup of its own.
+ *
+ * A wakeup runs what's queued in batches of MPSC_BATCH, but no more than
+ * one lap of the queue; for the rest, the loop wakes itself up again after
+ * it has polled for I/O, so that a flood of messages can't starve it.
+ */
+
+static void mpsc_wakeup(uv_async_t *handle);
+static void mpsc_close_done(uv_handle_t *handle);
+
+/* |size| is rounded up to a power of two.  The async handle doesn't keep
+ * the loop alive by itself.
+ */
+void mpsc_queue_init(mpsc_queue *q, uv_loop_t *loop, unsigned int size) {
+  unsigned long n;
+  unsigned long i;
+
+  memset(q, 0, sizeof(*q));
+  n = 2;
+  while (n < size) {
+    n *= 2;
+  }
+
+  q->cells = xmalloc(n * sizeof(q->cells[0]));
+  for (i = 0; i < n; i += 1) {
+    q->cells[i].seq = (long) i;
+  }
+  q->mask = n - 1;
+
+  CHECK(0 == uv_async_init(loop, &q->async, mpsc_wakeup));
+  uv_unref((uv_handle_t *) &q->async);
+}
+
+/* Thread-safe.  Has |cb| run with |data| on the loop thread, or returns
+ * UV_ENOBUFS if the queue is full.
+ */
+int mpsc_queue_post(mpsc_queue *q, mpsc_cb cb, void *data) {
+  mpsc_cell *cell;
+  long pos;
+  long dif;
+
+  pos = atom_load(&q->tail);
+  for (;;) {
+    cell = q->cells + ((unsigned long) pos & q->mask);
+    dif = (long) ((unsigned long) atom_load(&cell->seq)
+                  - (unsigned long) pos);
+    if (dif == 0) {
+      if (atom_cas(&q->tail, &pos, (long) ((unsigned long) pos + 1))) {
+        break;
+      }
+    } else if (dif < 0) {
+      atom_add(&q->full, 1);  /* The consumer is a lap behind. */
+      return UV_ENOBUFS;
+    } else {
+      pos = atom_load(&q->tail);  /* Someone else got it. */
+    }
+  }
+
+  cell->cb = cb;
+  cell->data = data;
+  cell->posted = uv_hrtime();
+  atom_store(&cell->seq, (long) ((unsigned long) pos + 1));
+
+  if (atom_xchg(&q->signalled, 1) == 0) {
+    uv_async_send(&q->async);
+  }
+  return 0;
+}
+
+/* Loop thread.  Messages still queued are dropped. */
+void mpsc_queue_close(mpsc_queue *q) {
+  uv_close((uv_handle_t *) &q->async, mpsc_close_done);
+}
+
+int mpsc_queue_stats(const mpsc_queue *q, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "inbox_delivered %llu\n"
+                  "inbox_wakeups %llu\n"
+                  "inbox_drained_max %u\n"
+                  "inbox_full %lu\n"
+                  "inbox_latency_avg_us %llu\n"
+                  "inbox_latency_max_us %llu\n",
+                  (unsigned long long) q->delivered,
+                  (unsigned long long) q->wakeups,
+                  q->drained_max,
+                  (unsigned long) q->full,
+                  (unsigned long long) (q->delivered == 0
+                                        ? 0
+                                        : q->latency_us / q->delivered),
+                  (unsigned long long) q->latency_max_us);
+}
+
+static void mpsc_wakeup(uv_async_t *handle) {
+  mpsc_queue *q;
+  mpsc_cell *cell;
+  unsigned long n;
+  uint64_t now;
+  uint64_t us;
+
+  q = CONTAINER_OF(handle, mpsc_queue, async);
+  atom_xchg(&q->signalled, 0);
+  q->wakeups += 1;
+  now = 0;
+
+  for (n = 0; n <= q->mask; n += 1) {
+    cell = q->cells + (q->head & q->mask);
+    if ((unsigned long) atom_load(&cell->seq) != q->head + 1) {
+      break;  /* Empty, or the producer hasn't published it yet. */
+    }
+
+    if (n % MPSC_BATCH == 0) {
+      now = uv_hrtime();
+    }
+
+    us = now > cell->posted ? (now - cell->posted) / 1000 : 0;
+    q->latency_us += us;
+    if (us > q->latency_max_us) {
+      q->latency_max_us = us;
+    }
+
+    cell->cb(cell->data);
+    atom_store(&cell->seq, (long) (q->head + q->mask + 1));
+    q->head += 1;
+  }
+
+  q->delivered += n;
+  if (n > q->drained_max) {
+    q->drained_max = (unsigned int) n;
+  }
+
+  /* More to do, come back after the loop has polled for I/O. */
+  if (n > q->mask && atom_xchg(&q->signalled, 1) == 0) {
+    uv_async_send(&q->async);
+  }
+}
+
+static void mpsc_close_done(uv_handle_t *handle) {
+  mpsc_queue *q;
+
+  q = CONTAINER_OF(handle, mpsc_queue, async);
+  free(q->cells);
+  q->cells = NULL;
+}
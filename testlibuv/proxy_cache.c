@@ -0,0 +1,1318 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* A shared cache for proxied GET responses, with HTTP's rules for shared
+ * caches: responses need an explicit lifetime from s-maxage, max-age or
+ * Expires and aren't kept if they're private, no-store or no-cache, set
+ * cookies or vary on everything.  Requests with credentials or their own
+ * no-store never touch it.
+ *
+ * Entries keep the response as the backend sent it, minus the headers that
+ * only applied to that connection, so a hit goes out with one uv_write()
+ * straight from the entry; only an Age line is added.  Entries are pinned
+ * while responses write from them, like the content cache's.
+ *
+ * Responses are keyed on the request-target together with the Host it was
+ * asked of, since both go to the backend as they are; then on what Vary
+ * names.  A client that sends someone else's URI with a Host of its own
+ * gets an entry of its own.
+ *
+ * A response that is served past its lifetime within its
+ * stale-while-revalidate window is refetched in the background, once.
+ * Requests that miss while another request is already fetching the same
+ * key wait for that fetch instead of sending their own.
+ *
+ * Memory is bounded by a byte budget.  When it's full, a new response only
+ * gets in if its URI has been asked for more often than the entries it
+ * would push out; a four row count-min sketch of recent requests, halved
+ * every so often, tells.  Otherwise a scan of one-off URIs would flush
+ * the hot set.
+ */
+
+#define SKETCH_ROWS 4
+#define VARY_MAX 512  /* Longest secondary key, longer ones aren't cached. */
+#define REFRESH_CHUNK (16 * 1024)
+#define CACHE_KEY_MAX (4 * 1024)  /* Twice a head that fits the read buffer. */
+
+typedef struct {
+  int no_store;
+  int no_cache;
+  int priv;
+  int64_t max_age;  /* Seconds, -1 if not given. */
+  int64_t s_maxage;
+  int64_t swr;  /* stale-while-revalidate, seconds. */
+} cache_control;
+
+/* What cache_head() found in a response head. */
+typedef struct {
+  cache_control cc;
+  int64_t date;  /* Seconds since the epoch, -1 if not given. */
+  int64_t expires;
+  int has_expires;
+  unsigned int age;
+  char vary[128];
+} cache_info;
+
+/* Where the values of request headers come from. */
+typedef const char *(*header_fn)(const void *src, const char *name, size_t *len);
+
+typedef struct {
+  const char *data;
+  size_t len;
+} cache_head_text;
+
+/* A background fetch of a stale entry. */
+typedef struct {
+  upstream_dial dial;
+  proxy_cache *pc;
+  server_state *state;
+  config_snapshot *snap;  /* Held, |group| belongs to it. */
+  upstream_group *group;
+  upstream_backend *backend;  /* Counted in its |inflight|. */
+  cache_entry *ce;  /* Pinned. */
+  proxy_resp resp;
+  char *req;
+  size_t reqlen;
+  char *buf;
+  size_t len;
+  size_t cap;
+  uint64_t sent;
+  int keepalive;
+  unsigned char reported;
+} cache_refresh;
+
+static const uint64_t sketch_seeds[SKETCH_ROWS] = {
+  0x9e3779b97f4a7c15ULL,
+  0xc2b2ae3d27d4eb4fULL,
+  0x165667b19e3779f9ULL,
+  0xd6e8feb86659fd93ULL,
+};
+
+/* Response headers that a hit doesn't repeat.  Age is recomputed. */
+static const char *const dropped_headers[] = {
+  "Connection",
+  "Keep-Alive",
+  "Proxy-Connection",
+  "TE",
+  "Trailer",
+  "Upgrade",
+  "Age",
+};
+
+static int cache_key(char *key,
+                     const char *uri,
+                     size_t urilen,
+                     const char *host,
+                     size_t hostlen);
+static cache_entry *cache_find(proxy_cache *pc,
+                               const char *key,
+                               size_t keylen,
+                               uint64_t h,
+                               header_fn fn,
+                               const void *src,
+                               cache_entry **pending);
+static int cache_vary_match(const cache_entry *ce, header_fn fn, const void *src);
+static int cache_vary_key(const char *names,
+                          header_fn fn,
+                          const void *src,
+                          char *buf,
+                          size_t len);
+static const char *cache_parser_header(const void *src,
+                                       const char *name,
+                                       size_t *len);
+static const char *cache_text_header(const void *src,
+                                     const char *name,
+                                     size_t *len);
+static int cache_status(int status);
+static size_t cache_head(char *head, size_t len, cache_info *info);
+static int cache_vary_names(const char *s, size_t len, char *buf, size_t size);
+static void cache_control_parse(const char *s, size_t len, cache_control *cc);
+static int64_t cache_seconds(const char *s, size_t len);
+static int cache_admit(proxy_cache *pc, uint64_t h, size_t cost);
+static void cache_evict(proxy_cache *pc, size_t need);
+static void cache_link(proxy_cache *pc, cache_entry *ce);
+static void cache_remove(proxy_cache *pc, cache_entry *ce);
+static void cache_lru_unlink(cache_entry *ce);
+static void cache_lru_push(proxy_cache *pc, cache_entry *ce);
+static void cache_fill_done(proxy_cache *pc, cache_entry *fill, int stored);
+static void cache_free(cache_entry *ce);
+static void sketch_add(proxy_cache *pc, uint64_t h);
+static unsigned int sketch_estimate(const proxy_cache *pc, uint64_t h);
+static unsigned int sketch_index(const proxy_cache *pc,
+                                 uint64_t h,
+                                 unsigned int row);
+static void refresh_dial_done(upstream_dial *d, int status);
+static void refresh_write_done(uv_write_t *req, int status);
+static void refresh_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void refresh_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf);
+static void refresh_timeout(uv_timer_t *handle);
+static void refresh_report(cache_refresh *r, int failed);
+static void refresh_end(cache_refresh *r, const char *what, int err);
+
+void proxy_cache_init(proxy_cache *pc,
+                      uv_loop_t *loop,
+                      size_t max_bytes,
+                      size_t max_entry,
+                      unsigned int timeout) {
+  memset(pc, 0, sizeof(*pc));
+  pc->loop = loop;
+  pc->max_bytes = max_bytes;
+  pc->max_entry = max_entry;
+  pc->timeout = timeout;
+
+  /* Size the table for an average entry of 4 kB, and give the sketch
+   * about four counters per row for each of those.
+   */
+  pc->nbuckets = 256;
+  while (pc->nbuckets < max_bytes / 4096) {
+    pc->nbuckets *= 2;
+  }
+  pc->buckets = xmalloc(pc->nbuckets * sizeof(pc->buckets[0]));
+  memset(pc->buckets, 0, pc->nbuckets * sizeof(pc->buckets[0]));
+  pc->lru.lru_next = &pc->lru;
+  pc->lru.lru_prev = &pc->lru;
+
+  pc->sketch_width = 1024;
+  while (pc->sketch_width < max_bytes / 1024 && pc->sketch_width < 1 << 24) {
+    pc->sketch_width *= 2;
+  }
+  pc->sketch = xmalloc(SKETCH_ROWS * pc->sketch_width);
+  memset(pc->sketch, 0, SKETCH_ROWS * pc->sketch_width);
+}
+
+/* Tells how far the request lets a shared cache serve it. */
+cache_mode proxy_cache_mode(const http_ctx *parser) {
+  cache_control cc;
+  const char *value;
+  size_t len;
+  int hosts;
+  int i;
+
+  if (http_header_find(parser, "Authorization", &len) != NULL) {
+    return cache_bypass;
+  }
+
+  /* The key takes the first Host, the backend might go by another. */
+  hosts = 0;
+  for (i = 0; i < parser->nheaders; i += 1) {
+    hosts += http_token_eq(parser->headers[i].name,
+                           parser->headers[i].namelen,
+                           "Host");
+  }
+  if (hosts > 1) {
+    return cache_bypass;
+  }
+
+  memset(&cc, 0, sizeof(cc));
+  cc.max_age = -1;
+  cc.s_maxage = -1;
+  value = http_header_find(parser, "Cache-Control", &len);
+  if (value != NULL) {
+    cache_control_parse(value, len, &cc);
+  }
+  value = http_header_find(parser, "Pragma", &len);
+  if (value != NULL) {
+    cache_control_parse(value, len, &cc);
+  }
+
+  if (cc.no_store) {
+    return cache_bypass;
+  }
+  if (cc.no_cache || cc.max_age == 0) {
+    return cache_refetch;
+  }
+  return cache_use;
+}
+
+/* Looks up the response to a GET or HEAD.  On a hit, fresh or stale,
+ * |*out| is the pinned entry.  On cache_pending it's the entry being
+ * filled, see proxy_cache_wait().
+ */
+cache_result proxy_cache_lookup(proxy_cache *pc,
+                                const http_ctx *parser,
+                                cache_entry **out) {
+  char key[CACHE_KEY_MAX];
+  cache_entry *pending;
+  const char *host;
+  cache_entry *ce;
+  size_t hostlen;
+  uint64_t h;
+  int n;
+
+  hostlen = 0;
+  host = http_header_find(parser, "Host", &hostlen);
+  n = cache_key(key, parser->uri, parser->urilen, host, hostlen);
+  CHECK(n >= 0);  /* The head fit the read buffer. */
+  h = hash64(key, n, 0);
+  sketch_add(pc, h);
+  ce = cache_find(pc,
+                  key,
+                  n,
+                  h,
+                  cache_parser_header,
+                  parser,
+                  &pending);
+  if (ce != NULL) {
+    cache_lru_unlink(ce);
+    cache_lru_push(pc, ce);
+    ce->refs += 1;
+    *out = ce;
+    if (uv_now(pc->loop) < ce->fresh_until) {
+      pc->hits += 1;
+      return cache_hit;
+    }
+    pc->stale_hits += 1;
+    return cache_stale;
+  }
+
+  *out = pending;
+  if (pending != NULL) {
+    pc->collapsed += 1;
+    return cache_pending;
+  }
+
+  pc->misses += 1;
+  return cache_miss;
+}
+
+/* Marks the key as being fetched, so that requests for it wait instead of
+ * going upstream too.  The caller ends the fill with proxy_cache_store()
+ * or proxy_cache_abort().
+ */
+cache_entry *proxy_cache_fill(proxy_cache *pc, const http_ctx *parser) {
+  char key[CACHE_KEY_MAX];
+  cache_entry *ce;
+  cache_entry **bucket;
+  const char *host;
+  size_t hostlen;
+  int n;
+
+  hostlen = 0;
+  host = http_header_find(parser, "Host", &hostlen);
+  n = cache_key(key, parser->uri, parser->urilen, host, hostlen);
+  CHECK(n >= 0);
+  ce = xmalloc(sizeof(*ce) + n + 2);
+  memset(ce, 0, sizeof(*ce));
+  memcpy(ce->key, key, n + 1);
+  ce->vary = ce->key + n;  /* Empty strings. */
+  ce->varyval = ce->vary;
+  ce->hash = hash64(key, n, 0);
+  ce->refs = 1;
+  ce->filling = 1;
+  ce->lru_next = ce;
+  ce->lru_prev = ce;
+
+  bucket = pc->buckets + ((unsigned int) ce->hash & (pc->nbuckets - 1));
+  ce->hash_next = *bucket;
+  *bucket = ce;
+  return ce;
+}
+
+/* |cb| runs once the fill ends; w->stored tells whether it's worth
+ * looking again.
+ */
+void proxy_cache_wait(cache_entry *fill, cache_waiter *w, cache_wait_cb cb) {
+  ASSERT(fill->filling);
+  w->entry = fill;
+  w->cb = cb;
+  w->stored = 0;
+  w->next = fill->waiters;
+  fill->waiters = w;
+}
+
+/* Stops waiting, e.g. because the client went away. */
+void proxy_cache_unwait(cache_waiter *w) {
+  cache_waiter **pp;
+
+  if (w->entry == NULL) {
+    return;
+  }
+
+  for (pp = &w->entry->waiters; *pp != w; pp = &(*pp)->next) {
+    ASSERT(*pp != NULL);
+  }
+  *pp = w->next;
+  w->entry = NULL;
+}
+
+/* Keeps the complete response in |data| if it may be cached, and ends
+ * |fill| if there is one.  |req| is the request head it answers, |resp|
+ * what proxy_resp_feed() made of |data|.  Takes |data| either way.
+ * Returns 1 if the response is in the cache now.
+ */
+int proxy_cache_store(proxy_cache *pc,
+                      cache_entry *fill,
+                      const char *req,
+                      size_t reqlen,
+                      const proxy_resp *resp,
+                      char *data,
+                      size_t len) {
+  char key[CACHE_KEY_MAX];
+  char varyval[VARY_MAX];
+  cache_head_text text;
+  cache_entry *old;
+  cache_entry *ce;
+  const char *host;
+  const char *uri;
+  const char *end;
+  cache_info info;
+  size_t headlen;
+  size_t hostlen;
+  size_t varylen;
+  size_t n;
+  int64_t lifetime;
+  int64_t date;
+  uint64_t now;
+  int keylen;
+  int vallen;
+
+  /* A head that came with both Transfer-Encoding and Content-Length is
+   * passed on, not kept.
+   */
+  memset(&info, 0, sizeof(info));
+  headlen = 0;
+  if (cache_status(resp->status)
+      && !resp->conflict
+      && proxy_resp_done(resp)
+      && resp->head_end > resp->head_start
+      && resp->head_end <= len
+      && len <= pc->max_entry) {
+    /* Drop any interim heads, then the headers a hit doesn't repeat. */
+    len -= (size_t) resp->head_start;
+    memmove(data, data + resp->head_start, len);
+    n = (size_t) (resp->head_end - resp->head_start);
+    headlen = cache_head(data, n, &info);
+    if (headlen > 0) {
+      memmove(data + headlen, data + n, len - n);
+      len -= n - headlen;
+    }
+  }
+
+  /* Shared caches keep s-maxage over max-age over Expires. */
+  lifetime = 0;
+  if (headlen > 0) {
+    if (info.cc.s_maxage >= 0) {
+      lifetime = info.cc.s_maxage;
+    } else if (info.cc.max_age >= 0) {
+      lifetime = info.cc.max_age;
+    } else if (info.has_expires) {
+      date = info.date >= 0 ? info.date : (int64_t) time(NULL);
+      lifetime = info.expires - date;
+    }
+    if (info.cc.no_store || info.cc.no_cache || info.cc.priv) {
+      lifetime = 0;
+    }
+  }
+
+  /* The key is the URI from the request line and the Host header, plus
+   * what Vary names.
+   */
+  keylen = -1;
+  vallen = -1;
+  text.data = req;
+  text.len = reqlen;
+  if (lifetime > (int64_t) info.age) {
+    uri = memchr(req, ' ', reqlen);
+    end = uri == NULL ? NULL : memchr(uri + 1, ' ', reqlen - (uri + 1 - req));
+    if (end != NULL) {
+      uri += 1;
+      hostlen = 0;
+      host = cache_text_header(&text, "Host", &hostlen);
+      keylen = cache_key(key, uri, end - uri, host, hostlen);
+    }
+    if (keylen >= 0) {
+      vallen = cache_vary_key(info.vary,
+                              cache_text_header,
+                              &text,
+                              varyval,
+                              sizeof(varyval));
+    }
+  }
+
+  if (vallen < 0 || !cache_admit(pc, hash64(key, keylen, 0), len)) {
+    if (vallen < 0) {
+      pc->uncacheable += 1;
+    } else {
+      pc->rejected += 1;
+    }
+    if (fill != NULL) {
+      cache_fill_done(pc, fill, 0);
+    }
+    free(data);
+    return 0;
+  }
+
+  varylen = strlen(info.vary);
+  ce = xmalloc(sizeof(*ce) + keylen + varylen + vallen + 2);
+  memset(ce, 0, sizeof(*ce));
+  memcpy(ce->key, key, keylen + 1);
+  ce->vary = ce->key + keylen + 1;
+  memcpy((char *) ce->vary, info.vary, varylen + 1);
+  ce->varyval = ce->vary + varylen + 1;
+  memcpy((char *) ce->varyval, varyval, vallen + 1);
+  ce->hash = hash64(key, keylen, 0);
+  ce->data = realloc(data, len);
+  CHECK(ce->data != NULL);
+  ce->size = len;
+  ce->headlen = headlen;
+  ce->age = info.age;
+  now = uv_now(pc->loop);
+  ce->stored = now;
+  ce->fresh_until = now + (uint64_t) (lifetime - info.age) * 1000;
+  ce->stale_until = ce->fresh_until + (uint64_t) info.cc.swr * 1000;
+
+  /* A newer copy of the same variant replaces the old one. */
+  old = cache_find(pc, key, keylen, ce->hash, cache_text_header, &text, NULL);
+  if (old != NULL && 0 == strcmp(old->vary, ce->vary)) {
+    cache_remove(pc, old);
+    if (old->refs == 0) {
+      cache_free(old);
+    }
+  }
+
+  cache_evict(pc, len);
+  cache_link(pc, ce);
+  pc->stores += 1;
+  if (fill != NULL) {
+    cache_fill_done(pc, fill, 1);
+  }
+  return 1;
+}
+
+/* The fetch for |fill| failed or went elsewhere; its waiters go upstream
+ * themselves.
+ */
+void proxy_cache_abort(proxy_cache *pc, cache_entry *fill) {
+  cache_fill_done(pc, fill, 0);
+}
+
+void proxy_cache_release(proxy_cache *pc, cache_entry *ce) {
+  ASSERT(ce->refs > 0);
+  ce->refs -= 1;
+  if (ce->refs == 0 && ce->stale) {
+    cache_free(ce);
+  }
+}
+
+/* The Age to send with |ce|, in seconds. */
+unsigned int proxy_cache_age(const proxy_cache *pc, const cache_entry *ce) {
+  return ce->age + (unsigned int) ((uv_now(pc->loop) - ce->stored) / 1000);
+}
+
+/* Fetches |ce| again in the background with the request head |req|, on a
+ * backend of |g|.  The answer replaces |ce| if it may be cached; until
+ * then, and if the fetch fails, |ce| is served as it is.  The fetch may
+ * outlive the session that asked for it, so it holds |snap|, which |g|
+ * belongs to, until it ends.
+ */
+void proxy_cache_refresh(proxy_cache *pc,
+                         cache_entry *ce,
+                         server_state *state,
+                         config_snapshot *snap,
+                         upstream_group *g,
+                         const char *req,
+                         size_t reqlen,
+                         int keepalive) {
+  cache_refresh *r;
+
+  if (ce->refreshing) {
+    return;
+  }
+
+  r = xmalloc(sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  r->pc = pc;
+  r->state = state;
+  r->snap = snap;
+  r->group = g;
+  r->ce = ce;
+  r->keepalive = keepalive;
+  r->req = xmalloc(reqlen);
+  memcpy(r->req, req, reqlen);
+  r->reqlen = reqlen;
+  proxy_resp_init(&r->resp, 0);
+  ce->refs += 1;
+  ce->refreshing = 1;
+  pc->refreshes += 1;
+  snapshot_hold(snap);
+
+  r->backend = upstream_group_pick(g, ce->key, strcspn(ce->key, " "));
+  r->sent = uv_hrtime();
+  upstream_dial_start(&r->dial,
+                      &r->backend->pool,
+                      &state->dns,
+                      refresh_dial_done);
+}
+
+int proxy_cache_stats(const proxy_cache *pc, char *buf, size_t len) {
+  uint64_t lookups;
+  double ratio;
+
+  lookups = pc->hits + pc->stale_hits + pc->misses + pc->collapsed;
+  ratio = lookups == 0 ? 0.0 : (double) (pc->hits + pc->stale_hits)
+                               / (double) lookups;
+  return snprintf(buf,
+                  len,
+                  "proxy_cache_hits %llu\n"
+                  "proxy_cache_stale_hits %llu\n"
+                  "proxy_cache_misses %llu\n"
+                  "proxy_cache_collapsed %llu\n"
+                  "proxy_cache_hit_ratio %.4f\n"
+                  "proxy_cache_entries %u\n"
+                  "proxy_cache_bytes_resident %llu\n"
+                  "proxy_cache_bytes_max %llu\n"
+                  "proxy_cache_stores %llu\n"
+                  "proxy_cache_uncacheable %llu\n"
+                  "proxy_cache_rejected %llu\n"
+                  "proxy_cache_evictions %llu\n"
+                  "proxy_cache_refreshes %llu\n"
+                  "proxy_cache_refresh_failures %llu\n",
+                  (unsigned long long) pc->hits,
+                  (unsigned long long) pc->stale_hits,
+                  (unsigned long long) pc->misses,
+                  (unsigned long long) pc->collapsed,
+                  ratio,
+                  pc->nentries,
+                  (unsigned long long) pc->nbytes,
+                  (unsigned long long) pc->max_bytes,
+                  (unsigned long long) pc->stores,
+                  (unsigned long long) pc->uncacheable,
+                  (unsigned long long) pc->rejected,
+                  (unsigned long long) pc->evictions,
+                  (unsigned long long) pc->refreshes,
+                  (unsigned long long) pc->refresh_failures);
+}
+
+/* Writes the primary key of a request for |uri| sent to |host| to |key|:
+ * the URI, a space and the host name in lowercase.  The URI has no
+ * spaces, so the two can't run into each other.  Returns the length, or
+ * -1 if it doesn't fit CACHE_KEY_MAX.
+ */
+static int cache_key(char *key,
+                     const char *uri,
+                     size_t urilen,
+                     const char *host,
+                     size_t hostlen) {
+  size_t i;
+  int c;
+
+  while (hostlen > 0
+         && (host[hostlen - 1] == ' ' || host[hostlen - 1] == '\t')) {
+    hostlen -= 1;
+  }
+  if (urilen + hostlen + 2 > CACHE_KEY_MAX) {
+    return -1;
+  }
+
+  memcpy(key, uri, urilen);
+  key[urilen] = ' ';
+  for (i = 0; i < hostlen; i += 1) {
+    c = (unsigned char) host[i];
+    key[urilen + 1 + i] = (char) (c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+  }
+  key[urilen + 1 + hostlen] = '\0';
+  return (int) (urilen + 1 + hostlen);
+}
+
+/* Returns the servable entry for |key| whose Vary headers match the ones
+ * |fn| finds in |src|.  Entries past their stale window are dropped on the
+ * way.  If |pending| isn't NULL, it's set to the entry being filled for
+ * |key|, if any.
+ */
+static cache_entry *cache_find(proxy_cache *pc,
+                               const char *key,
+                               size_t keylen,
+                               uint64_t h,
+                               header_fn fn,
+                               const void *src,
+                               cache_entry **pending) {
+  cache_entry *next;
+  cache_entry *ce;
+  uint64_t now;
+
+  if (pending != NULL) {
+    *pending = NULL;
+  }
+
+  now = uv_now(pc->loop);
+  for (ce = pc->buckets[(unsigned int) h & (pc->nbuckets - 1)];
+       ce != NULL;
+       ce = next) {
+    next = ce->hash_next;
+    if (ce->hash != h
+        || 0 != memcmp(ce->key, key, keylen)
+        || ce->key[keylen] != '\0') {
+      continue;
+    }
+
+    if (ce->filling) {
+      if (pending != NULL) {
+        *pending = ce;
+      }
+      continue;
+    }
+
+    if (now >= ce->stale_until) {
+      cache_remove(pc, ce);
+      if (ce->refs == 0) {
+        cache_free(ce);
+      }
+      continue;
+    }
+
+    if (cache_vary_match(ce, fn, src)) {
+      return ce;
+    }
+  }
+
+  return NULL;
+}
+
+static int cache_vary_match(const cache_entry *ce, header_fn fn, const void *src) {
+  char buf[VARY_MAX];
+  int n;
+
+  if (ce->vary[0] == '\0') {
+    return 1;
+  }
+
+  n = cache_vary_key(ce->vary, fn, src, buf, sizeof(buf));
+  return n >= 0 && 0 == strcmp(buf, ce->varyval);
+}
+
+/* Lists the request's values of the comma separated header |names|, one
+ * per line, in |buf|.  Returns the length, or -1 if it doesn't fit.
+ */
+static int cache_vary_key(const char *names,
+                          header_fn fn,
+                          const void *src,
+                          char *buf,
+                          size_t len) {
+  const char *value;
+  const char *end;
+  char name[64];
+  size_t namelen;
+  size_t vlen;
+  size_t n;
+
+  n = 0;
+  while (*names != '\0') {
+    end = strchr(names, ',');
+    namelen = end == NULL ? strlen(names) : (size_t) (end - names);
+    if (namelen >= sizeof(name)) {
+      return -1;
+    }
+    memcpy(name, names, namelen);
+    name[namelen] = '\0';
+    names += namelen + (end != NULL);
+
+    vlen = 0;
+    value = fn(src, name, &vlen);
+    while (vlen > 0 && (value[vlen - 1] == ' ' || value[vlen - 1] == '\t')) {
+      vlen -= 1;
+    }
+    if (n + vlen + 2 > len) {
+      return -1;
+    }
+    if (vlen > 0) {
+      memcpy(buf + n, value, vlen);
+    }
+    n += vlen;
+    buf[n++] = '\n';
+  }
+
+  buf[n] = '\0';
+  return (int) n;
+}
+
+static const char *cache_parser_header(const void *src,
+                                       const char *name,
+                                       size_t *len) {
+  return http_header_find(src, name, len);
+}
+
+/* Finds a header in a request head that's only available as text. */
+static const char *cache_text_header(const void *src,
+                                     const char *name,
+                                     size_t *len) {
+  const cache_head_text *text;
+  const char *line;
+  const char *end;
+  const char *eol;
+  const char *colon;
+
+  text = src;
+  end = text->data + text->len;
+  line = memchr(text->data, '\n', text->len);
+  while (line != NULL && ++line < end) {
+    eol = memchr(line, '\n', end - line);
+    if (eol == NULL || eol - line <= 1) {
+      break;  /* End of the head. */
+    }
+
+    colon = memchr(line, ':', eol - line);
+    if (colon != NULL && http_token_eq(line, colon - line, name)) {
+      colon += 1;
+      while (colon < eol && (*colon == ' ' || *colon == '\t')) {
+        colon += 1;
+      }
+      *len = eol - colon;
+      if (*len > 0 && colon[*len - 1] == '\r') {
+        *len -= 1;
+      }
+      return colon;
+    }
+    line = eol;
+  }
+
+  return NULL;
+}
+
+/* Statuses that may be cached given an explicit lifetime. */
+static int cache_status(int status) {
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 410:
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Squeezes the headers a hit doesn't repeat out of |head| and gathers the
+ * ones that decide whether and how long it's cached.  Returns the new
+ * length of the head, or 0 if it can't be cached.
+ */
+static size_t cache_head(char *head, size_t len, cache_info *info) {
+  const char *value;
+  const char *colon;
+  const char *eol;
+  char *line;
+  size_t linelen;
+  size_t vlen;
+  size_t r;
+  size_t w;
+  unsigned int i;
+  int drop;
+
+  memset(info, 0, sizeof(*info));
+  info->cc.max_age = -1;
+  info->cc.s_maxage = -1;
+  info->date = -1;
+
+  eol = memchr(head, '\n', len);
+  if (eol == NULL) {
+    return 0;
+  }
+  w = eol + 1 - head;
+  r = w;
+
+  for (;;) {
+    line = head + r;
+    eol = memchr(line, '\n', len - r);
+    if (eol == NULL || eol == line || eol[-1] != '\r') {
+      return 0;  /* Cut short or bare LF line ends, don't bother. */
+    }
+    linelen = eol - line - 1;
+    if (linelen == 0) {
+      memcpy(head + w, "\r\n", 2);
+      return w + 2;
+    }
+
+    colon = memchr(line, ':', linelen);
+    if (colon == NULL || line[0] == ' ' || line[0] == '\t') {
+      return 0;  /* Folded or broken. */
+    }
+    value = colon + 1;
+    vlen = linelen - (value - line);
+    while (vlen > 0 && (*value == ' ' || *value == '\t')) {
+      value += 1;
+      vlen -= 1;
+    }
+
+    if (http_token_eq(line, colon - line, "Cache-Control")) {
+      cache_control_parse(value, vlen, &info->cc);
+    } else if (http_token_eq(line, colon - line, "Expires")) {
+      info->has_expires = 1;
+      if (http_date_parse(value, vlen, &info->expires)) {
+        info->expires = 0;  /* Invalid dates mean already expired. */
+      }
+    } else if (http_token_eq(line, colon - line, "Date")) {
+      if (http_date_parse(value, vlen, &info->date)) {
+        info->date = -1;
+      }
+    } else if (http_token_eq(line, colon - line, "Age")) {
+      info->age = (unsigned int) cache_seconds(value, vlen);
+    } else if (http_token_eq(line, colon - line, "Vary")) {
+      if (cache_vary_names(value, vlen, info->vary, sizeof(info->vary))) {
+        return 0;
+      }
+    } else if (http_token_eq(line, colon - line, "Set-Cookie")) {
+      return 0;
+    }
+
+    drop = 0;
+    for (i = 0; i < sizeof(dropped_headers) / sizeof(dropped_headers[0]); i += 1) {
+      if (http_token_eq(line, colon - line, dropped_headers[i])) {
+        drop = 1;
+      }
+    }
+    if (!drop) {
+      memmove(head + w, line, linelen + 2);
+      w += linelen + 2;
+    }
+    r += linelen + 2;
+  }
+}
+
+/* Appends the lowercased names of a Vary header to |buf|.  Returns -1 for
+ * "*", which no secondary key can match, or if they don't fit.
+ */
+static int cache_vary_names(const char *s, size_t len, char *buf, size_t size) {
+  size_t n;
+  size_t i;
+  size_t j;
+
+  n = strlen(buf);
+  i = 0;
+  while (i < len) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+      i += 1;
+    }
+    j = i;
+    while (j < len && s[j] != ',' && s[j] != ' ' && s[j] != '\t') {
+      j += 1;
+    }
+    if (j == i) {
+      break;
+    }
+    if ((j - i == 1 && s[i] == '*') || n + (j - i) + 2 > size) {
+      return -1;
+    }
+
+    if (n > 0) {
+      buf[n++] = ',';
+    }
+    for (; i < j; i += 1) {
+      buf[n++] = (s[i] >= 'A' && s[i] <= 'Z') ? s[i] + 'a' - 'A' : s[i];
+    }
+    buf[n] = '\0';
+  }
+
+  return 0;
+}
+
+/* Adds the directives of a Cache-Control or Pragma header to |cc|. */
+static void cache_control_parse(const char *s, size_t len, cache_control *cc) {
+  const char *value;
+  size_t namelen;
+  size_t vlen;
+  size_t i;
+  size_t j;
+
+  i = 0;
+  while (i < len) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+      i += 1;
+    }
+    j = i;
+    while (j < len && s[j] != ',' && s[j] != '=') {
+      j += 1;
+    }
+    namelen = j - i;
+    while (namelen > 0 && (s[i + namelen - 1] == ' ' || s[i + namelen - 1] == '\t')) {
+      namelen -= 1;
+    }
+
+    value = NULL;
+    vlen = 0;
+    if (j < len && s[j] == '=') {
+      value = s + j + 1;
+      while (j < len && s[j] != ',') {
+        j += 1;
+      }
+      vlen = s + j - value;
+    }
+
+    if (http_token_eq(s + i, namelen, "no-store")) {
+      cc->no_store = 1;
+    } else if (http_token_eq(s + i, namelen, "no-cache")) {
+      cc->no_cache = 1;
+    } else if (http_token_eq(s + i, namelen, "private")) {
+      cc->priv = 1;
+    } else if (value != NULL && http_token_eq(s + i, namelen, "max-age")) {
+      cc->max_age = cache_seconds(value, vlen);
+    } else if (value != NULL && http_token_eq(s + i, namelen, "s-maxage")) {
+      cc->s_maxage = cache_seconds(value, vlen);
+    } else if (value != NULL
+               && http_token_eq(s + i, namelen, "stale-while-revalidate")) {
+      cc->swr = cache_seconds(value, vlen);
+    }
+    i = j;
+  }
+}
+
+/* A delta-seconds value, maybe quoted.  Garbage counts as zero. */
+static int64_t cache_seconds(const char *s, size_t len) {
+  int64_t n;
+  size_t i;
+
+  i = 0;
+  while (i < len && (s[i] == ' ' || s[i] == '"')) {
+    i += 1;
+  }
+
+  n = 0;
+  for (; i < len && s[i] >= '0' && s[i] <= '9'; i += 1) {
+    if (n < 0x7fffffff) {
+      n = n * 10 + (s[i] - '0');
+    }
+  }
+
+  return n;
+}
+
+/* Whether a response of |cost| bytes for the URI hashing to |h| gets in.
+ * If room has to be made, everything it would push out must have been
+ * asked for less often than it.
+ */
+static int cache_admit(proxy_cache *pc, uint64_t h, size_t cost) {
+  cache_entry *ce;
+  unsigned int freq;
+  size_t freed;
+
+  if (cost > pc->max_bytes) {
+    return 0;
+  }
+
+  freq = sketch_estimate(pc, h);
+  freed = 0;
+  for (ce = pc->lru.lru_prev;
+       ce != &pc->lru && pc->nbytes - freed + cost > pc->max_bytes;
+       ce = ce->lru_prev) {
+    if (ce->refs > 0) {
+      continue;
+    }
+    if (sketch_estimate(pc, ce->hash) >= freq) {
+      return 0;
+    }
+    freed += ce->size;
+  }
+
+  return pc->nbytes - freed + cost <= pc->max_bytes;
+}
+
+/* Makes room for |need| bytes from the cold end of the LRU list.
+ * cache_admit() has checked that there's enough unpinned to drop.
+ */
+static void cache_evict(proxy_cache *pc, size_t need) {
+  cache_entry *ce;
+  cache_entry *prev;
+
+  for (ce = pc->lru.lru_prev;
+       ce != &pc->lru && pc->nbytes + need > pc->max_bytes;
+       ce = prev) {
+    prev = ce->lru_prev;
+    if (ce->refs == 0) {
+      cache_remove(pc, ce);
+      cache_free(ce);
+      pc->evictions += 1;
+    }
+  }
+}
+
+static void cache_link(proxy_cache *pc, cache_entry *ce) {
+  cache_entry **bucket;
+
+  bucket = pc->buckets + ((unsigned int) ce->hash & (pc->nbuckets - 1));
+  ce->hash_next = *bucket;
+  *bucket = ce;
+  cache_lru_push(pc, ce);
+  pc->nentries += 1;
+  pc->nbytes += ce->size;
+}
+
+static void cache_remove(proxy_cache *pc, cache_entry *ce) {
+  cache_entry **pp;
+
+  ASSERT(!ce->stale);
+  for (pp = pc->buckets + ((unsigned int) ce->hash & (pc->nbuckets - 1));
+       *pp != ce;
+       pp = &(*pp)->hash_next) {
+    ASSERT(*pp != NULL);
+  }
+  *pp = ce->hash_next;
+  ce->stale = 1;
+  if (!ce->filling) {
+    cache_lru_unlink(ce);
+    pc->nentries -= 1;
+    pc->nbytes -= ce->size;
+  }
+}
+
+static void cache_lru_unlink(cache_entry *ce) {
+  ce->lru_prev->lru_next = ce->lru_next;
+  ce->lru_next->lru_prev = ce->lru_prev;
+  ce->lru_next = ce;
+  ce->lru_prev = ce;
+}
+
+static void cache_lru_push(proxy_cache *pc, cache_entry *ce) {
+  ce->lru_next = pc->lru.lru_next;
+  ce->lru_prev = &pc->lru;
+  pc->lru.lru_next->lru_prev = ce;
+  pc->lru.lru_next = ce;
+}
+
+/* Unlinks |fill|, drops the filler's pin and wakes the waiters.  They may
+ * start fills of their own from their callbacks.
+ */
+static void cache_fill_done(proxy_cache *pc, cache_entry *fill, int stored) {
+  cache_waiter *next;
+  cache_waiter *w;
+
+  ASSERT(fill->filling);
+  cache_remove(pc, fill);
+  w = fill->waiters;
+  fill->waiters = NULL;
+  proxy_cache_release(pc, fill);
+
+  for (; w != NULL; w = next) {
+    next = w->next;
+    w->entry = NULL;
+    w->stored = stored;
+    w->cb(w);
+  }
+}
+
+static void cache_free(cache_entry *ce) {
+  ASSERT(ce->waiters == NULL);
+  free(ce->data);
+  free(ce);
+}
+
+/* Counts a request for the URI hashing to |h|.  The counters are halved
+ * after about ten times as many requests as entries fit, so that what was
+ * hot a while ago fades.
+ */
+static void sketch_add(proxy_cache *pc, uint64_t h) {
+  unsigned int row;
+  unsigned int i;
+  uint8_t *c;
+
+  for (row = 0; row < SKETCH_ROWS; row += 1) {
+    c = pc->sketch + row * pc->sketch_width + sketch_index(pc, h, row);
+    if (*c < 255) {
+      *c += 1;
+    }
+  }
+
+  pc->sketch_adds += 1;
+  if (pc->sketch_adds >= pc->sketch_width / 4 * 10) {
+    pc->sketch_adds = 0;
+    for (i = 0; i < SKETCH_ROWS * pc->sketch_width; i += 1) {
+      pc->sketch[i] >>= 1;
+    }
+  }
+}
+
+static unsigned int sketch_estimate(const proxy_cache *pc, uint64_t h) {
+  unsigned int row;
+  unsigned int min;
+  unsigned int c;
+
+  min = 255;
+  for (row = 0; row < SKETCH_ROWS; row += 1) {
+    c = pc->sketch[row * pc->sketch_width + sketch_index(pc, h, row)];
+    if (c < min) {
+      min = c;
+    }
+  }
+
+  return min;
+}
+
+static unsigned int sketch_index(const proxy_cache *pc,
+                                 uint64_t h,
+                                 unsigned int row) {
+  return (unsigned int) ((h * sketch_seeds[row]) >> 40) & (pc->sketch_width - 1);
+}
+
+static void refresh_dial_done(upstream_dial *d, int status) {
+  cache_refresh *r;
+  upstream_conn *uc;
+  uv_buf_t buf;
+
+  r = CONTAINER_OF(d, cache_refresh, dial);
+  if (status != 0) {
+    refresh_end(r, "connect", status);
+    return;
+  }
+
+  uc = d->uc;
+  buf.base = r->req;
+  buf.len = (unsigned long) r->reqlen;
+  uc->c.write_req.data = r;
+  CHECK(0 == uv_write(&uc->c.write_req,
+                      &uc->c.handle.stream,
+                      &buf,
+                      1,
+                      refresh_write_done));
+
+  uc->c.handle.handle.data = r;
+  CHECK(0 == uv_read_start(&uc->c.handle.stream, refresh_alloc, refresh_read_done));
+  uc->c.timer_handle.data = r;
+  CHECK(0 == uv_timer_start(&uc->c.timer_handle,
+                            refresh_timeout,
+                            r->pc->timeout,
+                            0));
+}
+
+static void refresh_write_done(uv_write_t *req, int status) {
+  upstream_conn *uc;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  uc = CONTAINER_OF(req, upstream_conn, c.write_req);
+  if (uc->closing != 0) {
+    return;  /* Done since, |r| may be gone. */
+  }
+
+  if (status < 0) {
+    refresh_end(req->data, "write", status);
+  }
+}
+
+/* Reads straight into the response buffer.  It may grow one byte past
+ * max_entry, which tells refresh_read_done() that it's too big.
+ */
+static void refresh_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  cache_refresh *r;
+  size_t cap;
+
+  r = handle->data;
+  if (r->cap - r->len < REFRESH_CHUNK && r->cap <= r->pc->max_entry) {
+    cap = r->cap == 0 ? 4 * REFRESH_CHUNK : 2 * r->cap;
+    if (cap > r->pc->max_entry + 1) {
+      cap = r->pc->max_entry + 1;
+    }
+    r->buf = realloc(r->buf, cap);
+    CHECK(r->buf != NULL);
+    r->cap = cap;
+  }
+
+  buf->base = r->buf + r->len;
+  buf->len = (unsigned long) (r->cap - r->len);
+}
+
+static void refresh_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf) {
+  upstream_conn *uc;
+  cache_refresh *r;
+  int n;
+
+  if (nread == 0) {
+    return;  /* EAGAIN, nothing happened. */
+  }
+
+  r = handle->data;
+  if (nread < 0) {
+    refresh_end(r, "read", (int) nread);
+    return;
+  }
+
+  n = proxy_resp_feed(&r->resp, buf->base, (size_t) nread);
+  if (n < 0 || r->resp.status != 0) {
+    refresh_report(r, n < 0 || r->resp.status >= 500);
+  }
+  if (n < 0) {
+    refresh_end(r, "response", UV_EPROTO);
+    return;
+  }
+
+  r->len += n;
+  if (r->len > r->pc->max_entry) {
+    refresh_end(r, "response", UV_E2BIG);
+    return;
+  }
+
+  if (!proxy_resp_done(&r->resp)) {
+    CHECK(0 == uv_timer_start(&r->dial.uc->c.timer_handle,
+                              refresh_timeout,
+                              r->pc->timeout,
+                              0));
+    return;
+  }
+
+  /* Done.  The connection goes back to the pool if nothing odd happened. */
+  uc = r->dial.uc;
+  uv_read_stop(handle);
+  if (r->keepalive && r->resp.keepalive && n == nread) {
+    uv_timer_stop(&uc->c.timer_handle);
+    r->dial.uc = NULL;
+    upstream_pool_put(&r->backend->pool, uc);
+  }
+
+  proxy_cache_store(r->pc, NULL, r->req, r->reqlen, &r->resp, r->buf, r->len);
+  r->buf = NULL;
+  refresh_end(r, NULL, 0);
+}
+
+static void refresh_timeout(uv_timer_t *handle) {
+  refresh_end(handle->data, "read", UV_ETIMEDOUT);
+}
+
+static void refresh_report(cache_refresh *r, int failed) {
+  if (r->reported) {
+    return;
+  }
+
+  r->reported = 1;
+  if (failed) {
+    upstream_backend_failed(r->group, r->backend);
+  } else {
+    upstream_backend_sample(r->group,
+                            r->backend,
+                            (uv_hrtime() - r->sent) / 1000);
+  }
+}
+
+/* Releases everything; |what| is set if the refresh failed.  The stale
+ * entry may be refreshed again by the next request that gets it.
+ */
+static void refresh_end(cache_refresh *r, const char *what, int err) {
+  if (what != NULL) {
+    pr_warn("upstream %s:%u refresh %s error: %s",
+            r->backend->pool.host,
+            r->backend->pool.port,
+            what,
+            uv_strerror(err));
+    if (!r->dial.reused) {
+      refresh_report(r, 1);
+    }
+    r->pc->refresh_failures += 1;
+  }
+
+  upstream_dial_cancel(&r->dial);
+  upstream_group_done(r->group, r->backend);
+  r->ce->refreshing = 0;
+  proxy_cache_release(r->pc, r->ce);
+  snapshot_leave(r->state, r->snap);  /* May free |group|. */
+  free(r->buf);
+  free(r->req);
+  free(r);
+}
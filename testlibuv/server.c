@@ -21,6 +21,8 @@
 
 #include "defs.h"
 //#include <netinet/in.h>  /* INET6_ADDRSTRLEN */
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,56 +30,292 @@
 # define INET6_ADDRSTRLEN 63
 #endif
 
-typedef struct {
-  uv_getaddrinfo_t getaddrinfo_req;
-  server_config config;
-  server_ctx *servers;
-  uv_loop_t *loop;
-} server_state;
-
 static void do_bind(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
 static void on_connection(uv_stream_t *server, int status);
+static void on_stop_signal(uv_signal_t *handle, int signum);
+static void drain_expire(uv_timer_t *handle);
+static void drain_cut_off(server_state *state);
+static void close_walk(uv_handle_t *handle, void *arg);
 
 int server_run(const server_config *cf, uv_loop_t *loop) {
   struct addrinfo hints;
+  config_snapshot *snap;
   server_state state;
+  unsigned int tp;
+  unsigned int i;
   int err;
 
+  /* What can be reloaded is read from the snapshot, what can't from
+   * state.config.  The routes only live in snapshots.
+   */
+  log_start();  /* Before there are other threads to log from. */
   memset(&state, 0, sizeof(state));
   state.servers = NULL;
-  state.config = *cf;
+  snap = snapshot_new(cf);
+  state.config = snap->config;
+  state.config.routes = NULL;
+  state.config.nroutes = 0;
   state.loop = loop;
+  if (state.config.proxy_cache_max_entry == 0
+      || state.config.proxy_cache_max_entry > state.config.proxy_cache_size) {
+    state.config.proxy_cache_max_entry = state.config.proxy_cache_size / 8;
+  }
+  if (state.config.inbox_size == 0) {
+    state.config.inbox_size = 1024;
+  }
+  if (state.config.drain_timeout == 0) {
+    state.config.drain_timeout = state.config.idle_timeout;
+  }
+  /* On libuv's threadpool, they'd queue behind file I/O again. */
+  if (state.config.executor_threads == 0) {
+    state.config.executor_threads = 1;
+  }
+  if (state.config.dns_threads == 0) {
+    state.config.dns_threads = 1;
+  }
+  /* Before anything queues work, that's when libuv starts its threads. */
+  tp = work_threadpool_size(cf->threadpool_size);
+  mpsc_queue_init(&state.inbox, loop, state.config.inbox_size);
+  state.cpu_exec = executor_new(state.config.executor_threads);
+  state.lookup_exec = executor_new(state.config.dns_threads);
+  work_pool_init(&state.fs, "fs", loop, tp, NULL, NULL);
+  work_pool_probe(&state.fs, 1000);
+  work_pool_init(&state.cpu, "cpu", loop, tp, state.cpu_exec, &state.inbox);
+  work_pool_init(&state.lookup,
+                 "dns",
+                 loop,
+                 tp,
+                 state.lookup_exec,
+                 &state.inbox);
+  file_cache_init(&state.files, loop, &state.cpu, cf->fd_cache_size);
+  content_cache_init(&state.contents,
+                     cf->content_cache_size,
+                     cf->content_max_file);
+  dns_cache_init(&state.dns,
+                 loop,
+                 &state.lookup,
+                 cf->dns_ttl,
+                 cf->dns_negative_ttl,
+                 cf->dns_stale_ttl);
+  coro_pool_init(&state.coros, loop, &state.dns);
+  proxy_cache_init(&state.cache,
+                   loop,
+                   state.config.proxy_cache_size,
+                   state.config.proxy_cache_max_entry,
+                   state.config.idle_timeout);
+
+  snapshot_init(&state, snap);
+  static_watch_start(&state);
+
+  /* SIGINT and SIGTERM stop the server gracefully, see on_stop_signal(). */
+  CHECK(0 == uv_timer_init(loop, &state.drain_timer));
+  CHECK(0 == uv_signal_init(loop, &state.stop_signals[0]));
+  CHECK(0 == uv_signal_start(&state.stop_signals[0], on_stop_signal, SIGINT));
+  CHECK(0 == uv_signal_init(loop, &state.stop_signals[1]));
+  CHECK(0 == uv_signal_start(&state.stop_signals[1], on_stop_signal, SIGTERM));
+  for (i = 0; i < 2; i += 1) {
+    state.stop_signals[i].data = &state;
+    uv_unref((uv_handle_t *) &state.stop_signals[i]);
+  }
+  upgrade_init(&state);
 
   /* Resolve the address of the interface that we should bind to.
    * The getaddrinfo callback starts the server and everything else.
+   * After an upgrade, the old process hands over its listeners instead.
    */
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-
-  err = uv_getaddrinfo(loop,
-                       &state.getaddrinfo_req,
-                       do_bind,
-                       cf->bind_host,
-                       NULL,
-                       &hints);
-  if (err != 0) {
-    pr_err("getaddrinfo: %s", uv_strerror(err));
-    return err;
+  if (!upgrade_inherit(&state)) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    err = uv_getaddrinfo(loop,
+                         &state.getaddrinfo_req,
+                         do_bind,
+                         cf->bind_host,
+                         NULL,
+                         &hints);
+    if (err != 0) {
+      pr_err("getaddrinfo: %s", uv_strerror(err));
+      log_stop();
+      return err;
+    }
   }
 
   /* Start the event loop.  Control continues in do_bind(). */
-  if (uv_run(loop, UV_RUN_DEFAULT)) {
+  if (uv_run(loop, UV_RUN_DEFAULT) && !state.draining) {
     abort();
   }
 
-  /* Please Valgrind. */
+  /* Please Valgrind.  A reload that's under way publishes when it's done,
+   * so it has to be done first.  Then the executors, they post to the loop.
+   * What's left open after a drain belongs to caches and pools.
+   */
+  while (state.reloading) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  if (state.cpu_exec != NULL) {
+    executor_free(state.cpu_exec);
+  }
+  if (state.lookup_exec != NULL) {
+    executor_free(state.lookup_exec);
+  }
+  snapshot_close(&state);
+  uv_walk(loop, close_walk, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+  coro_pool_free(&state.coros);
   uv_loop_delete(loop);
   free(state.servers);
+  snapshot_free(state.snap);
+  free(state.inbox.cells);
+  log_stop();
   return 0;
 }
 
+/* Formats the counters of every subsystem as "name value" lines. */
+int server_stats(const server_state *state, char *buf, size_t len) {
+  const config_snapshot *snap;
+  unsigned int i;
+  size_t n;
+
+  n = 0;
+  n += file_cache_stats(&state->files, buf + n, len - n);
+  if (n < len) {
+    n += content_cache_stats(&state->contents, buf + n, len - n);
+  }
+  if (n < len) {
+    n += proxy_stats(&state->proxy, buf + n, len - n);
+  }
+  if (n < len) {
+    n += request_stats(&state->requests, buf + n, len - n);
+  }
+  if (n < len) {
+    n += dns_cache_stats(&state->dns, buf + n, len - n);
+  }
+  if (n < len) {
+    n += proxy_cache_stats(&state->cache, buf + n, len - n);
+  }
+  if (n < len) {
+    n += work_pool_stats(&state->fs, buf + n, len - n);
+  }
+  if (n < len) {
+    n += work_pool_stats(&state->cpu, buf + n, len - n);
+  }
+  if (n < len) {
+    n += work_pool_stats(&state->lookup, buf + n, len - n);
+  }
+  if (n < len) {
+    n += mpsc_queue_stats(&state->inbox, buf + n, len - n);
+  }
+  if (n < len && state->cpu_exec != NULL) {
+    n += executor_stats(state->cpu_exec, "cpu", buf + n, len - n);
+  }
+  if (n < len && state->lookup_exec != NULL) {
+    n += executor_stats(state->lookup_exec, "dns", buf + n, len - n);
+  }
+  if (n < len) {
+    n += coro_pool_stats(&state->coros, buf + n, len - n);
+  }
+  if (n < len) {
+    n += log_stats(buf + n, len - n);
+  }
+  if (n < len) {
+    n += snapshot_stats(state, buf + n, len - n);
+  }
+  snap = state->snap;
+  for (i = 0; i < snap->config.nroutes && n < len; i += 1) {
+    if (snap->config.routes[i].kind == route_proxy) {
+      n += upstream_group_stats(snap->groups + i, buf + n, len - n);
+    }
+  }
+
+  return n < len ? (int) n : (int) len - 1;
+}
+
+/* Starts accepting on sx->tcp_handle, which is bound already. */
+int server_listen(server_ctx *sx) {
+  return uv_listen((uv_stream_t *) &sx->tcp_handle, 128, on_connection);
+}
+
+/* Stops accepting and lets the sessions that are still open finish.  Those
+ * left after drain_timeout are killed.  Once none are left, uv_run()
+ * returns and so does server_run().
+ *
+ * With |close_idle|, sessions that haven't sent a byte yet are closed
+ * right away instead of waiting for a request that will never be served.
+ * A hot upgrade keeps them: they were accepted a moment ago, and their
+ * request is likely on its way.
+ */
+void server_drain(server_state *state, int close_idle) {
+  client_ctx *cx;
+  client_ctx *next;
+  unsigned int i;
+
+  if (state->draining) {
+    return;
+  }
+
+  state->draining = 1;
+  for (i = 0; i < state->nservers; i += 1) {
+    uv_close((uv_handle_t *) &state->servers[i].tcp_handle, NULL);
+  }
+
+  state->drain.started = uv_now(state->loop);
+  state->drain.sessions = state->nclients;
+  if (close_idle) {
+    for (cx = state->clients; cx != NULL; cx = next) {
+      next = cx->next;  /* Not freed yet, see drain_cut_off(). */
+      if (http_client_idle(cx) && http_client_kill(cx)) {
+        state->drain.idle += 1;
+      }
+    }
+  }
+
+  pr_info("draining %u connections, %u of them idle",
+          state->drain.sessions,
+          state->drain.idle);
+  CHECK(0 == uv_timer_start(&state->drain_timer,
+                            drain_expire,
+                            state->config.drain_timeout,
+                            0));
+  if (state->nclients == 0) {
+    server_drained(state);
+  }
+}
+
+/* The last session is gone. */
+void server_drained(server_state *state) {
+  drain_metrics *d;
+
+  d = &state->drain;
+  pr_info("drained in %llu ms: %u finished, %u idle closed, %u cut off",
+          (unsigned long long) (uv_now(state->loop) - d->started),
+          d->sessions - d->idle - d->cut_off,
+          d->idle,
+          d->cut_off);
+  uv_timer_stop(&state->drain_timer);
+  uv_stop(state->loop);
+}
+
+/* Returns the first route whose prefix |uri| starts with, or NULL. */
+const route_config *route_match(const server_config *cf,
+                                const char *uri,
+                                size_t urilen) {
+  const route_config *route;
+  unsigned int i;
+  size_t len;
+
+  for (i = 0; i < cf->nroutes; i += 1) {
+    route = cf->routes + i;
+    len = strlen(route->prefix);
+    if (len <= urilen && 0 == memcmp(uri, route->prefix, len)) {
+      return route;
+    }
+  }
+
+  return NULL;
+}
+
 /* Bind a server to each address that getaddrinfo() reported. */
 static void do_bind(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs) {
   char addrbuf[INET6_ADDRSTRLEN + 1];
@@ -151,14 +389,14 @@ static void do_bind(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs) {
 
     sx = state->servers + n;
     sx->loop = loop;
-    sx->idle_timeout = state->config.idle_timeout;
+    sx->state = state;
     CHECK(0 == uv_tcp_init(loop, &sx->tcp_handle));
 
     what = "uv_tcp_bind";
     err = uv_tcp_bind(&sx->tcp_handle, &s.addr, 0);
     if (err == 0) {
       what = "uv_listen";
-      err = uv_listen((uv_stream_t *) &sx->tcp_handle, 128, on_connection);
+      err = server_listen(sx);
     }
 
     if (err != 0) {
@@ -178,6 +416,7 @@ static void do_bind(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs) {
     n += 1;
   }
 
+  state->nservers = n;
   uv_freeaddrinfo(addrs);
 }
 
@@ -188,7 +427,59 @@ static void on_connection(uv_stream_t *server, int status) {
   CHECK(status == 0);
   sx = CONTAINER_OF(server, server_ctx, tcp_handle);
   cx = xmalloc(sizeof(*cx));
-  CHECK(0 == uv_tcp_init(sx->loop, &cx->clientconn.handle.tcp));
+  CHECK(0 == uv_tcp_init(sx->loop, &cx->clientconn.handle.tcp));
   CHECK(0 == uv_accept(server, &cx->clientconn.handle.stream));
   http_client_finish_init(sx, cx);
 }
+
+/* The first signal drains, a second one stops waiting for it. */
+static void on_stop_signal(uv_signal_t *handle, int signum) {
+  server_state *state;
+
+  state = handle->data;
+  if (state->draining) {
+    pr_warn("signal %d while draining, closing %u connections",
+            signum,
+            state->nclients);
+    drain_cut_off(state);
+    return;
+  }
+
+  pr_info("signal %d, shutting down", signum);
+  server_drain(state, 1);
+}
+
+static void drain_expire(uv_timer_t *handle) {
+  server_state *state;
+
+  state = CONTAINER_OF(handle, server_state, drain_timer);
+  pr_warn("drain timed out, closing %u connections", state->nclients);
+  drain_cut_off(state);
+}
+
+/* Kills the sessions still open.  Those already closing aren't counted;
+ * those that hadn't sent a request yet count as idle, not cut off.
+ */
+static void drain_cut_off(server_state *state) {
+  client_ctx *cx;
+  client_ctx *next;
+  int idle;
+
+  for (cx = state->clients; cx != NULL; cx = next) {
+    next = cx->next;  /* Not freed yet, it still has handles to close. */
+    idle = http_client_idle(cx);
+    if (http_client_kill(cx)) {
+      if (idle) {
+        state->drain.idle += 1;
+      } else {
+        state->drain.cut_off += 1;
+      }
+    }
+  }
+}
+
+static void close_walk(uv_handle_t *handle, void *arg) {
+  if (!uv_is_closing(handle)) {
+    uv_close(handle, NULL);
+  }
+}
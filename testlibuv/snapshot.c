@@ -0,0 +1,359 @@
+#include "defs.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reloadable configuration.  Timeouts, limits, routes and their backends
+ * are published as a snapshot that never changes once it's out: a copy of
+ * the configuration in one block, routes and strings included, with the
+ * upstream groups of its proxy routes.  A session runs under the snapshot
+ * that was current when it was accepted, from its first byte to its last,
+ * so a request never sees half of one configuration and half of another.
+ *
+ * Any thread can publish one with snapshot_publish().  It goes into a
+ * single slot, the newest one wins, and the loop takes it out in an async
+ * callback, between the callbacks of any two sessions.  On SIGHUP, the
+ * config.reload callback fills in a new configuration on a thread of the
+ * file system pool, which then publishes it.  Retired snapshots that are
+ * still in use are counted as config_retired.
+ *
+ * Reclamation is by epoch.  Each snapshot is an epoch, and it counts the
+ * sessions that entered it, and the background cache refreshes they
+ * started, which use its upstream groups; entering and leaving are the
+ * only work a session does for this, and since both happen on the loop
+ * thread they are plain increments.  Once an epoch is no longer current and its last
+ * session has left, nothing can refer to it any more and it's freed, its
+ * idle upstream connections with it.
+ *
+ * What's sized once at startup stays as it was started: the listeners, the
+ * caches, the pools and their threads, DNS caching and draining.  Those
+ * are read from state->config, which has no routes.
+ */
+
+static void snapshot_normalize(server_config *cf);
+static char *snapshot_str(char **p, const char *s);
+static void snapshot_attach(server_state *state, config_snapshot *snap);
+static void snapshot_take(uv_async_t *handle);
+static void snapshot_reclaim(server_state *state, config_snapshot *snap);
+static void reload_start(uv_signal_t *handle, int signum);
+static void reload_work(work_job *job);
+static void reload_done(work_job *job, int status);
+
+/* Any thread.  Copies |cf|; what it points to may go away afterwards. */
+config_snapshot *snapshot_new(const server_config *cf) {
+  const route_config *r;
+  config_snapshot *snap;
+  route_config *routes;
+  backend_config *bc;
+  unsigned int i;
+  unsigned int k;
+  size_t size;
+  char *p;
+
+  size = sizeof(*snap) + cf->nroutes * sizeof(routes[0]);
+  for (i = 0; i < cf->nroutes; i += 1) {
+    r = cf->routes + i;
+    size += r->prefix != NULL ? strlen(r->prefix) + 1 : 0;
+    size += r->root != NULL ? strlen(r->root) + 1 : 0;
+    size += r->host != NULL ? strlen(r->host) + 1 : 0;
+    size += r->lb_key != NULL ? strlen(r->lb_key) + 1 : 0;
+    if (r->backends != NULL) {
+      size += r->nbackends * sizeof(bc[0]);
+      for (k = 0; k < r->nbackends; k += 1) {
+        size += strlen(r->backends[k].host) + 1;
+      }
+    }
+  }
+
+  /* The arrays come first; pointers align them, the strings need nothing. */
+  snap = xmalloc(size);
+  memset(snap, 0, sizeof(*snap));
+  snap->config = *cf;
+  routes = (route_config *) (snap + 1);
+  p = (char *) (routes + cf->nroutes);
+  for (i = 0; i < cf->nroutes; i += 1) {
+    r = cf->routes + i;
+    routes[i] = *r;
+    if (r->backends != NULL) {
+      bc = (backend_config *) p;
+      p += r->nbackends * sizeof(bc[0]);
+      memcpy(bc, r->backends, r->nbackends * sizeof(bc[0]));
+      routes[i].backends = bc;
+    }
+  }
+  for (i = 0; i < cf->nroutes; i += 1) {
+    routes[i].prefix = snapshot_str(&p, routes[i].prefix);
+    routes[i].root = snapshot_str(&p, routes[i].root);
+    routes[i].host = snapshot_str(&p, routes[i].host);
+    routes[i].lb_key = snapshot_str(&p, routes[i].lb_key);
+    if (routes[i].backends != NULL) {
+      bc = (backend_config *) routes[i].backends;
+      for (k = 0; k < routes[i].nbackends; k += 1) {
+        bc[k].host = snapshot_str(&p, bc[k].host);
+      }
+    }
+  }
+  ASSERT(p == (char *) snap + size);
+
+  snap->config.routes = routes;
+  snapshot_normalize(&snap->config);
+  return snap;
+}
+
+/* Frees a snapshot that no session runs under and that has no connections
+ * open any more, or that was never attached.
+ */
+void snapshot_free(config_snapshot *snap) {
+  unsigned int i;
+
+  if (snap->groups != NULL) {
+    for (i = 0; i < snap->config.nroutes; i += 1) {
+      if (snap->config.routes[i].kind == route_proxy) {
+        upstream_group_free(snap->groups + i);
+      }
+    }
+    free(snap->groups);
+  }
+  free(snap);
+}
+
+/* Makes |snap| the first snapshot.  Reloads are off without config.reload. */
+void snapshot_init(server_state *state, config_snapshot *snap) {
+  snapshot_attach(state, snap);
+  state->snap = snap;
+  CHECK(0 == uv_async_init(state->loop, &state->reload_async, snapshot_take));
+  uv_unref((uv_handle_t *) &state->reload_async);
+
+  if (snap->config.reload == NULL) {
+    return;
+  }
+
+  CHECK(0 == uv_signal_init(state->loop, &state->reload_signal));
+  CHECK(0 == uv_signal_start(&state->reload_signal, reload_start, SIGHUP));
+  uv_unref((uv_handle_t *) &state->reload_signal);
+}
+
+/* Thread-safe.  New sessions run under |snap| from the loop's next turn
+ * on.  Another snapshot published before then replaces it.
+ */
+void snapshot_publish(server_state *state, config_snapshot *snap) {
+  config_snapshot *old;
+
+  old = atom_xchg_ptr(&state->reload_pending, snap);
+  if (old != NULL) {
+    snapshot_free(old);  /* Never attached, the loop didn't get to it. */
+  }
+  uv_async_send(&state->reload_async);
+}
+
+/* A session starts: it runs under the current snapshot until it leaves. */
+config_snapshot *snapshot_enter(server_state *state) {
+  state->snap->readers += 1;
+  return state->snap;
+}
+
+/* Work that outlives its session, like a background cache refresh, keeps
+ * the session's snapshot in use; it calls snapshot_leave() when done.
+ */
+void snapshot_hold(config_snapshot *snap) {
+  snap->readers += 1;
+}
+
+void snapshot_leave(server_state *state, config_snapshot *snap) {
+  ASSERT(snap->readers > 0);
+  snap->readers -= 1;
+  if (snap->readers == 0 && snap != state->snap) {
+    snapshot_reclaim(state, snap);
+  }
+}
+
+/* On the way out, once there are no sessions left.  Closes what the
+ * current snapshot has open; it's freed after the loop has run.
+ */
+void snapshot_close(server_state *state) {
+  config_snapshot *snap;
+  unsigned int i;
+
+  snap = atom_xchg_ptr(&state->reload_pending, NULL);
+  if (snap != NULL) {
+    snapshot_free(snap);
+  }
+
+  static_watch_stop(state);
+  snap = state->snap;
+  for (i = 0; i < snap->config.nroutes; i += 1) {
+    if (snap->config.routes[i].kind == route_proxy) {
+      upstream_group_flush(snap->groups + i);
+    }
+  }
+}
+
+int snapshot_stats(const server_state *state, char *buf, size_t len) {
+  return snprintf(buf,
+                  len,
+                  "config_epoch %llu\n"
+                  "config_reloads %llu\n"
+                  "config_reload_failures %llu\n"
+                  "config_retired %u\n",
+                  (unsigned long long) state->snap->epoch,
+                  (unsigned long long) state->reloads,
+                  (unsigned long long) state->reload_failures,
+                  state->retired);
+}
+
+/* The per-request settings, as server_run() does for the others. */
+static void snapshot_normalize(server_config *cf) {
+  if (cf->stream_bufs == 0) {
+    cf->stream_bufs = 1;
+  }
+  if (cf->stream_bufs > STATIC_MAX_RING) {
+    cf->stream_bufs = STATIC_MAX_RING;
+  }
+  if (cf->stream_chunk == 0) {
+    cf->stream_chunk = 64 * 1024;
+  }
+  if (cf->relay_bufs == 0) {
+    cf->relay_bufs = 1;
+  }
+  if (cf->relay_bufs > RELAY_MAX_BUFS) {
+    cf->relay_bufs = RELAY_MAX_BUFS;
+  }
+  if (cf->relay_chunk == 0) {
+    cf->relay_chunk = 16 * 1024;
+  }
+  if (cf->relay_max_inflight == 0) {
+    cf->relay_max_inflight = cf->relay_bufs * cf->relay_chunk;
+  }
+  if (cf->eject_ms == 0) {
+    cf->eject_ms = 10 * 1000;
+  }
+  if (cf->eject_max_ms < cf->eject_ms) {
+    cf->eject_max_ms = cf->eject_ms;
+  }
+  if (cf->probe_every == 0) {
+    cf->probe_every = 1;
+  }
+  if (cf->hedge_percentile == 0 || cf->hedge_percentile > 100) {
+    cf->hedge_percentile = 95;
+  }
+  if (cf->connect_ports[0] == 0) {
+    cf->connect_ports[0] = 443;
+  }
+#if defined(_WIN32)
+  /* uv_fs_sendfile() only emulates sendfile there: it writes through a
+   * CRT descriptor, synchronously, from the file's shared position.  The
+   * read ring does the same work without those problems.
+   */
+  cf->use_sendfile = 0;
+#endif
+}
+
+/* Copies |s| to *p and moves *p past it. */
+static char *snapshot_str(char **p, const char *s) {
+  char *copy;
+  size_t len;
+
+  if (s == NULL) {
+    return NULL;
+  }
+
+  len = strlen(s) + 1;
+  copy = *p;
+  memcpy(copy, s, len);
+  *p += len;
+  return copy;
+}
+
+/* Loop thread.  Builds what the snapshot needs a loop for. */
+static void snapshot_attach(server_state *state, config_snapshot *snap) {
+  const server_config *cf;
+  unsigned int i;
+
+  /* One backend group per proxy route; they're indexed like the routes. */
+  cf = &snap->config;
+  snap->groups = xmalloc((cf->nroutes + 1) * sizeof(snap->groups[0]));
+  for (i = 0; i < cf->nroutes; i += 1) {
+    if (cf->routes[i].kind == route_proxy) {
+      upstream_group_init(snap->groups + i, state->loop, cf, cf->routes + i);
+    }
+  }
+}
+
+static void snapshot_take(uv_async_t *handle) {
+  config_snapshot *snap;
+  config_snapshot *old;
+  server_state *state;
+
+  state = CONTAINER_OF(handle, server_state, reload_async);
+  snap = atom_xchg_ptr(&state->reload_pending, NULL);
+  if (snap == NULL) {
+    return;  /* Taken along with an earlier wakeup. */
+  }
+
+  snapshot_attach(state, snap);
+  old = state->snap;
+  snap->epoch = old->epoch + 1;
+  state->snap = snap;
+  state->reloads += 1;
+  state->retired += 1;
+  static_watch_stop(state);
+  static_watch_start(state);
+  pr_info("config epoch %llu: %u routes, %u sessions on the old one",
+          (unsigned long long) snap->epoch,
+          snap->config.nroutes,
+          old->readers);
+
+  if (old->readers == 0) {
+    snapshot_reclaim(state, old);
+  }
+}
+
+/* The grace period is over, see above. */
+static void snapshot_reclaim(server_state *state, config_snapshot *snap) {
+  unsigned int i;
+
+  state->retired -= 1;
+  for (i = 0; i < snap->config.nroutes; i += 1) {
+    if (snap->config.routes[i].kind == route_proxy) {
+      upstream_group_flush(snap->groups + i);
+    }
+  }
+  snapshot_free(snap);
+}
+
+static void reload_start(uv_signal_t *handle, int signum) {
+  server_state *state;
+
+  state = CONTAINER_OF(handle, server_state, reload_signal);
+  if (state->reloading || state->draining) {
+    return;
+  }
+
+  pr_info("signal %d, reloading the configuration", signum);
+  state->reloading = 1;
+  state->reload_config = state->config;
+  work_pool_submit(&state->fs, &state->reload_job, reload_work, reload_done);
+}
+
+/* Worker thread.  The callback may read files, it's off the loop. */
+static void reload_work(work_job *job) {
+  server_state *state;
+
+  state = CONTAINER_OF(job, server_state, reload_job);
+  state->reload_status = state->reload_config.reload(&state->reload_config);
+  if (state->reload_status == 0) {
+    snapshot_publish(state, snapshot_new(&state->reload_config));
+  }
+}
+
+static void reload_done(work_job *job, int status) {
+  server_state *state;
+
+  state = CONTAINER_OF(job, server_state, reload_job);
+  state->reloading = 0;
+  if (status == 0 && state->reload_status != 0) {
+    pr_warn("reload failed, keeping the configuration");
+    state->reload_failures += 1;
+  }
+}
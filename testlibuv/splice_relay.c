@@ -0,0 +1,264 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* splice(), pipe2() */
+#endif
+
+#include "defs.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+/* Moves a known number of bytes from one TCP connection to another without
+ * copying them through user space: socket to pipe, pipe to socket, with
+ * splice().  The pipe is the only buffer, so reading stops while it's full
+ * and the usual flow control applies.
+ *
+ * libuv won't watch a descriptor that a handle already owns, so the relay
+ * polls duplicates of the two sockets.  The owners must not read or write
+ * while the relay runs.  Only Linux has splice(); elsewhere
+ * splice_relay_start() fails with UV_ENOSYS and callers copy as before.
+ */
+
+#define SPLICE_CHUNK (64 * 1024)  /* The default pipe capacity. */
+
+#if defined(__linux__)
+
+static int relay_fd(uv_tcp_t *handle, int *fd);
+static void relay_pump(splice_relay *sr);
+static void relay_poll_done(uv_poll_t *handle, int status, int events);
+static void relay_close_done(uv_handle_t *handle);
+static void relay_free(splice_relay *sr);
+
+/* Starts moving |len| bytes from |from| to |to|.  |cb| runs whenever bytes
+ * have moved and when an error stops the relay; sr->left is zero once
+ * everything is through.  The caller frees the relay with
+ * splice_relay_stop(), after which |cb| doesn't run anymore.
+ */
+int splice_relay_start(uv_loop_t *loop,
+                       uv_tcp_t *from,
+                       uv_tcp_t *to,
+                       uint64_t len,
+                       splice_cb cb,
+                       void *data,
+                       splice_relay **out) {
+  splice_relay *sr;
+  int err;
+
+  sr = xmalloc(sizeof(*sr));
+  memset(sr, 0, sizeof(*sr));
+  sr->infd = -1;
+  sr->outfd = -1;
+  sr->pipefd[0] = -1;
+  sr->pipefd[1] = -1;
+  sr->cb = cb;
+  sr->data = data;
+  sr->left = len;
+  sr->toread = len;
+
+  err = relay_fd(from, &sr->infd);
+  if (err == 0) {
+    err = relay_fd(to, &sr->outfd);
+  }
+  if (err == 0 && pipe2(sr->pipefd, O_NONBLOCK | O_CLOEXEC)) {
+    err = -errno;
+  }
+  if (err == 0) {
+    err = uv_poll_init(loop, &sr->in_poll, sr->infd);
+  }
+  if (err != 0) {
+    relay_free(sr);
+    return err;
+  }
+
+  sr->in_poll.data = sr;
+  err = uv_poll_init(loop, &sr->out_poll, sr->outfd);
+  if (err != 0) {
+    sr->closing = 1;
+    uv_close((uv_handle_t *) &sr->in_poll, relay_close_done);
+    return err;
+  }
+
+  sr->out_poll.data = sr;
+  *out = sr;
+
+  /* The first round usually finds data waiting; report it right away
+   * through the poll callbacks instead of calling back from here.
+   */
+  CHECK(0 == uv_poll_start(&sr->in_poll, UV_READABLE, relay_poll_done));
+  CHECK(0 == uv_poll_start(&sr->out_poll, UV_WRITABLE, relay_poll_done));
+  return 0;
+}
+
+void splice_relay_stop(splice_relay *sr) {
+  sr->cb = NULL;
+  sr->closing = 2;
+  uv_close((uv_handle_t *) &sr->in_poll, relay_close_done);
+  uv_close((uv_handle_t *) &sr->out_poll, relay_close_done);
+}
+
+static int relay_fd(uv_tcp_t *handle, int *fd) {
+  uv_os_fd_t osfd;
+  int err;
+
+  err = uv_fileno((uv_handle_t *) handle, &osfd);
+  if (err != 0) {
+    return err;
+  }
+
+  *fd = fcntl(osfd, F_DUPFD_CLOEXEC, 0);
+  return *fd == -1 ? -errno : 0;
+}
+
+/* Fills the pipe from the source and drains it into the sink until one of
+ * them would block, then waits for whichever that was.
+ */
+static void relay_pump(splice_relay *sr) {
+  unsigned int want_in;
+  unsigned int want_out;
+  ssize_t n;
+  size_t len;
+  int moved;
+
+  moved = 0;
+  want_in = 0;
+  want_out = 0;
+  for (;;) {
+    if (sr->toread > 0 && sr->inpipe < SPLICE_CHUNK) {
+      len = SPLICE_CHUNK - sr->inpipe;
+      if (sr->toread < len) {
+        len = (size_t) sr->toread;
+      }
+      n = splice(sr->infd,
+                 NULL,
+                 sr->pipefd[1],
+                 NULL,
+                 len,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        sr->inpipe += n;
+        sr->toread -= n;
+        continue;
+      }
+      if (n == 0) {
+        sr->result = UV_EOF;  /* Peer closed before sending it all. */
+        break;
+      }
+      if (errno != EAGAIN) {
+        sr->result = -errno;
+        break;
+      }
+      if (sr->inpipe == 0) {
+        want_in = 1;  /* Nothing to drain either. */
+      }
+    }
+
+    if (sr->inpipe == 0) {
+      break;
+    }
+
+    n = splice(sr->pipefd[0],
+               NULL,
+               sr->outfd,
+               NULL,
+               sr->inpipe,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      sr->inpipe -= n;
+      sr->left -= n;
+      sr->moved += n;
+      moved = 1;
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      want_out = 1;
+      want_in = sr->toread > 0 && sr->inpipe < SPLICE_CHUNK;
+      break;
+    }
+    sr->result = n == 0 ? UV_EOF : -errno;
+    break;
+  }
+
+  if (sr->result == 0 && sr->left > 0) {
+    if (want_in) {
+      CHECK(0 == uv_poll_start(&sr->in_poll, UV_READABLE, relay_poll_done));
+    } else {
+      CHECK(0 == uv_poll_stop(&sr->in_poll));
+    }
+    if (want_out) {
+      CHECK(0 == uv_poll_start(&sr->out_poll, UV_WRITABLE, relay_poll_done));
+    } else {
+      CHECK(0 == uv_poll_stop(&sr->out_poll));
+    }
+  } else {
+    uv_poll_stop(&sr->in_poll);
+    uv_poll_stop(&sr->out_poll);
+  }
+
+  if (moved || sr->result != 0 || sr->left == 0) {
+    sr->cb(sr);
+  }
+}
+
+static void relay_poll_done(uv_poll_t *handle, int status, int events) {
+  splice_relay *sr;
+
+  sr = handle->data;
+  if (status < 0) {
+    sr->result = status;
+    uv_poll_stop(&sr->in_poll);
+    uv_poll_stop(&sr->out_poll);
+    sr->cb(sr);
+    return;
+  }
+
+  relay_pump(sr);
+}
+
+static void relay_close_done(uv_handle_t *handle) {
+  splice_relay *sr;
+
+  sr = handle->data;
+  sr->closing -= 1;
+  if (sr->closing > 0) {
+    return;
+  }
+
+  relay_free(sr);
+}
+
+/* The descriptors are closed only now that no poll handle watches them. */
+static void relay_free(splice_relay *sr) {
+  if (sr->infd != -1) {
+    close(sr->infd);
+  }
+  if (sr->outfd != -1) {
+    close(sr->outfd);
+  }
+  if (sr->pipefd[0] != -1) {
+    close(sr->pipefd[0]);
+    close(sr->pipefd[1]);
+  }
+  free(sr);
+}
+
+#else  /* !defined(__linux__) */
+
+int splice_relay_start(uv_loop_t *loop,
+                       uv_tcp_t *from,
+                       uv_tcp_t *to,
+                       uint64_t len,
+                       splice_cb cb,
+                       void *data,
+                       splice_relay **out) {
+  return UV_ENOSYS;
+}
+
+void splice_relay_stop(splice_relay *sr) {
+  UNREACHABLE();
+}
+
+#endif
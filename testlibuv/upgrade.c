@@ -0,0 +1,337 @@
+#include "defs.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef INET6_ADDRSTRLEN
+# define INET6_ADDRSTRLEN 63
+#endif
+
+/* Hot upgrades: on UPGRADE_SIGNAL, the server runs a new copy of itself
+ * and hands it the listening sockets, so that the port never closes.
+ *
+ * The old process spawns the new one with an IPC pipe as its fd 3 and
+ * sends each listener down that pipe with uv_write2(), one 'L' byte per
+ * listener, then an 'E'.  The new process starts listening on what it got
+ * and answers 'R'.  Only then does the old one close its listeners and
+ * drain; connections that were queued in the kernel meanwhile are still
+ * there for the new process to accept, since both share the sockets.
+ * If the new process dies or hangs up before it's ready, the old one
+ * carries on as if nothing happened.
+ *
+ * argv[0] is run rather than uv_exepath(), so that a binary that was
+ * replaced on disk is picked up.
+ */
+
+#if defined(SIGUSR2)
+# define UPGRADE_SIGNAL SIGUSR2
+#else
+# define UPGRADE_SIGNAL SIGBREAK
+#endif
+
+#define UPGRADE_ENV "SERVER_UPGRADE_FD"
+#define UPGRADE_FD 3
+
+static void upgrade_start(uv_signal_t *handle, int signum);
+static void upgrade_sent(uv_write_t *req, int status);
+static void upgrade_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void upgrade_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf);
+static void upgrade_exit(uv_process_t *process,
+                         int64_t exit_status,
+                         int term_signal);
+static void upgrade_abort(upgrade_ctx *u, const char *why);
+static void upgrade_close_done(uv_handle_t *handle);
+static void inherit_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf);
+static void inherit_listen(server_state *state);
+static void inherit_ready_done(uv_write_t *req, int status);
+
+/* Old process.  Upgrades are off without config.argv. */
+void upgrade_init(server_state *state) {
+  upgrade_ctx *u;
+
+  u = &state->upgrade;
+  if (state->config.argv == NULL) {
+    return;
+  }
+
+  CHECK(0 == uv_signal_init(state->loop, &u->signal));
+  CHECK(0 == uv_signal_start(&u->signal, upgrade_start, UPGRADE_SIGNAL));
+  uv_unref((uv_handle_t *) &u->signal);
+}
+
+/* New process.  Returns nonzero if it was started by an upgrade; the
+ * listeners then come from the old process.
+ */
+int upgrade_inherit(server_state *state) {
+  upgrade_ctx *u;
+  const char *env;
+
+  u = &state->upgrade;
+  env = getenv(UPGRADE_ENV);
+  if (env == NULL || atoi(env) != UPGRADE_FD) {
+    return 0;
+  }
+
+  /* Our own upgrades set it again. */
+#if defined(_WIN32)
+  _putenv_s(UPGRADE_ENV, "");
+#else
+  unsetenv(UPGRADE_ENV);
+#endif
+
+  CHECK(0 == uv_pipe_init(state->loop, &u->pipe, 1));
+  CHECK(0 == uv_pipe_open(&u->pipe, UPGRADE_FD));
+  CHECK(0 == uv_read_start((uv_stream_t *) &u->pipe,
+                           upgrade_alloc,
+                           inherit_read_done));
+  u->running = 1;
+  return 1;
+}
+
+static void upgrade_start(uv_signal_t *handle, int signum) {
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[UPGRADE_FD + 1];
+  server_state *state;
+  upgrade_ctx *u;
+  uv_buf_t buf;
+  unsigned int i;
+  int err;
+
+  u = CONTAINER_OF(handle, upgrade_ctx, signal);
+  state = CONTAINER_OF(u, server_state, upgrade);
+  if (u->running || state->draining || state->nservers == 0) {
+    return;
+  }
+
+  pr_info("upgrading: starting %s", state->config.argv[0]);
+  CHECK(0 == uv_pipe_init(state->loop, &u->pipe, 1));
+
+  memset(stdio, 0, sizeof(stdio));
+  for (i = 0; i < UPGRADE_FD; i += 1) {
+    stdio[i].flags = UV_INHERIT_FD;
+    stdio[i].data.fd = (int) i;
+  }
+  stdio[UPGRADE_FD].flags =
+      UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE;
+  stdio[UPGRADE_FD].data.stream = (uv_stream_t *) &u->pipe;
+
+  memset(&options, 0, sizeof(options));
+  options.exit_cb = upgrade_exit;
+  options.file = state->config.argv[0];
+  options.args = state->config.argv;
+  options.stdio = stdio;
+  options.stdio_count = UPGRADE_FD + 1;
+
+  /* The environment is inherited, so this is the simplest way in. */
+#if defined(_WIN32)
+  _putenv_s(UPGRADE_ENV, "3");
+#else
+  setenv(UPGRADE_ENV, "3", 1);
+#endif
+  err = uv_spawn(state->loop, &u->process, &options);
+#if defined(_WIN32)
+  _putenv_s(UPGRADE_ENV, "");
+#else
+  unsetenv(UPGRADE_ENV);
+#endif
+
+  if (err != 0) {
+    pr_err("upgrade: spawn %s: %s", options.file, uv_strerror(err));
+    uv_close((uv_handle_t *) &u->process, NULL);
+    uv_close((uv_handle_t *) &u->pipe, NULL);
+    return;
+  }
+
+  u->running = 1;
+  u->reqs = xmalloc((state->nservers + 1) * sizeof(u->reqs[0]));
+  buf = uv_buf_init("L", 1);
+  for (i = 0; i < state->nservers; i += 1) {
+    CHECK(0 == uv_write2(u->reqs + i,
+                         (uv_stream_t *) &u->pipe,
+                         &buf,
+                         1,
+                         (uv_stream_t *) &state->servers[i].tcp_handle,
+                         upgrade_sent));
+  }
+  buf = uv_buf_init("E", 1);
+  CHECK(0 == uv_write(u->reqs + i,
+                      (uv_stream_t *) &u->pipe,
+                      &buf,
+                      1,
+                      upgrade_sent));
+  CHECK(0 == uv_read_start((uv_stream_t *) &u->pipe,
+                           upgrade_alloc,
+                           upgrade_read_done));
+}
+
+/* An error here shows up as a hangup on the read side, too. */
+static void upgrade_sent(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) {
+    pr_err("upgrade: send: %s", uv_strerror(status));
+  }
+}
+
+static void upgrade_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(handle, upgrade_ctx, pipe);
+  buf->base = u->buf;
+  buf->len = sizeof(u->buf);
+}
+
+/* Old process: waits for the new one to say it's listening. */
+static void upgrade_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf) {
+  server_state *state;
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(handle, upgrade_ctx, pipe);
+  state = CONTAINER_OF(u, server_state, upgrade);
+  if (nread == 0) {
+    return;  /* EAGAIN. */
+  }
+
+  if (nread < 0 || buf->base[0] != 'R') {
+    upgrade_abort(u, nread < 0 ? uv_strerror((int) nread) : "bad reply");
+    return;
+  }
+
+  pr_info("upgrading: pid %d is listening", u->process.pid);
+  uv_close((uv_handle_t *) &u->pipe, upgrade_close_done);
+  uv_close((uv_handle_t *) &u->process, NULL);  /* It lives on without us. */
+  server_drain(state, 0);
+}
+
+static void upgrade_exit(uv_process_t *process,
+                         int64_t exit_status,
+                         int term_signal) {
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(process, upgrade_ctx, process);
+  pr_err("upgrade: pid %d exited, status %d, signal %d",
+         process->pid,
+         (int) exit_status,
+         term_signal);
+  upgrade_abort(u, "exited");
+}
+
+/* Keeps serving on our own listeners. */
+static void upgrade_abort(upgrade_ctx *u, const char *why) {
+  if (!u->running) {
+    return;
+  }
+
+  pr_err("upgrade failed: %s", why);
+  uv_close((uv_handle_t *) &u->pipe, upgrade_close_done);
+  uv_close((uv_handle_t *) &u->process, NULL);
+  u->running = 0;
+}
+
+/* The writes have been called back by now. */
+static void upgrade_close_done(uv_handle_t *handle) {
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(handle, upgrade_ctx, pipe);
+  free(u->reqs);
+  u->reqs = NULL;
+}
+
+/* New process: collects the listeners up to the 'E'. */
+static void inherit_read_done(uv_stream_t *handle,
+                              ssize_t nread,
+                              const uv_buf_t *buf) {
+  server_state *state;
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(handle, upgrade_ctx, pipe);
+  state = CONTAINER_OF(u, server_state, upgrade);
+  if (nread == 0) {
+    return;  /* EAGAIN. */
+  }
+
+  if (nread < 0) {
+    pr_err("upgrade: old process hung up: %s", uv_strerror((int) nread));
+    log_stop();
+    abort();  /* Nothing to listen on. */
+  }
+
+  if (memchr(buf->base, 'E', (size_t) nread) == NULL) {
+    return;  /* The handles wait in the pipe until then. */
+  }
+
+  uv_read_stop(handle);
+  inherit_listen(state);
+}
+
+static void inherit_listen(server_state *state) {
+  char addrbuf[INET6_ADDRSTRLEN + 1];
+  struct sockaddr_storage addr;
+  upgrade_ctx *u;
+  server_ctx *sx;
+  uv_buf_t buf;
+  unsigned int n;
+  int addrlen;
+  int err;
+
+  u = &state->upgrade;
+  n = (unsigned int) uv_pipe_pending_count(&u->pipe);
+  CHECK(n > 0);
+  state->servers = xmalloc(n * sizeof(state->servers[0]));
+
+  for (state->nservers = 0; state->nservers < n; state->nservers += 1) {
+    sx = state->servers + state->nservers;
+    sx->loop = state->loop;
+    sx->state = state;
+    CHECK(UV_TCP == uv_pipe_pending_type(&u->pipe));
+    CHECK(0 == uv_tcp_init(state->loop, &sx->tcp_handle));
+    CHECK(0 == uv_accept((uv_stream_t *) &u->pipe,
+                         (uv_stream_t *) &sx->tcp_handle));
+
+    err = server_listen(sx);
+    if (err != 0) {
+      pr_err("upgrade: uv_listen: %s", uv_strerror(err));
+      log_stop();
+      abort();
+    }
+
+    addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    uv_tcp_getsockname(&sx->tcp_handle, (struct sockaddr *) &addr, &addrlen);
+    if (addr.ss_family == AF_INET6) {
+      uv_ip6_name((struct sockaddr_in6 *) &addr, addrbuf, sizeof(addrbuf));
+      pr_info("listening on %s:%hu (inherited)",
+              addrbuf,
+              ntohs(((struct sockaddr_in6 *) &addr)->sin6_port));
+    } else {
+      uv_ip4_name((struct sockaddr_in *) &addr, addrbuf, sizeof(addrbuf));
+      pr_info("listening on %s:%hu (inherited)",
+              addrbuf,
+              ntohs(((struct sockaddr_in *) &addr)->sin_port));
+    }
+  }
+
+  u->reqs = xmalloc(sizeof(u->reqs[0]));
+  buf = uv_buf_init("R", 1);
+  CHECK(0 == uv_write(u->reqs,
+                      (uv_stream_t *) &u->pipe,
+                      &buf,
+                      1,
+                      inherit_ready_done));
+}
+
+static void inherit_ready_done(uv_write_t *req, int status) {
+  upgrade_ctx *u;
+
+  u = CONTAINER_OF(req->handle, upgrade_ctx, pipe);
+  if (status < 0) {
+    pr_err("upgrade: ready: %s", uv_strerror(status));
+  }
+  uv_close((uv_handle_t *) &u->pipe, upgrade_close_done);
+  u->running = 0;
+}
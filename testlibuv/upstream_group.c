@@ -0,0 +1,612 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Picks the backend of a proxy route for each request.  All of it runs on
+ * the loop thread that owns the group, so the load and latency figures are
+ * plain counters.
+ *
+ * lb_least_outstanding sends the request where the fewest are in flight.
+ * lb_p2c looks at only two random backends and takes the one with the
+ * lower latency times load; that avoids the herd that forms on whichever
+ * backend looks best when many loops decide on stale numbers.  lb_hash maps
+ * a request key onto a ring of points so the same key keeps hitting the
+ * same backend's caches, but skips to the next backend on the ring when
+ * the first one already carries more than its share (c = 1.25).
+ *
+ * Health is judged from the proxied traffic alone.  Connect errors,
+ * timeouts, 5xx answers and an average latency far above the other
+ * backends' all count as failures; enough of them in a row take the
+ * backend out of rotation.  Once its time is up it gets one pick in
+ * probe_every, at most one at a time, until a probe succeeds.  A failed
+ * probe doubles the next ejection.  The last backend in rotation is never
+ * ejected; when only ejected ones could take a request they are used
+ * anyway.
+ *
+ * Routes that hedge keep a histogram of recent times to first byte.  A
+ * request that hasn't been answered at hedge_percentile of them goes out
+ * again to another backend, see upstream_hedge.c.  Every request that
+ * could be hedged earns hedge_budget percent of a hedge, so hedging never
+ * adds more than that to the backends' load, even when all of them slow
+ * down at once.
+ */
+
+#define EWMA_SHIFT 3  /* New samples weigh 1/8. */
+#define OUTLIER_MIN_US 1000  /* Below this, latency differences are noise. */
+#define TTFB_WINDOW 2048  /* Halve the histogram when it holds this many. */
+#define TTFB_RECALC 32  /* Samples between updates of the hedge delay. */
+#define HEDGE_BURST 10  /* Hedges the budget can save up. */
+
+static int point_cmp(const void *a, const void *b);
+static uint32_t point_hash(const char *s, size_t len, uint32_t h);
+static upstream_backend *pick_least(upstream_group *g);
+static upstream_backend *pick_p2c(upstream_group *g);
+static upstream_backend *pick_hash(upstream_group *g,
+                                   const char *key,
+                                   size_t keylen);
+static uint64_t backend_cost(const upstream_backend *b);
+static upstream_backend *pick_probe(upstream_group *g);
+static int backend_outlier(const upstream_group *g, const upstream_backend *b);
+static void backend_eject(upstream_group *g, upstream_backend *b);
+static void ttfb_record(upstream_group *g, uint64_t us);
+static unsigned int ttfb_bucket(uint64_t us);
+static uint64_t ttfb_value(unsigned int bucket);
+
+void upstream_group_init(upstream_group *g,
+                         uv_loop_t *loop,
+                         const server_config *cf,
+                         const route_config *route) {
+  const backend_config *bc;
+  backend_config single;
+  upstream_point *pt;
+  char name[300];
+  unsigned int i;
+  unsigned int k;
+  int n;
+
+  memset(g, 0, sizeof(*g));
+  g->route = route;
+  g->cf = cf;
+  g->loop = loop;
+  g->rand = 2463534242u;
+
+  bc = route->backends;
+  g->nbackends = route->nbackends;
+  if (bc == NULL || g->nbackends == 0) {
+    single.host = route->host;
+    single.port = route->port;
+    bc = &single;
+    g->nbackends = 1;
+  }
+
+  g->backends = xmalloc(g->nbackends * sizeof(g->backends[0]));
+  memset(g->backends, 0, g->nbackends * sizeof(g->backends[0]));
+  for (i = 0; i < g->nbackends; i += 1) {
+    upstream_pool_init(&g->backends[i].pool,
+                       loop,
+                       bc[i].host,
+                       bc[i].port,
+                       cf->upstream_max_idle,
+                       cf->upstream_idle_timeout);
+  }
+
+  if (route->lb != lb_hash) {
+    return;
+  }
+
+  g->npoints = g->nbackends * UPSTREAM_POINTS;
+  g->ring = xmalloc(g->npoints * sizeof(g->ring[0]));
+  pt = g->ring;
+  for (i = 0; i < g->nbackends; i += 1) {
+    for (k = 0; k < UPSTREAM_POINTS; k += 1) {
+      n = snprintf(name, sizeof(name), "%s:%u#%u", bc[i].host, bc[i].port, k);
+      pt->hash = point_hash(name, (size_t) n, 2166136261u);
+      pt->backend = i;
+      pt += 1;
+    }
+  }
+  qsort(g->ring, g->npoints, sizeof(g->ring[0]), point_cmp);
+}
+
+/* Closes the idle connections to every backend. */
+void upstream_group_flush(upstream_group *g) {
+  unsigned int i;
+
+  for (i = 0; i < g->nbackends; i += 1) {
+    upstream_pool_flush(&g->backends[i].pool);
+  }
+}
+
+void upstream_group_free(upstream_group *g) {
+  free(g->backends);
+  free(g->ring);
+  g->backends = NULL;
+  g->ring = NULL;
+}
+
+/* Chooses a backend and counts the request against it until it's handed
+ * to upstream_group_done().  |key| is only used by lb_hash.
+ */
+upstream_backend *upstream_group_pick(upstream_group *g,
+                                      const char *key,
+                                      size_t keylen) {
+  upstream_backend *b;
+
+  g->picks += 1;
+  b = NULL;
+  if (g->nejected > 0) {
+    b = pick_probe(g);
+  }
+
+  if (b != NULL) {
+    b->probes += 1;
+  } else if (g->nbackends == 1) {
+    b = g->backends;
+  } else if (g->route->lb == lb_p2c) {
+    b = pick_p2c(g);
+  } else if (g->route->lb == lb_hash) {
+    b = pick_hash(g, key, keylen);
+  } else {
+    b = pick_least(g);
+  }
+
+  b->inflight += 1;
+  b->requests += 1;
+  g->inflight += 1;
+  return b;
+}
+
+void upstream_group_done(upstream_group *g, upstream_backend *b) {
+  ASSERT(b->inflight > 0);
+  b->inflight -= 1;
+  g->inflight -= 1;
+}
+
+/* A response from |b| took |us| to start.  Folds that into the moving
+ * average, and brings the backend back if this was a probe.
+ */
+void upstream_backend_sample(upstream_group *g,
+                             upstream_backend *b,
+                             uint64_t us) {
+  if (g->route->hedge) {
+    ttfb_record(g, us);
+  }
+
+  if (b->ejected_until != 0) {
+    if (uv_now(g->loop) < b->ejected_until) {
+      return;  /* Picked before the ejection. */
+    }
+    pr_info("upstream %s:%u back in rotation", b->pool.host, b->pool.port);
+    b->ejected_until = 0;
+    b->consecutive = 0;
+    b->ewma_us = us;  /* The old average is what got it ejected. */
+    g->nejected -= 1;
+    return;
+  }
+
+  if (b->ewma_us == 0) {
+    b->ewma_us = us;
+  } else if (us > b->ewma_us) {
+    b->ewma_us += (us - b->ewma_us) >> EWMA_SHIFT;
+  } else {
+    b->ewma_us -= (b->ewma_us - us) >> EWMA_SHIFT;
+  }
+
+  if (backend_outlier(g, b)) {
+    upstream_backend_failed(g, b);
+  } else {
+    b->consecutive = 0;
+  }
+}
+
+/* |b| didn't answer, answered with a 5xx or was too slow. */
+void upstream_backend_failed(upstream_group *g, upstream_backend *b) {
+  b->failures += 1;
+  if (b->ejected_until != 0) {
+    if (uv_now(g->loop) >= b->ejected_until) {
+      backend_eject(g, b);  /* The probe failed. */
+    }
+    return;
+  }
+
+  b->consecutive += 1;
+  if (g->cf->health_failures > 0 && b->consecutive >= g->cf->health_failures) {
+    backend_eject(g, b);
+  }
+}
+
+/* Called for each request that could be hedged.  Returns how long to wait
+ * for its first response byte before hedging, in ms, or 0 while there are
+ * too few samples to tell what's slow.
+ */
+unsigned int upstream_group_hedge_arm(upstream_group *g) {
+  g->hedge_credit += g->cf->hedge_budget;
+  if (g->hedge_credit > HEDGE_BURST * 100) {
+    g->hedge_credit = HEDGE_BURST * 100;
+  }
+
+  return g->hedge_delay;
+}
+
+/* The least loaded backend in rotation other than |primary|, or NULL if
+ * there's none or the budget is used up.  Counted like a pick.
+ */
+upstream_backend *upstream_group_hedge_pick(upstream_group *g,
+                                            const upstream_backend *primary) {
+  upstream_backend *best;
+  upstream_backend *b;
+  unsigned int i;
+
+  if (g->hedge_credit < 100) {
+    return NULL;
+  }
+
+  best = NULL;
+  for (i = 0; i < g->nbackends; i += 1) {
+    b = g->backends + i;
+    if (b == primary || b->ejected_until != 0) {
+      continue;
+    }
+    if (best == NULL
+        || b->inflight < best->inflight
+        || (b->inflight == best->inflight && b->ewma_us < best->ewma_us)) {
+      best = b;
+    }
+  }
+
+  if (best == NULL) {
+    return NULL;
+  }
+
+  g->hedge_credit -= 100;
+  g->hedges += 1;
+  best->inflight += 1;
+  best->requests += 1;
+  g->inflight += 1;
+  return best;
+}
+
+int upstream_group_stats(const upstream_group *g, char *buf, size_t len) {
+  const upstream_backend *b;
+  unsigned int i;
+  size_t n;
+
+  n = 0;
+  if (g->route->lb == lb_hash) {
+    n = snprintf(buf,
+                 len,
+                 "lb_spills{route=\"%s\"} %llu\n",
+                 g->route->prefix,
+                 (unsigned long long) g->spills);
+  }
+  if (g->route->hedge && n < len) {
+    n += snprintf(buf + n,
+                  len - n,
+                  "hedge_delay_ms{route=\"%s\"} %u\n"
+                  "hedge_sent{route=\"%s\"} %llu\n"
+                  "hedge_won{route=\"%s\"} %llu\n",
+                  g->route->prefix, g->hedge_delay,
+                  g->route->prefix, (unsigned long long) g->hedges,
+                  g->route->prefix, (unsigned long long) g->hedge_wins);
+  }
+  for (i = 0; i < g->nbackends && n < len; i += 1) {
+    b = g->backends + i;
+    n += snprintf(buf + n,
+                  len - n,
+                  "upstream_inflight{upstream=\"%s:%u\"} %u\n"
+                  "upstream_requests{upstream=\"%s:%u\"} %llu\n"
+                  "upstream_ewma_us{upstream=\"%s:%u\"} %llu\n"
+                  "upstream_ejected{upstream=\"%s:%u\"} %d\n"
+                  "upstream_ejections{upstream=\"%s:%u\"} %llu\n"
+                  "upstream_failures{upstream=\"%s:%u\"} %llu\n"
+                  "upstream_probes{upstream=\"%s:%u\"} %llu\n",
+                  b->pool.host, b->pool.port, b->inflight,
+                  b->pool.host, b->pool.port,
+                  (unsigned long long) b->requests,
+                  b->pool.host, b->pool.port,
+                  (unsigned long long) b->ewma_us,
+                  b->pool.host, b->pool.port,
+                  b->ejected_until != 0,
+                  b->pool.host, b->pool.port,
+                  (unsigned long long) b->ejections,
+                  b->pool.host, b->pool.port,
+                  (unsigned long long) b->failures,
+                  b->pool.host, b->pool.port,
+                  (unsigned long long) b->probes);
+    if (n < len) {
+      n += upstream_pool_stats(&b->pool, buf + n, len - n);
+    }
+  }
+
+  return (int) n;
+}
+
+static int point_cmp(const void *a, const void *b) {
+  uint32_t x;
+  uint32_t y;
+
+  x = ((const upstream_point *) a)->hash;
+  y = ((const upstream_point *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+/* FNV-1a with a final mix; raw FNV clusters for keys that differ only in
+ * their last characters, like the point names.
+ */
+static uint32_t point_hash(const char *s, size_t len, uint32_t h) {
+  size_t i;
+
+  for (i = 0; i < len; i += 1) {
+    h ^= (unsigned char) s[i];
+    h *= 16777619u;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static upstream_backend *pick_least(upstream_group *g) {
+  upstream_backend *best;
+  upstream_backend *b;
+  unsigned int i;
+
+  best = NULL;
+  for (i = 0; i < g->nbackends; i += 1) {
+    b = g->backends + i;
+    if (b->ejected_until != 0) {
+      continue;
+    }
+    if (best == NULL
+        || b->inflight < best->inflight
+        || (b->inflight == best->inflight && b->ewma_us < best->ewma_us)) {
+      best = b;
+    }
+  }
+
+  ASSERT(best != NULL);
+  return best;
+}
+
+static upstream_backend *pick_p2c(upstream_group *g) {
+  upstream_backend *a;
+  upstream_backend *b;
+  unsigned int i;
+  unsigned int j;
+  uint32_t x;
+
+  x = g->rand;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  g->rand = x;
+
+  i = x % g->nbackends;
+  j = (x >> 16) % (g->nbackends - 1);
+  if (j >= i) {
+    j += 1;  /* Two distinct backends. */
+  }
+
+  a = g->backends + i;
+  b = g->backends + j;
+  if (a->ejected_until != 0 && b->ejected_until != 0) {
+    return pick_least(g);
+  }
+  if (a->ejected_until != 0) {
+    return b;
+  }
+  if (b->ejected_until != 0) {
+    return a;
+  }
+  return backend_cost(b) < backend_cost(a) ? b : a;
+}
+
+/* Walks the ring clockwise from the key to the first backend in rotation
+ * that is below its share of the load.  Some backend always is, so this
+ * ends.
+ */
+static upstream_backend *pick_hash(upstream_group *g,
+                                   const char *key,
+                                   size_t keylen) {
+  upstream_backend *b;
+  unsigned int healthy;
+  unsigned int limit;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+  unsigned int i;
+  uint32_t h;
+
+  h = point_hash(key, keylen, 2166136261u);
+  lo = 0;
+  hi = g->npoints;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (g->ring[mid].hash < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  /* ceil(1.25 * (load + 1) / n), counting the request being placed. */
+  healthy = g->nbackends - g->nejected;
+  limit = ((g->inflight + 1) * 5 + healthy * 4 - 1) / (healthy * 4);
+  for (i = 0; i < g->npoints; i += 1) {
+    b = g->backends + g->ring[(lo + i) % g->npoints].backend;
+    if (b->ejected_until == 0 && b->inflight < limit) {
+      return b;
+    }
+    if (i == 0 && b->ejected_until == 0) {
+      g->spills += 1;  /* Over its share, not just out of rotation. */
+    }
+  }
+
+  UNREACHABLE();
+  return g->backends;
+}
+
+/* Expected wait at a backend: its latency scaled by the queue we'd join.
+ * Backends without a sample yet look free so they get one.
+ */
+static uint64_t backend_cost(const upstream_backend *b) {
+  return b->ewma_us * (b->inflight + 1);
+}
+
+/* Every probe_every picks, an ejected backend whose time is up and that
+ * isn't already being probed gets the request.
+ */
+static upstream_backend *pick_probe(upstream_group *g) {
+  upstream_backend *b;
+  unsigned int i;
+  uint64_t now;
+
+  if (g->picks % g->cf->probe_every != 0) {
+    return NULL;
+  }
+
+  now = uv_now(g->loop);
+  for (i = 0; i < g->nbackends; i += 1) {
+    b = g->backends + i;
+    if (b->ejected_until != 0 && now >= b->ejected_until && b->inflight == 0) {
+      return b;
+    }
+  }
+
+  return NULL;
+}
+
+/* Whether |b| is much slower than the average of the other backends in
+ * rotation.
+ */
+static int backend_outlier(const upstream_group *g, const upstream_backend *b) {
+  const upstream_backend *o;
+  unsigned int i;
+  unsigned int n;
+  uint64_t sum;
+
+  if (g->cf->outlier_factor == 0 || b->ewma_us < OUTLIER_MIN_US) {
+    return 0;
+  }
+
+  sum = 0;
+  n = 0;
+  for (i = 0; i < g->nbackends; i += 1) {
+    o = g->backends + i;
+    if (o != b && o->ejected_until == 0 && o->ewma_us != 0) {
+      sum += o->ewma_us;
+      n += 1;
+    }
+  }
+
+  return n > 0 && b->ewma_us > g->cf->outlier_factor * (sum / n);
+}
+
+/* Takes |b| out of rotation for eject_ms, doubled for each earlier
+ * ejection that followed the one before it within eject_max_ms.
+ */
+static void backend_eject(upstream_group *g, upstream_backend *b) {
+  uint64_t now;
+  uint64_t ms;
+
+  if (b->ejected_until == 0) {
+    if (g->nejected + 1 >= g->nbackends) {
+      return;  /* It's the last one standing. */
+    }
+    g->nejected += 1;
+  }
+
+  now = uv_now(g->loop);
+  if (now - b->last_ejected > g->cf->eject_max_ms) {
+    b->backoff = 0;
+  }
+  ms = (uint64_t) g->cf->eject_ms << (b->backoff < 16 ? b->backoff : 16);
+  if (ms > g->cf->eject_max_ms) {
+    ms = g->cf->eject_max_ms;
+  }
+
+  pr_warn("upstream %s:%u ejected for %u ms",
+          b->pool.host,
+          b->pool.port,
+          (unsigned int) ms);
+  b->backoff += 1;
+  b->ejected_until = now + ms;
+  b->last_ejected = now;
+  b->consecutive = 0;
+  b->ejections += 1;
+}
+
+/* Adds a time to first byte to the histogram.  Old samples fade out by
+ * halving, so the delay follows the backends when they slow down.
+ */
+static void ttfb_record(upstream_group *g, uint64_t us) {
+  const server_config *cf;
+  unsigned int target;
+  unsigned int sum;
+  unsigned int i;
+  uint64_t ms;
+
+  g->ttfb[ttfb_bucket(us)] += 1;
+  g->nttfb += 1;
+  if (g->nttfb % TTFB_RECALC != 0) {
+    return;
+  }
+
+  if (g->nttfb >= TTFB_WINDOW) {
+    g->nttfb = 0;
+    for (i = 0; i < TTFB_BUCKETS; i += 1) {
+      g->ttfb[i] /= 2;
+      g->nttfb += g->ttfb[i];
+    }
+  }
+
+  cf = g->cf;
+  target = (g->nttfb * cf->hedge_percentile + 99) / 100;
+  sum = 0;
+  for (i = 0; i < TTFB_BUCKETS - 1; i += 1) {
+    sum += g->ttfb[i];
+    if (sum >= target) {
+      break;
+    }
+  }
+
+  ms = (ttfb_value(i) + 999) / 1000;
+  if (ms < cf->hedge_min_ms) {
+    ms = cf->hedge_min_ms;
+  }
+  g->hedge_delay = ms < 1 ? 1 : (unsigned int) ms;
+}
+
+/* Four buckets per power of two: the top bit and the two below it. */
+static unsigned int ttfb_bucket(uint64_t us) {
+  unsigned int top;
+  unsigned int i;
+
+  if (us < 4) {
+    return (unsigned int) us;
+  }
+
+  top = 2;
+  while ((us >> top) > 1) {
+    top += 1;
+  }
+
+  i = top * 4 + (unsigned int) ((us >> (top - 2)) & 3);
+  return i < TTFB_BUCKETS ? i : TTFB_BUCKETS - 1;
+}
+
+/* The largest time that falls into |bucket|. */
+static uint64_t ttfb_value(unsigned int bucket) {
+  unsigned int top;
+
+  if (bucket < 4) {
+    return bucket;
+  }
+
+  top = bucket / 4;
+  return ((uint64_t) (4 + bucket % 4 + 1) << (top - 2)) - 1;
+}
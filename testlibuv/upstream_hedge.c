@@ -0,0 +1,195 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Sends a second copy of a request that is taking too long to another
+ * backend of the same route, and reads until that copy's first response
+ * bytes arrive.  The owner arms the hedge once its request is out and
+ * cancels it when the first backend answers; if the hedge gets there
+ * first, the owner is called back and takes over its connection.
+ *
+ * Only requests that can be sent twice without harm are hedged, and the
+ * loser's connection is closed rather than pooled: its backend is still
+ * working on a request whose response nobody will read.
+ */
+
+static void hedge_fire(uv_timer_t *handle);
+static void hedge_dial_done(upstream_dial *d, int status);
+static void hedge_write_done(uv_write_t *req, int status);
+static void hedge_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void hedge_read_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf);
+static void hedge_fail(upstream_hedge *h, const char *what, int err);
+static void hedge_close_done(uv_handle_t *handle);
+
+/* Sends |head| to another backend than |primary| if nothing has cancelled
+ * the hedge after |delay| ms.  |head| must stay valid until then.
+ */
+upstream_hedge *upstream_hedge_start(upstream_group *g,
+                                     upstream_backend *primary,
+                                     dns_cache *dc,
+                                     char *head,
+                                     unsigned int headlen,
+                                     unsigned int delay,
+                                     hedge_cb cb,
+                                     void *data) {
+  upstream_hedge *h;
+
+  h = xmalloc(sizeof(*h));
+  memset(h, 0, sizeof(*h));
+  h->group = g;
+  h->primary = primary;
+  h->dc = dc;
+  h->head = head;
+  h->headlen = headlen;
+  h->cb = cb;
+  h->data = data;
+  CHECK(0 == uv_timer_init(g->loop, &h->timer));
+  h->timer.data = h;
+  CHECK(0 == uv_timer_start(&h->timer, hedge_fire, delay, 0));
+  return h;
+}
+
+/* Stops the hedge and releases whatever the owner didn't take.  |cb|
+ * doesn't run anymore; the hedge frees itself.
+ */
+void upstream_hedge_cancel(upstream_hedge *h) {
+  h->cb = NULL;
+  upstream_dial_cancel(&h->dial);
+  if (h->backend != NULL) {
+    upstream_group_done(h->group, h->backend);
+    h->backend = NULL;
+  }
+
+  uv_close((uv_handle_t *) &h->timer, hedge_close_done);
+}
+
+static void hedge_fire(uv_timer_t *handle) {
+  upstream_hedge *h;
+  char *head;
+
+  h = handle->data;
+  h->backend = upstream_group_hedge_pick(h->group, h->primary);
+  if (h->backend == NULL) {
+    return;  /* Over budget or nowhere else to go, wait for the first. */
+  }
+
+  /* The owner may go away while the write is still in flight. */
+  head = xmalloc(h->headlen);
+  memcpy(head, h->head, h->headlen);
+  h->head = head;
+  h->start = uv_hrtime();
+  upstream_dial_start(&h->dial, &h->backend->pool, h->dc, hedge_dial_done);
+}
+
+static void hedge_dial_done(upstream_dial *d, int status) {
+  upstream_hedge *h;
+  upstream_conn *uc;
+  uv_buf_t buf;
+
+  h = CONTAINER_OF(d, upstream_hedge, dial);
+  if (status != 0) {
+    hedge_fail(h, "connect", status);
+    return;
+  }
+
+  uc = d->uc;
+  buf.base = h->head;
+  buf.len = h->headlen;
+  uc->c.write_req.data = h;
+  CHECK(0 == uv_write(&uc->c.write_req,
+                      &uc->c.handle.stream,
+                      &buf,
+                      1,
+                      hedge_write_done));
+
+  uc->c.handle.handle.data = h;
+  CHECK(0 == uv_read_start(&uc->c.handle.stream, hedge_alloc, hedge_read_done));
+}
+
+/* The owner is only told once the write is done, so that it never gets a
+ * connection with a hedge callback still to come.
+ */
+static void hedge_write_done(uv_write_t *req, int status) {
+  upstream_conn *uc;
+  upstream_hedge *h;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  uc = CONTAINER_OF(req, upstream_conn, c.write_req);
+  if (uc->closing != 0) {
+    return;  /* Cancelled since, |h| may be gone. */
+  }
+
+  h = req->data;
+  if (status < 0) {
+    hedge_fail(h, "write", status);
+    return;
+  }
+
+  h->written = 1;
+  if (h->len > 0) {
+    h->cb(h);
+  }
+}
+
+static void hedge_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  upstream_conn *uc;
+
+  uc = CONTAINER_OF(handle, upstream_conn, c.handle);
+  buf->base = uc->c.t.buf;
+  buf->len = sizeof(uc->c.t.buf);
+}
+
+static void hedge_read_done(uv_stream_t *handle,
+                            ssize_t nread,
+                            const uv_buf_t *buf) {
+  upstream_hedge *h;
+
+  if (nread == 0) {
+    return;  /* EAGAIN, nothing happened. */
+  }
+
+  h = handle->data;
+  uv_read_stop(handle);
+  if (nread < 0) {
+    hedge_fail(h, "read", (int) nread);
+    return;
+  }
+
+  h->len = (unsigned int) nread;
+  if (h->written) {
+    h->cb(h);
+  }
+}
+
+/* The hedge's backend failed it.  The owner still has the first one.  A
+ * pooled connection may just have gone stale, that isn't held against
+ * the backend.
+ */
+static void hedge_fail(upstream_hedge *h, const char *what, int err) {
+  pr_warn("upstream %s:%u hedge %s error: %s",
+          h->backend->pool.host,
+          h->backend->pool.port,
+          what,
+          uv_strerror(err));
+  if (!h->dial.reused) {
+    upstream_backend_failed(h->group, h->backend);
+  }
+  upstream_group_done(h->group, h->backend);
+  h->backend = NULL;
+  upstream_dial_cancel(&h->dial);
+}
+
+static void hedge_close_done(uv_handle_t *handle) {
+  upstream_hedge *h;
+
+  h = handle->data;
+  if (h->start != 0) {
+    free(h->head);  /* Our copy. */
+  }
+  free(h);
+}
@@ -0,0 +1,317 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Keep-alive connections to a backend that aren't serving a request wait
+ * here for the next one.  Checkout is LIFO: the most recently used
+ * connection is the one least likely to have been closed by the backend,
+ * and it keeps the set of busy connections small so the others expire.
+ *
+ * An idle connection keeps a read pending.  Backends don't send anything
+ * unasked, so any read result, usually EOF, means the connection is done
+ * for and it's closed right away instead of failing the next request.
+ */
+
+static void pool_unlink(upstream_pool *p, upstream_conn *uc);
+static void pool_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void pool_read_done(uv_stream_t *handle,
+                           ssize_t nread,
+                           const uv_buf_t *buf);
+static void pool_expire(uv_timer_t *handle);
+static void pool_close_done(uv_handle_t *handle);
+static void dial_resolve_done(dns_query *q, int status);
+static void dial_connect(upstream_dial *d, int status);
+static void dial_connect_done(uv_connect_t *req, int status);
+
+void upstream_pool_init(upstream_pool *p,
+                        uv_loop_t *loop,
+                        const char *host,
+                        unsigned short port,
+                        unsigned int max_idle,
+                        unsigned int idle_timeout) {
+  memset(p, 0, sizeof(*p));
+  p->loop = loop;
+  p->host = host;
+  p->port = port;
+  p->max_idle = max_idle;
+  p->idle_timeout = idle_timeout;
+  p->idle.prev = &p->idle;
+  p->idle.next = &p->idle;
+}
+
+/* Returns the most recently used idle connection, or NULL. */
+upstream_conn *upstream_pool_get(upstream_pool *p) {
+  upstream_conn *uc;
+
+  if (p->nidle == 0) {
+    return NULL;
+  }
+
+  uc = CONTAINER_OF(p->idle.next, upstream_conn, link);
+  pool_unlink(p, uc);
+  uv_read_stop(&uc->c.handle.stream);
+  uv_timer_stop(&uc->c.timer_handle);
+  uc->c.result = 0;
+  p->reused += 1;
+  return uc;
+}
+
+/* Takes back a connection that has finished a request and response.  The
+ * caller no longer uses it.
+ */
+void upstream_pool_put(upstream_pool *p, upstream_conn *uc) {
+  upstream_conn *oldest;
+
+  if (p->max_idle == 0) {
+    upstream_conn_close(uc);
+    return;
+  }
+
+  if (p->nidle == p->max_idle) {
+    oldest = CONTAINER_OF(p->idle.prev, upstream_conn, link);
+    pool_unlink(p, oldest);
+    upstream_conn_close(oldest);
+    p->dropped += 1;
+  }
+
+  uc->c.client = NULL;
+  uc->link.next = p->idle.next;
+  uc->link.prev = &p->idle;
+  p->idle.next->prev = &uc->link;
+  p->idle.next = &uc->link;
+  p->nidle += 1;
+
+  CHECK(0 == uv_read_start(&uc->c.handle.stream, pool_alloc, pool_read_done));
+  CHECK(0 == uv_timer_start(&uc->c.timer_handle,
+                            pool_expire,
+                            p->idle_timeout,
+                            0));
+}
+
+/* A fresh, unconnected connection for |p|, or for no pool at all if |p|
+ * is NULL.  The caller sets the client backlink and owns it until it's
+ * handed to upstream_pool_put() or upstream_conn_close().
+ */
+upstream_conn *upstream_conn_new(uv_loop_t *loop, upstream_pool *p) {
+  upstream_conn *uc;
+
+  uc = xmalloc(sizeof(*uc));
+  memset(uc, 0, sizeof(*uc));
+  uc->pool = p;
+  uc->link.prev = &uc->link;
+  uc->link.next = &uc->link;
+  CHECK(0 == uv_tcp_init(loop, &uc->c.handle.tcp));
+  CHECK(0 == uv_timer_init(loop, &uc->c.timer_handle));
+  return uc;
+}
+
+/* Closes a connection that no client_ctx refers to and frees it once
+ * both handles are closed.
+ */
+void upstream_conn_close(upstream_conn *uc) {
+  uc->c.client = NULL;
+  uc->closing = 2;
+  uc->c.handle.handle.data = uc;
+  uc->c.timer_handle.data = uc;
+  uv_close(&uc->c.handle.handle, pool_close_done);
+  uv_close((uv_handle_t *) &uc->c.timer_handle, pool_close_done);
+}
+
+/* Closes the idle connections, for when no more requests will come. */
+void upstream_pool_flush(upstream_pool *p) {
+  upstream_conn *uc;
+
+  while (p->nidle > 0) {
+    uc = CONTAINER_OF(p->idle.next, upstream_conn, link);
+    pool_unlink(p, uc);
+    upstream_conn_close(uc);
+  }
+}
+
+/* Gets |d| a connection to the backend of |p|: an idle one from the pool
+ * if there is one, else a new one once the host is resolved and connected.
+ * |cb| gets the result, right away in the first case.  On success d->uc
+ * is the caller's; upstream_dial_cancel() closes it unless the caller has
+ * taken it by clearing d->uc.
+ */
+void upstream_dial_start(upstream_dial *d,
+                         upstream_pool *p,
+                         dns_cache *dc,
+                         upstream_dial_cb cb) {
+  int err;
+
+  d->pool = p;
+  d->cb = cb;
+  d->resolving = 0;
+  d->start = uv_hrtime();
+  d->uc = upstream_pool_get(p);
+  d->reused = d->uc != NULL;
+  if (d->reused) {
+    cb(d, 0);
+    return;
+  }
+
+  d->uc = upstream_conn_new(p->loop, p);
+  uv_tcp_nodelay(&d->uc->c.handle.tcp, 1);
+  err = dns_cache_resolve(dc, p->host, &d->dns, dial_resolve_done);
+  if (err == DNS_PENDING) {
+    d->resolving = 1;
+    return;
+  }
+
+  dial_connect(d, err);
+}
+
+/* |cb| doesn't run after this. */
+void upstream_dial_cancel(upstream_dial *d) {
+  if (d->resolving) {
+    dns_cache_cancel(&d->dns);
+    d->resolving = 0;
+  }
+  if (d->uc != NULL) {
+    upstream_conn_close(d->uc);
+    d->uc = NULL;
+  }
+}
+
+int upstream_pool_stats(const upstream_pool *p, char *buf, size_t len) {
+  uint64_t requests;
+  char name[300];
+  double ratio;
+
+  snprintf(name, sizeof(name), "%s:%u", p->host, p->port);
+  requests = p->reused + p->connects;
+  ratio = requests == 0 ? 0.0 : (double) p->reused / (double) requests;
+  return snprintf(buf,
+                  len,
+                  "upstream_reused{upstream=\"%s\"} %llu\n"
+                  "upstream_connects{upstream=\"%s\"} %llu\n"
+                  "upstream_reuse_ratio{upstream=\"%s\"} %.4f\n"
+                  "upstream_connect_us{upstream=\"%s\"} %llu\n"
+                  "upstream_idle{upstream=\"%s\"} %u\n"
+                  "upstream_expired{upstream=\"%s\"} %llu\n"
+                  "upstream_dropped{upstream=\"%s\"} %llu\n"
+                  "upstream_retries{upstream=\"%s\"} %llu\n",
+                  name, (unsigned long long) p->reused,
+                  name, (unsigned long long) p->connects,
+                  name, ratio,
+                  name, (unsigned long long) p->connect_us,
+                  name, p->nidle,
+                  name, (unsigned long long) p->expired,
+                  name, (unsigned long long) p->dropped,
+                  name, (unsigned long long) p->retries);
+}
+
+static void pool_unlink(upstream_pool *p, upstream_conn *uc) {
+  ASSERT(p->nidle > 0);
+  uc->link.prev->next = uc->link.next;
+  uc->link.next->prev = uc->link.prev;
+  uc->link.prev = &uc->link;
+  uc->link.next = &uc->link;
+  p->nidle -= 1;
+}
+
+static void pool_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  upstream_conn *uc;
+
+  uc = CONTAINER_OF(handle, upstream_conn, c.handle);
+  buf->base = uc->c.t.buf;
+  buf->len = sizeof(uc->c.t.buf);
+}
+
+static void pool_read_done(uv_stream_t *handle,
+                           ssize_t nread,
+                           const uv_buf_t *buf) {
+  upstream_conn *uc;
+
+  if (nread == 0) {
+    return;  /* EAGAIN, nothing happened. */
+  }
+
+  uc = CONTAINER_OF(handle, upstream_conn, c.handle);
+  pool_unlink(uc->pool, uc);
+  uc->pool->dropped += 1;
+  upstream_conn_close(uc);
+}
+
+static void pool_expire(uv_timer_t *handle) {
+  upstream_conn *uc;
+
+  uc = CONTAINER_OF(handle, upstream_conn, c.timer_handle);
+  pool_unlink(uc->pool, uc);
+  uc->pool->expired += 1;
+  upstream_conn_close(uc);
+}
+
+static void pool_close_done(uv_handle_t *handle) {
+  upstream_conn *uc;
+
+  uc = handle->data;
+  uc->closing -= 1;
+  if (uc->closing == 0) {
+    free(uc);
+  }
+}
+
+static void dial_resolve_done(dns_query *q, int status) {
+  upstream_dial *d;
+
+  d = CONTAINER_OF(q, upstream_dial, dns);
+  d->resolving = 0;
+  dial_connect(d, status);
+}
+
+static void dial_connect(upstream_dial *d, int status) {
+  conn *c;
+
+  c = &d->uc->c;
+  if (status == 0) {
+    if (d->dns.addr.ss_family == AF_INET6) {
+      c->t.addr6 = *(const struct sockaddr_in6 *) &d->dns.addr;
+      c->t.addr6.sin6_port = htons(d->pool->port);
+    } else {
+      c->t.addr4 = *(const struct sockaddr_in *) &d->dns.addr;
+      c->t.addr4.sin_port = htons(d->pool->port);
+    }
+    status = uv_tcp_connect(&c->t.connect_req,
+                            &c->handle.tcp,
+                            &c->t.addr,
+                            dial_connect_done);
+  }
+
+  if (status == 0) {
+    c->t.connect_req.data = d;  /* Shares memory with the address. */
+    return;
+  }
+
+  upstream_conn_close(d->uc);
+  d->uc = NULL;
+  d->cb(d, status);
+}
+
+static void dial_connect_done(uv_connect_t *req, int status) {
+  upstream_conn *uc;
+  upstream_dial *d;
+
+  if (status == UV_ECANCELED) {
+    return;  /* Handle has been closed. */
+  }
+
+  uc = CONTAINER_OF(req, upstream_conn, c.t.connect_req);
+  if (uc->closing != 0) {
+    return;  /* Cancelled since, |d| may be gone. */
+  }
+
+  d = req->data;
+  if (status < 0) {
+    upstream_conn_close(d->uc);
+    d->uc = NULL;
+    d->cb(d, status);
+    return;
+  }
+
+  d->pool->connects += 1;
+  d->pool->connect_us += (uv_hrtime() - d->start) / 1000;
+  d->cb(d, 0);
+}
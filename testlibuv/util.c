@@ -23,11 +23,11 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-static void pr_do(FILE *stream,
-                  const char *label,
-                  const char *fmt,
-                  va_list ap);
+#if !defined(_WIN32)
+# include <sched.h>  /* sched_yield() */
+#endif
 
 void *xmalloc(size_t size) {
   void *ptr;
@@ -35,38 +35,210 @@ void *xmalloc(size_t size) {
   ptr = malloc(size);
   if (ptr == NULL) {
     pr_err("out of memory, need %lu bytes", (unsigned long) size);
+    log_stop();
     exit(1);
   }
 
   return ptr;
 }
 
+/* MurmurHash64A by Austin Appleby, public domain.  Fast, non-cryptographic;
+ * good enough for ETags and hash tables, not for anything adversarial.
+ */
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t h;
+  uint64_t k;
+
+  p = data;
+  end = p + (len & ~(size_t) 7);
+  h = seed ^ (len * m);
+
+  for (; p != end; p += 8) {
+    memcpy(&k, p, 8);  /* Unaligned load; little endian assumed. */
+    k *= m;
+    k ^= k >> 47;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7: h ^= (uint64_t) p[6] << 48;
+    case 6: h ^= (uint64_t) p[5] << 40;
+    case 5: h ^= (uint64_t) p[4] << 32;
+    case 4: h ^= (uint64_t) p[3] << 24;
+    case 3: h ^= (uint64_t) p[2] << 16;
+    case 2: h ^= (uint64_t) p[1] << 8;
+    case 1: h ^= (uint64_t) p[0];
+            h *= m;
+  }
+
+  h ^= h >> 47;
+  h *= m;
+  h ^= h >> 47;
+  return h;
+}
+
+/* File system paths as cache keys.  Windows file names don't distinguish
+ * case, so there "/A.TXT" and "/a.txt" are one file and must be one key,
+ * and a change event names the file the way the directory spells it, not
+ * the way the request did.  ASCII case is folded on Windows; elsewhere
+ * paths compare byte for byte.
+ */
+#if defined(_WIN32)
+# define PATH_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+#else
+# define PATH_FOLD(c) (c)
+#endif
+
+/* FNV-1a.  Paths are short, this is plenty. */
+unsigned int path_hash(const char *path) {
+  const unsigned char *p;
+  unsigned int h;
+
+  h = 2166136261u;
+  for (p = (const unsigned char *) path; *p != '\0'; p += 1) {
+    h ^= PATH_FOLD(*p);
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+int path_equal(const char *a, const char *b) {
+  const unsigned char *p;
+  const unsigned char *q;
+
+  p = (const unsigned char *) a;
+  q = (const unsigned char *) b;
+  while (PATH_FOLD(*p) == PATH_FOLD(*q)) {
+    if (*p == '\0') {
+      return 1;
+    }
+    p += 1;
+    q += 1;
+  }
+
+  return 0;
+}
+
+/* Nonzero if |path| is the |len| byte long |dir| or lies below it. */
+int path_within(const char *path, const char *dir, size_t len) {
+  const unsigned char *p;
+  const unsigned char *q;
+  size_t i;
+
+  p = (const unsigned char *) path;
+  q = (const unsigned char *) dir;
+  for (i = 0; i < len; i += 1) {
+    if (PATH_FOLD(p[i]) != PATH_FOLD(q[i])) {
+      return 0;  /* Also stops at the end of a shorter |path|. */
+    }
+  }
+
+  return p[len] == '\0' || p[len] == '/';
+}
+
+/* Atomic operations on a long, or swapping a pointer, for the few places
+ * where threads share data without a lock.  Loads acquire and stores
+ * release; the rest are full barriers.
+ */
+#if defined(_MSC_VER)
+long atom_load(volatile long *p) {
+  long v;
+
+  v = *p;
+  _ReadWriteBarrier();  /* x86 doesn't reorder loads with later accesses. */
+  return v;
+}
+
+void atom_store(volatile long *p, long v) {
+  _ReadWriteBarrier();
+  *p = v;
+}
+
+int atom_cas(volatile long *p, long *expected, long desired) {
+  long seen;
+
+  seen = InterlockedCompareExchange(p, desired, *expected);
+  if (seen == *expected) {
+    return 1;
+  }
+  *expected = seen;
+  return 0;
+}
+
+long atom_xchg(volatile long *p, long v) {
+  return InterlockedExchange(p, v);
+}
+
+long atom_add(volatile long *p, long v) {
+  return InterlockedExchangeAdd(p, v) + v;
+}
+
+void *atom_xchg_ptr(void *volatile *p, void *v) {
+  return InterlockedExchangePointer(p, v);
+}
+#else
+long atom_load(volatile long *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void atom_store(volatile long *p, long v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+int atom_cas(volatile long *p, long *expected, long desired) {
+  return __atomic_compare_exchange_n(p,
+                                     expected,
+                                     desired,
+                                     0,
+                                     __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST);
+}
+
+long atom_xchg(volatile long *p, long v) {
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+long atom_add(volatile long *p, long v) {
+  return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+void *atom_xchg_ptr(void *volatile *p, void *v) {
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+#endif
+
+/* Lets another thread run, for spinning on something that takes a while. */
+void thread_yield(void) {
+#if defined(_WIN32)
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
 void pr_info(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  pr_do(stdout, "info", fmt, ap);
+  log_vprint("info", 0, fmt, ap);
   va_end(ap);
 }
 
 void pr_warn(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  pr_do(stderr, "warn", fmt, ap);
+  log_vprint("warn", 1, fmt, ap);
   va_end(ap);
 }
 
 void pr_err(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  pr_do(stderr, "error", fmt, ap);
+  log_vprint("error", 1, fmt, ap);
   va_end(ap);
 }
-
-static void pr_do(FILE *stream,
-                  const char *label,
-                  const char *fmt,
-                  va_list ap) {
-  char fmtbuf[1024];
-  vsnprintf(fmtbuf, sizeof(fmtbuf), fmt, ap);
-  fprintf(stream, "%s:%s: %s\n", _getprogname(), label, fmtbuf);
-}
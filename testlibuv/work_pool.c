@@ -0,0 +1,226 @@
+#include "defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Runs blocking and CPU-bound jobs on libuv's threadpool, or on an
+ * executor if the pool has one, so the loop thread stays free for I/O, and
+ * keeps count of how long jobs queue for a worker: once that wait grows,
+ * the pool is too small for the load.
+ *
+ * Each kind of blocking work gets a pool of its own, so that one kind
+ * can't starve the others: a burst of slow disk reads holds up neither
+ * DNS lookups nor handlers.  File system requests keep libuv's threadpool
+ * to themselves, server_run() gives each other pool an executor of at
+ * least one thread.  libuv sizes its threadpool from UV_THREADPOOL_SIZE
+ * when it's first used, which is why work_threadpool_size() has to come
+ * before anything else that queues work.  uv_fs_* requests can't be timed
+ * from the outside, so that pool is probed instead: every so often, an
+ * empty job is queued behind them and its wait stands for theirs.
+ *
+ * A cancelled job that no worker has taken yet doesn't run at all.  One
+ * that is already running can't be stopped from the outside, but it can
+ * poll work_job_cancelled() and return early; either way its callback
+ * still runs, and the job counts as abandoned.
+ */
+
+#define WORK_MAX_THREADS 128  /* libuv's upper bound. */
+#define WORK_DEFAULT_THREADS 4  /* And its default. */
+
+static void work_run(uv_work_t *req);
+static void work_done(uv_work_t *req, int status);
+static void work_posted(void *data);
+static void work_finish(work_job *job, int status);
+static void work_probe(uv_timer_t *handle);
+static void work_probe_run(work_job *job);
+static void work_probe_done(work_job *job, int status);
+
+/* Sizes libuv's threadpool, 0 keeps UV_THREADPOOL_SIZE or libuv's
+ * default.  Returns the number of threads it will have.
+ */
+unsigned int work_threadpool_size(unsigned int size) {
+  char num[16];
+  const char *env;
+
+  if (size > WORK_MAX_THREADS) {
+    size = WORK_MAX_THREADS;
+  }
+  if (size > 0) {
+    snprintf(num, sizeof(num), "%u", size);
+#if defined(_WIN32)
+    _putenv_s("UV_THREADPOOL_SIZE", num);
+#else
+    setenv("UV_THREADPOOL_SIZE", num, 1);
+#endif
+  }
+
+  env = getenv("UV_THREADPOOL_SIZE");
+  size = env != NULL ? (unsigned int) atoi(env) : 0;
+  if (size == 0) {
+    size = WORK_DEFAULT_THREADS;
+  }
+  if (size > WORK_MAX_THREADS) {
+    size = WORK_MAX_THREADS;
+  }
+  return size;
+}
+
+/* Jobs run on libuv's threadpool, whose size is |size|, unless there's an
+ * executor; then they run there and report back through |inbox|, which
+ * must belong to |loop|.  |name| labels the counters.
+ */
+void work_pool_init(work_pool *wp,
+                    const char *name,
+                    uv_loop_t *loop,
+                    unsigned int size,
+                    executor *exec,
+                    mpsc_queue *inbox) {
+  memset(wp, 0, sizeof(*wp));
+  wp->name = name;
+  wp->loop = loop;
+  wp->exec = exec;
+  wp->inbox = inbox;
+  wp->size = exec != NULL ? exec->nworkers : size;
+}
+
+/* Queues an empty job every |interval| ms, see above. */
+void work_pool_probe(work_pool *wp, unsigned int interval) {
+  CHECK(0 == uv_timer_init(wp->loop, &wp->probe_timer));
+  CHECK(0 == uv_timer_start(&wp->probe_timer, work_probe, interval, interval));
+  uv_unref((uv_handle_t *) &wp->probe_timer);
+}
+
+/* Runs |work| on a worker thread, then |cb| on the loop thread with a
+ * status of UV_ECANCELED if work_pool_cancel() got to the job before a
+ * worker did.  |job| must stay put until then.
+ */
+void work_pool_submit(work_pool *wp,
+                      work_job *job,
+                      work_fn work,
+                      work_done_cb cb) {
+  job->pool = wp;
+  job->work = work;
+  job->cb = cb;
+  job->queued = uv_hrtime();
+  job->started = 0;
+  job->finished = 0;
+  job->cancel = 0;
+  if (wp->exec != NULL) {
+    executor_submit(wp->exec, job, wp->inbox, work_posted);
+  } else {
+    CHECK(0 == uv_queue_work(wp->loop, &job->req, work_run, work_done));
+  }
+
+  wp->pending += 1;
+  if (wp->pending > wp->pending_max) {
+    wp->pending_max = wp->pending;
+  }
+}
+
+/* The callback runs either way, see work_pool_submit(). */
+void work_pool_cancel(work_job *job) {
+  atom_store(&job->cancel, 1);
+  if (job->pool->exec != NULL) {
+    executor_cancel(job);
+  } else {
+    uv_cancel((uv_req_t *) &job->req);
+  }
+}
+
+/* Worker thread.  Nonzero once the job's result won't be used. */
+int work_job_cancelled(work_job *job) {
+  return atom_load(&job->cancel) != 0;
+}
+
+int work_pool_stats(const work_pool *wp, char *buf, size_t len) {
+  const char *name;
+  uint64_t ran;
+
+  name = wp->name;
+  ran = wp->jobs - wp->cancelled;
+  return snprintf(buf,
+                  len,
+                  "work_threads{pool=\"%s\"} %u\n"
+                  "work_pending{pool=\"%s\"} %u\n"
+                  "work_pending_max{pool=\"%s\"} %u\n"
+                  "work_jobs{pool=\"%s\"} %llu\n"
+                  "work_cancelled{pool=\"%s\"} %llu\n"
+                  "work_abandoned{pool=\"%s\"} %llu\n"
+                  "work_wait_us{pool=\"%s\"} %llu\n"
+                  "work_wait_avg_us{pool=\"%s\"} %llu\n"
+                  "work_wait_max_us{pool=\"%s\"} %llu\n"
+                  "work_run_us{pool=\"%s\"} %llu\n",
+                  name, wp->size,
+                  name, wp->pending,
+                  name, wp->pending_max,
+                  name, (unsigned long long) wp->jobs,
+                  name, (unsigned long long) wp->cancelled,
+                  name, (unsigned long long) wp->abandoned,
+                  name, (unsigned long long) wp->wait_us,
+                  name, (unsigned long long) (ran == 0 ? 0 : wp->wait_us / ran),
+                  name, (unsigned long long) wp->wait_max_us,
+                  name, (unsigned long long) wp->run_us);
+}
+
+/* Worker thread.  Only the job itself is touched here. */
+static void work_run(uv_work_t *req) {
+  work_job *job;
+
+  job = CONTAINER_OF(req, work_job, req);
+  job->started = uv_hrtime();
+  job->work(job);
+  job->finished = uv_hrtime();
+}
+
+static void work_done(uv_work_t *req, int status) {
+  work_finish(CONTAINER_OF(req, work_job, req), status);
+}
+
+/* From the executor, through the inbox. */
+static void work_posted(void *data) {
+  work_job *job;
+
+  job = data;
+  work_finish(job, job->status);
+}
+
+static void work_finish(work_job *job, int status) {
+  work_pool *wp;
+  uint64_t wait;
+
+  wp = job->pool;
+  wp->pending -= 1;
+  wp->jobs += 1;
+  if (status == UV_ECANCELED) {
+    wp->cancelled += 1;
+  } else {
+    if (job->cancel) {
+      wp->abandoned += 1;
+    }
+    wait = (job->started - job->queued) / 1000;
+    wp->wait_us += wait;
+    if (wait > wp->wait_max_us) {
+      wp->wait_max_us = wait;
+    }
+    wp->run_us += (job->finished - job->started) / 1000;
+  }
+
+  job->cb(job, status);
+}
+
+static void work_probe(uv_timer_t *handle) {
+  work_pool *wp;
+
+  wp = CONTAINER_OF(handle, work_pool, probe_timer);
+  if (!wp->probing) {
+    wp->probing = 1;
+    work_pool_submit(wp, &wp->probe_job, work_probe_run, work_probe_done);
+  }
+}
+
+static void work_probe_run(work_job *job) {
+}
+
+static void work_probe_done(work_job *job, int status) {
+  job->pool->probing = 0;
+}